@@ -0,0 +1,228 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "broadcast_ring.h"
+#include "platform.h"
+#include "protocol.h"
+
+// Second capture output of the inject DLL, for consumers that only watch: a
+// BroadcastRing in named shared memory that any number of readers follow at
+// their own pace, next to the Transport the recording injector owns. Packets
+// are written once however many readers there are, and a reader that falls
+// behind skips ahead instead of holding the producer up.
+//
+// Records are version 3 frames that describe their formats and stream
+// themselves, so a reader can start at any record, including the one it
+// lands on after being lapped. Each reader slot has its own event, signaled
+// by Flush() while the reader waits.
+class Broadcast {
+ public:
+  static constexpr size_t kCapacity = 4 * 1024 * 1024;
+  // Packets are collected into frames of up to this many bytes between
+  // Flush() calls.
+  static constexpr size_t kFrameBytes = 64 * 1024;
+
+  static std::string Name(uint32_t pid) {
+    return "audiocapture_broadcast_" + std::to_string(pid);
+  }
+
+  static std::string EventName(uint32_t pid, int slot) {
+    return Name(pid) + "_event" + std::to_string(slot);
+  }
+
+  Broadcast() = default;
+  ~Broadcast() { Close(); }
+  Broadcast(const Broadcast&) = delete;
+  Broadcast& operator=(const Broadcast&) = delete;
+
+  bool Create(uint32_t pid) {
+    Close();
+    if (!memory_.Create(Name(pid), BroadcastRing::RequiredSize(kCapacity))) {
+      return false;
+    }
+    for (int i = 0; i < BroadcastRing::kMaxReaders; ++i) {
+      if (!events_[i].Create(EventName(pid, i))) {
+        Close();
+        return false;
+      }
+    }
+    ring_.Initialize(memory_.data(), kCapacity);
+    return true;
+  }
+
+  // Publishes what is left and tells the readers the producer is gone.
+  void Close() {
+    if (memory_.data() != nullptr) {
+      Flush();
+      ring_.control()->producer_closed.store(1, std::memory_order_release);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      for (Event& event : events_) {
+        event.Signal();
+      }
+    }
+    for (Event& event : events_) {
+      event.Close();
+    }
+    memory_.Close();
+  }
+
+  // True while anyone reads the broadcast; packets are not worth framing
+  // otherwise.
+  bool listening() const {
+    return memory_.data() != nullptr && ring_.listening();
+  }
+
+  // Appends a packet with a |size| byte payload to the open frame, starting
+  // one if needed. Returns false if the packet is too large to broadcast.
+  bool Add(const AudioFormat& format, const PacketMessage& message,
+           const uint8_t* data, size_t size, uint32_t stream) {
+    uint8_t* dst = nullptr;
+    if (frame_.open()) {
+      dst = encoder_.AddPacket(frame_, format, message, size, stream);
+      if (dst == nullptr) {
+        Commit();
+      }
+    }
+    if (dst == nullptr) {
+      size_t frame_size = std::min<size_t>(
+          std::max<size_t>(
+              kFrameBytes,
+              FrameWriter::FrameSize(Encoder::kPacketOverhead + size)),
+          ring_.max_record_size());
+      uint8_t* buf = ring_.Reserve(frame_size);
+      if (buf == nullptr) {
+        return false;
+      }
+      frame_.Begin(buf, frame_size);
+      encoder_.Restart();
+      dst = encoder_.AddPacket(frame_, format, message, size, stream);
+      if (dst == nullptr) {
+        // Larger than a ring record can ever be. The frame is dropped
+        // unpublished.
+        frame_.Finish();
+        return false;
+      }
+    }
+    ::memcpy(dst, data, size);
+    return true;
+  }
+
+  // Publishes the open frame and wakes the readers waiting for it.
+  void Flush() {
+    if (!frame_.open()) {
+      return;
+    }
+    Commit();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    BroadcastRing::Control* control = ring_.control();
+    for (int i = 0; i < BroadcastRing::kMaxReaders; ++i) {
+      if (control->slots[i].waiting.load(std::memory_order_relaxed)) {
+        events_[i].Signal();
+      }
+    }
+  }
+
+ private:
+  void Commit() { ring_.Commit(frame_.Finish()); }
+
+  SharedMemory memory_;
+  Event events_[BroadcastRing::kMaxReaders];
+  BroadcastRing ring_;
+  FrameWriter frame_;
+  Encoder encoder_;
+};
+
+// One consumer of a Broadcast. Read() hands out a private copy of each
+// record, so the producer may overwrite the ring while it is processed.
+class BroadcastReader {
+ public:
+  BroadcastReader() = default;
+  ~BroadcastReader() { Close(); }
+  BroadcastReader(const BroadcastReader&) = delete;
+  BroadcastReader& operator=(const BroadcastReader&) = delete;
+
+  // Attaches to the broadcast of process |pid|. Reading starts with the
+  // next record published. Fails if the process has no broadcast or every
+  // reader slot is taken.
+  bool Open(uint32_t pid) {
+    Close();
+    if (!memory_.Open(Broadcast::Name(pid)) ||
+        !ring_.Attach(memory_.data(), memory_.size())) {
+      Close();
+      return false;
+    }
+    auto gone = [](uint32_t owner) {
+      Process process;
+      return !process.Open(owner) || process.exited();
+    };
+    if (!ring_.AddReader(CurrentProcessId(), gone, &cursor_) ||
+        !event_.Open(Broadcast::EventName(pid, cursor_.slot))) {
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  void Close() {
+    if (memory_.data() != nullptr) {
+      ring_.RemoveReader(&cursor_);
+    }
+    event_.Close();
+    memory_.Close();
+  }
+
+  // Returns the next record, or nullptr if there is none yet. The record
+  // stays valid until the next call.
+  const uint8_t* Read(size_t* size) {
+    if (!ring_.Read(&cursor_, &record_)) {
+      return nullptr;
+    }
+    *size = record_.size();
+    return record_.data();
+  }
+
+  // True once the producer has closed the broadcast. Check it before the
+  // Read() that comes up empty: records published before closing are
+  // visible then.
+  bool closed() const {
+    return ring_.control()->producer_closed.load(std::memory_order_acquire) !=
+           0;
+  }
+
+  // Blocks until a record is available, the producer closes the broadcast,
+  // |process| (if given) exits, or |timeout_ms| elapses. Returns true if
+  // there is a record to read.
+  bool Wait(uint32_t timeout_ms, const Process* process = nullptr) {
+    std::atomic<uint32_t>& waiting =
+        ring_.control()->slots[cursor_.slot].waiting;
+    waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring_.Empty(cursor_) && !closed()) {
+      event_.Wait(timeout_ms, process);
+    }
+    waiting.store(0, std::memory_order_relaxed);
+    return !ring_.Empty(cursor_);
+  }
+
+  // Bytes of records the producer overwrote before this reader got to them,
+  // and how many times that happened.
+  uint64_t skipped_bytes() const { return cursor_.skipped_bytes; }
+  uint64_t laps() const { return cursor_.laps; }
+
+  // The reader slot taken by Open(), unique among the current readers.
+  int slot() const { return cursor_.slot; }
+
+ private:
+  SharedMemory memory_;
+  Event event_;
+  BroadcastRing ring_;
+  BroadcastRing::Cursor cursor_;
+  std::vector<uint8_t> record_;
+};
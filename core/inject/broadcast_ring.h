@@ -0,0 +1,266 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <vector>
+
+// Single-producer/multi-consumer ring of variable-sized records in one block
+// of memory, for several readers of one capture. Unlike Ring, the producer
+// never waits for anyone: it overwrites the oldest records, and each reader
+// keeps its own cursor and notices when it has been lapped.
+//
+// Cursors are free-running byte counts and records are laid out as in Ring,
+// padding included. The producer announces how far it is about to write
+// (Control::reserve) before writing; a reader copies a record out and then
+// checks that the producer had not come within a ring's length of it in the
+// meantime, the way a seqlock reader checks its sequence. A reader that was
+// overtaken jumps ahead to the newest record and counts what it missed.
+class BroadcastRing {
+ public:
+  static constexpr uint32_t kMagic = 0x52434242;
+  static constexpr size_t kControlSize = 1024;
+  static constexpr size_t kAlignment = 8;
+  static constexpr int kMaxReaders = 8;
+
+  struct ReaderSlot {
+    // Process id of the reader; 0 while free.
+    alignas(64) std::atomic<uint32_t> owner;
+    std::atomic<uint32_t> waiting;
+  };
+
+  struct Control {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t capacity;
+
+    // Written by the producer. Everything below |head| is published; bytes
+    // up to |reserve| may be being written.
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<uint64_t> reserve;
+    std::atomic<uint32_t> producer_closed;
+
+    // Written by the readers.
+    alignas(64) std::atomic<uint32_t> readers;
+    ReaderSlot slots[kMaxReaders];
+  };
+  static_assert(sizeof(Control) <= kControlSize, "control block too large");
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                "ring cursors must be lock-free");
+
+  // Reader-private position in the ring.
+  struct Cursor {
+    int slot = -1;
+    uint64_t position = 0;
+    // Bytes of records overwritten before the reader got to them, and how
+    // many times that happened.
+    uint64_t skipped_bytes = 0;
+    uint64_t laps = 0;
+  };
+
+  static constexpr size_t RequiredSize(size_t capacity) {
+    return kControlSize + capacity;
+  }
+
+  // Producer side. Formats |memory| as an empty ring; |capacity| must be a
+  // power of two.
+  void Initialize(void* memory, size_t capacity) {
+    assert((capacity & (capacity - 1)) == 0);
+    control_ = new (memory) Control();
+    control_->magic = kMagic;
+    control_->capacity = capacity;
+    data_ = static_cast<uint8_t*>(memory) + kControlSize;
+    capacity_ = capacity;
+  }
+
+  // Reader side. Attaches to a ring formatted by Initialize().
+  bool Attach(void* memory, size_t size) {
+    Control* control = static_cast<Control*>(memory);
+    if (size < kControlSize || control->magic != kMagic ||
+        RequiredSize(control->capacity) > size) {
+      return false;
+    }
+    control_ = control;
+    data_ = static_cast<uint8_t*>(memory) + kControlSize;
+    capacity_ = static_cast<size_t>(control->capacity);
+    return true;
+  }
+
+  Control* control() const { return control_; }
+  size_t capacity() const { return capacity_; }
+
+  // Largest payload a single record can carry.
+  size_t max_record_size() const { return capacity_ / 2 - sizeof(Record); }
+
+  // Returns space for a |size| byte record, or nullptr if it can never fit.
+  // Nothing is visible until Commit(); the oldest records become unreadable
+  // right away.
+  uint8_t* Reserve(size_t size) {
+    if (size > max_record_size()) {
+      return nullptr;
+    }
+    size_t record = AlignUp(sizeof(Record) + size);
+    uint64_t head = head_;
+    size_t offset = static_cast<size_t>(head) & (capacity_ - 1);
+    size_t to_end = capacity_ - offset;
+    size_t needed = record <= to_end ? record : to_end + record;
+    if (head + needed > reserve_) {
+      reserve_ = head + needed;
+      control_->reserve.store(reserve_, std::memory_order_relaxed);
+      // Orders the store before the writes below for Read()'s check.
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+    if (record > to_end) {
+      Record* pad = RecordAt(offset);
+      pad->size = static_cast<uint32_t>(to_end - sizeof(Record));
+      pad->flags = kPadding;
+      head += to_end;
+      offset = 0;
+    }
+    reserved_head_ = head;
+    reserved_size_ = size;
+    return data_ + offset + sizeof(Record);
+  }
+
+  // Publishes the record returned by the last Reserve(). |size| may be
+  // smaller than the reserved size.
+  void Commit(size_t size) {
+    assert(size <= reserved_size_);
+    Record* record = RecordAt(static_cast<size_t>(reserved_head_) &
+                              (capacity_ - 1));
+    record->size = static_cast<uint32_t>(size);
+    record->flags = 0;
+    head_ = reserved_head_ + AlignUp(sizeof(Record) + size);
+    control_->head.store(head_, std::memory_order_release);
+  }
+
+  // Producer side. True while any reader is attached.
+  bool listening() const {
+    return control_->readers.load(std::memory_order_acquire) != 0;
+  }
+
+  // Reader side. Claims a slot for |owner| and starts |cursor| at the
+  // newest record. A slot whose owner |gone(owner)| says has exited is taken
+  // over, so a reader that crashed does not hold its slot forever. Returns
+  // false if every slot is in use.
+  template <typename Gone>
+  bool AddReader(uint32_t owner, Gone gone, Cursor* cursor) {
+    for (int i = 0; i < kMaxReaders; ++i) {
+      uint32_t expected = 0;
+      if (control_->slots[i].owner.compare_exchange_strong(
+              expected, owner, std::memory_order_acq_rel)) {
+        control_->readers.fetch_add(1, std::memory_order_acq_rel);
+        return Start(i, cursor);
+      }
+    }
+    for (int i = 0; i < kMaxReaders; ++i) {
+      uint32_t expected = control_->slots[i].owner.load(
+          std::memory_order_acquire);
+      if (expected != 0 && expected != owner && gone(expected) &&
+          control_->slots[i].owner.compare_exchange_strong(
+              expected, owner, std::memory_order_acq_rel)) {
+        return Start(i, cursor);
+      }
+    }
+    return false;
+  }
+
+  void RemoveReader(Cursor* cursor) {
+    if (cursor->slot < 0) {
+      return;
+    }
+    ReaderSlot& slot = control_->slots[cursor->slot];
+    slot.waiting.store(0, std::memory_order_relaxed);
+    slot.owner.store(0, std::memory_order_release);
+    control_->readers.fetch_sub(1, std::memory_order_acq_rel);
+    cursor->slot = -1;
+  }
+
+  // Reader side. Copies the record at |cursor| into |out| and moves past
+  // it. Returns false if there is nothing new.
+  bool Read(Cursor* cursor, std::vector<uint8_t>* out) {
+    while (true) {
+      uint64_t head = control_->head.load(std::memory_order_acquire);
+      uint64_t position = cursor->position;
+      if (position == head) {
+        return false;
+      }
+      if (head - position > capacity_) {
+        Lapped(cursor, head);
+        continue;
+      }
+      size_t offset = static_cast<size_t>(position) & (capacity_ - 1);
+      Record record;
+      ::memcpy(&record, RecordAt(offset), sizeof(Record));
+      // A record the producer is overwriting can have any size; it must not
+      // send the copy outside the ring.
+      bool plausible =
+          offset + sizeof(Record) + record.size <= capacity_ &&
+          position + sizeof(Record) + record.size <= head;
+      if (plausible && !(record.flags & kPadding)) {
+        out->resize(record.size);
+        ::memcpy(out->data(), RecordAt(offset) + 1, record.size);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      uint64_t reserve = control_->reserve.load(std::memory_order_relaxed);
+      if (!plausible || reserve - position > capacity_) {
+        Lapped(cursor, control_->head.load(std::memory_order_acquire));
+        continue;
+      }
+      if (record.flags & kPadding) {
+        cursor->position = position + sizeof(Record) + record.size;
+        continue;
+      }
+      cursor->position = position + AlignUp(sizeof(Record) + record.size);
+      return true;
+    }
+  }
+
+  bool Empty(const Cursor& cursor) const {
+    return control_->head.load(std::memory_order_acquire) == cursor.position;
+  }
+
+ private:
+  static constexpr uint32_t kPadding = 1;
+
+  struct Record {
+    uint32_t size;
+    uint32_t flags;
+  };
+
+  static constexpr size_t AlignUp(size_t size) {
+    return (size + kAlignment - 1) & ~(kAlignment - 1);
+  }
+
+  Record* RecordAt(size_t offset) const {
+    return reinterpret_cast<Record*>(data_ + offset);
+  }
+
+  bool Start(int slot, Cursor* cursor) {
+    control_->slots[slot].waiting.store(0, std::memory_order_relaxed);
+    cursor->slot = slot;
+    cursor->position = control_->head.load(std::memory_order_acquire);
+    return true;
+  }
+
+  // Moves a reader that was overtaken to |head|, which is always the start
+  // of a record.
+  static void Lapped(Cursor* cursor, uint64_t head) {
+    cursor->skipped_bytes += head - cursor->position;
+    ++cursor->laps;
+    cursor->position = head;
+  }
+
+  Control* control_ = nullptr;
+  uint8_t* data_ = nullptr;
+  size_t capacity_ = 0;
+
+  // Producer-local.
+  uint64_t head_ = 0;
+  uint64_t reserve_ = 0;
+  uint64_t reserved_head_ = 0;
+  size_t reserved_size_ = 0;
+};
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include "protocol.h"
+
+// Describes one buffer handed over by an audio hook.
+struct CapturePacket {
+  // PCM bytes that follow; 0 for a kPacketSilent packet.
+  uint32_t size;
+  uint32_t frames;
+  // PacketFlags.
+  uint8_t flags;
+  AudioFormat format;
+  // Assigned by CaptureQueue::Drain() in queue order. Packets the queue
+  // dropped are counted in, so losses show up downstream as gaps.
+  uint64_t sequence;
+  // Set by the hook from StreamRegistry::Advance(), so it counts dropped
+  // packets too.
+  uint64_t position;
+  uint64_t timestamp_ns;
+  // StreamRegistry id of the stream the buffer came from.
+  uint32_t stream;
+};
+
+// Bounded in-process queue between the audio hooks and the DLL worker thread.
+// Any number of hooks reserve space with a compare-and-swap on the head,
+// copy their PCM and publish the record by setting its bit in a commit
+// bitmap, so a hook never waits for another one's copy, never blocks and
+// never enters the kernel. The worker takes records in reservation order and
+// stops at the first one still being written. When it falls behind, packets
+// are dropped and counted instead of stalling the caller.
+//
+// Records are contiguous and 8-byte aligned; one that would straddle the end
+// of the buffer is preceded by a padding record, as in Ring.
+class CaptureQueue {
+ public:
+  static constexpr size_t kCapacity = 4 * 1024 * 1024;
+
+  CaptureQueue()
+      : memory_(new uint64_t[kCapacity / 8]),
+        committed_(new std::atomic<uint64_t>[kCapacity / 8 / 64]) {
+    for (size_t i = 0; i < kCapacity / 8 / 64; ++i) {
+      committed_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+  CaptureQueue(const CaptureQueue&) = delete;
+  CaptureQueue& operator=(const CaptureQueue&) = delete;
+
+  // Hook side. Returns where |packet.size| bytes of PCM go, or nullptr if the
+  // queue is full. A non-null return must be passed to End() once the PCM is
+  // written. Safe to call from several threads at once.
+  uint8_t* Begin(const CapturePacket& packet) {
+    size_t record = AlignUp(sizeof(Header) + sizeof(CapturePacket) +
+                            static_cast<size_t>(packet.size));
+    if (record > kCapacity / 2) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    size_t offset;
+    size_t padding;
+    do {
+      offset = static_cast<size_t>(head) & (kCapacity - 1);
+      size_t to_end = kCapacity - offset;
+      padding = record <= to_end ? 0 : to_end;
+      if (head + padding + record - tail_.load(std::memory_order_acquire) >
+          kCapacity) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+      }
+    } while (!head_.compare_exchange_weak(head, head + padding + record,
+                                          std::memory_order_relaxed));
+    if (padding != 0) {
+      Header* pad = HeaderAt(offset);
+      pad->size = static_cast<uint32_t>(padding - sizeof(Header));
+      pad->flags = kPadding;
+      Publish(offset);
+      offset = 0;
+    }
+    Header* header = HeaderAt(offset);
+    header->size = static_cast<uint32_t>(record - sizeof(Header));
+    header->flags = 0;
+    // Drops counted so far; Drain() turns this into the sequence number.
+    CapturePacket staged = packet;
+    staged.sequence = dropped_.load(std::memory_order_relaxed);
+    uint8_t* ptr = reinterpret_cast<uint8_t*>(header + 1);
+    ::memcpy(ptr, &staged, sizeof(CapturePacket));
+    return ptr + sizeof(CapturePacket);
+  }
+
+  // Publishes the record whose PCM starts at |pcm|.
+  void End(uint8_t* pcm) {
+    Publish(static_cast<size_t>(pcm - sizeof(CapturePacket) -
+                                sizeof(Header) - data()));
+  }
+
+  // Worker side. Calls |fn(const CapturePacket&, const uint8_t* pcm)| for
+  // every published packet, oldest first, and returns how many were handled.
+  // Stops early at a record a hook is still writing.
+  template <typename Fn>
+  size_t Drain(Fn fn) {
+    size_t count = 0;
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      size_t offset = static_cast<size_t>(tail) & (kCapacity - 1);
+      std::atomic<uint64_t>& word = committed_[offset / 8 / 64];
+      uint64_t bit = uint64_t(1) << (offset / 8 % 64);
+      if ((word.load(std::memory_order_acquire) & bit) == 0) {
+        break;
+      }
+      word.fetch_and(~bit, std::memory_order_relaxed);
+      const Header* header = HeaderAt(offset);
+      if ((header->flags & kPadding) == 0) {
+        const uint8_t* ptr = reinterpret_cast<const uint8_t*>(header + 1);
+        CapturePacket packet;
+        ::memcpy(&packet, ptr, sizeof(CapturePacket));
+        // Hooks read the drop count in any order, so keep it monotonic.
+        gaps_ = std::max(gaps_, packet.sequence);
+        packet.sequence = drained_++ + gaps_;
+        fn(packet, ptr + sizeof(CapturePacket));
+        ++count;
+      }
+      tail += sizeof(Header) + header->size;
+      tail_.store(tail, std::memory_order_release);
+    }
+    return count;
+  }
+
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  static constexpr uint32_t kPadding = 1;
+
+  struct Header {
+    uint32_t size;
+    uint32_t flags;
+  };
+
+  static constexpr size_t AlignUp(size_t size) {
+    return (size + 7) & ~size_t(7);
+  }
+
+  uint8_t* data() const { return reinterpret_cast<uint8_t*>(memory_.get()); }
+  Header* HeaderAt(size_t offset) const {
+    return reinterpret_cast<Header*>(data() + offset);
+  }
+
+  void Publish(size_t offset) {
+    committed_[offset / 8 / 64].fetch_or(uint64_t(1) << (offset / 8 % 64),
+                                         std::memory_order_release);
+  }
+
+  std::unique_ptr<uint64_t[]> memory_;
+  // One bit per 8-byte offset, set while a published record starts there.
+  std::unique_ptr<std::atomic<uint64_t>[]> committed_;
+  // Written by the hooks.
+  alignas(64) std::atomic<uint64_t> head_{0};
+  std::atomic<uint64_t> dropped_{0};
+  // Written by the worker.
+  alignas(64) std::atomic<uint64_t> tail_{0};
+
+  // Worker-local.
+  uint64_t drained_ = 0;
+  uint64_t gaps_ = 0;
+};
@@ -1,6 +1,7 @@
-﻿#include <array>
+﻿#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <string>
 
 #define NOMINMAX
@@ -12,17 +13,48 @@
 
 // WASAPI
 #include <audioclient.h>
+#include <ksmedia.h>
 #include <mmdeviceapi.h>
+#include <mmreg.h>
 
 // WRL
 #include <wrl.h>
 using namespace Microsoft::WRL;
 
+#include "broadcast.h"
+#include "capture_queue.h"
 #include "detours/detours.h"
 #include "inject.h"
 #include "loguru.hpp"
+#include "protocol.h"
+#include "silence.h"
+#include "stream_registry.h"
+#include "transport.h"
+
+// Describes a wave format for the wire, looking through
+// WAVE_FORMAT_EXTENSIBLE for the sample type and channel mask.
+AudioFormat toAudioFormat(const WAVEFORMATEX& format) {
+  AudioFormat out;
+  out.channels = format.nChannels;
+  out.bits_per_sample = format.wBitsPerSample;
+  out.sampling_rate = format.nSamplesPerSec;
+  out.sample_type = format.wFormatTag == WAVE_FORMAT_IEEE_FLOAT
+                        ? SampleType::kFloat
+                        : SampleType::kInt;
+  if (format.wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+      format.cbSize >= sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX)) {
+    const WAVEFORMATEXTENSIBLE& ext = (const WAVEFORMATEXTENSIBLE&)format;
+    if (ext.SubFormat == KSDATAFORMAT_SUBTYPE_IEEE_FLOAT) {
+      out.sample_type = SampleType::kFloat;
+    }
+    out.channel_mask = ext.dwChannelMask;
+  }
+  return out;
+}
 
-constexpr size_t kPipeSize = 1024 * 1024;
+// How long the worker thread sleeps when there is nothing to drain. With
+// batching on, it wakes earlier when a batch deadline is closer.
+constexpr DWORD kDrainIntervalMs = 2;
 
 class Inject {
  public:
@@ -35,75 +67,364 @@ class Inject {
   HANDLE thread = NULL;
   std::atomic_bool threadExit = false;
 
-  // WASAPI
-  IAudioClient* wasapiAudioClient = NULL;
-  WAVEFORMATEX* wasapiFormat = NULL;
-  uint8_t* wasapiBuffer = NULL;
+  // Formats of the IAudioClients seen, for the render clients they create.
+  StreamRegistry clients;
+  // One entry per IAudioRenderClient or IDirectSoundBuffer; its id tells the
+  // streams apart on the wire.
+  StreamRegistry streams;
 
  public:
   void Initialize() {
     DWORD pid = ::GetProcessIdOfThread(::GetCurrentThread());
-    std::string pipename = "\\\\.\\pipe\\audiocapture_" + std::to_string(pid);
-    pipe_ = ::CreateNamedPipeA(pipename.c_str(), PIPE_ACCESS_DUPLEX,
-                               PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
-                               1, kPipeSize, 1024 * 1024,
-                               NMPWAIT_USE_DEFAULT_WAIT, NULL);
-
-    if (pipe_ == INVALID_HANDLE_VALUE) {
-      DLOG_F(ERROR, "failed CreateNamedPipe().");
+    if (!transport_.Create(pid)) {
+      DLOG_F(ERROR, "failed to create transport. GetLastError() = %u.",
+             ::GetLastError());
     }
+    if (!broadcast_.Create(pid)) {
+      DLOG_F(ERROR, "failed to create broadcast. GetLastError() = %u.",
+             ::GetLastError());
+    }
+  }
+
+  void Finalize() {
+    transport_.Close();
+    broadcast_.Close();
   }
 
-  void Finalize() { ::CloseHandle(pipe_); }
+  // Called from the audio hooks. Reserves a staging slot for |frames| frames
+  // of PCM from |stream| and returns where the PCM goes, or NULL if nobody
+  // reads the transport or the broadcast, or the staging queue is full. A
+  // non-NULL return must be passed to endCaptureData(). Framing and
+  // transport I/O happen later on the worker thread, so this never blocks the
+  // caller. A |silent| packet has no PCM.
+  uint8_t* beginCaptureData(const StreamRegistry::Stream& stream,
+                            uint32_t frames, bool silent = false) {
+    uint64_t position = streams.Advance(stream.slot, frames);
+    if (!transport_.connected() && !broadcast_.listening()) {
+      return NULL;
+    }
 
-  void writeCaptureData(uint8_t* data, size_t size, int channels, int samples,
-                        int bitspersample, int samplespersec) {
-    static std::array<uint8_t, kPipeSize> buf;
+    const AudioFormat& format = stream.format;
+    CapturePacket packet{};
+    packet.size = silent ? 0 : (uint32_t)(frames * format.block_align());
+    packet.frames = frames;
+    packet.flags = silent ? kPacketSilent : 0;
+    packet.format = format;
+    packet.position = position;
+    packet.timestamp_ns = MonotonicNanoseconds();
+    packet.stream = stream.id;
+    return queue_.Begin(packet);
+  }
 
-    // Magic number
-    buf[0] = 0xFE;
-    buf[1] = 0xCF;
+  void endCaptureData(uint8_t* dst) { queue_.End(dst); }
+
+  // Called from the audio hooks for a buffer of silence. It is sent as a
+  // payload-free packet if the reader elides silence, as zeros otherwise;
+  // the buffer itself is never read.
+  void captureSilence(const StreamRegistry::Stream& stream, uint32_t frames) {
+    bool elide = elideSilence_.load(std::memory_order_relaxed);
+    uint8_t* dst = beginCaptureData(stream, frames, elide);
+    if (dst != NULL) {
+      if (!elide) {
+        const AudioFormat& format = stream.format;
+        ::memset(dst, SilenceByte(format), frames * format.block_align());
+      }
+      endCaptureData(dst);
+    }
+  }
+
+  // Called from the audio hooks. True if the reader elides silence and
+  // |size| bytes of |data| are below its threshold.
+  bool belowSilenceThreshold(const AudioFormat& format, const void* data,
+                             size_t size) {
+    return elideSilence_.load(std::memory_order_relaxed) &&
+           transport_.connected() &&
+           IsNearSilent(format, data, size,
+                        silenceLimit_.load(std::memory_order_relaxed));
+  }
+
+  // Called from the worker thread. Frames every staged packet into the
+  // transport and the broadcast and returns how many were moved. Depending
+  // on the consumer's settings, transport packets go out as individual
+  // frames or are coalesced into batches that are flushed by size or
+  // deadline, in the wire format version the consumer asked for. The
+  // broadcast gets one frame per pass.
+  size_t drainCaptureData() {
+    uint32_t session = transport_.session();
+    if (session != session_) {
+      // A new consumer knows none of the formats described so far.
+      flushBatch();
+      encoder_.Reset();
+      session_ = session;
+    }
+
+    Transport::Settings settings = transport_.settings();
+    elideSilence_.store(settings.protocol_version >= kProtocolV2 &&
+                            settings.elide_silence != 0,
+                        std::memory_order_relaxed);
+    if (settings.silence_threshold_db != silenceThresholdDb_) {
+      silenceThresholdDb_ = settings.silence_threshold_db;
+      silenceLimit_.store(SilenceLimit(silenceThresholdDb_),
+                          std::memory_order_relaxed);
+    }
+    bool connected = transport_.connected();
+    bool broadcasting = broadcast_.listening();
+    size_t count = queue_.Drain(
+        [&](const CapturePacket& packet, const uint8_t* pcm) {
+          if (connected) {
+            if (settings.protocol_version >= kProtocolV2) {
+              writeMessage(settings, packet, pcm);
+            } else {
+              writeFrame(settings, packet, pcm);
+            }
+          }
+          if (broadcasting &&
+              !broadcast_.Add(packet.format, toPacketMessage(packet), pcm,
+                              packet.size, packet.stream)) {
+            DLOG_F(WARNING, "broadcast: dropped a %u byte packet.",
+                   (unsigned)packet.size);
+          }
+        });
+    broadcast_.Flush();
+
+    if (batchOpen() && (settings.batch_max_bytes == 0 ||
+                        batchAgeUs() >= settings.batch_deadline_us)) {
+      flushBatch();
+    }
+
+    uint64_t dropped = queue_.dropped();
+    if (dropped != queueDropped_) {
+      DLOG_F(WARNING, "staging queue full, dropped %llu packets.",
+             dropped - queueDropped_);
+      transport_.Drop(dropped - queueDropped_);
+      queueDropped_ = dropped;
+    }
 
-    // Header
+    if (published_) {
+      transport_.Notify();
+      published_ = false;
+    }
+    return count;
+  }
+
+  // Called from the worker thread on shutdown. Publishes a partial batch.
+  void flushCaptureData() {
+    flushBatch();
+    transport_.Notify();
+    broadcast_.Flush();
+  }
+
+  // How long the worker thread may sleep before the open batch is due.
+  DWORD drainInterval() {
+    if (!batchOpen()) {
+      return kDrainIntervalMs;
+    }
+    uint64_t deadline = transport_.settings().batch_deadline_us;
+    uint64_t age = batchAgeUs();
+    return (DWORD)std::min<uint64_t>(
+        kDrainIntervalMs, age >= deadline ? 0 : (deadline - age) / 1000);
+  }
+
+ private:
+  static constexpr size_t kFrameHeaderSize = 2 + sizeof(Header);
+  static constexpr size_t kBatchHeaderSize = 2 + sizeof(BatchHeader);
+
+  // Version 1: one 0xFE 0xCF frame per packet, or 0xFE 0xCB batches of them.
+  // Version 1 has no silent packets, so those are expanded to zeros.
+  void writeFrame(const Transport::Settings& settings,
+                  const CapturePacket& packet, const uint8_t* pcm) {
+    Ring& ring = transport_.ring();
+    size_t frameSize =
+        kFrameHeaderSize + packet.frames * packet.format.block_align();
+    size_t batchSize =
+        std::min<size_t>(settings.batch_max_bytes, ring.max_record_size());
+
+    if (frameSize + kBatchHeaderSize + sizeof(int) > batchSize) {
+      // Batching is off, or the packet would not fit in a batch anyway.
+      flushBatch();
+      uint8_t* buf = ring.Reserve(frameSize);
+      if (buf == NULL) {
+        transport_.Drop();
+        DLOG_F(WARNING, "writeFrame: ring full, dropped %u bytes.",
+               (unsigned)frameSize);
+        return;
+      }
+      fillFrame(buf, packet, pcm);
+      ring.Commit(frameSize);
+      published_ = true;
+      return;
+    }
+
+    if (batch_ != NULL &&
+        (batchCount_ == kMaxBatchFrames ||
+         batchUsed_ + frameSize + (batchCount_ + 1) * sizeof(int) >
+             batchCapacity_)) {
+      flushBatch();
+    }
+    if (batch_ == NULL) {
+      batch_ = ring.Reserve(batchSize);
+      if (batch_ == NULL) {
+        transport_.Drop();
+        DLOG_F(WARNING, "writeFrame: ring full, dropped %u bytes.",
+               (unsigned)frameSize);
+        return;
+      }
+      batchCapacity_ = batchSize;
+      batchUsed_ = kBatchHeaderSize;
+      batchCount_ = 0;
+      batchStart_ = std::chrono::steady_clock::now();
+    }
+    batchOffsets_[batchCount_++] = (int)batchUsed_;
+    fillFrame(batch_ + batchUsed_, packet, pcm);
+    batchUsed_ += frameSize;
+  }
+
+  // Version 2: packet messages in FrameWriter frames, preceded by a format
+  // descriptor whenever the consumer has not seen the format yet. Version 3
+  // also says which stream they belong to.
+  void writeMessage(const Transport::Settings& settings,
+                    const CapturePacket& packet, const uint8_t* pcm) {
+    uint32_t stream =
+        settings.protocol_version >= kProtocolV3 ? packet.stream : 0;
+    PacketMessage message = toPacketMessage(packet);
+
+    uint8_t* dst = NULL;
+    if (frame_.open()) {
+      dst = encoder_.AddPacket(frame_, packet.format, message, packet.size,
+                               stream);
+      if (dst == NULL) {
+        flushBatch();
+      }
+    }
+    if (dst == NULL) {
+      Ring& ring = transport_.ring();
+      size_t frameSize = std::min<size_t>(
+          std::max<size_t>(
+              settings.batch_max_bytes,
+              FrameWriter::FrameSize(Encoder::kPacketOverhead + packet.size)),
+          ring.max_record_size());
+      uint8_t* buf = ring.Reserve(frameSize);
+      if (buf == NULL) {
+        transport_.Drop();
+        DLOG_F(WARNING, "writeMessage: ring full, dropped %u bytes.",
+               (unsigned)packet.size);
+        return;
+      }
+      frame_.Begin(buf, frameSize);
+      batchStart_ = std::chrono::steady_clock::now();
+      dst = encoder_.AddPacket(frame_, packet.format, message, packet.size,
+                               stream);
+      if (dst == NULL) {
+        // Larger than a ring record can ever be.
+        flushBatch();
+        transport_.Drop();
+        return;
+      }
+    }
+    ::memcpy(dst, pcm, packet.size);
+    if (settings.batch_max_bytes == 0) {
+      flushBatch();
+    }
+  }
+
+  static PacketMessage toPacketMessage(const CapturePacket& packet) {
+    PacketMessage message{};
+    message.frames = packet.frames;
+    message.flags = packet.flags;
+    message.sequence = packet.sequence;
+    message.position = packet.position;
+    message.timestamp_ns = packet.timestamp_ns;
+    return message;
+  }
+
+  void fillFrame(uint8_t* buf, const CapturePacket& packet,
+                 const uint8_t* pcm) {
     Header header;
     header.header_offset = 2;
     header.header_size = sizeof(Header);
     header.data_offset = header.header_offset + header.header_size;
-    header.data_size = size;
+    header.data_size = packet.frames * packet.format.block_align();
     header.total_size =
         header.header_offset + header.header_size + header.data_size;
-    header.channels = channels;
-    header.samples = samples;
-    header.bits_per_sample = bitspersample;
-    header.sampling_rate = samplespersec;
-    ::memcpy(buf.data() + header.header_offset, &header, header.header_size);
-
-    ::memcpy(buf.data() + header.data_offset, data, size);
-
-    // Write to the pipe
-    BOOL ret;
-    DWORD num_bytes_written = 0;
-    ret = ::WriteFile(pipe_, buf.data(), header.total_size, &num_bytes_written,
-                      NULL);
-    if (ret == FALSE) {
-      DWORD err = ::GetLastError();
-      DLOG_F(ERROR, "failed WriteFile(). GetLastError() = %u.", err);
+    header.channels = packet.format.channels;
+    header.samples = packet.frames;
+    header.bits_per_sample = packet.format.bits_per_sample;
+    header.sampling_rate = packet.format.sampling_rate;
+
+    // Magic number
+    buf[0] = 0xFE;
+    buf[1] = 0xCF;
+    ::memcpy(buf + header.header_offset, &header, header.header_size);
+    if (packet.flags & kPacketSilent) {
+      ::memset(buf + header.data_offset, SilenceByte(packet.format),
+               header.data_size);
+    } else {
+      ::memcpy(buf + header.data_offset, pcm, packet.size);
     }
+  }
+
+  bool batchOpen() const { return batch_ != NULL || frame_.open(); }
 
-#if 1
-    DWORD avail = 0;
-    ret = ::PeekNamedPipe(pipe_, NULL, 0, NULL, &avail, NULL);
-    if (ret == FALSE) {
-      DWORD err = ::GetLastError();
-      DLOG_F(ERROR, "failed PeekNamedPipe(). GetLastError() = %u.", err);
+  // Publishes the open v1 batch or v2 frame, if any.
+  void flushBatch() {
+    if (frame_.open()) {
+      transport_.ring().Commit(frame_.Finish());
+      published_ = true;
     }
-    DLOG_F(INFO, "writeCaptureData: %u of %u bytes written. pipe has %u bytes.",
-           num_bytes_written, header.total_size, avail);
-#endif
+    if (batch_ == NULL) {
+      return;
+    }
+
+    BatchHeader header;
+    header.header_size = sizeof(BatchHeader);
+    header.count = batchCount_;
+    header.table_offset = (int)batchUsed_;
+    header.total_size = header.table_offset + batchCount_ * (int)sizeof(int);
+
+    // Magic number
+    batch_[0] = 0xFE;
+    batch_[1] = 0xCB;
+    ::memcpy(batch_ + 2, &header, sizeof(BatchHeader));
+    ::memcpy(batch_ + header.table_offset, batchOffsets_,
+             batchCount_ * sizeof(int));
+    transport_.ring().Commit(header.total_size);
+
+    batch_ = NULL;
+    published_ = true;
   }
 
- private:
-  HANDLE pipe_;
+  uint64_t batchAgeUs() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - batchStart_)
+        .count();
+  }
+
+  Transport transport_;
+  // Read-only copies of the capture for any number of other consumers.
+  Broadcast broadcast_;
+  CaptureQueue queue_;
+  uint64_t queueDropped_ = 0;
+  // The reader's silence settings, for the hooks.
+  std::atomic<bool> elideSilence_{false};
+  // Linear, so the hooks never compute it. The threshold it was computed
+  // for is only used by the worker thread.
+  std::atomic<float> silenceLimit_{0.0f};
+  uint32_t silenceThresholdDb_ = 0;
+  bool published_ = false;
+
+  // Batch being filled in place in the transport ring.
+  uint8_t* batch_ = NULL;
+  size_t batchCapacity_ = 0;
+  size_t batchUsed_ = 0;
+  int batchCount_ = 0;
+  int batchOffsets_[kMaxBatchFrames];
+  std::chrono::steady_clock::time_point batchStart_;
+
+  // Version 2 frame being filled in place, and what the consumer has been
+  // told about formats in this session.
+  FrameWriter frame_;
+  Encoder encoder_;
+  uint32_t session_ = 0;
 };
 
 HRESULT(__stdcall* RealGetDefaultAudioEndPoint)
@@ -116,15 +437,76 @@ HRESULT __stdcall HookGetDefaultAudioEndPoint(IMMDeviceEnumerator* self,
   return ret;
 }
 
+// The client GetCurrentPadding() was last called on by this thread. Render
+// loops call it right before GetBuffer(), so it names the client of a render
+// client created before the hooks were installed.
+thread_local IAudioClient* lastAudioClient = NULL;
+
+// Cold path for clients initialized before the hooks were installed.
+// GetMixFormat() allocates, so it is only called once per client.
+bool bindMixFormat(IAudioClient* client) {
+  WAVEFORMATEX* format = NULL;
+  if (FAILED(client->GetMixFormat(&format))) {
+    return false;
+  }
+  int slot = Inject::GetInstance().clients.Bind(
+      client, toAudioFormat(*format), MonotonicNanoseconds());
+  ::CoTaskMemFree(format);
+  return slot >= 0;
+}
+
+HRESULT(__stdcall* RealInitialize)
+(IAudioClient* self, AUDCLNT_SHAREMODE mode, DWORD flags,
+ REFERENCE_TIME duration, REFERENCE_TIME periodicity,
+ const WAVEFORMATEX* format, LPCGUID session) = NULL;
+HRESULT __stdcall HookInitialize(IAudioClient* self, AUDCLNT_SHAREMODE mode,
+                                 DWORD flags, REFERENCE_TIME duration,
+                                 REFERENCE_TIME periodicity,
+                                 const WAVEFORMATEX* format, LPCGUID session) {
+  HRESULT ret = RealInitialize(self, mode, flags, duration, periodicity,
+                               format, session);
+
+  // The buffers hold this format, which is not the mix format when the
+  // client asked WASAPI to convert.
+  if (SUCCEEDED(ret) && format != NULL) {
+    Inject::GetInstance().clients.Bind(self, toAudioFormat(*format),
+                                       MonotonicNanoseconds());
+  }
+  return ret;
+}
+
+HRESULT(__stdcall* RealGetService)
+(IAudioClient* self, REFIID riid, void** service) = NULL;
+HRESULT __stdcall HookGetService(IAudioClient* self, REFIID riid,
+                                 void** service) {
+  HRESULT ret = RealGetService(self, riid, service);
+
+  // Every render client is a stream of its own, in its client's format.
+  if (SUCCEEDED(ret) && riid == __uuidof(IAudioRenderClient)) {
+    Inject& instance = Inject::GetInstance();
+    StreamRegistry::Stream client;
+    if (instance.clients.Lookup(self, &client) ||
+        (bindMixFormat(self) && instance.clients.Lookup(self, &client))) {
+      instance.streams.Bind(*service, client.format, MonotonicNanoseconds());
+    }
+  }
+  return ret;
+}
+
 HRESULT(__stdcall* RealGetCurrentPadding)
 (IAudioClient* self, UINT32* padding) = NULL;
 HRESULT __stdcall HookGetCurrentPadding(IAudioClient* self, UINT32* padding) {
-  DLOG_F(INFO, "HookGetCurrentPadding");
   HRESULT ret = RealGetCurrentPadding(self, padding);
 
-  Inject& instance = Inject::GetInstance();
-  instance.wasapiAudioClient = self;
-
+  // Render loops call this every period, which keeps the client's entry
+  // from going stale while its render client still needs it.
+  StreamRegistry& clients = Inject::GetInstance().clients;
+  int slot = clients.Find(self);
+  if ((slot < 0 || !clients.Touch(slot, self, MonotonicNanoseconds())) &&
+      lastAudioClient != self) {
+    bindMixFormat(self);
+  }
+  lastAudioClient = self;
   return ret;
 }
 
@@ -132,11 +514,26 @@ HRESULT(__stdcall* RealGetBuffer)
 (IAudioRenderClient* self, UINT32 frames, BYTE** data) = NULL;
 HRESULT __stdcall HookGetBuffer(IAudioRenderClient* self, UINT32 frames,
                                 BYTE** data) {
-  DLOG_F(INFO, "HookGetBuffer");
   HRESULT ret = RealGetBuffer(self, frames, data);
+  if (FAILED(ret)) {
+    return ret;
+  }
 
   Inject& instance = Inject::GetInstance();
-  instance.wasapiBuffer = *data;
+  uint64_t now = MonotonicNanoseconds();
+  int slot = instance.streams.Find(self);
+  if (slot < 0) {
+    // Created before the hooks were installed.
+    StreamRegistry::Stream client;
+    if (lastAudioClient == NULL ||
+        !instance.clients.Lookup(lastAudioClient, &client)) {
+      return ret;
+    }
+    slot = instance.streams.Bind(self, client.format, now);
+  }
+  if (slot >= 0) {
+    instance.streams.SetBuffer(slot, self, *data, now);
+  }
   return ret;
 }
 
@@ -146,20 +543,26 @@ HRESULT __stdcall HookReleaseBuffer(IAudioRenderClient* self,
                                     UINT32 framesWritten, DWORD flags) {
   Inject& instance = Inject::GetInstance();
 
-  instance.wasapiAudioClient->GetMixFormat(&instance.wasapiFormat);
-  int channels = instance.wasapiFormat->nChannels;
-  int framesize = instance.wasapiFormat->nBlockAlign;
-  int bitspersample = instance.wasapiFormat->wBitsPerSample;
-  int samplespersec = instance.wasapiFormat->nSamplesPerSec;
-  int size = framesWritten * instance.wasapiFormat->nBlockAlign;
-  int samples = framesWritten;
-  if (instance.wasapiFormat->nBlockAlign !=
-      instance.wasapiFormat->nChannels *
-          (instance.wasapiFormat->wBitsPerSample / 8)) {
-    assert(false && "not aligned.");
+  // Everything needed was recorded by the hooks before, so this makes no COM
+  // calls.
+  StreamRegistry::Stream stream;
+  if (framesWritten > 0 && instance.streams.Lookup(self, &stream) &&
+      stream.buffer != NULL) {
+    const AudioFormat& format = stream.format;
+    size_t size = framesWritten * format.block_align();
+    uint8_t* dst = NULL;
+    if ((flags & AUDCLNT_BUFFERFLAGS_SILENT) ||
+        instance.belowSilenceThreshold(format, stream.buffer, size)) {
+      // The contents of a buffer flagged silent are undefined.
+      instance.captureSilence(stream, framesWritten);
+    } else {
+      dst = instance.beginCaptureData(stream, framesWritten);
+    }
+    if (dst != NULL) {
+      ::memcpy(dst, stream.buffer, size);
+      instance.endCaptureData(dst);
+    }
   }
-  instance.writeCaptureData((uint8_t*)instance.wasapiBuffer, size, channels,
-                            samples, bitspersample, samplespersec);
 
   HRESULT ret = RealReleaseBuffer(self, framesWritten, flags);
   return ret;
@@ -174,8 +577,6 @@ HRESULT __stdcall HookDirectSoundLock(IDirectSoundBuffer* self, DWORD dwOffset,
                                       LPDWORD pdwAudioBytes1,
                                       LPVOID* ppvAudioPtr2,
                                       LPDWORD pdwAudioBytes2, DWORD dwFlags) {
-  DLOG_F(INFO, "HookDirectSoundLock");
-
   HRESULT ret =
       RealDirectSoundLock(self, dwOffset, dwBytes, ppvAudioPtr1, pdwAudioBytes1,
                           ppvAudioPtr2, pdwAudioBytes2, dwFlags);
@@ -190,26 +591,76 @@ HRESULT __stdcall HookDirectSoundUnlock(IDirectSoundBuffer* self,
                                         DWORD pdwAudioBytes1,
                                         LPVOID ppvAudioPtr2,
                                         DWORD pdwAudioBytes2) {
-  DLOG_F(INFO, "HookDirectSoundUnlock");
-
   Inject& instance = Inject::GetInstance();
-  static WAVEFORMATEX wfex{};
-  wfex.cbSize = sizeof(WAVEFORMATEX);
-  self->GetFormat(&wfex, sizeof(WAVEFORMATEX), NULL);
-
-  DLOG_F(INFO, "ppvAudioBytes1=%u", pdwAudioBytes1);
-  DLOG_F(INFO, "ppvAudioBytes2=%u", pdwAudioBytes2);
-
-  int samples = pdwAudioBytes1 / wfex.nBlockAlign;
-  instance.writeCaptureData((uint8_t*)ppvAudioPtr1, pdwAudioBytes1,
-                            wfex.nChannels, samples, wfex.wBitsPerSample,
-                            wfex.nSamplesPerSec);
+  uint64_t now = MonotonicNanoseconds();
+  // Touched on every Unlock(), as there is no GetBuffer() to do it.
+  StreamRegistry::Stream stream;
+  int slot = instance.streams.Find(self);
+  if (slot < 0 || !instance.streams.Touch(slot, self, now) ||
+      !instance.streams.Read(slot, self, &stream)) {
+    // First Unlock() of this buffer.
+    WAVEFORMATEXTENSIBLE wfex{};
+    self->GetFormat((WAVEFORMATEX*)&wfex, sizeof(wfex), NULL);
+    slot = instance.streams.Bind(self, toAudioFormat(wfex.Format), now);
+    if (slot < 0 || !instance.streams.Read(slot, self, &stream)) {
+      // Every slot holds a live stream; this one is not captured.
+      return RealDirectSoundUnlock(self, ppvAudioPtr1, pdwAudioBytes1,
+                                   ppvAudioPtr2, pdwAudioBytes2);
+    }
+  }
+  const AudioFormat& format = stream.format;
+
+  // The locked region wraps around the end of the buffer when the second
+  // pointer is set; both parts go into one frame.
+  // Only whole frames are captured.
+  DWORD bytes1 = pdwAudioBytes1;
+  DWORD bytes2 = ppvAudioPtr2 != NULL ? pdwAudioBytes2 : 0;
+  size_t align = format.block_align();
+  uint32_t frames = align > 0 ? (uint32_t)((bytes1 + bytes2) / align) : 0;
+  uint8_t* dst = NULL;
+  if (frames > 0 &&
+      instance.belowSilenceThreshold(format, ppvAudioPtr1, bytes1) &&
+      (bytes2 == 0 ||
+       instance.belowSilenceThreshold(format, ppvAudioPtr2, bytes2))) {
+    instance.captureSilence(stream, frames);
+  } else if (frames > 0) {
+    dst = instance.beginCaptureData(stream, frames);
+  }
+  if (dst != NULL) {
+    size_t size = frames * align;
+    bytes1 = (DWORD)std::min<size_t>(bytes1, size);
+    ::memcpy(dst, ppvAudioPtr1, bytes1);
+    if (bytes2 > 0) {
+      ::memcpy(dst + bytes1, ppvAudioPtr2, size - bytes1);
+    }
+    instance.endCaptureData(dst);
+  }
 
   HRESULT ret = RealDirectSoundUnlock(self, ppvAudioPtr1, pdwAudioBytes1,
                                       ppvAudioPtr2, pdwAudioBytes2);
   return ret;
 }
 
+HRESULT(__stdcall* RealDirectSoundSetFormat)
+(IDirectSoundBuffer* self, LPCWAVEFORMATEX format) = NULL;
+HRESULT __stdcall HookDirectSoundSetFormat(IDirectSoundBuffer* self,
+                                           LPCWAVEFORMATEX format) {
+  HRESULT ret = RealDirectSoundSetFormat(self, format);
+
+  // Only a primary buffer's format can change; what it plays from here on
+  // is a new stream.
+  if (SUCCEEDED(ret)) {
+    Inject& instance = Inject::GetInstance();
+    if (instance.streams.Find(self) >= 0) {
+      WAVEFORMATEXTENSIBLE wfex{};
+      self->GetFormat((WAVEFORMATEX*)&wfex, sizeof(wfex), NULL);
+      instance.streams.Bind(self, toAudioFormat(wfex.Format),
+                            MonotonicNanoseconds());
+    }
+  }
+  return ret;
+}
+
 void* getVTableFunction(void* instance, int offset) {
   void** vtable = (LPVOID*)*(void**)instance;
   void* addr = *(vtable + offset);
@@ -253,8 +704,12 @@ void hookWASAPI() {
 
   RealGetDefaultAudioEndPoint = (decltype(RealGetDefaultAudioEndPoint))(
       getVTableFunction(device_enumerator.Get(), 4));
+  RealInitialize =
+      decltype(RealInitialize)(getVTableFunction(audio_client.Get(), 3));
   RealGetCurrentPadding =
       decltype(RealGetCurrentPadding)(getVTableFunction(audio_client.Get(), 6));
+  RealGetService =
+      decltype(RealGetService)(getVTableFunction(audio_client.Get(), 14));
   RealGetBuffer =
       decltype(RealGetBuffer)(getVTableFunction(audio_render_client.Get(), 3));
   RealReleaseBuffer = decltype(RealReleaseBuffer)(
@@ -264,7 +719,9 @@ void hookWASAPI() {
   DetourUpdateThread(::GetCurrentThread());
   DetourAttach(&(PVOID&)RealGetDefaultAudioEndPoint,
                HookGetDefaultAudioEndPoint);
+  DetourAttach(&(PVOID&)RealInitialize, HookInitialize);
   DetourAttach(&(PVOID&)RealGetCurrentPadding, HookGetCurrentPadding);
+  DetourAttach(&(PVOID&)RealGetService, HookGetService);
   DetourAttach(&(PVOID&)RealGetBuffer, HookGetBuffer);
   DetourAttach(&(PVOID&)RealReleaseBuffer, HookReleaseBuffer);
   DetourTransactionCommit();
@@ -275,7 +732,9 @@ void unhookWASAPI() {
   DetourUpdateThread(::GetCurrentThread());
   DetourDetach(&(PVOID&)RealGetDefaultAudioEndPoint,
                HookGetDefaultAudioEndPoint);
+  DetourDetach(&(PVOID&)RealInitialize, HookInitialize);
   DetourDetach(&(PVOID&)RealGetCurrentPadding, HookGetCurrentPadding);
+  DetourDetach(&(PVOID&)RealGetService, HookGetService);
   DetourDetach(&(PVOID&)RealGetBuffer, HookGetBuffer);
   DetourDetach(&(PVOID&)RealReleaseBuffer, HookReleaseBuffer);
   DetourTransactionCommit();
@@ -307,12 +766,15 @@ void hookDSound() {
 
   RealDirectSoundLock =
       (decltype(RealDirectSoundLock))(getVTableFunction(buffer.Get(), 11));
+  RealDirectSoundSetFormat = (decltype(RealDirectSoundSetFormat))(
+      getVTableFunction(buffer.Get(), 14));
   RealDirectSoundUnlock =
       (decltype(RealDirectSoundUnlock))(getVTableFunction(buffer.Get(), 19));
 
   DetourTransactionBegin();
   DetourUpdateThread(::GetCurrentThread());
   DetourAttach(&(PVOID&)RealDirectSoundLock, HookDirectSoundLock);
+  DetourAttach(&(PVOID&)RealDirectSoundSetFormat, HookDirectSoundSetFormat);
   DetourAttach(&(PVOID&)RealDirectSoundUnlock, HookDirectSoundUnlock);
   DetourTransactionCommit();
 }
@@ -321,6 +783,7 @@ void unhookDSound() {
   DetourTransactionBegin();
   DetourUpdateThread(::GetCurrentThread());
   DetourDetach(&(PVOID&)RealDirectSoundLock, HookDirectSoundLock);
+  DetourDetach(&(PVOID&)RealDirectSoundSetFormat, HookDirectSoundSetFormat);
   DetourDetach(&(PVOID&)RealDirectSoundUnlock, HookDirectSoundUnlock);
   DetourTransactionCommit();
 }
@@ -352,10 +815,14 @@ DWORD WINAPI thread(LPVOID lpParam) {
 
   std::atomic_bool* exit = (std::atomic_bool*)lpParam;
   while (!(*exit)) {
-    ::Sleep(10);
+    if (instance.drainCaptureData() == 0) {
+      ::Sleep(instance.drainInterval());
+    }
   }
 
   uninstallHook();
+  instance.drainCaptureData();
+  instance.flushCaptureData();
 
   instance.Finalize();
 
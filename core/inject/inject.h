@@ -12,3 +12,16 @@ struct Header {
   int bits_per_sample;
   int sampling_rate;
 } header;
+
+// Several frames coalesced into one transport record. A batch starts with the
+// magic 0xFE 0xCB followed by BatchHeader. The frames (each a regular 0xFE 0xCF
+// frame) follow back to back, and an int offset per frame, relative to the
+// start of the batch, is stored at table_offset.
+struct BatchHeader {
+  int header_size;
+  int count;
+  int table_offset;
+  int total_size;
+};
+
+constexpr int kMaxBatchFrames = 256;
@@ -0,0 +1,349 @@
+#pragma once
+
+// Thin OS layer shared by the inject DLL and the injector. Windows is the
+// production target; the POSIX branch exists so the transport can be built
+// and exercised on Linux.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// Timeout for blocking waits that should only end on an event.
+constexpr uint32_t kInfinite = 0xFFFFFFFF;
+
+// Prefixes |name| so it is a valid name for a shared memory object or event.
+inline std::string SharedObjectName(const std::string& name) {
+#ifdef _WIN32
+  return "Local\\" + name;
+#else
+  return "/" + name;
+#endif
+}
+
+// Monotonic clock in nanoseconds. It is system-wide, so timestamps taken in
+// the target process can be compared with the injector's.
+inline uint64_t MonotonicNanoseconds() {
+#ifdef _WIN32
+  static const uint64_t frequency = [] {
+    LARGE_INTEGER f;
+    ::QueryPerformanceFrequency(&f);
+    return static_cast<uint64_t>(f.QuadPart);
+  }();
+  LARGE_INTEGER now;
+  ::QueryPerformanceCounter(&now);
+  uint64_t ticks = static_cast<uint64_t>(now.QuadPart);
+  return ticks / frequency * 1000000000 +
+         ticks % frequency * 1000000000 / frequency;
+#else
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 +
+         static_cast<uint64_t>(ts.tv_nsec);
+#endif
+}
+
+inline uint32_t CurrentProcessId() {
+#ifdef _WIN32
+  return ::GetCurrentProcessId();
+#else
+  return static_cast<uint32_t>(::getpid());
+#endif
+}
+
+// Named shared memory. The side that Create()s the object owns the name and
+// removes it on Close(); Open() only maps an existing object.
+class SharedMemory {
+ public:
+  SharedMemory() = default;
+  ~SharedMemory() { Close(); }
+  SharedMemory(const SharedMemory&) = delete;
+  SharedMemory& operator=(const SharedMemory&) = delete;
+
+  bool Create(const std::string& name, size_t size) {
+    Close();
+#ifdef _WIN32
+    mapping_ = ::CreateFileMappingA(
+        INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+        static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+        static_cast<DWORD>(size), SharedObjectName(name).c_str());
+    if (mapping_ == NULL) {
+      return false;
+    }
+    data_ = static_cast<uint8_t*>(
+        ::MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, size));
+#else
+    name_ = SharedObjectName(name);
+    int fd = ::shm_open(name_.c_str(), O_CREAT | O_RDWR, 0600);
+    if (fd < 0) {
+      return false;
+    }
+    owner_ = true;
+    if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+      ::close(fd);
+      Close();
+      return false;
+    }
+    void* ptr =
+        ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    data_ = ptr == MAP_FAILED ? nullptr : static_cast<uint8_t*>(ptr);
+#endif
+    if (data_ == nullptr) {
+      Close();
+      return false;
+    }
+    size_ = size;
+    return true;
+  }
+
+  bool Open(const std::string& name) {
+    Close();
+#ifdef _WIN32
+    mapping_ = ::OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE,
+                                  SharedObjectName(name).c_str());
+    if (mapping_ == NULL) {
+      return false;
+    }
+    data_ = static_cast<uint8_t*>(
+        ::MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+    MEMORY_BASIC_INFORMATION info{};
+    if (data_ != nullptr && ::VirtualQuery(data_, &info, sizeof(info)) != 0) {
+      size_ = info.RegionSize;
+    }
+#else
+    int fd = ::shm_open(SharedObjectName(name).c_str(), O_RDWR, 0600);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st {};
+    if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* ptr = ::mmap(NULL, static_cast<size_t>(st.st_size),
+                         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (ptr != MAP_FAILED) {
+        data_ = static_cast<uint8_t*>(ptr);
+        size_ = static_cast<size_t>(st.st_size);
+      }
+    }
+    ::close(fd);
+#endif
+    if (data_ == nullptr) {
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  void Close() {
+#ifdef _WIN32
+    if (data_ != nullptr) {
+      ::UnmapViewOfFile(data_);
+    }
+    if (mapping_ != NULL) {
+      ::CloseHandle(mapping_);
+      mapping_ = NULL;
+    }
+#else
+    if (data_ != nullptr) {
+      ::munmap(data_, size_);
+    }
+    if (owner_) {
+      ::shm_unlink(name_.c_str());
+      owner_ = false;
+    }
+#endif
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+#ifdef _WIN32
+  HANDLE mapping_ = NULL;
+#else
+  std::string name_;
+  bool owner_ = false;
+#endif
+  uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Another process, watched for exit.
+class Process {
+ public:
+  Process() = default;
+  ~Process() { Close(); }
+  Process(const Process&) = delete;
+  Process& operator=(const Process&) = delete;
+
+  bool Open(uint32_t pid) {
+    Close();
+#ifdef _WIN32
+    handle_ = ::OpenProcess(SYNCHRONIZE, FALSE, pid);
+    return handle_ != NULL;
+#else
+    pid_ = static_cast<pid_t>(pid);
+    return !exited();
+#endif
+  }
+
+  void Close() {
+#ifdef _WIN32
+    if (handle_ != NULL) {
+      ::CloseHandle(handle_);
+      handle_ = NULL;
+    }
+#else
+    pid_ = 0;
+#endif
+  }
+
+  bool exited() const {
+#ifdef _WIN32
+    return handle_ != NULL &&
+           ::WaitForSingleObject(handle_, 0) == WAIT_OBJECT_0;
+#else
+    return pid_ != 0 && ::kill(pid_, 0) != 0 && errno == ESRCH;
+#endif
+  }
+
+#ifdef _WIN32
+  HANDLE handle() const { return handle_; }
+#endif
+
+ private:
+#ifdef _WIN32
+  HANDLE handle_ = NULL;
+#else
+  pid_t pid_ = 0;
+#endif
+};
+
+// Named auto-reset event usable across processes. On Linux the state is a
+// futex word that lives in its own small shared memory object.
+class Event {
+ public:
+  Event() = default;
+  ~Event() { Close(); }
+  Event(const Event&) = delete;
+  Event& operator=(const Event&) = delete;
+
+  bool Create(const std::string& name) {
+    Close();
+#ifdef _WIN32
+    event_ = ::CreateEventA(NULL, FALSE, FALSE, SharedObjectName(name).c_str());
+    return event_ != NULL;
+#else
+    if (!memory_.Create(name, sizeof(std::atomic<uint32_t>))) {
+      return false;
+    }
+    word()->store(0);
+    return true;
+#endif
+  }
+
+  bool Open(const std::string& name) {
+    Close();
+#ifdef _WIN32
+    event_ = ::OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE,
+                          SharedObjectName(name).c_str());
+    return event_ != NULL;
+#else
+    return memory_.Open(name);
+#endif
+  }
+
+  void Close() {
+#ifdef _WIN32
+    if (event_ != NULL) {
+      ::CloseHandle(event_);
+      event_ = NULL;
+    }
+#else
+    memory_.Close();
+#endif
+  }
+
+  void Signal() {
+#ifdef _WIN32
+    ::SetEvent(event_);
+#else
+    if (word()->exchange(1, std::memory_order_release) == 0) {
+      ::syscall(SYS_futex, word(), FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+#endif
+  }
+
+  // Returns true if the event was signaled, false on timeout or, when
+  // |process| is given, once that process has exited. |timeout_ms| may be
+  // kInfinite.
+  bool Wait(uint32_t timeout_ms, const Process* process = nullptr) {
+#ifdef _WIN32
+    if (process != nullptr && process->handle() != NULL) {
+      HANDLE handles[] = {event_, process->handle()};
+      return ::WaitForMultipleObjects(2, handles, FALSE, timeout_ms) ==
+             WAIT_OBJECT_0;
+    }
+    return ::WaitForSingleObject(event_, timeout_ms) == WAIT_OBJECT_0;
+#else
+    // A futex cannot be waited on together with a process, so process exit
+    // is noticed by re-checking every kExitPollMs.
+    constexpr uint32_t kExitPollMs = 500;
+    while (true) {
+      if (word()->exchange(0, std::memory_order_acquire) != 0) {
+        return true;
+      }
+      if (process != nullptr && process->exited()) {
+        return false;
+      }
+      uint32_t slice = timeout_ms;
+      if (process != nullptr && slice > kExitPollMs) {
+        slice = kExitPollMs;
+      }
+      struct timespec ts;
+      ts.tv_sec = slice / 1000;
+      ts.tv_nsec = static_cast<long>(slice % 1000) * 1000000;
+      ::syscall(SYS_futex, word(), FUTEX_WAIT, 0,
+                slice == kInfinite ? NULL : &ts, NULL, 0);
+      if (word()->exchange(0, std::memory_order_acquire) != 0) {
+        return true;
+      }
+      if (timeout_ms != kInfinite) {
+        if (timeout_ms <= slice) {
+          return false;
+        }
+        timeout_ms -= slice;
+      }
+    }
+#endif
+  }
+
+ private:
+#ifdef _WIN32
+  HANDLE event_ = NULL;
+#else
+  std::atomic<uint32_t>* word() {
+    return reinterpret_cast<std::atomic<uint32_t>*>(memory_.data());
+  }
+  SharedMemory memory_;
+#endif
+};
@@ -0,0 +1,486 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "inject.h"
+
+// Capture wire format.
+//
+// Version 1 is the original framing from inject.h: every packet is a 0xFE 0xCF
+// magic, a Header and the PCM, optionally coalesced into 0xFE 0xCB batches.
+//
+// Version 2 sends each transport record as one frame: a FrameHeader, a run of
+// 8-byte aligned messages, and a table of uint32 message offsets (relative to
+// the frame) at table_offset. A FormatMessage is sent the first time a format
+// is used in a session and assigns it a small id; PacketMessages refer to
+// that id instead of repeating the format. A packet's payload follows its
+// message header and is frames * block_align bytes of interleaved PCM,
+// except for kPacketSilent packets, which carry no payload and stand for that
+// many frames of silence. Producers only send those when the consumer asks
+// for them (Transport::Settings::elide_silence).
+//
+// Version 3 adds StreamMessages for processes that render several streams
+// at once. One is sent whenever the next packets belong to a different
+// stream than the previous ones in the session; packets before the first
+// belong to stream 0. Older consumers skip the message type.
+//
+// The consumer requests a version when it attaches and the producer never
+// speaks a newer one than requested.
+
+constexpr uint32_t kProtocolV1 = 1;
+constexpr uint32_t kProtocolV2 = 2;
+constexpr uint32_t kProtocolV3 = 3;
+constexpr uint32_t kProtocolVersion = kProtocolV3;
+
+enum class SampleType : uint8_t { kInt = 0, kFloat = 1 };
+
+struct AudioFormat {
+  uint16_t channels = 0;
+  uint16_t bits_per_sample = 0;
+  uint32_t sampling_rate = 0;
+  SampleType sample_type = SampleType::kInt;
+  uint32_t channel_mask = 0;
+
+  size_t block_align() const { return channels * (bits_per_sample / 8); }
+
+  bool operator==(const AudioFormat& other) const {
+    return channels == other.channels &&
+           bits_per_sample == other.bits_per_sample &&
+           sampling_rate == other.sampling_rate &&
+           sample_type == other.sample_type &&
+           channel_mask == other.channel_mask;
+  }
+  bool operator!=(const AudioFormat& other) const { return !(*this == other); }
+};
+
+enum MessageType : uint8_t {
+  kFormatMessage = 1,
+  kPacketMessage = 2,
+  kStreamMessage = 3,
+};
+
+struct FrameHeader {
+  uint8_t magic[2];
+  uint16_t count;
+  uint32_t table_offset;
+  uint32_t total_size;
+  uint32_t reserved;
+};
+
+struct FormatMessage {
+  uint8_t type;
+  uint8_t sample_type;
+  uint16_t format_id;
+  uint16_t channels;
+  uint16_t bits_per_sample;
+  uint32_t sampling_rate;
+  uint32_t channel_mask;
+};
+
+// PacketMessage::flags.
+enum PacketFlags : uint8_t {
+  kPacketSilent = 0x01,
+};
+
+struct PacketMessage {
+  uint8_t type;
+  uint8_t flags;
+  uint16_t format_id;
+  uint32_t frames;
+  uint64_t sequence;
+  // Frames of the packet's stream before it, including lost ones. Version 3
+  // producers count each stream on its own.
+  uint64_t position;
+  uint64_t timestamp_ns;
+};
+
+struct StreamMessage {
+  uint8_t type;
+  uint8_t reserved[3];
+  uint32_t stream_id;
+};
+
+static_assert(sizeof(FrameHeader) == 16, "unexpected FrameHeader layout");
+static_assert(sizeof(FormatMessage) == 16, "unexpected FormatMessage layout");
+static_assert(sizeof(PacketMessage) == 32, "unexpected PacketMessage layout");
+static_assert(sizeof(StreamMessage) == 8, "unexpected StreamMessage layout");
+
+// A decoded packet, whatever version it arrived in.
+struct Packet {
+  const AudioFormat* format;
+  const uint8_t* data;
+  size_t size;
+  uint32_t frames;
+  // PacketFlags. A kPacketSilent packet has no data and |size| 0.
+  uint8_t flags;
+  uint64_t sequence;
+  uint64_t position;
+  uint64_t timestamp_ns;
+  // Packets were lost between the previous packet and this one.
+  bool discontinuity;
+  // Producer-assigned stream, 0 before version 3.
+  uint32_t stream;
+};
+
+// Builds a v2 frame in place.
+class FrameWriter {
+ public:
+  static constexpr size_t kMaxMessages = 512;
+
+  void Begin(uint8_t* buf, size_t capacity) {
+    buf_ = buf;
+    capacity_ = capacity;
+    used_ = sizeof(FrameHeader);
+    count_ = 0;
+  }
+
+  bool open() const { return buf_ != nullptr; }
+  size_t count() const { return count_; }
+  size_t size() const { return used_; }
+
+  // Returns space for a |size| byte message, or nullptr if the message and
+  // its offset table entry no longer fit.
+  uint8_t* Append(size_t size) {
+    size_t offset = AlignUp(used_, 8);
+    if (count_ == kMaxMessages ||
+        AlignUp(offset + size, 4) + (count_ + 1) * sizeof(uint32_t) >
+            capacity_) {
+      return nullptr;
+    }
+    offsets_[count_++] = static_cast<uint32_t>(offset);
+    used_ = offset + size;
+    return buf_ + offset;
+  }
+
+  // Writes the header and offset table and returns the frame size.
+  size_t Finish() {
+    FrameHeader header{};
+    header.magic[0] = 0xFE;
+    header.magic[1] = 0xC2;
+    header.count = static_cast<uint16_t>(count_);
+    header.table_offset = static_cast<uint32_t>(AlignUp(used_, 4));
+    header.total_size = static_cast<uint32_t>(header.table_offset +
+                                              count_ * sizeof(uint32_t));
+    ::memcpy(buf_, &header, sizeof(header));
+    ::memcpy(buf_ + header.table_offset, offsets_, count_ * sizeof(uint32_t));
+    buf_ = nullptr;
+    return header.total_size;
+  }
+
+  // Worst-case frame size for a single message of |size| bytes.
+  static size_t FrameSize(size_t size) {
+    return AlignUp(sizeof(FrameHeader) + size, 8) + sizeof(uint32_t);
+  }
+
+ private:
+  static size_t AlignUp(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+  }
+
+  uint8_t* buf_ = nullptr;
+  size_t capacity_ = 0;
+  size_t used_ = 0;
+  size_t count_ = 0;
+  uint32_t offsets_[kMaxMessages];
+};
+
+// Producer-side session state: which formats the consumer has been told,
+// and which stream it was told the packets belong to.
+class Encoder {
+ public:
+  static constexpr size_t kMaxFormats = 16;
+
+  // Forgets every format; called when a new consumer attaches.
+  void Reset() {
+    count_ = 0;
+    stream_ = 0;
+  }
+
+  // Also re-announces the stream with the next packet, even stream 0, so the
+  // frame it goes into can be decoded without the ones before it.
+  void Restart() {
+    count_ = 0;
+    stream_ = kNoStream;
+  }
+
+  // Appends a packet with a |size| byte payload, preceded by a format
+  // descriptor if this session has not seen |format| yet, and by a stream
+  // message if |stream| differs from the previous packet's. Streams other
+  // than 0 need version 3. Returns where the payload goes, or nullptr if the
+  // messages do not fit in |writer|.
+  uint8_t* AddPacket(FrameWriter& writer, const AudioFormat& format,
+                     const PacketMessage& packet, size_t size,
+                     uint32_t stream = 0) {
+    if (stream != stream_) {
+      uint8_t* ptr = writer.Append(sizeof(StreamMessage));
+      if (ptr == nullptr) {
+        return nullptr;
+      }
+      StreamMessage message{};
+      message.type = kStreamMessage;
+      message.stream_id = stream;
+      ::memcpy(ptr, &message, sizeof(message));
+      stream_ = stream;
+    }
+
+    size_t id = Find(format);
+    bool is_new = id == count_;
+    if (is_new && count_ == kMaxFormats) {
+      count_ = 0;
+      id = 0;
+    }
+
+    if (is_new) {
+      uint8_t* ptr = writer.Append(sizeof(FormatMessage));
+      if (ptr == nullptr) {
+        return nullptr;
+      }
+      FormatMessage message{};
+      message.type = kFormatMessage;
+      message.sample_type = static_cast<uint8_t>(format.sample_type);
+      message.format_id = static_cast<uint16_t>(id);
+      message.channels = format.channels;
+      message.bits_per_sample = format.bits_per_sample;
+      message.sampling_rate = format.sampling_rate;
+      message.channel_mask = format.channel_mask;
+      ::memcpy(ptr, &message, sizeof(message));
+      // Frames are always published once started, so even if the packet
+      // itself spills into the next frame the consumer sees the descriptor.
+      formats_[count_++] = format;
+    }
+
+    uint8_t* ptr = writer.Append(sizeof(PacketMessage) + size);
+    if (ptr == nullptr) {
+      return nullptr;
+    }
+    PacketMessage message = packet;
+    message.type = kPacketMessage;
+    message.format_id = static_cast<uint16_t>(id);
+    ::memcpy(ptr, &message, sizeof(message));
+    return ptr + sizeof(PacketMessage);
+  }
+
+  // Bytes AddPacket() may need beyond the payload.
+  static constexpr size_t kPacketOverhead =
+      sizeof(StreamMessage) + sizeof(FormatMessage) + sizeof(PacketMessage) +
+      3 * sizeof(uint32_t) + 24;
+
+ private:
+  // Not a stream id, so the next packet always gets a stream message.
+  static constexpr uint32_t kNoStream = UINT32_MAX;
+
+  size_t Find(const AudioFormat& format) const {
+    for (size_t i = 0; i < count_; ++i) {
+      if (formats_[i] == format) {
+        return i;
+      }
+    }
+    return count_;
+  }
+
+  AudioFormat formats_[kMaxFormats];
+  size_t count_ = 0;
+  uint32_t stream_ = 0;
+};
+
+// Consumer-side decoder for v1 frames, v1 batches and v2 frames (which
+// version 3 uses as well).
+class Decoder {
+ public:
+  // Decodes one transport record and calls |fn(const Packet&)| for every
+  // packet in it. Returns false if the record is malformed.
+  template <typename Fn>
+  bool Decode(const uint8_t* buf, size_t size, Fn fn) {
+    if (size < 2 || buf[0] != 0xFE) {
+      return false;
+    }
+    switch (buf[1]) {
+      case 0xCF:
+        return DecodeV1Frame(buf, size, fn);
+      case 0xCB:
+        return DecodeV1Batch(buf, size, fn);
+      case 0xC2:
+        return DecodeV2Frame(buf, size, fn);
+      default:
+        return false;
+    }
+  }
+
+  // Packets known to be missing, from gaps in the sequence numbers.
+  uint64_t lost() const { return lost_; }
+
+ private:
+  template <typename Fn>
+  bool DecodeV1Frame(const uint8_t* buf, size_t size, Fn& fn) {
+    if (size < 2 + sizeof(Header)) {
+      return false;
+    }
+    Header h;
+    ::memcpy(&h, buf + 2, sizeof(Header));
+    if (h.data_offset < 0 || h.data_size < 0 || h.samples < 0 ||
+        (size_t)h.data_offset + h.data_size > size) {
+      return false;
+    }
+
+    // v1 does not say whether samples are float. WASAPI mix formats, the
+    // only 32-bit source, are float.
+    AudioFormat format;
+    format.channels = static_cast<uint16_t>(h.channels);
+    format.bits_per_sample = static_cast<uint16_t>(h.bits_per_sample);
+    format.sampling_rate = static_cast<uint32_t>(h.sampling_rate);
+    format.sample_type =
+        h.bits_per_sample == 32 ? SampleType::kFloat : SampleType::kInt;
+    formats_[0] = format;
+
+    Packet packet{};
+    packet.format = &formats_[0];
+    packet.data = buf + h.data_offset;
+    packet.size = static_cast<size_t>(h.data_size);
+    packet.frames = static_cast<uint32_t>(h.samples);
+    packet.sequence = next_sequence_;
+    packet.position = next_position_;
+    Deliver(packet, fn);
+    return true;
+  }
+
+  template <typename Fn>
+  bool DecodeV1Batch(const uint8_t* buf, size_t size, Fn& fn) {
+    if (size < 2 + sizeof(BatchHeader)) {
+      return false;
+    }
+    BatchHeader b;
+    ::memcpy(&b, buf + 2, sizeof(BatchHeader));
+    if (b.count < 0 || b.table_offset < 0 || b.total_size < 0 ||
+        (size_t)b.total_size > size ||
+        (size_t)b.table_offset + b.count * sizeof(int) >
+            (size_t)b.total_size) {
+      return false;
+    }
+    for (int i = 0; i < b.count; ++i) {
+      int offset;
+      ::memcpy(&offset, buf + b.table_offset + i * sizeof(int), sizeof(int));
+      if (offset < 0 || offset >= b.table_offset ||
+          !DecodeV1Frame(buf + offset, b.table_offset - offset, fn)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  template <typename Fn>
+  bool DecodeV2Frame(const uint8_t* buf, size_t size, Fn& fn) {
+    if (size < sizeof(FrameHeader)) {
+      return false;
+    }
+    FrameHeader h;
+    ::memcpy(&h, buf, sizeof(FrameHeader));
+    if (h.total_size > size ||
+        (size_t)h.table_offset + h.count * sizeof(uint32_t) > h.total_size) {
+      return false;
+    }
+    for (size_t i = 0; i < h.count; ++i) {
+      uint32_t offset;
+      ::memcpy(&offset, buf + h.table_offset + i * sizeof(uint32_t),
+               sizeof(uint32_t));
+      if (offset < sizeof(FrameHeader) || offset >= h.table_offset) {
+        return false;
+      }
+      if (!DecodeV2Message(buf + offset, h.table_offset - offset, fn)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  template <typename Fn>
+  bool DecodeV2Message(const uint8_t* buf, size_t size, Fn& fn) {
+    if (buf[0] == kFormatMessage) {
+      FormatMessage m;
+      if (size < sizeof(m)) {
+        return false;
+      }
+      ::memcpy(&m, buf, sizeof(m));
+      if (m.format_id >= kMaxFormats) {
+        return false;
+      }
+      AudioFormat& format = formats_[m.format_id];
+      format.channels = m.channels;
+      format.bits_per_sample = m.bits_per_sample;
+      format.sampling_rate = m.sampling_rate;
+      format.sample_type = static_cast<SampleType>(m.sample_type);
+      format.channel_mask = m.channel_mask;
+      known_ |= 1u << m.format_id;
+      return true;
+    }
+
+    if (buf[0] == kPacketMessage) {
+      PacketMessage m;
+      if (size < sizeof(m)) {
+        return false;
+      }
+      ::memcpy(&m, buf, sizeof(m));
+      if (m.format_id >= kMaxFormats) {
+        return false;
+      }
+      if (!(known_ & (1u << m.format_id))) {
+        // Described before this consumer attached; nothing to decode it with.
+        return true;
+      }
+      Packet packet{};
+      packet.format = &formats_[m.format_id];
+      packet.data = buf + sizeof(m);
+      packet.size = (m.flags & kPacketSilent)
+                        ? 0
+                        : static_cast<size_t>(m.frames) *
+                              packet.format->block_align();
+      packet.frames = m.frames;
+      packet.flags = m.flags;
+      packet.sequence = m.sequence;
+      packet.position = m.position;
+      packet.timestamp_ns = m.timestamp_ns;
+      packet.stream = stream_;
+      if (sizeof(m) + packet.size > size) {
+        return false;
+      }
+      Deliver(packet, fn);
+      return true;
+    }
+
+    if (buf[0] == kStreamMessage) {
+      StreamMessage m;
+      if (size < sizeof(m)) {
+        return false;
+      }
+      ::memcpy(&m, buf, sizeof(m));
+      stream_ = m.stream_id;
+      return true;
+    }
+
+    // Unknown message types are skipped so newer producers stay readable.
+    return true;
+  }
+
+  template <typename Fn>
+  void Deliver(Packet& packet, Fn& fn) {
+    if (started_ && packet.sequence > next_sequence_) {
+      lost_ += packet.sequence - next_sequence_;
+      packet.discontinuity = true;
+    }
+    started_ = true;
+    next_sequence_ = packet.sequence + 1;
+    next_position_ = packet.position + packet.frames;
+    fn(static_cast<const Packet&>(packet));
+  }
+
+  static constexpr size_t kMaxFormats = Encoder::kMaxFormats;
+
+  AudioFormat formats_[kMaxFormats];
+  uint32_t known_ = 0;
+  uint32_t stream_ = 0;
+  bool started_ = false;
+  uint64_t next_sequence_ = 0;
+  uint64_t next_position_ = 0;
+  uint64_t lost_ = 0;
+};
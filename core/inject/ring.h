@@ -0,0 +1,196 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+// Single-producer/single-consumer ring of variable-sized records in one block
+// of memory. The block may be shared memory mapped by two processes, so the
+// layout only uses fixed-width fields and lock-free atomics.
+//
+// Cursors are free-running byte counts. Every record is contiguous: a record
+// that would straddle the end of the buffer is preceded by a padding record
+// and starts again at offset 0.
+class Ring {
+ public:
+  static constexpr uint32_t kMagic = 0x52434121;
+  static constexpr size_t kControlSize = 512;
+  static constexpr size_t kAlignment = 8;
+
+  struct Control {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t capacity;
+
+    // Written by the producer.
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint32_t> producer_closed;
+
+    // Written by the consumer.
+    alignas(64) std::atomic<uint64_t> tail;
+    std::atomic<uint32_t> consumer_attached;
+    std::atomic<uint32_t> consumer_waiting;
+  };
+  static_assert(sizeof(Control) <= kControlSize, "control block too large");
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                "ring cursors must be lock-free");
+
+  static constexpr size_t RequiredSize(size_t capacity) {
+    return kControlSize + capacity;
+  }
+
+  // Producer side. Formats |memory| as an empty ring; |capacity| must be a
+  // power of two.
+  void Initialize(void* memory, size_t capacity) {
+    assert((capacity & (capacity - 1)) == 0);
+    control_ = new (memory) Control();
+    control_->magic = kMagic;
+    control_->capacity = capacity;
+    data_ = static_cast<uint8_t*>(memory) + kControlSize;
+    capacity_ = capacity;
+  }
+
+  // Consumer side. Attaches to a ring formatted by Initialize().
+  bool Attach(void* memory, size_t size) {
+    Control* control = static_cast<Control*>(memory);
+    if (size < kControlSize || control->magic != kMagic ||
+        RequiredSize(control->capacity) > size) {
+      return false;
+    }
+    control_ = control;
+    data_ = static_cast<uint8_t*>(memory) + kControlSize;
+    capacity_ = static_cast<size_t>(control->capacity);
+    head_cache_ = control->tail.load(std::memory_order_acquire);
+    return true;
+  }
+
+  Control* control() const { return control_; }
+  size_t capacity() const { return capacity_; }
+
+  // Largest payload a single record can carry.
+  size_t max_record_size() const { return capacity_ / 2 - sizeof(Record); }
+
+  // Returns space for a |size| byte record, or nullptr if the consumer has
+  // not freed enough room yet. Nothing is visible until Commit().
+  uint8_t* Reserve(size_t size) {
+    if (size > max_record_size()) {
+      return nullptr;
+    }
+    size_t record = AlignUp(sizeof(Record) + size);
+    uint64_t head = control_->head.load(std::memory_order_relaxed);
+    size_t offset = static_cast<size_t>(head) & (capacity_ - 1);
+    size_t to_end = capacity_ - offset;
+    size_t needed = record <= to_end ? record : to_end + record;
+    if (capacity_ - (head - tail_cache_) < needed) {
+      tail_cache_ = control_->tail.load(std::memory_order_acquire);
+      if (capacity_ - (head - tail_cache_) < needed) {
+        return nullptr;
+      }
+    }
+    if (record > to_end) {
+      Record* pad = RecordAt(offset);
+      pad->size = static_cast<uint32_t>(to_end - sizeof(Record));
+      pad->flags = kPadding;
+      head += to_end;
+      offset = 0;
+    }
+    reserved_head_ = head;
+    reserved_size_ = size;
+    return data_ + offset + sizeof(Record);
+  }
+
+  // Publishes the record returned by the last Reserve(). |size| may be
+  // smaller than the reserved size.
+  void Commit(size_t size) {
+    assert(size <= reserved_size_);
+    Record* record = RecordAt(static_cast<size_t>(reserved_head_) &
+                              (capacity_ - 1));
+    record->size = static_cast<uint32_t>(size);
+    record->flags = 0;
+    control_->head.store(reserved_head_ + AlignUp(sizeof(Record) + size),
+                         std::memory_order_release);
+  }
+
+  bool Write(const void* data, size_t size) {
+    uint8_t* ptr = Reserve(size);
+    if (ptr == nullptr) {
+      return false;
+    }
+    ::memcpy(ptr, data, size);
+    Commit(size);
+    return true;
+  }
+
+  // Consumer side. Returns the oldest record, or nullptr if the ring is
+  // empty. The record stays valid until Release().
+  const uint8_t* Peek(size_t* size) {
+    uint64_t tail = control_->tail.load(std::memory_order_relaxed);
+    while (true) {
+      if (tail == head_cache_) {
+        head_cache_ = control_->head.load(std::memory_order_acquire);
+        if (tail == head_cache_) {
+          return nullptr;
+        }
+      }
+      Record* record = RecordAt(static_cast<size_t>(tail) & (capacity_ - 1));
+      if (record->flags & kPadding) {
+        tail += sizeof(Record) + record->size;
+        control_->tail.store(tail, std::memory_order_release);
+        continue;
+      }
+      *size = record->size;
+      return reinterpret_cast<const uint8_t*>(record + 1);
+    }
+  }
+
+  // Frees the record returned by the last Peek().
+  void Release() {
+    uint64_t tail = control_->tail.load(std::memory_order_relaxed);
+    Record* record = RecordAt(static_cast<size_t>(tail) & (capacity_ - 1));
+    control_->tail.store(tail + AlignUp(sizeof(Record) + record->size),
+                         std::memory_order_release);
+  }
+
+  bool Empty() const {
+    return control_->head.load(std::memory_order_acquire) ==
+           control_->tail.load(std::memory_order_relaxed);
+  }
+
+  // Consumer side. Drops everything published so far.
+  void Skip() {
+    head_cache_ = control_->head.load(std::memory_order_acquire);
+    control_->tail.store(head_cache_, std::memory_order_release);
+  }
+
+ private:
+  static constexpr uint32_t kPadding = 1;
+
+  struct Record {
+    uint32_t size;
+    uint32_t flags;
+  };
+
+  static constexpr size_t AlignUp(size_t size) {
+    return (size + kAlignment - 1) & ~(kAlignment - 1);
+  }
+
+  Record* RecordAt(size_t offset) const {
+    return reinterpret_cast<Record*>(data_ + offset);
+  }
+
+  Control* control_ = nullptr;
+  uint8_t* data_ = nullptr;
+  size_t capacity_ = 0;
+
+  // Producer-local.
+  uint64_t tail_cache_ = 0;
+  uint64_t reserved_head_ = 0;
+  size_t reserved_size_ = 0;
+
+  // Consumer-local.
+  uint64_t head_cache_ = 0;
+};
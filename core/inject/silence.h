@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#define SILENCE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "protocol.h"
+
+// Byte pattern of a silent sample: 8-bit PCM is unsigned, everything else is
+// zero.
+inline uint8_t SilenceByte(const AudioFormat& format) {
+  return format.bits_per_sample == 8 ? 0x80 : 0x00;
+}
+
+// The linear limit for a threshold of |threshold_db| below full scale, or 0
+// (never silent) for a threshold of 0. Computed once per setting, not per
+// buffer.
+inline float SilenceLimit(uint32_t threshold_db) {
+  if (threshold_db == 0) {
+    return 0.0f;
+  }
+  return static_cast<float>(std::pow(10.0, -double(threshold_db) / 20.0));
+}
+
+// Near-silence test run by the audio hooks before a buffer is copied, so it
+// bails out at the first loud sample: audible buffers usually cost a few
+// cache lines. Float and 16-bit PCM, the WASAPI and DirectSound defaults, are
+// checked 16 samples at a time with SSE2.
+//
+// Returns true if no sample in the |size| bytes of |data| reaches |limit|,
+// a fraction of full scale from SilenceLimit(). A limit of 0 always returns
+// false.
+inline bool IsNearSilent(const AudioFormat& format, const void* data,
+                         size_t size, float limit) {
+  if (!(limit > 0.0f)) {
+    return false;
+  }
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+
+  if (format.sample_type == SampleType::kFloat &&
+      format.bits_per_sample == 32) {
+    const float* s = reinterpret_cast<const float*>(p);
+    size_t count = size / 4;
+    size_t i = 0;
+    float l = limit;
+#ifdef SILENCE_SSE2
+    const __m128 lv = _mm_set1_ps(l);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    for (; i + 16 <= count; i += 16) {
+      __m128 a = _mm_and_ps(_mm_loadu_ps(s + i), abs_mask);
+      __m128 b = _mm_and_ps(_mm_loadu_ps(s + i + 4), abs_mask);
+      __m128 c = _mm_and_ps(_mm_loadu_ps(s + i + 8), abs_mask);
+      __m128 d = _mm_and_ps(_mm_loadu_ps(s + i + 12), abs_mask);
+      __m128 loud = _mm_or_ps(
+          _mm_or_ps(_mm_cmpge_ps(a, lv), _mm_cmpge_ps(b, lv)),
+          _mm_or_ps(_mm_cmpge_ps(c, lv), _mm_cmpge_ps(d, lv)));
+      if (_mm_movemask_ps(loud) != 0) {
+        return false;
+      }
+    }
+#endif
+    for (; i < count; ++i) {
+      if (std::fabs(s[i]) >= l) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  if (format.sample_type != SampleType::kInt) {
+    return false;
+  }
+  switch (format.bits_per_sample) {
+    case 16: {
+      size_t count = size / 2;
+      size_t i = 0;
+      int l = static_cast<int>(std::ceil(limit * 32768.0));
+      if (l > 32767) {
+        return false;
+      }
+#ifdef SILENCE_SSE2
+      // |x| >= l  <=>  x > l - 1 or x < -(l - 1).
+      const __m128i hi = _mm_set1_epi16(static_cast<int16_t>(l - 1));
+      const __m128i lo = _mm_set1_epi16(static_cast<int16_t>(1 - l));
+      for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p) +
+                                    i / 8);
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p) +
+                                    i / 8 + 1);
+        __m128i loud = _mm_or_si128(
+            _mm_or_si128(_mm_cmpgt_epi16(a, hi), _mm_cmplt_epi16(a, lo)),
+            _mm_or_si128(_mm_cmpgt_epi16(b, hi), _mm_cmplt_epi16(b, lo)));
+        if (_mm_movemask_epi8(loud) != 0) {
+          return false;
+        }
+      }
+#endif
+      for (; i < count; ++i) {
+        int16_t v;
+        ::memcpy(&v, p + i * 2, 2);
+        if (v >= l || v <= -l) {
+          return false;
+        }
+      }
+      return true;
+    }
+    case 24: {
+      int32_t l = static_cast<int32_t>(std::ceil(limit * 8388608.0));
+      for (size_t i = 0; i + 3 <= size; i += 3) {
+        int32_t v = static_cast<int32_t>(uint32_t(p[i]) << 8 |
+                                         uint32_t(p[i + 1]) << 16 |
+                                         uint32_t(p[i + 2]) << 24) >>
+                    8;
+        if (v >= l || v <= -l) {
+          return false;
+        }
+      }
+      return true;
+    }
+    case 32: {
+      int64_t l = static_cast<int64_t>(std::ceil(limit * 2147483648.0));
+      for (size_t i = 0; i + 4 <= size; i += 4) {
+        int32_t v;
+        ::memcpy(&v, p + i, 4);
+        if (v >= l || v <= -l) {
+          return false;
+        }
+      }
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "protocol.h"
+
+// Per-stream state for the audio hooks, keyed by the COM object a hook is
+// called on (an IAudioRenderClient, IAudioClient or IDirectSoundBuffer). An
+// application may render several streams at once on different threads, so
+// each gets its own entry and its own id on the wire.
+//
+// The hooks run on audio threads: lookups and updates never lock, allocate
+// or call into COM. The table has a fixed number of slots and entries are
+// never removed, since the hooks do not see streams being released; when it
+// is full, the entry idle for longest is reused once it has been idle for
+// kStaleNs. Each slot is guarded by a sequence counter (a seqlock), so a
+// reader racing with reuse sees a miss rather than half of another stream.
+class StreamRegistry {
+ public:
+  static constexpr int kBits = 6;
+  static constexpr size_t kCapacity = size_t(1) << kBits;
+  static constexpr uint64_t kStaleNs = 5000000000ull;
+
+  struct Stream {
+    // For Advance(); -1 if the stream has no slot.
+    int slot = -1;
+    uint32_t id = 0;
+    AudioFormat format;
+    // Set by SetBuffer(), e.g. between GetBuffer() and ReleaseBuffer().
+    uint8_t* buffer = nullptr;
+  };
+
+  StreamRegistry() = default;
+  StreamRegistry(const StreamRegistry&) = delete;
+  StreamRegistry& operator=(const StreamRegistry&) = delete;
+
+  // Returns the slot holding |key|, or -1. Keys go into the first free slot
+  // from where they hash to and slots are never freed, so the search ends
+  // at a free one.
+  int Find(const void* key) const {
+    size_t start = Hash(key);
+    for (size_t i = 0; i < kCapacity; ++i) {
+      size_t slot = (start + i) & (kCapacity - 1);
+      const void* k = slots_[slot].key.load(std::memory_order_acquire);
+      if (k == key) {
+        return static_cast<int>(slot);
+      }
+      if (k == nullptr &&
+          slots_[slot].last_used.load(std::memory_order_acquire) == 0) {
+        return -1;
+      }
+    }
+    return -1;
+  }
+
+  // Copies the entry in |slot| if it still belongs to |key|.
+  bool Read(int slot, const void* key, Stream* stream) const {
+    const Slot& s = slots_[slot];
+    uint32_t before = s.seq.load(std::memory_order_acquire);
+    if (before & 1) {
+      return false;
+    }
+    bool match = s.key.load(std::memory_order_relaxed) == key;
+    uint64_t format = s.format.load(std::memory_order_relaxed);
+    uint32_t mask = s.channel_mask.load(std::memory_order_relaxed);
+    uint32_t id = s.id.load(std::memory_order_relaxed);
+    uint8_t* buffer = s.buffer.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!match || s.seq.load(std::memory_order_relaxed) != before) {
+      return false;
+    }
+    stream->slot = slot;
+    stream->id = id;
+    stream->format = Unpack(format, mask);
+    stream->buffer = buffer;
+    return true;
+  }
+
+  bool Lookup(const void* key, Stream* stream) const {
+    int slot = Find(key);
+    return slot >= 0 && Read(slot, key, stream);
+  }
+
+  // Starts a new stream for |key| with a new id, replacing any entry it
+  // had. Returns its slot, or -1 if every slot holds a live stream.
+  int Bind(const void* key, const AudioFormat& format, uint64_t now_ns) {
+    now_ns = Now(now_ns);
+    for (int attempt = 0; attempt < 8; ++attempt) {
+      int slot = Find(key);
+      if (slot < 0) {
+        slot = Victim(key, now_ns);
+      }
+      if (slot < 0) {
+        return -1;
+      }
+      Slot& s = slots_[slot];
+      uint64_t last = s.last_used.load(std::memory_order_acquire);
+      bool own = s.key.load(std::memory_order_relaxed) == key;
+      if (last == kClaimed || (!own && !Reusable(last, now_ns)) ||
+          !s.last_used.compare_exchange_strong(last, kClaimed,
+                                               std::memory_order_acq_rel)) {
+        continue;
+      }
+      uint32_t seq = s.seq.load(std::memory_order_relaxed);
+      s.seq.store(seq + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      s.key.store(key, std::memory_order_relaxed);
+      s.format.store(Pack(format), std::memory_order_relaxed);
+      s.channel_mask.store(format.channel_mask, std::memory_order_relaxed);
+      s.id.store(next_id_.fetch_add(1, std::memory_order_relaxed),
+                 std::memory_order_relaxed);
+      s.buffer.store(nullptr, std::memory_order_relaxed);
+      s.position.store(0, std::memory_order_relaxed);
+      s.seq.store(seq + 2, std::memory_order_release);
+      s.last_used.store(now_ns, std::memory_order_release);
+      return slot;
+    }
+    return -1;
+  }
+
+  // Marks the stream in |slot| used at |now_ns|, so it is not taken for
+  // reuse while it is still playing. Hooks call this for every buffer they
+  // see. Returns false if the slot no longer belongs to |key|.
+  bool Touch(int slot, const void* key, uint64_t now_ns) {
+    Slot& s = slots_[slot];
+    // Marking the slot used first means it cannot be chosen for reuse from
+    // here on, and a reuse that already started is seen below.
+    uint64_t last = s.last_used.load(std::memory_order_relaxed);
+    do {
+      if (last == kClaimed) {
+        return false;
+      }
+    } while (!s.last_used.compare_exchange_weak(last, Now(now_ns),
+                                                std::memory_order_acq_rel));
+    return s.key.load(std::memory_order_acquire) == key;
+  }
+
+  // Records the buffer the stream in |slot| is filling and touches it.
+  // Returns false if the slot no longer belongs to |key|.
+  bool SetBuffer(int slot, const void* key, uint8_t* buffer,
+                 uint64_t now_ns) {
+    if (!Touch(slot, key, now_ns)) {
+      return false;
+    }
+    slots_[slot].buffer.store(buffer, std::memory_order_release);
+    return true;
+  }
+
+  // Counts |frames| more frames of the stream in |slot| and returns how many
+  // there were before, i.e. the position of a packet of |frames|.
+  uint64_t Advance(int slot, uint32_t frames) {
+    if (slot < 0) {
+      return 0;
+    }
+    return slots_[slot].position.fetch_add(frames, std::memory_order_relaxed);
+  }
+
+ private:
+  // Slot::last_used of a slot that is being rewritten.
+  static constexpr uint64_t kClaimed = UINT64_MAX;
+
+  struct Slot {
+    // Odd while the entry is rewritten.
+    std::atomic<uint32_t> seq{0};
+    std::atomic<const void*> key{nullptr};
+    // Channels, bits per sample, rate and sample type; see Pack().
+    std::atomic<uint64_t> format{0};
+    std::atomic<uint32_t> channel_mask{0};
+    std::atomic<uint32_t> id{0};
+    std::atomic<uint8_t*> buffer{nullptr};
+    std::atomic<uint64_t> position{0};
+    // 0 while free.
+    std::atomic<uint64_t> last_used{0};
+  };
+
+  static size_t Hash(const void* key) {
+    uint64_t x = reinterpret_cast<uintptr_t>(key) >> 4;
+    return static_cast<size_t>((x * 0x9E3779B97F4A7C15ull) >> (64 - kBits));
+  }
+
+  // 0 marks a free slot, so a clock reading of 0 is moved on.
+  static uint64_t Now(uint64_t now_ns) { return now_ns != 0 ? now_ns : 1; }
+
+  static bool Reusable(uint64_t last, uint64_t now_ns) {
+    return last == 0 || (now_ns > last && now_ns - last >= kStaleNs);
+  }
+
+  // The first free slot from where |key| hashes to, so Find() gets there
+  // quickly, or else the stalest reusable one, or -1.
+  int Victim(const void* key, uint64_t now_ns) const {
+    int stalest = -1;
+    uint64_t oldest = UINT64_MAX;
+    size_t start = Hash(key);
+    for (size_t i = 0; i < kCapacity; ++i) {
+      size_t slot = (start + i) & (kCapacity - 1);
+      uint64_t last = slots_[slot].last_used.load(std::memory_order_relaxed);
+      if (last == 0) {
+        return static_cast<int>(slot);
+      }
+      if (last != kClaimed && Reusable(last, now_ns) && last < oldest) {
+        oldest = last;
+        stalest = static_cast<int>(slot);
+      }
+    }
+    return stalest;
+  }
+
+  static uint64_t Pack(const AudioFormat& format) {
+    return uint64_t(format.channels) | uint64_t(format.bits_per_sample) << 16 |
+           uint64_t(format.sampling_rate) << 32 |
+           uint64_t(format.sample_type == SampleType::kFloat) << 15;
+  }
+
+  static AudioFormat Unpack(uint64_t packed, uint32_t mask) {
+    AudioFormat format;
+    format.channels = static_cast<uint16_t>(packed & 0x7FFF);
+    format.bits_per_sample = static_cast<uint16_t>(packed >> 16);
+    format.sampling_rate = static_cast<uint32_t>(packed >> 32);
+    format.sample_type =
+        (packed >> 15) & 1 ? SampleType::kFloat : SampleType::kInt;
+    format.channel_mask = mask;
+    return format;
+  }
+
+  Slot slots_[kCapacity];
+  std::atomic<uint32_t> next_id_{1};
+};
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+
+#include "platform.h"
+#include "protocol.h"
+#include "ring.h"
+
+// Capture transport between the inject DLL (producer) and the injector
+// (consumer): a Ring in named shared memory plus an event that wakes the
+// consumer. The producer only pays for an event signal when the consumer is
+// parked in Wait(); otherwise publishing a record is a single release store.
+//
+// The ring has a single consumer. Open() claims it, and fails while another
+// live process holds it; processes that only watch read the Broadcast.
+class Transport {
+ public:
+  static constexpr size_t kCapacity = 4 * 1024 * 1024;
+
+  // Capture options chosen by the consumer. They are written before the
+  // consumer marks itself attached, and the producer re-reads them while it
+  // has a consumer.
+  struct Settings {
+    // Wire format version. The consumer asks for one in Open() and it is
+    // lowered to what the producer speaks.
+    uint32_t protocol_version = kProtocolV1;
+    // Packets are coalesced into one frame until it holds this many bytes;
+    // 0 sends every packet as its own frame.
+    uint32_t batch_max_bytes = 0;
+    // A partially filled batch is flushed once its oldest packet is this old.
+    uint32_t batch_deadline_us = 0;
+    // Send silent buffers as payload-free kPacketSilent packets (version 2
+    // only). Otherwise they go out as zeros.
+    uint32_t elide_silence = 0;
+    // Also treat buffers whose peak is below -N dBFS as silent; 0 only
+    // trusts the application's silent flag.
+    uint32_t silence_threshold_db = 0;
+    // A consumer serving many transports sets this to the id of a shared
+    // event (see DoorbellName()); the producer then wakes it through that
+    // event instead of this transport's own. 0: no doorbell.
+    uint32_t doorbell = 0;
+  };
+
+  // Start of the mapping, ahead of the ring.
+  struct Shared {
+    // Written by the producer in Create().
+    uint32_t max_protocol_version;
+    // Bumped by every consumer that attaches, so the producer can tell a
+    // fresh consumer that has not seen any format descriptors yet.
+    std::atomic<uint32_t> session;
+    // Process id of the consumer that claimed the ring; 0 while unclaimed.
+    // Only the owner writes |settings| and the ring's consumer fields.
+    std::atomic<uint32_t> consumer;
+    Settings settings;
+  };
+  static constexpr size_t kHeaderSize = 64;
+  static_assert(sizeof(Shared) <= kHeaderSize, "shared header too large");
+
+  static std::string Name(uint32_t pid) {
+    return "audiocapture_" + std::to_string(pid);
+  }
+
+  static std::string DoorbellName(uint32_t id) {
+    return "audiocapture_doorbell_" + std::to_string(id);
+  }
+
+  Transport() = default;
+  ~Transport() { Close(); }
+  Transport(const Transport&) = delete;
+  Transport& operator=(const Transport&) = delete;
+
+  // Producer side.
+  bool Create(uint32_t pid) {
+    Close();
+    if (!memory_.Create(Name(pid),
+                        kHeaderSize + Ring::RequiredSize(kCapacity)) ||
+        !event_.Create(Name(pid) + "_event")) {
+      Close();
+      return false;
+    }
+    Shared* header = new (memory_.data()) Shared();
+    header->max_protocol_version = kProtocolVersion;
+    ring_.Initialize(memory_.data() + kHeaderSize, kCapacity);
+    producer_ = true;
+    return true;
+  }
+
+  // Consumer side. Records published before Open() are discarded.
+  // |settings.protocol_version| is the newest version the consumer accepts.
+  // Fails if another consumer has the transport, unless its process is gone.
+  bool Open(uint32_t pid) { return Open(pid, Settings()); }
+  bool Open(uint32_t pid, Settings settings) {
+    Close();
+    producer_ = false;
+    if (!memory_.Open(Name(pid)) || !event_.Open(Name(pid) + "_event") ||
+        memory_.size() < kHeaderSize ||
+        !ring_.Attach(memory_.data() + kHeaderSize,
+                      memory_.size() - kHeaderSize) ||
+        !Claim()) {
+      Close();
+      return false;
+    }
+    // Not connected while the settings change, so the producer never frames
+    // with half of them.
+    Ring::Control* control = ring_.control();
+    control->consumer_attached.store(0, std::memory_order_release);
+    Shared* header = this->header();
+    settings.protocol_version =
+        std::min(settings.protocol_version, header->max_protocol_version);
+    ::memcpy(&header->settings, &settings, sizeof(Settings));
+    header->session.fetch_add(1, std::memory_order_release);
+    ring_.Skip();
+    control->consumer_attached.store(1, std::memory_order_release);
+    return true;
+  }
+
+  void Close() {
+    if (memory_.data() != nullptr) {
+      if (producer_) {
+        ring_.control()->producer_closed.store(1, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        Signal();
+      } else if (claimed_) {
+        ring_.control()->consumer_attached.store(0, std::memory_order_release);
+        header()->consumer.store(0, std::memory_order_release);
+      }
+    }
+    claimed_ = false;
+    event_.Close();
+    doorbell_.Close();
+    doorbell_id_ = 0;
+    memory_.Close();
+  }
+
+  Ring& ring() { return ring_; }
+
+  // The negotiated settings. On the producer side only meaningful while
+  // connected().
+  Settings settings() const {
+    Settings settings;
+    if (memory_.data() == nullptr) {
+      return settings;
+    }
+    ::memcpy(&settings, &header()->settings, sizeof(Settings));
+    return settings;
+  }
+
+  // Producer side. Changes whenever a new consumer attaches.
+  uint32_t session() const {
+    if (memory_.data() == nullptr) {
+      return 0;
+    }
+    return header()->session.load(std::memory_order_acquire);
+  }
+
+  // Producer side. True while a consumer is attached; records written with no
+  // consumer would only be stale by the time anyone reads them.
+  bool connected() const {
+    return memory_.data() != nullptr &&
+           ring_.control()->consumer_attached.load(
+               std::memory_order_acquire) != 0;
+  }
+
+  // Producer side. Wakes the consumer if it is waiting for data.
+  void Notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring_.control()->consumer_waiting.load(std::memory_order_relaxed)) {
+      Signal();
+    }
+  }
+
+  // Producer side. Counts records that did not fit.
+  void Drop(uint64_t count = 1) {
+    ring_.control()->dropped.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  // Consumer side. True once the producer has closed the transport.
+  bool closed() const {
+    return ring_.control()->producer_closed.load(std::memory_order_acquire) !=
+           0;
+  }
+
+  // Consumer side, for waiting on a doorbell shared by many transports:
+  // while set, the producer signals after publishing. Set it, then check
+  // Empty() and closed() before waiting, so nothing published in between
+  // is missed.
+  void SetWaiting(bool waiting) {
+    ring_.control()->consumer_waiting.store(waiting ? 1 : 0,
+                                            std::memory_order_relaxed);
+    if (waiting) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+  }
+
+  // Consumer side. Blocks until a record is available, the producer closes
+  // the transport, |process| (if given) exits, or |timeout_ms| elapses.
+  // Returns true if the ring has data.
+  bool Wait(uint32_t timeout_ms, const Process* process = nullptr) {
+    Ring::Control* control = ring_.control();
+    control->consumer_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring_.Empty() && !closed()) {
+      event_.Wait(timeout_ms, process);
+    }
+    control->consumer_waiting.store(0, std::memory_order_relaxed);
+    return !ring_.Empty();
+  }
+
+ private:
+  Shared* header() const { return reinterpret_cast<Shared*>(memory_.data()); }
+
+  // Consumer side. Takes the ring for this process, or over from a consumer
+  // that exited without closing.
+  bool Claim() {
+    std::atomic<uint32_t>& consumer = header()->consumer;
+    uint32_t self = CurrentProcessId();
+    uint32_t owner = 0;
+    if (!consumer.compare_exchange_strong(owner, self,
+                                          std::memory_order_acq_rel)) {
+      Process process;
+      if (owner == self || (process.Open(owner) && !process.exited()) ||
+          !consumer.compare_exchange_strong(owner, self,
+                                            std::memory_order_acq_rel)) {
+        return false;
+      }
+    }
+    claimed_ = true;
+    return true;
+  }
+
+  // Producer side. The doorbell event is opened on first use and again
+  // whenever a consumer with a different doorbell attaches.
+  void Signal() {
+    uint32_t doorbell = header()->settings.doorbell;
+    if (doorbell == 0) {
+      event_.Signal();
+      return;
+    }
+    if (doorbell != doorbell_id_) {
+      doorbell_id_ = doorbell_.Open(DoorbellName(doorbell)) ? doorbell : 0;
+    }
+    if (doorbell_id_ != 0) {
+      doorbell_.Signal();
+    } else {
+      event_.Signal();
+    }
+  }
+
+  SharedMemory memory_;
+  Event event_;
+  Event doorbell_;
+  uint32_t doorbell_id_ = 0;
+  Ring ring_;
+  bool producer_ = false;
+  // Consumer side. This transport holds Shared::consumer.
+  bool claimed_ = false;
+};
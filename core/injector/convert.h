@@ -0,0 +1,809 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+
+#include "../inject/protocol.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#define CONVERT_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(CONVERT_X86) && !defined(_MSC_VER)
+#define CONVERT_TARGET(isa) __attribute__((target(isa)))
+#else
+#define CONVERT_TARGET(isa)
+#endif
+
+// Sample format conversion between the encodings the capture can produce and
+// the ones we can store: s16, packed s24, s32 and f32, interleaved.
+//
+// The scalar kernels are the reference. Every vector kernel gives bit-identical
+// output on every input, including out-of-range and NaN floats, so the
+// instruction set picked at runtime never changes what lands on disk.
+// Conversions dr_wav also offers (s32 to s16, s16/s24/s32 to f32) match
+// drwav_*_to_* exactly, and f32 to s32 does too except that it saturates
+// where dr_wav overflows. Float is quantized to s16 and s24 alike, rounding
+// to nearest, so 0.0 stays 0 and integer samples survive a trip through
+// float; drwav_f32_to_s16 truncates instead and turns 0.0 into -1.
+
+enum class SampleEncoding : uint8_t { kUnknown, kS16, kS24, kS32, kF32 };
+
+inline SampleEncoding EncodingOf(SampleType type, uint16_t bits_per_sample) {
+  if (type == SampleType::kFloat) {
+    return bits_per_sample == 32 ? SampleEncoding::kF32
+                                 : SampleEncoding::kUnknown;
+  }
+  switch (bits_per_sample) {
+    case 16:
+      return SampleEncoding::kS16;
+    case 24:
+      return SampleEncoding::kS24;
+    case 32:
+      return SampleEncoding::kS32;
+  }
+  return SampleEncoding::kUnknown;
+}
+
+inline SampleEncoding EncodingOf(const AudioFormat& format) {
+  return EncodingOf(format.sample_type, format.bits_per_sample);
+}
+
+inline size_t BytesPerSample(SampleEncoding encoding) {
+  switch (encoding) {
+    case SampleEncoding::kS16:
+      return 2;
+    case SampleEncoding::kS24:
+      return 3;
+    case SampleEncoding::kS32:
+    case SampleEncoding::kF32:
+      return 4;
+    default:
+      return 0;
+  }
+}
+
+// The conversions worth vectorizing. Anything not listed here is a shift and
+// runs the scalar code on every instruction set.
+struct ConvertKernels {
+  const char* name;
+  void (*f32_to_s16)(int16_t* out, const float* in, size_t count);
+  void (*f32_to_s24)(uint8_t* out, const float* in, size_t count);
+  void (*f32_to_s32)(int32_t* out, const float* in, size_t count);
+  void (*s16_to_f32)(float* out, const int16_t* in, size_t count);
+  void (*s24_to_f32)(float* out, const uint8_t* in, size_t count);
+  void (*s32_to_f32)(float* out, const int32_t* in, size_t count);
+  void (*s32_to_s16)(int16_t* out, const int32_t* in, size_t count);
+};
+
+enum class ConvertIsa { kScalar, kSse2, kAvx2, kAvx512, kNeon };
+
+namespace convert_internal {
+
+// Scalar reference ---------------------------------------------------------
+
+// |x| * |scale| rounded to nearest even. 1.0 would be |scale| and is clipped
+// to full scale; NaN becomes -|scale|, as with maxps/minps.
+inline int32_t ScaleToInt(float x, float scale) {
+  float v = x * scale;
+  v = v > -scale ? v : -scale;
+  v = v < scale - 1.0f ? v : scale - 1.0f;
+  return static_cast<int32_t>(std::nearbyint(v));
+}
+
+inline int16_t F32ToS16(float x) {
+  return static_cast<int16_t>(ScaleToInt(x, 32768.0f));
+}
+
+inline int32_t F32ToS24(float x) { return ScaleToInt(x, 8388608.0f); }
+
+inline int32_t F32ToS32(float x) {
+  float v = x * 2147483648.0f;
+  if (v >= 2147483648.0f) {
+    return INT32_MAX;
+  }
+  if (!(v >= -2147483648.0f)) {
+    return INT32_MIN;  // Also NaN, as cvttps2dq does.
+  }
+  return static_cast<int32_t>(v);
+}
+
+inline int32_t LoadS24(const uint8_t* p) {
+  return static_cast<int32_t>((uint32_t(p[0]) << 8) | (uint32_t(p[1]) << 16) |
+                              (uint32_t(p[2]) << 24)) >>
+         8;
+}
+
+inline void StoreS24(uint8_t* p, int32_t x) {
+  p[0] = static_cast<uint8_t>(x);
+  p[1] = static_cast<uint8_t>(x >> 8);
+  p[2] = static_cast<uint8_t>(x >> 16);
+}
+
+inline void F32ToS16Scalar(int16_t* out, const float* in, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    out[i] = F32ToS16(in[i]);
+  }
+}
+
+inline void F32ToS24Scalar(uint8_t* out, const float* in, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    StoreS24(out + i * 3, F32ToS24(in[i]));
+  }
+}
+
+inline void F32ToS32Scalar(int32_t* out, const float* in, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    out[i] = F32ToS32(in[i]);
+  }
+}
+
+inline void S16ToF32Scalar(float* out, const int16_t* in, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    out[i] = in[i] * 0.000030517578125f;
+  }
+}
+
+inline void S24ToF32Scalar(float* out, const uint8_t* in, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    out[i] = static_cast<float>(LoadS24(in + i * 3)) *
+             0.00000011920928955078125f;
+  }
+}
+
+inline void S32ToF32Scalar(float* out, const int32_t* in, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    out[i] = static_cast<float>(in[i]) * 4.656612873077392578125e-10f;
+  }
+}
+
+inline void S32ToS16Scalar(int16_t* out, const int32_t* in, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    out[i] = static_cast<int16_t>(in[i] >> 16);
+  }
+}
+
+#ifdef CONVERT_X86
+
+// SSE2 ---------------------------------------------------------------------
+
+CONVERT_TARGET("sse2")
+inline __m128i ScaleToIntSse2(__m128 x, float scale) {
+  __m128 v = _mm_mul_ps(x, _mm_set1_ps(scale));
+  v = _mm_max_ps(v, _mm_set1_ps(-scale));
+  v = _mm_min_ps(v, _mm_set1_ps(scale - 1.0f));
+  return _mm_cvtps_epi32(v);
+}
+
+CONVERT_TARGET("sse2")
+inline __m128i ToS32Sse2(__m128 x) {
+  // cvttps2dq yields INT32_MIN on overflow; flip it to INT32_MAX where the
+  // input was too large.
+  __m128 v = _mm_mul_ps(x, _mm_set1_ps(2147483648.0f));
+  __m128i over = _mm_castps_si128(_mm_cmpge_ps(v, _mm_set1_ps(2147483648.0f)));
+  return _mm_xor_si128(_mm_cvttps_epi32(v), over);
+}
+
+CONVERT_TARGET("sse2")
+inline void F32ToS16Sse2(int16_t* out, const float* in, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i a = ScaleToIntSse2(_mm_loadu_ps(in + i), 32768.0f);
+    __m128i b = ScaleToIntSse2(_mm_loadu_ps(in + i + 4), 32768.0f);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm_packs_epi32(a, b));
+  }
+  F32ToS16Scalar(out + i, in + i, count - i);
+}
+
+CONVERT_TARGET("sse2")
+inline void F32ToS24Sse2(uint8_t* out, const float* in, size_t count) {
+  // No byte shuffle before SSSE3; pack the converted lanes by hand.
+  alignas(16) int32_t lanes[4];
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes),
+                    ScaleToIntSse2(_mm_loadu_ps(in + i), 8388608.0f));
+    for (int k = 0; k < 4; ++k) {
+      StoreS24(out + (i + k) * 3, lanes[k]);
+    }
+  }
+  F32ToS24Scalar(out + i * 3, in + i, count - i);
+}
+
+CONVERT_TARGET("sse2")
+inline void F32ToS32Sse2(int32_t* out, const float* in, size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     ToS32Sse2(_mm_loadu_ps(in + i)));
+  }
+  F32ToS32Scalar(out + i, in + i, count - i);
+}
+
+CONVERT_TARGET("sse2")
+inline void S16ToF32Sse2(float* out, const int16_t* in, size_t count) {
+  const __m128 scale = _mm_set1_ps(0.000030517578125f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+  S16ToF32Scalar(out + i, in + i, count - i);
+}
+
+CONVERT_TARGET("sse2")
+inline void S32ToF32Sse2(float* out, const int32_t* in, size_t count) {
+  const __m128 scale = _mm_set1_ps(4.656612873077392578125e-10f);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+  }
+  S32ToF32Scalar(out + i, in + i, count - i);
+}
+
+CONVERT_TARGET("sse2")
+inline void S32ToS16Sse2(int16_t* out, const int32_t* in, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 4));
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i*>(out + i),
+        _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16)));
+  }
+  S32ToS16Scalar(out + i, in + i, count - i);
+}
+
+// AVX2 ---------------------------------------------------------------------
+
+CONVERT_TARGET("avx2")
+inline __m256i ScaleToIntAvx2(__m256 x, float scale) {
+  __m256 v = _mm256_mul_ps(x, _mm256_set1_ps(scale));
+  v = _mm256_max_ps(v, _mm256_set1_ps(-scale));
+  v = _mm256_min_ps(v, _mm256_set1_ps(scale - 1.0f));
+  return _mm256_cvtps_epi32(v);
+}
+
+CONVERT_TARGET("avx2")
+inline void F32ToS16Avx2(int16_t* out, const float* in, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i a = ScaleToIntAvx2(_mm256_loadu_ps(in + i), 32768.0f);
+    __m256i b = ScaleToIntAvx2(_mm256_loadu_ps(in + i + 8), 32768.0f);
+    // packs works per 128-bit lane; put the quadwords back in order.
+    __m256i packed =
+        _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), packed);
+  }
+  F32ToS16Sse2(out + i, in + i, count - i);
+}
+
+CONVERT_TARGET("avx2")
+inline void F32ToS24Avx2(uint8_t* out, const float* in, size_t count) {
+  // Drop the top byte of every lane, then close the gap between the two
+  // 12-byte halves.
+  const __m256i shuffle = _mm256_setr_epi8(
+      0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,  //
+      0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = ScaleToIntAvx2(_mm256_loadu_ps(in + i), 8388608.0f);
+    v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuffle), compact);
+    uint8_t* p = out + i * 3;
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p),
+                     _mm256_castsi256_si128(v));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(p + 16),
+                     _mm256_extracti128_si256(v, 1));
+  }
+  F32ToS24Scalar(out + i * 3, in + i, count - i);
+}
+
+CONVERT_TARGET("avx2")
+inline void F32ToS32Avx2(int32_t* out, const float* in, size_t count) {
+  const __m256 scale = _mm256_set1_ps(2147483648.0f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 v = _mm256_mul_ps(_mm256_loadu_ps(in + i), scale);
+    __m256i over = _mm256_castps_si256(_mm256_cmp_ps(v, scale, _CMP_GE_OQ));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_xor_si256(_mm256_cvttps_epi32(v), over));
+  }
+  F32ToS32Sse2(out + i, in + i, count - i);
+}
+
+CONVERT_TARGET("avx2")
+inline void S16ToF32Avx2(float* out, const int16_t* in, size_t count) {
+  const __m256 scale = _mm256_set1_ps(0.000030517578125f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_cvtepi16_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+  }
+  S16ToF32Scalar(out + i, in + i, count - i);
+}
+
+CONVERT_TARGET("avx2")
+inline void S24ToF32Avx2(float* out, const uint8_t* in, size_t count) {
+  // Each lane loads 16 bytes and uses 12: samples go to the top three bytes
+  // of a dword and an arithmetic shift sign-extends them.
+  const __m256i shuffle = _mm256_setr_epi8(
+      -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,  //
+      -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+  const __m256 scale = _mm256_set1_ps(0.00000011920928955078125f);
+  size_t i = 0;
+  // The upper load reads 4 bytes past the 8th sample; stop short of the end.
+  for (; i + 10 <= count; i += 8) {
+    const uint8_t* p = in + i * 3;
+    __m256i v = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(p))),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12)), 1);
+    v = _mm256_srai_epi32(_mm256_shuffle_epi8(v, shuffle), 8);
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+  }
+  S24ToF32Scalar(out + i, in + i * 3, count - i);
+}
+
+CONVERT_TARGET("avx2")
+inline void S32ToF32Avx2(float* out, const int32_t* in, size_t count) {
+  const __m256 scale = _mm256_set1_ps(4.656612873077392578125e-10f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+  }
+  S32ToF32Sse2(out + i, in + i, count - i);
+}
+
+CONVERT_TARGET("avx2")
+inline void S32ToS16Avx2(int16_t* out, const int32_t* in, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    __m256i b =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i + 8));
+    __m256i packed = _mm256_packs_epi32(_mm256_srai_epi32(a, 16),
+                                        _mm256_srai_epi32(b, 16));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+  S32ToS16Sse2(out + i, in + i, count - i);
+}
+
+// AVX-512 ------------------------------------------------------------------
+
+CONVERT_TARGET("avx512f")
+inline void F32ToS16Avx512(int16_t* out, const float* in, size_t count) {
+  const __m512 scale = _mm512_set1_ps(32768.0f);
+  const __m512 lo = _mm512_set1_ps(-32768.0f);
+  const __m512 hi = _mm512_set1_ps(32767.0f);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512 v = _mm512_mul_ps(_mm512_loadu_ps(in + i), scale);
+    v = _mm512_min_ps(_mm512_max_ps(v, lo), hi);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm512_cvtsepi32_epi16(_mm512_cvtps_epi32(v)));
+  }
+  F32ToS16Avx2(out + i, in + i, count - i);
+}
+
+CONVERT_TARGET("avx512f")
+inline void F32ToS32Avx512(int32_t* out, const float* in, size_t count) {
+  const __m512 scale = _mm512_set1_ps(2147483648.0f);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512 v = _mm512_mul_ps(_mm512_loadu_ps(in + i), scale);
+    __mmask16 over = _mm512_cmp_ps_mask(v, scale, _CMP_GE_OQ);
+    __m512i r = _mm512_mask_mov_epi32(_mm512_cvttps_epi32(v), over,
+                                      _mm512_set1_epi32(INT32_MAX));
+    _mm512_storeu_si512(out + i, r);
+  }
+  F32ToS32Avx2(out + i, in + i, count - i);
+}
+
+CONVERT_TARGET("avx512f")
+inline void S16ToF32Avx512(float* out, const int16_t* in, size_t count) {
+  const __m512 scale = _mm512_set1_ps(0.000030517578125f);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512i v = _mm512_cvtepi16_epi32(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i)));
+    _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_cvtepi32_ps(v), scale));
+  }
+  S16ToF32Avx2(out + i, in + i, count - i);
+}
+
+CONVERT_TARGET("avx512f")
+inline void S32ToF32Avx512(float* out, const int32_t* in, size_t count) {
+  const __m512 scale = _mm512_set1_ps(4.656612873077392578125e-10f);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512i v = _mm512_loadu_si512(in + i);
+    _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_cvtepi32_ps(v), scale));
+  }
+  S32ToF32Avx2(out + i, in + i, count - i);
+}
+
+CONVERT_TARGET("avx512f")
+inline void S32ToS16Avx512(int16_t* out, const int32_t* in, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512i v = _mm512_srai_epi32(_mm512_loadu_si512(in + i), 16);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm512_cvtsepi32_epi16(v));
+  }
+  S32ToS16Avx2(out + i, in + i, count - i);
+}
+
+inline void Cpuid(int leaf, int subleaf, uint32_t regs[4]) {
+#ifdef _MSC_VER
+  int r[4];
+  __cpuidex(r, leaf, subleaf);
+  for (int k = 0; k < 4; ++k) {
+    regs[k] = static_cast<uint32_t>(r[k]);
+  }
+#else
+  __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register state the OS saves on context switches (XCR0).
+inline uint64_t EnabledXState() {
+#ifdef _MSC_VER
+  return _xgetbv(0);
+#else
+  uint32_t lo, hi;
+  __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return (uint64_t(hi) << 32) | lo;
+#endif
+}
+
+inline bool CpuSupports(ConvertIsa isa) {
+  uint32_t regs[4];
+  Cpuid(0, 0, regs);
+  uint32_t max_leaf = regs[0];
+  Cpuid(1, 0, regs);
+  bool sse2 = (regs[3] & (1u << 26)) != 0;
+  bool osxsave = (regs[2] & (1u << 27)) != 0;
+  bool avx = (regs[2] & (1u << 28)) != 0;
+  if (isa == ConvertIsa::kSse2) {
+    return sse2;
+  }
+  if (!osxsave || !avx || max_leaf < 7) {
+    return false;
+  }
+  uint64_t xstate = EnabledXState();
+  Cpuid(7, 0, regs);
+  if (isa == ConvertIsa::kAvx2) {
+    return (xstate & 0x6) == 0x6 && (regs[1] & (1u << 5)) != 0;
+  }
+  if (isa == ConvertIsa::kAvx512) {
+    // AVX2 is used for the tails, so require it too.
+    return (xstate & 0xE6) == 0xE6 && (regs[1] & (1u << 5)) != 0 &&
+           (regs[1] & (1u << 16)) != 0;
+  }
+  return false;
+}
+
+#endif  // CONVERT_X86
+
+#ifdef CONVERT_NEON
+
+// NEON ---------------------------------------------------------------------
+
+// vmaxq/vminq propagate NaN; select instead to match maxps/minps.
+inline float32x4_t MaxNeon(float32x4_t x, float32x4_t lo) {
+  return vbslq_f32(vcgtq_f32(x, lo), x, lo);
+}
+
+inline float32x4_t MinNeon(float32x4_t x, float32x4_t hi) {
+  return vbslq_f32(vcltq_f32(x, hi), x, hi);
+}
+
+inline void F32ToS16Neon(int16_t* out, const float* in, size_t count) {
+  const float32x4_t scale = vdupq_n_f32(32768.0f);
+  const float32x4_t lo = vdupq_n_f32(-32768.0f);
+  const float32x4_t hi = vdupq_n_f32(32767.0f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    float32x4_t a = vmulq_f32(vld1q_f32(in + i), scale);
+    float32x4_t b = vmulq_f32(vld1q_f32(in + i + 4), scale);
+    int32x4_t ia = vcvtnq_s32_f32(MinNeon(MaxNeon(a, lo), hi));
+    int32x4_t ib = vcvtnq_s32_f32(MinNeon(MaxNeon(b, lo), hi));
+    vst1q_s16(out + i, vcombine_s16(vqmovn_s32(ia), vqmovn_s32(ib)));
+  }
+  F32ToS16Scalar(out + i, in + i, count - i);
+}
+
+inline void F32ToS24Neon(uint8_t* out, const float* in, size_t count) {
+  const float32x4_t scale = vdupq_n_f32(8388608.0f);
+  const float32x4_t lo = vdupq_n_f32(-8388608.0f);
+  const float32x4_t hi = vdupq_n_f32(8388607.0f);
+  alignas(16) int32_t lanes[4];
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    float32x4_t v = vmulq_f32(vld1q_f32(in + i), scale);
+    v = MinNeon(MaxNeon(v, lo), hi);
+    vst1q_s32(lanes, vcvtnq_s32_f32(v));
+    for (int k = 0; k < 4; ++k) {
+      StoreS24(out + (i + k) * 3, lanes[k]);
+    }
+  }
+  F32ToS24Scalar(out + i * 3, in + i, count - i);
+}
+
+inline void F32ToS32Neon(int32_t* out, const float* in, size_t count) {
+  const float32x4_t scale = vdupq_n_f32(2147483648.0f);
+  const int32x4_t min = vdupq_n_s32(INT32_MIN);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    float32x4_t v = vmulq_f32(vld1q_f32(in + i), scale);
+    // fcvtzs already saturates; only NaN needs fixing up.
+    int32x4_t r = vcvtq_s32_f32(v);
+    vst1q_s32(out + i, vbslq_s32(vceqq_f32(v, v), r, min));
+  }
+  F32ToS32Scalar(out + i, in + i, count - i);
+}
+
+inline void S16ToF32Neon(float* out, const int16_t* in, size_t count) {
+  const float32x4_t scale = vdupq_n_f32(0.000030517578125f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    int16x8_t v = vld1q_s16(in + i);
+    vst1q_f32(out + i,
+              vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), scale));
+    vst1q_f32(out + i + 4,
+              vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), scale));
+  }
+  S16ToF32Scalar(out + i, in + i, count - i);
+}
+
+inline void S24ToF32Neon(float* out, const uint8_t* in, size_t count) {
+  const float32x4_t scale = vdupq_n_f32(0.00000011920928955078125f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    // De-interleave the bytes, rebuild each sample in the top of a dword.
+    uint8x8x3_t b = vld3_u8(in + i * 3);
+    uint16x8_t lo = vshll_n_u8(b.val[0], 8);
+    uint16x8_t hi = vorrq_u16(vmovl_u8(b.val[1]), vshll_n_u8(b.val[2], 8));
+    uint32x4_t w0 = vorrq_u32(vshll_n_u16(vget_low_u16(hi), 16),
+                              vmovl_u16(vget_low_u16(lo)));
+    uint32x4_t w1 = vorrq_u32(vshll_n_u16(vget_high_u16(hi), 16),
+                              vmovl_u16(vget_high_u16(lo)));
+    int32x4_t s0 = vshrq_n_s32(vreinterpretq_s32_u32(w0), 8);
+    int32x4_t s1 = vshrq_n_s32(vreinterpretq_s32_u32(w1), 8);
+    vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(s0), scale));
+    vst1q_f32(out + i + 4, vmulq_f32(vcvtq_f32_s32(s1), scale));
+  }
+  S24ToF32Scalar(out + i, in + i * 3, count - i);
+}
+
+inline void S32ToF32Neon(float* out, const int32_t* in, size_t count) {
+  const float32x4_t scale = vdupq_n_f32(4.656612873077392578125e-10f);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(vld1q_s32(in + i)), scale));
+  }
+  S32ToF32Scalar(out + i, in + i, count - i);
+}
+
+inline void S32ToS16Neon(int16_t* out, const int32_t* in, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    int16x4_t a = vshrn_n_s32(vld1q_s32(in + i), 16);
+    int16x4_t b = vshrn_n_s32(vld1q_s32(in + i + 4), 16);
+    vst1q_s16(out + i, vcombine_s16(a, b));
+  }
+  S32ToS16Scalar(out + i, in + i, count - i);
+}
+
+#endif  // CONVERT_NEON
+
+}  // namespace convert_internal
+
+// Returns the kernels for |isa|, or nullptr if this build or this CPU cannot
+// run them.
+inline const ConvertKernels* ConvertKernelsFor(ConvertIsa isa) {
+  using namespace convert_internal;
+  static const ConvertKernels kScalar = {
+      "scalar",       F32ToS16Scalar, F32ToS24Scalar, F32ToS32Scalar,
+      S16ToF32Scalar, S24ToF32Scalar, S32ToF32Scalar, S32ToS16Scalar};
+  switch (isa) {
+    case ConvertIsa::kScalar:
+      return &kScalar;
+#ifdef CONVERT_X86
+    case ConvertIsa::kSse2: {
+      static const ConvertKernels kSse2 = {
+          "sse2",       F32ToS16Sse2,   F32ToS24Sse2, F32ToS32Sse2,
+          S16ToF32Sse2, S24ToF32Scalar, S32ToF32Sse2, S32ToS16Sse2};
+      return CpuSupports(isa) ? &kSse2 : nullptr;
+    }
+    case ConvertIsa::kAvx2: {
+      static const ConvertKernels kAvx2 = {
+          "avx2",       F32ToS16Avx2, F32ToS24Avx2, F32ToS32Avx2,
+          S16ToF32Avx2, S24ToF32Avx2, S32ToF32Avx2, S32ToS16Avx2};
+      return CpuSupports(isa) ? &kAvx2 : nullptr;
+    }
+    case ConvertIsa::kAvx512: {
+      // Packed 24-bit needs byte shuffles from AVX-512BW; AVX2 does those.
+      static const ConvertKernels kAvx512 = {
+          "avx512",       F32ToS16Avx512, F32ToS24Avx2,   F32ToS32Avx512,
+          S16ToF32Avx512, S24ToF32Avx2,   S32ToF32Avx512, S32ToS16Avx512};
+      return CpuSupports(isa) ? &kAvx512 : nullptr;
+    }
+#endif
+#ifdef CONVERT_NEON
+    case ConvertIsa::kNeon: {
+      static const ConvertKernels kNeon = {
+          "neon",       F32ToS16Neon, F32ToS24Neon, F32ToS32Neon,
+          S16ToF32Neon, S24ToF32Neon, S32ToF32Neon, S32ToS16Neon};
+      return &kNeon;
+    }
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+// The widest kernels this CPU runs, picked once.
+inline const ConvertKernels& DefaultConvertKernels() {
+  static const ConvertKernels* kernels = [] {
+    for (ConvertIsa isa : {ConvertIsa::kAvx512, ConvertIsa::kAvx2,
+                           ConvertIsa::kSse2, ConvertIsa::kNeon}) {
+      if (const ConvertKernels* k = ConvertKernelsFor(isa)) {
+        return k;
+      }
+    }
+    return ConvertKernelsFor(ConvertIsa::kScalar);
+  }();
+  return *kernels;
+}
+
+// Triangular (TPDF) dither of +-1 LSB of the output encoding, added to float
+// samples before they are quantized. The noise comes from a scalar xorshift
+// generator, so dithered output is also the same on every instruction set.
+class TpdfDither {
+ public:
+  explicit TpdfDither(uint32_t seed = 0x9E3779B9u) : state_(seed ? seed : 1) {}
+
+  // |lsb| must be a power of two for the result to be exact.
+  void Apply(float* out, const float* in, size_t count, float lsb) {
+    const float scale = lsb * (1.0f / 16777216.0f);
+    for (size_t i = 0; i < count; ++i) {
+      int32_t a = static_cast<int32_t>(Next() >> 8);
+      int32_t b = static_cast<int32_t>(Next() >> 8);
+      out[i] = in[i] + static_cast<float>(a - b) * scale;
+    }
+  }
+
+ private:
+  uint32_t Next() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 17;
+    state_ ^= state_ << 5;
+    return state_;
+  }
+
+  uint32_t state_;
+};
+
+// Converts |count| samples (frames * channels) from |src| to |dst|. The
+// buffers must not overlap. |dither| is used when quantizing float to s16 or
+// s24 and may be null. Integer narrowing truncates like dr_wav does. Returns
+// false for an unknown encoding.
+inline bool ConvertSamples(SampleEncoding dst_encoding, void* dst,
+                           SampleEncoding src_encoding, const void* src,
+                           size_t count, TpdfDither* dither = nullptr,
+                           const ConvertKernels& k = DefaultConvertKernels()) {
+  using namespace convert_internal;
+  using E = SampleEncoding;
+  if (BytesPerSample(dst_encoding) == 0 || BytesPerSample(src_encoding) == 0) {
+    return false;
+  }
+  if (dst_encoding == src_encoding) {
+    ::memcpy(dst, src, count * BytesPerSample(src_encoding));
+    return true;
+  }
+
+  uint8_t* out = static_cast<uint8_t*>(dst);
+  const uint8_t* in = static_cast<const uint8_t*>(src);
+  const float* in_f32 = reinterpret_cast<const float*>(in);
+  const int16_t* in_s16 = reinterpret_cast<const int16_t*>(in);
+  const int32_t* in_s32 = reinterpret_cast<const int32_t*>(in);
+
+  if (src_encoding == E::kF32) {
+    if (dither != nullptr && dst_encoding != E::kS32) {
+      // Dither a block at a time into a scratch buffer that stays in cache.
+      constexpr size_t kBlock = 1024;
+      float block[kBlock];
+      float lsb = dst_encoding == E::kS16 ? 1.0f / 32768 : 1.0f / 8388608;
+      size_t size = BytesPerSample(dst_encoding);
+      for (size_t done = 0; done < count; done += kBlock) {
+        size_t n = count - done < kBlock ? count - done : kBlock;
+        dither->Apply(block, in_f32 + done, n, lsb);
+        ConvertSamples(dst_encoding, out + done * size, E::kF32, block, n,
+                       nullptr, k);
+      }
+      return true;
+    }
+    switch (dst_encoding) {
+      case E::kS16:
+        k.f32_to_s16(reinterpret_cast<int16_t*>(out), in_f32, count);
+        return true;
+      case E::kS24:
+        k.f32_to_s24(out, in_f32, count);
+        return true;
+      default:
+        k.f32_to_s32(reinterpret_cast<int32_t*>(out), in_f32, count);
+        return true;
+    }
+  }
+
+  if (dst_encoding == E::kF32) {
+    float* f = reinterpret_cast<float*>(out);
+    switch (src_encoding) {
+      case E::kS16:
+        k.s16_to_f32(f, in_s16, count);
+        return true;
+      case E::kS24:
+        k.s24_to_f32(f, in, count);
+        return true;
+      default:
+        k.s32_to_f32(f, in_s32, count);
+        return true;
+    }
+  }
+
+  if (src_encoding == E::kS32 && dst_encoding == E::kS16) {
+    k.s32_to_s16(reinterpret_cast<int16_t*>(out), in_s32, count);
+    return true;
+  }
+
+  // The remaining integer pairs go through a left-aligned 32-bit sample.
+  for (size_t i = 0; i < count; ++i) {
+    int32_t x;
+    switch (src_encoding) {
+      case E::kS16:
+        x = static_cast<int32_t>(uint32_t(in_s16[i]) << 16);
+        break;
+      case E::kS24:
+        x = static_cast<int32_t>(uint32_t(LoadS24(in + i * 3)) << 8);
+        break;
+      default:
+        x = in_s32[i];
+        break;
+    }
+    switch (dst_encoding) {
+      case E::kS16:
+        reinterpret_cast<int16_t*>(out)[i] = static_cast<int16_t>(x >> 16);
+        break;
+      case E::kS24:
+        StoreS24(out + i * 3, x >> 8);
+        break;
+      default:
+        reinterpret_cast<int32_t*>(out)[i] = x;
+        break;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "../inject/protocol.h"
+#include "convert.h"
+#include "loguru.hpp"
+#include "recorder.h"
+#include "remix.h"
+#include "resampler.h"
+
+// Turns PCM in one AudioFormat into another and writes it to a Recorder.
+// Identical layouts are copied through and an encoding change alone is
+// converted directly; a remix or rate change goes through float. The
+// resampler keeps its state between packets, so the Pipeline builds one
+// Converter per format pair and reuses it.
+class Converter {
+ public:
+  // Packets are converted this many output bytes at a time, so the scratch
+  // buffers stay small and in cache whatever the packet size.
+  static constexpr size_t kChunkSize = 64 * 1024;
+
+  // Whether |source| can be turned into |output| at all.
+  static bool Supports(const AudioFormat& source, const AudioFormat& output) {
+    if (SameLayout(source, output)) {
+      return true;
+    }
+    return EncodingOf(source) != SampleEncoding::kUnknown &&
+           EncodingOf(output) != SampleEncoding::kUnknown &&
+           source.channels > 0 && output.channels > 0 &&
+           source.sampling_rate > 0 && output.sampling_rate > 0;
+  }
+
+  // |remix| is used if it fits the channel counts; otherwise a channel count
+  // change uses RemixMatrix::Preset().
+  Converter(const AudioFormat& source, const AudioFormat& output,
+            ResampleQuality quality, const RemixMatrix* remix = nullptr)
+      : source_(source),
+        output_(output),
+        source_encoding_(EncodingOf(source)),
+        output_encoding_(EncodingOf(output)) {
+    bool custom = remix != nullptr && remix->in_channels == source.channels &&
+                  remix->out_channels == output.channels;
+    if (SameLayout(source, output) && !custom) {
+      mode_ = Mode::kCopy;
+      return;
+    }
+    if (source.channels == output.channels &&
+        source.sampling_rate == output.sampling_rate && !custom) {
+      mode_ = Mode::kEncode;
+      scratch_.resize(kChunkSize);
+      DLOG_F(INFO, "storing %u-bit samples as %u-bit (%s).",
+             source.bits_per_sample, output.bits_per_sample,
+             DefaultConvertKernels().name);
+      return;
+    }
+    mode_ = Mode::kFloat;
+    scratch_.resize(kChunkSize);
+    if (custom || source.channels != output.channels) {
+      remix_ = true;
+      remixer_.Reset(custom ? *remix
+                            : RemixMatrix::Preset(source.channels,
+                                                  output.channels));
+    }
+    if (source.sampling_rate != output.sampling_rate) {
+      resample_ = true;
+      resampler_.Reset(source.sampling_rate, output.sampling_rate,
+                       output.channels, quality);
+    }
+    DLOG_F(INFO, "converting %u ch %u Hz %u-bit to %u ch %u Hz %u-bit.",
+           source.channels, source.sampling_rate, source.bits_per_sample,
+           output.channels, output.sampling_rate, output.bits_per_sample);
+  }
+
+  const AudioFormat& source() const { return source_; }
+  const AudioFormat& output() const { return output_; }
+
+  bool Write(const uint8_t* data, size_t size, Recorder* recorder,
+             TpdfDither* dither) {
+    switch (mode_) {
+      case Mode::kCopy:
+        return recorder->Write(data, size);
+      case Mode::kEncode:
+        return Encode(data, size, recorder, dither);
+      default:
+        return Float(data, size, recorder, dither);
+    }
+  }
+
+  // Writes |frames| source frames of silence. Without resampling that is the
+  // same number of output frames, which the recorder stores as it likes;
+  // otherwise the zeros go through the resampler, which is still ringing out
+  // the audio before them.
+  bool WriteSilence(uint64_t frames, Recorder* recorder) {
+    if (!resample_) {
+      return recorder->WriteSilence(frames);
+    }
+    size_t channels = output_.channels;
+    size_t chunk = kChunkSize / sizeof(float) / channels;
+    silence_.assign(chunk * channels, 0.0f);
+    while (frames > 0) {
+      size_t n = static_cast<size_t>(std::min<uint64_t>(frames, chunk));
+      resampler_.Process(silence_.data(), n, &resampled_);
+      bool ok = WriteFloats(resampled_.data(), resampled_.size(), recorder,
+                            nullptr);
+      resampled_.clear();
+      if (!ok) {
+        return false;
+      }
+      frames -= n;
+    }
+    return true;
+  }
+
+  // Writes the output the resampler still holds for the audio so far. Called
+  // before switching away, so a later packet in this format starts afresh.
+  bool Flush(Recorder* recorder, TpdfDither* dither) {
+    if (!resample_) {
+      return true;
+    }
+    resampler_.Flush(&resampled_);
+    bool ok = WriteFloats(resampled_.data(), resampled_.size(), recorder,
+                          dither);
+    resampled_.clear();
+    return ok;
+  }
+
+ private:
+  enum class Mode { kCopy, kEncode, kFloat };
+
+  // Everything but the channel mask matches, so bytes can be copied as is.
+  static bool SameLayout(const AudioFormat& a, const AudioFormat& b) {
+    return a.channels == b.channels && a.sampling_rate == b.sampling_rate &&
+           a.bits_per_sample == b.bits_per_sample &&
+           a.sample_type == b.sample_type;
+  }
+
+  bool Encode(const uint8_t* data, size_t size, Recorder* recorder,
+              TpdfDither* dither) {
+    size_t in_size = BytesPerSample(source_encoding_);
+    size_t out_size = BytesPerSample(output_encoding_);
+    size_t chunk = kChunkSize / out_size;
+    size_t count = size / in_size;
+    for (size_t done = 0; done < count; done += chunk) {
+      size_t n = std::min(chunk, count - done);
+      ConvertSamples(output_encoding_, scratch_.data(), source_encoding_,
+                     data + done * in_size, n, dither);
+      if (!recorder->Write(scratch_.data(), n * out_size)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool Float(const uint8_t* data, size_t size, Recorder* recorder,
+             TpdfDither* dither) {
+    size_t in_size = BytesPerSample(source_encoding_);
+    size_t in_channels = source_.channels;
+    size_t out_channels = output_.channels;
+    size_t chunk =
+        kChunkSize / sizeof(float) / std::max(in_channels, out_channels);
+    size_t frames = size / (in_size * in_channels);
+    floats_.resize(chunk * in_channels);
+    for (size_t done = 0; done < frames; done += chunk) {
+      size_t n = std::min(chunk, frames - done);
+      ConvertSamples(SampleEncoding::kF32, floats_.data(), source_encoding_,
+                     data + done * in_channels * in_size, n * in_channels);
+      const float* pcm = floats_.data();
+      if (remix_) {
+        remixed_.resize(n * out_channels);
+        remixer_.Process(pcm, remixed_.data(), n);
+        pcm = remixed_.data();
+      }
+      bool ok;
+      if (resample_) {
+        resampler_.Process(pcm, n, &resampled_);
+        ok = WriteFloats(resampled_.data(), resampled_.size(), recorder,
+                         dither);
+        resampled_.clear();
+      } else {
+        ok = WriteFloats(pcm, n * out_channels, recorder, dither);
+      }
+      if (!ok) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool WriteFloats(const float* pcm, size_t count, Recorder* recorder,
+                   TpdfDither* dither) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(pcm);
+    if (output_encoding_ == SampleEncoding::kF32) {
+      return count == 0 || recorder->Write(bytes, count * sizeof(float));
+    }
+    size_t out_size = BytesPerSample(output_encoding_);
+    size_t chunk = kChunkSize / out_size;
+    for (size_t done = 0; done < count; done += chunk) {
+      size_t n = std::min(chunk, count - done);
+      ConvertSamples(output_encoding_, scratch_.data(), SampleEncoding::kF32,
+                     bytes + done * sizeof(float), n, dither);
+      if (!recorder->Write(scratch_.data(), n * out_size)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  AudioFormat source_;
+  AudioFormat output_;
+  SampleEncoding source_encoding_;
+  SampleEncoding output_encoding_;
+  Mode mode_ = Mode::kCopy;
+
+  bool remix_ = false;
+  Remixer remixer_;
+  bool resample_ = false;
+  Resampler resampler_;
+  std::vector<uint8_t> scratch_;
+  std::vector<float> floats_;
+  std::vector<float> remixed_;
+  std::vector<float> resampled_;
+  std::vector<float> silence_;
+};
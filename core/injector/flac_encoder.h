@@ -0,0 +1,505 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include "../inject/protocol.h"
+#include "convert.h"
+
+// A small FLAC frame encoder. Every frame is independent of the others, so
+// frames can be encoded on any thread and in any order, then concatenated.
+//
+// Subframes use the fixed polynomial predictors (orders 0-4) with partitioned
+// Rice residuals, or constant/verbatim where that is smaller. Stereo picks the
+// cheapest of left/right, left/side, side/right and mid/side. No LPC: that
+// would buy a few percent more at several times the CPU.
+
+namespace flac_internal {
+
+class BitWriter {
+ public:
+  explicit BitWriter(std::vector<uint8_t>* out) : out_(out) {}
+
+  // Appends the low |bits| bits of |value|, most significant first.
+  void Put(uint32_t value, int bits) {
+    if (bits == 0) {
+      return;
+    }
+    acc_ = (acc_ << bits) | (value & (0xFFFFFFFFu >> (32 - bits)));
+    count_ += bits;
+    while (count_ >= 8) {
+      count_ -= 8;
+      out_->push_back(static_cast<uint8_t>(acc_ >> count_));
+    }
+  }
+
+  void PutSigned(int32_t value, int bits) {
+    Put(static_cast<uint32_t>(value), bits);
+  }
+
+  // |q| zeros followed by a one.
+  void PutUnary(uint32_t q) {
+    for (; q >= 24; q -= 24) {
+      Put(0, 24);
+    }
+    Put(1, q + 1);
+  }
+
+  void AlignToByte() {
+    if (count_ > 0) {
+      Put(0, 8 - count_);
+    }
+  }
+
+ private:
+  std::vector<uint8_t>* out_;
+  uint64_t acc_ = 0;
+  int count_ = 0;
+};
+
+inline uint8_t Crc8(const uint8_t* data, size_t size) {
+  uint8_t crc = 0;
+  for (size_t i = 0; i < size; ++i) {
+    crc ^= data[i];
+    for (int k = 0; k < 8; ++k) {
+      crc = static_cast<uint8_t>((crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1);
+    }
+  }
+  return crc;
+}
+
+inline uint16_t Crc16(const uint8_t* data, size_t size) {
+  static const auto table = [] {
+    std::vector<uint16_t> t(256);
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint16_t crc = static_cast<uint16_t>(i << 8);
+      for (int k = 0; k < 8; ++k) {
+        crc = static_cast<uint16_t>((crc & 0x8000) ? (crc << 1) ^ 0x8005
+                                                   : crc << 1);
+      }
+      t[i] = crc;
+    }
+    return t;
+  }();
+  uint16_t crc = 0;
+  for (size_t i = 0; i < size; ++i) {
+    crc = static_cast<uint16_t>((crc << 8) ^ table[(crc >> 8) ^ data[i]]);
+  }
+  return crc;
+}
+
+inline uint32_t ZigZag(int32_t r) {
+  return (static_cast<uint32_t>(r) << 1) ^ static_cast<uint32_t>(r >> 31);
+}
+
+inline int BitLength(uint32_t u) {
+  int n = 0;
+  for (; u != 0; u >>= 1) {
+    ++n;
+  }
+  return n;
+}
+
+// Residual of the fixed predictor of |order| for samples [order, n).
+inline void FixedResidual(const int32_t* x, uint32_t n, int order,
+                          int32_t* r) {
+  for (uint32_t i = order; i < n; ++i) {
+    switch (order) {
+      case 0:
+        r[i] = x[i];
+        break;
+      case 1:
+        r[i] = x[i] - x[i - 1];
+        break;
+      case 2:
+        r[i] = x[i] - 2 * x[i - 1] + x[i - 2];
+        break;
+      case 3:
+        r[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+        break;
+      default:
+        r[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+        break;
+    }
+  }
+}
+
+// The order whose residual has the smallest magnitude, found in one pass.
+inline int BestFixedOrder(const int32_t* x, uint32_t n) {
+  if (n <= 4) {
+    return 0;
+  }
+  uint64_t sum[5] = {};
+  for (uint32_t i = 4; i < n; ++i) {
+    int64_t e0 = x[i];
+    int64_t e1 = e0 - x[i - 1];
+    int64_t e2 = e1 - (int64_t(x[i - 1]) - x[i - 2]);
+    int64_t e3 = e2 - (int64_t(x[i - 1]) - 2 * int64_t(x[i - 2]) + x[i - 3]);
+    int64_t e4 = e3 - (int64_t(x[i - 1]) - 3 * int64_t(x[i - 2]) +
+                       3 * int64_t(x[i - 3]) - x[i - 4]);
+    sum[0] += std::llabs(e0);
+    sum[1] += std::llabs(e1);
+    sum[2] += std::llabs(e2);
+    sum[3] += std::llabs(e3);
+    sum[4] += std::llabs(e4);
+  }
+  return static_cast<int>(std::min_element(sum, sum + 5) - sum);
+}
+
+constexpr int kMaxPartitionOrder = 8;
+constexpr uint32_t kEscape = 0xFFFFFFFF;
+
+struct Subframe {
+  enum Type { kConstant, kVerbatim, kFixed } type = kVerbatim;
+  int bps = 0;
+  int order = 0;
+  int partition_order = 0;
+  bool rice2 = false;
+  // Per partition: Rice parameter, or kEscape with the raw width in |raw|.
+  std::vector<uint32_t> params;
+  std::vector<int> raw;
+  uint64_t bits = 0;
+};
+
+// Rice parameter minimizing |count| * (k + 1) + |sum| >> k.
+inline uint32_t RiceParameter(uint64_t sum, uint32_t count, uint32_t max) {
+  uint32_t k = 0;
+  while (k < max && (uint64_t(count) << (k + 1)) < sum) {
+    ++k;
+  }
+  return k;
+}
+
+// Chooses how to code |x| and returns the plan. Leaves the residual of the
+// chosen predictor in |r|.
+inline Subframe Plan(const int32_t* x, uint32_t n, int bps,
+                     std::vector<int32_t>& r) {
+  Subframe s;
+  s.bps = bps;
+  if (std::all_of(x, x + n, [&](int32_t v) { return v == x[0]; })) {
+    s.type = Subframe::kConstant;
+    s.bits = 8 + bps;
+    return s;
+  }
+  s.type = Subframe::kVerbatim;
+  s.bits = 8 + uint64_t(bps) * n;
+  int order = BestFixedOrder(x, n);
+  if (n <= uint32_t(order)) {
+    return s;
+  }
+  r.resize(n);
+  FixedResidual(x, n, order, r.data());
+
+  int max_porder = 0;
+  while (max_porder < kMaxPartitionOrder &&
+         n % (2u << max_porder) == 0 &&
+         (n >> (max_porder + 1)) > uint32_t(order)) {
+    ++max_porder;
+  }
+
+  // Sums of the zigzagged residual over the finest partitions, merged
+  // pairwise for every coarser order.
+  std::vector<uint64_t> sums(size_t(1) << max_porder);
+  uint32_t size = n >> max_porder;
+  for (size_t p = 0; p < sums.size(); ++p) {
+    uint32_t begin = p == 0 ? order : uint32_t(p) * size;
+    uint64_t sum = 0;
+    for (uint32_t i = begin; i < (p + 1) * size; ++i) {
+      sum += ZigZag(r[i]);
+    }
+    sums[p] = sum;
+  }
+  uint64_t best_bits = UINT64_MAX;
+  int best_porder = 0;
+  for (int porder = max_porder;; --porder) {
+    uint32_t psize = n >> porder;
+    uint64_t bits = 0;
+    for (size_t p = 0; p < (size_t(1) << porder); ++p) {
+      uint32_t count = p == 0 ? psize - order : psize;
+      uint32_t k = RiceParameter(sums[p], count, 30);
+      bits += 4 + uint64_t(count) * (k + 1) + (sums[p] >> k);
+    }
+    if (bits < best_bits) {
+      best_bits = bits;
+      best_porder = porder;
+    }
+    if (porder == 0) {
+      break;
+    }
+    for (size_t p = 0; p < (size_t(1) << (porder - 1)); ++p) {
+      sums[p] = sums[2 * p] + sums[2 * p + 1];
+    }
+  }
+
+  // Exact cost of the chosen partitioning, escaping partitions where Rice
+  // coding would cost more than raw samples.
+  s.type = Subframe::kFixed;
+  s.order = order;
+  s.partition_order = best_porder;
+  uint32_t psize = n >> best_porder;
+  uint32_t partitions = 1u << best_porder;
+  s.params.resize(partitions);
+  s.raw.resize(partitions);
+  uint64_t bits = 8 + uint64_t(order) * bps + 2 + 4;
+  uint32_t max_param = 0;
+  for (uint32_t p = 0; p < partitions; ++p) {
+    uint32_t begin = p == 0 ? order : p * psize;
+    uint32_t end = (p + 1) * psize;
+    uint64_t sum = 0;
+    uint32_t max_u = 0;
+    for (uint32_t i = begin; i < end; ++i) {
+      uint32_t u = ZigZag(r[i]);
+      sum += u;
+      max_u = std::max(max_u, u);
+    }
+    uint32_t count = end - begin;
+    uint32_t k = RiceParameter(sum, count, 30);
+    uint64_t rice = uint64_t(count) * (k + 1);
+    for (uint32_t i = begin; i < end; ++i) {
+      rice += ZigZag(r[i]) >> k;
+    }
+    int width = BitLength(max_u);
+    uint64_t escaped = 5 + uint64_t(count) * width;
+    if (escaped < rice) {
+      s.params[p] = kEscape;
+      s.raw[p] = width;
+      bits += escaped;
+    } else {
+      s.params[p] = k;
+      max_param = std::max(max_param, k);
+      bits += rice;
+    }
+  }
+  s.rice2 = max_param > 14;
+  bits += uint64_t(partitions) * (s.rice2 ? 5 : 4);
+  if (bits < s.bits) {
+    s.bits = bits;
+  } else {
+    s.type = Subframe::kVerbatim;
+  }
+  return s;
+}
+
+inline void WriteSubframe(BitWriter& w, const Subframe& s, const int32_t* x,
+                          uint32_t n, const std::vector<int32_t>& r) {
+  switch (s.type) {
+    case Subframe::kConstant:
+      w.Put(0x00, 8);
+      w.PutSigned(x[0], s.bps);
+      return;
+    case Subframe::kVerbatim:
+      w.Put(0x02, 8);
+      for (uint32_t i = 0; i < n; ++i) {
+        w.PutSigned(x[i], s.bps);
+      }
+      return;
+    case Subframe::kFixed:
+      break;
+  }
+  w.Put((0x08 | s.order) << 1, 8);
+  for (int i = 0; i < s.order; ++i) {
+    w.PutSigned(x[i], s.bps);
+  }
+  int param_bits = s.rice2 ? 5 : 4;
+  uint32_t escape = s.rice2 ? 31 : 15;
+  w.Put(s.rice2 ? 1 : 0, 2);
+  w.Put(s.partition_order, 4);
+  uint32_t psize = n >> s.partition_order;
+  for (size_t p = 0; p < s.params.size(); ++p) {
+    uint32_t begin = p == 0 ? s.order : uint32_t(p) * psize;
+    uint32_t end = uint32_t(p + 1) * psize;
+    if (s.params[p] == kEscape) {
+      w.Put(escape, param_bits);
+      w.Put(s.raw[p], 5);
+      for (uint32_t i = begin; i < end; ++i) {
+        w.PutSigned(r[i], s.raw[p]);
+      }
+      continue;
+    }
+    uint32_t k = s.params[p];
+    w.Put(k, param_bits);
+    for (uint32_t i = begin; i < end; ++i) {
+      uint32_t u = ZigZag(r[i]);
+      w.PutUnary(u >> k);
+      w.Put(u, k);
+    }
+  }
+}
+
+inline uint32_t SampleRateCode(uint32_t rate) {
+  switch (rate) {
+    case 88200: return 1;
+    case 176400: return 2;
+    case 192000: return 3;
+    case 8000: return 4;
+    case 16000: return 5;
+    case 22050: return 6;
+    case 24000: return 7;
+    case 32000: return 8;
+    case 44100: return 9;
+    case 48000: return 10;
+    case 96000: return 11;
+    default: return 0;  // Taken from STREAMINFO.
+  }
+}
+
+inline uint32_t SampleSizeCode(int bits) {
+  switch (bits) {
+    case 8: return 1;
+    case 12: return 2;
+    case 16: return 4;
+    case 20: return 5;
+    case 24: return 6;
+    default: return 0;
+  }
+}
+
+// Frame numbers are coded like UTF-8, extended to 36 bits.
+inline void PutFrameNumber(BitWriter& w, uint64_t number) {
+  if (number < 0x80) {
+    w.Put(static_cast<uint32_t>(number), 8);
+    return;
+  }
+  int bytes = 2;
+  while (bytes < 7 && number >= (uint64_t(1) << (5 * bytes + 1))) {
+    ++bytes;
+  }
+  int shift = 6 * (bytes - 1);
+  uint32_t lead = (0xFF00u >> bytes) & 0xFF;
+  w.Put(lead | static_cast<uint32_t>(number >> shift), 8);
+  for (shift -= 6; shift >= 0; shift -= 6) {
+    w.Put(0x80 | static_cast<uint32_t>((number >> shift) & 0x3F), 8);
+  }
+}
+
+}  // namespace flac_internal
+
+// Encodes |frames| frames of interleaved |format| PCM as FLAC frame |number|
+// of a fixed-blocksize stream. |format| must be integer PCM of 8, 16 or 24
+// bits and 1-8 channels.
+inline std::vector<uint8_t> EncodeFlacFrame(const uint8_t* pcm,
+                                            uint32_t frames,
+                                            const AudioFormat& format,
+                                            uint64_t number) {
+  using namespace flac_internal;
+  const int channels = format.channels;
+  const int bps = format.bits_per_sample;
+  const uint32_t n = frames;
+
+  std::vector<std::vector<int32_t>> x(channels, std::vector<int32_t>(n));
+  for (uint32_t i = 0; i < n; ++i) {
+    for (int c = 0; c < channels; ++c) {
+      const uint8_t* p = pcm + (size_t(i) * channels + c) * (bps / 8);
+      switch (bps) {
+        case 8:
+          x[c][i] = int32_t(p[0]) - 128;
+          break;
+        case 16:
+          x[c][i] = int16_t(p[0] | (p[1] << 8));
+          break;
+        default:
+          x[c][i] = convert_internal::LoadS24(p);
+          break;
+      }
+    }
+  }
+
+  // Channel assignment: 0-7 independent, 8 left/side, 9 side/right,
+  // 10 mid/side.
+  uint32_t assignment = channels - 1;
+  std::vector<const std::vector<int32_t>*> coded;
+  std::vector<int> coded_bps;
+  std::vector<Subframe> plans;
+  std::vector<std::vector<int32_t>> residuals(channels);
+  std::vector<int32_t> side, mid;
+  if (channels == 2) {
+    side.resize(n);
+    mid.resize(n);
+    for (uint32_t i = 0; i < n; ++i) {
+      side[i] = x[0][i] - x[1][i];
+      mid[i] = (x[0][i] + x[1][i]) >> 1;
+    }
+    std::vector<int32_t> scratch;
+    uint64_t l = Plan(x[0].data(), n, bps, scratch).bits;
+    uint64_t r = Plan(x[1].data(), n, bps, scratch).bits;
+    uint64_t s = Plan(side.data(), n, bps + 1, scratch).bits;
+    uint64_t m = Plan(mid.data(), n, bps, scratch).bits;
+    uint64_t best = std::min({l + r, l + s, s + r, m + s});
+    if (best == l + r) {
+      coded = {&x[0], &x[1]};
+      coded_bps = {bps, bps};
+    } else if (best == l + s) {
+      assignment = 8;
+      coded = {&x[0], &side};
+      coded_bps = {bps, bps + 1};
+    } else if (best == s + r) {
+      assignment = 9;
+      coded = {&side, &x[1]};
+      coded_bps = {bps + 1, bps};
+    } else {
+      assignment = 10;
+      coded = {&mid, &side};
+      coded_bps = {bps, bps + 1};
+    }
+  } else {
+    for (int c = 0; c < channels; ++c) {
+      coded.push_back(&x[c]);
+      coded_bps.push_back(bps);
+    }
+  }
+  for (int c = 0; c < channels; ++c) {
+    plans.push_back(Plan(coded[c]->data(), n, coded_bps[c], residuals[c]));
+  }
+
+  std::vector<uint8_t> out;
+  out.reserve(size_t(n) * channels * (bps / 8) + 64);
+  BitWriter w(&out);
+  w.Put(0xFFF8, 16);  // Sync code, fixed blocksize.
+  // 4096 has a code of its own; anything else is sent as n - 1.
+  uint32_t block_code = n == 4096 ? 12 : 7;
+  w.Put(block_code, 4);
+  uint32_t rate_code = SampleRateCode(format.sampling_rate);
+  w.Put(rate_code, 4);
+  w.Put(assignment, 4);
+  w.Put(SampleSizeCode(bps), 3);
+  w.Put(0, 1);
+  PutFrameNumber(w, number);
+  if (block_code == 7) {
+    w.Put(n - 1, 16);
+  }
+  w.Put(Crc8(out.data(), out.size()), 8);
+
+  for (int c = 0; c < channels; ++c) {
+    WriteSubframe(w, plans[c], coded[c]->data(), n, residuals[c]);
+  }
+  w.AlignToByte();
+  uint16_t crc = Crc16(out.data(), out.size());
+  w.Put(crc, 16);
+  return out;
+}
+
+// The 34-byte STREAMINFO block body.
+inline void WriteFlacStreamInfo(uint8_t out[34], const AudioFormat& format,
+                                uint32_t min_block, uint32_t max_block,
+                                uint32_t min_frame, uint32_t max_frame,
+                                uint64_t total_frames) {
+  std::vector<uint8_t> bytes;
+  flac_internal::BitWriter w(&bytes);
+  w.Put(min_block, 16);
+  w.Put(max_block, 16);
+  w.Put(min_frame, 24);
+  w.Put(max_frame, 24);
+  w.Put(format.sampling_rate, 20);
+  w.Put(format.channels - 1, 3);
+  w.Put(format.bits_per_sample - 1, 5);
+  w.Put(static_cast<uint32_t>(total_frames >> 32) & 0xF, 4);
+  w.Put(static_cast<uint32_t>(total_frames), 32);
+  // MD5 of the decoded audio; all zero means "not computed".
+  for (int i = 0; i < 16; ++i) {
+    w.Put(0, 8);
+  }
+  std::copy(bytes.begin(), bytes.end(), out);
+}
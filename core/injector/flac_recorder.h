@@ -0,0 +1,220 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../inject/protocol.h"
+#include "flac_encoder.h"
+#include "recorder.h"
+#include "worker_pool.h"
+
+// Writes FLAC instead of WAV. PCM is cut into fixed-size blocks, and every
+// block is encoded as an independent frame on a shared WorkerPool. Finished
+// frames are written strictly in order from the caller's thread. At most
+// kFramesPerThread frames per worker are in flight. Beyond that Write() waits
+// for the oldest one, so memory stays bounded if the encoder falls behind.
+//
+// STREAMINFO is written with unknown totals up front, which players accept,
+// and patched with the real frame sizes and sample count on Close().
+class FlacRecorder : public Recorder {
+ public:
+  static constexpr uint32_t kBlockSize = 4096;
+  static constexpr size_t kFramesPerThread = 4;
+
+  explicit FlacRecorder(std::shared_ptr<WorkerPool> pool)
+      : pool_(std::move(pool)) {}
+  ~FlacRecorder() override { Close(); }
+  FlacRecorder(const FlacRecorder&) = delete;
+  FlacRecorder& operator=(const FlacRecorder&) = delete;
+
+  // FLAC stores integer PCM only; float must be converted first (--format).
+  static bool Supports(const AudioFormat& format) {
+    return format.sample_type == SampleType::kInt &&
+           (format.bits_per_sample == 8 || format.bits_per_sample == 16 ||
+            format.bits_per_sample == 24) &&
+           format.channels >= 1 && format.channels <= 8 &&
+           format.sampling_rate > 0 && format.sampling_rate < (1u << 20);
+  }
+
+  bool Open(const std::string& path, const AudioFormat& format) override {
+    Close();
+    if (!Supports(format)) {
+      return false;
+    }
+#ifdef _MSC_VER
+    if (::fopen_s(&file_, path.c_str(), "wb") != 0) {
+      file_ = NULL;
+    }
+#else
+    file_ = ::fopen(path.c_str(), "wb");
+#endif
+    if (file_ == NULL) {
+      return false;
+    }
+    format_ = format;
+    bytes_ = 0;
+    frames_ = 0;
+    next_number_ = 0;
+    min_frame_ = UINT32_MAX;
+    max_frame_ = 0;
+    block_bytes_ = kBlockSize * format.block_align();
+    block_.clear();
+    block_.reserve(block_bytes_);
+    if (!WriteHeader()) {
+      ::fclose(file_);
+      file_ = NULL;
+      return false;
+    }
+    return true;
+  }
+
+  bool is_open() const override { return file_ != NULL; }
+  const AudioFormat& format() const override { return format_; }
+  uint64_t bytes() const override { return bytes_; }
+
+  bool Write(const uint8_t* data, size_t size) override {
+    bool ok = true;
+    while (size > 0) {
+      size_t n = std::min(size, block_bytes_ - block_.size());
+      block_.insert(block_.end(), data, data + n);
+      bytes_ += n;
+      data += n;
+      size -= n;
+      if (block_.size() == block_bytes_) {
+        ok = Submit() && ok;
+      }
+    }
+    return Drain(false) && ok;
+  }
+
+  // Writes out frames that finished encoding since the last Write(), and
+  // returns true while any are still in flight.
+  bool Idle() override {
+    if (!is_open()) {
+      return false;
+    }
+    Drain(false);
+    return !pending_.empty();
+  }
+
+  void Close() override {
+    if (!is_open()) {
+      return;
+    }
+    if (!block_.empty()) {
+      Submit();
+    }
+    Drain(true);
+    WriteHeader();
+    ::fclose(file_);
+    file_ = NULL;
+  }
+
+ private:
+  struct Frame {
+    std::vector<uint8_t> pcm;
+    std::vector<uint8_t> data;
+    bool done = false;
+  };
+
+  // Hands the current block to the pool.
+  bool Submit() {
+    bool ok = true;
+    if (pending_.size() >= pool_->size() * kFramesPerThread) {
+      ok = WriteFront();
+    }
+    auto frame = std::make_shared<Frame>();
+    frame->pcm.swap(block_);
+    block_.reserve(block_bytes_);
+    frames_ += frame->pcm.size() / format_.block_align();
+    pending_.push_back(frame);
+
+    AudioFormat format = format_;
+    uint64_t number = next_number_++;
+    pool_->Submit([this, frame, format, number] {
+      uint32_t frames =
+          static_cast<uint32_t>(frame->pcm.size() / format.block_align());
+      std::vector<uint8_t> data =
+          EncodeFlacFrame(frame->pcm.data(), frames, format, number);
+      std::lock_guard<std::mutex> lock(mutex_);
+      frame->data = std::move(data);
+      frame->pcm = std::vector<uint8_t>();
+      frame->done = true;
+      done_.notify_all();
+    });
+    return ok;
+  }
+
+  // Waits for the oldest frame to be encoded and writes it.
+  bool WriteFront() {
+    std::shared_ptr<Frame> frame = pending_.front();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [&] { return frame->done; });
+    }
+    pending_.pop_front();
+    uint32_t size = static_cast<uint32_t>(frame->data.size());
+    min_frame_ = std::min(min_frame_, size);
+    max_frame_ = std::max(max_frame_, size);
+    return ::fwrite(frame->data.data(), 1, size, file_) == size;
+  }
+
+  // Writes finished frames in order, or all of them if |wait|.
+  bool Drain(bool wait) {
+    while (!pending_.empty()) {
+      std::shared_ptr<Frame> front = pending_.front();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!front->done && !wait) {
+          return true;
+        }
+      }
+      if (!WriteFront()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // "fLaC" and the STREAMINFO block, rewritten in place on Close().
+  bool WriteHeader() {
+    uint8_t header[42];
+    ::memcpy(header, "fLaC", 4);
+    header[4] = 0x80;  // Last metadata block, type 0 (STREAMINFO).
+    header[5] = 0;
+    header[6] = 0;
+    header[7] = 34;
+    bool known = frames_ != 0;
+    uint32_t block =
+        known && frames_ < kBlockSize ? uint32_t(frames_) : kBlockSize;
+    WriteFlacStreamInfo(header + 8, format_, block, block,
+                        known ? min_frame_ : 0, known ? max_frame_ : 0,
+                        frames_);
+    return ::fseek(file_, 0, SEEK_SET) == 0 &&
+           ::fwrite(header, sizeof(header), 1, file_) == 1;
+  }
+
+  std::shared_ptr<WorkerPool> pool_;
+  FILE* file_ = NULL;
+  AudioFormat format_;
+  uint64_t bytes_ = 0;
+  uint64_t frames_ = 0;
+  uint64_t next_number_ = 0;
+  uint32_t min_frame_ = UINT32_MAX;
+  uint32_t max_frame_ = 0;
+
+  size_t block_bytes_ = 0;
+  std::vector<uint8_t> block_;
+  std::deque<std::shared_ptr<Frame>> pending_;
+  std::mutex mutex_;
+  std::condition_variable done_;
+};
@@ -1,7 +1,10 @@
 ﻿#include <array>
+#include <atomic>
 #include <cassert>
 #include <filesystem>
 #include <iostream>
+#include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -10,10 +13,17 @@
 #include <psapi.h>
 
 #define DR_WAV_IMPLEMENTATION
+#include "../inject/broadcast.h"
 #include "../inject/inject.h"
+#include "../inject/protocol.h"
+#include "../inject/transport.h"
 #include "CLI11.hpp"
 #include "dr_wav.h"
 #include "loguru.hpp"
+#include "mixer.h"
+#include "pipeline.h"
+#include "stream_loop.h"
+#include "trace.h"
 
 int ActivateSeDebugPrivilege(void) {
   HANDLE hToken;
@@ -47,16 +57,240 @@ int ActivateSeDebugPrivilege(void) {
   return 0;
 }
 
+// A process whose file name matched --process.
+struct Target {
+  DWORD pid = 0;
+  std::string name;
+  bool warned = false;
+};
+
+// Lists running processes whose file name contains |pattern|.
+std::vector<Target> FindTargets(const std::string& pattern) {
+  std::vector<Target> targets;
+  std::vector<DWORD> processes(65535, 0);
+  DWORD needed = 0;
+  if (::EnumProcesses(processes.data(),
+                      (DWORD)(processes.size() * sizeof(DWORD)),
+                      &needed) == FALSE) {
+    DLOG_F(ERROR, "failed EnumProcesses().");
+    return targets;
+  }
+
+  int process_count = needed / sizeof(DWORD);
+  for (int i = 0; i < process_count; ++i) {
+    DWORD pid = processes[i];
+    if (pid == 0) {
+      continue;
+    }
+
+    HANDLE handle = ::OpenProcess(
+        PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, FALSE, pid);
+    if (handle == NULL) {
+      continue;
+    }
+
+    char str[MAX_PATH];
+    DWORD len = ::GetModuleFileNameExA(handle, NULL, str, MAX_PATH);
+    ::CloseHandle(handle);
+    if (len == 0) {
+      continue;
+    }
+
+    std::string filename = std::filesystem::path(str).filename().string();
+    if (filename.find(pattern) == std::string::npos) {
+      continue;
+    }
+    DLOG_F(INFO, "found pid(%u) path(%s)", pid, str);
+    Target target;
+    target.pid = pid;
+    target.name = std::filesystem::path(str).stem().string();
+    targets.push_back(target);
+  }
+  return targets;
+}
+
+// Loads the DLL at |dll| into process |pid|.
+bool InjectDll(DWORD pid, const std::string& dll) {
+  HANDLE handle = ::OpenProcess(
+      PROCESS_QUERY_INFORMATION | PROCESS_CREATE_THREAD |
+          PROCESS_VM_OPERATION | PROCESS_VM_WRITE | PROCESS_VM_READ,
+      FALSE, pid);
+  if (handle == NULL) {
+    DLOG_F(ERROR, "failed OpenProcess().");
+    return false;
+  }
+
+  size_t size = dll.size() + 1;
+  LPVOID ptr = ::VirtualAllocEx(handle, NULL, size, MEM_COMMIT, PAGE_READWRITE);
+  if (ptr == NULL) {
+    DLOG_F(ERROR, "failed VirtualAllocEx().");
+    ::CloseHandle(handle);
+    return false;
+  }
+
+  SIZE_T written = 0;
+  BOOL ret = ::WriteProcessMemory(handle, ptr, dll.data(), size, &written);
+  if (ret == FALSE || written != size) {
+    DLOG_F(ERROR, "failed WriteProcessMemory().");
+    ::CloseHandle(handle);
+    return false;
+  }
+
+  HANDLE remote_thread_handle = ::CreateRemoteThread(
+      handle, NULL, 0, (LPTHREAD_START_ROUTINE)LoadLibraryA, ptr, 0, NULL);
+  if (remote_thread_handle == NULL) {
+    DLOG_F(ERROR, "failed CreateRemoteThread().");
+    ::CloseHandle(handle);
+    return false;
+  }
+
+  ::CloseHandle(remote_thread_handle);
+  ::CloseHandle(handle);
+  return true;
+}
+
+// Lets Ctrl+C finish the recordings instead of killing the process.
+StreamLoop* g_loop = nullptr;
+std::atomic<bool> g_stop_listening{false};
+
+BOOL WINAPI ConsoleHandler(DWORD type) {
+  if (type != CTRL_C_EVENT && type != CTRL_BREAK_EVENT) {
+    return FALSE;
+  }
+  g_stop_listening.store(true);
+  if (g_loop != NULL) {
+    g_loop->Stop();
+  }
+  return TRUE;
+}
+
+// Local time for output file names.
+std::string TimeStamp() {
+  time_t rawtime;
+  std::time(&rawtime);
+  char tb[256];
+  std::tm ti;
+  localtime_s(&ti, &rawtime);
+  std::strftime(tb, sizeof(tb), "%Y%m%d_%H%M%S", &ti);
+  return tb;
+}
+
+// --listen: records the broadcast of a process that another injector is
+// capturing, without injecting or taking its transport over. Any number of
+// listeners can share one capture; one that falls behind skips ahead and
+// says how much it missed.
+// Follows the broadcast of the first process matching |pattern|. The audio is
+// only saved if |save| (-s); otherwise the listener just meters it.
+int Listen(const std::string& pattern, Pipeline::Options options, bool save) {
+  if (!save && !options.loudness && !options.waveform) {
+    DLOG_F(ERROR, "--listen needs -s, --loudness or --waveform.");
+    return 1;
+  }
+  if (!save) {
+    options.writer = "none";
+  }
+  std::vector<Target> targets = FindTargets(pattern);
+  while (targets.empty()) {
+    DLOG_F(WARNING, "Can't find target process. sleeping 3 sec ...");
+    ::Sleep(3000);
+    targets = FindTargets(pattern);
+  }
+  const Target& target = targets.front();
+  Process process;
+  BroadcastReader reader;
+  if (!process.Open(target.pid) || !reader.Open(target.pid)) {
+    DLOG_F(ERROR, "Can't open the broadcast of pid(%u). Is it captured?",
+           target.pid);
+    return 1;
+  }
+  DLOG_F(INFO, "Listening to pid(%u).", target.pid);
+
+  // Listeners started in the same second differ in pid and reader slot.
+  Pipeline pipeline(options, "record_" + TimeStamp() + "_listen" +
+                                 std::to_string(reader.slot()) + "_" +
+                                 std::to_string(::GetCurrentProcessId()) +
+                                 Pipeline::Extension(options));
+  ::SetConsoleCtrlHandler(ConsoleHandler, TRUE);
+  bool failed = false;
+  size_t size = 0;
+  while (!g_stop_listening.load()) {
+    // Checked first: what was published before the end is visible then.
+    bool ended = reader.closed() || process.exited();
+    if (const uint8_t* buf = reader.Read(&size)) {
+      if (!pipeline.Process(buf, size)) {
+        DLOG_F(ERROR, "pid(%u): unexpected data.", target.pid);
+        failed = true;
+        break;
+      }
+      continue;
+    }
+    if (ended) {
+      break;
+    }
+    pipeline.Idle();
+    reader.Wait(StreamLoop::kIdleIntervalMs, &process);
+  }
+  ::SetConsoleCtrlHandler(ConsoleHandler, FALSE);
+  pipeline.Close();
+  std::string output = "Not saved";
+  if (save) {
+    output = "Saved to " + pipeline.path() + " (" +
+             std::to_string(pipeline.bytes()) + " bytes)";
+  }
+  DLOG_F(INFO,
+         "pid(%u) %s: %llu packets, %llu frames, %llu packets lost, %llu "
+         "bytes skipped in %llu laps. %s.",
+         target.pid, target.name.c_str(),
+         (unsigned long long)pipeline.packets(),
+         (unsigned long long)pipeline.frames(),
+         (unsigned long long)pipeline.lost(),
+         (unsigned long long)reader.skipped_bytes(),
+         (unsigned long long)reader.laps(), output.c_str());
+  return failed ? 1 : 0;
+}
+
 int main(int argc, char** argv) {
   CLI::App app{"injector"};
   bool use_32bit_dll;
+  bool all = false;
   std::string record_wav_path;
   std::string target_process_path;
   app.add_flag("--x86", use_32bit_dll, "use 32-bit dll")->default_val(false);
   app.add_option("-p,--process", target_process_path,
                  "target process path (partial match)")
       ->required();
+  app.add_flag("-a,--all", all,
+               "capture every matching process, including ones started "
+               "later, each to its own file");
   app.add_option("-s,--save", record_wav_path, "save to .wav file");
+  bool listen = false;
+  app.add_flag("--listen", listen,
+               "record a process another injector is capturing, from its "
+               "broadcast, without injecting");
+  std::string trace_path;
+  app.add_option("--trace", trace_path,
+                 "also record the raw transport stream to a trace file");
+  Pipeline::Options pipeline_options;
+  Pipeline::AddOptions(app, &pipeline_options);
+  Mixer::Options mix_options;
+  Mixer::AddOptions(app, &mix_options);
+  Transport::Settings settings;
+  app.add_option("--protocol", settings.protocol_version,
+                 "newest wire format version to accept")
+      ->default_val(kProtocolVersion)
+      ->check(CLI::Range(kProtocolV1, kProtocolVersion));
+  app.add_option("--batch-bytes", settings.batch_max_bytes,
+                 "coalesce packets into frames of up to N bytes (0: off)")
+      ->default_val(0);
+  app.add_option("--batch-us", settings.batch_deadline_us,
+                 "flush a partial batch after N microseconds")
+      ->default_val(5000);
+  app.add_option("--elide-silence", settings.elide_silence,
+                 "send silent buffers as frame counts instead of PCM (0: off)")
+      ->default_val(1);
+  app.add_option("--silence-db", settings.silence_threshold_db,
+                 "also treat buffers below -N dBFS as silent (0: off)")
+      ->default_val(0);
 
   try {
     app.parse(argc, argv);
@@ -68,8 +302,10 @@ int main(int argc, char** argv) {
         (use_32bit_dll ? "true" : "false"), target_process_path.c_str(),
         record_wav_path.c_str());
 
-  bool injected = false;
-  DWORD injected_pid = 0;
+  if (listen) {
+    return Listen(target_process_path, pipeline_options,
+                  !record_wav_path.empty());
+  }
 
   char temp[1024]{};
   ::GetModuleFileNameA(NULL, temp, 1024);
@@ -91,180 +327,175 @@ int main(int argc, char** argv) {
     }
   }
 
-  std::vector<DWORD> processes(65535, NULL);
-  while (!injected) {
-    DWORD needed = 0;
-    BOOL ret;
-    ret = ::EnumProcesses(processes.data(), processes.size() * sizeof(DWORD),
-                          &needed);
-    if (ret == FALSE) {
-      DLOG_F(ERROR, "failed EnumProcesses().");
-      return 1;
-    }
-
-    int process_count = needed / sizeof(DWORD);
-    for (int i = 0; i < process_count; ++i) {
-      int pid = processes[i];
-      if (pid == 0) {
-        continue;
-      }
-
-      HANDLE handle = ::OpenProcess(
-          PROCESS_QUERY_INFORMATION | PROCESS_CREATE_THREAD |
-              PROCESS_VM_OPERATION | PROCESS_VM_WRITE | PROCESS_VM_READ,
-          FALSE, pid);
-      if (handle == NULL) {
-        continue;
+  // Every pid injected so far, and the ones whose transport is not open yet.
+  // With --all, a pid that failed is tried again on the next scan; without
+  // it, a failure ends the injector as before. Returns false in that case.
+  std::set<DWORD> injected;
+  std::vector<Target> pending;
+  auto inject_new = [&] {
+    for (const Target& target : FindTargets(target_process_path)) {
+      if (!all && !injected.empty()) {
+        break;
       }
-
-      char str[MAX_PATH];
-      DWORD len = ::GetModuleFileNameExA(handle, NULL, str, MAX_PATH);
-      if (len == 0) {
+      if (injected.count(target.pid) != 0) {
         continue;
       }
-
-      std::filesystem::path path(str);
-      std::string filename = path.filename().string();
-      if (filename.find(target_process_path) == std::string::npos) {
-        ::CloseHandle(handle);
+      if (!InjectDll(target.pid, fullpath)) {
+        if (!all) {
+          return false;
+        }
         continue;
       }
-
-      DLOG_F(INFO, "found pid(%d) path(%s)", pid, str);
-      size_t size = fullpath.size() + 1;
-      LPVOID ptr =
-          ::VirtualAllocEx(handle, NULL, size, MEM_COMMIT, PAGE_READWRITE);
-      if (ptr == NULL) {
-        DLOG_F(ERROR, "failed VirtualAllocEx().");
-        return 1;
-      }
-
-      SIZE_T written = 0;
-      BOOL ret =
-          ::WriteProcessMemory(handle, ptr, fullpath.data(), size, &written);
-      if (ret == FALSE || written != size) {
-        DLOG_F(ERROR, "failed WriteProcessMemory().");
-        return 1;
-      }
-
-      HANDLE remote_thread_handle = ::CreateRemoteThread(
-          handle, NULL, 0, (LPTHREAD_START_ROUTINE)LoadLibraryA, ptr, 0, NULL);
-      if (remote_thread_handle == NULL) {
-        DLOG_F(ERROR, "failed CreateRemoteThread().");
-        return 1;
-      }
-
-      ::CloseHandle(handle);
-
-      injected = true;
-      injected_pid = processes[i];
-      DLOG_F(INFO, "Injected to pid(%d).", injected_pid);
-      break;
+      injected.insert(target.pid);
+      DLOG_F(INFO, "Injected to pid(%u).", target.pid);
+      pending.push_back(target);
     }
+    return true;
+  };
 
-    if (injected) {
-      break;
+  while (pending.empty()) {
+    if (!inject_new()) {
+      return 1;
+    }
+    if (pending.empty()) {
+      DLOG_F(WARNING, "Can't find target process. sleeping 3 sec ...");
+      ::Sleep(3000);
     }
-
-    DLOG_F(WARNING, "Can't find target process. sleeping 3 sec ...");
-    ::Sleep(3000);
   }
 
   if (record_wav_path.empty()) {
-    // No need to consume data from the named pipe.
+    // No need to consume data from the capture transport.
     return 0;
   }
 
-  // Connect to pipe
-  std::string pipename =
-      "\\\\.\\pipe\\audiocapture_" + std::to_string(injected_pid);
-  HANDLE hPipe = INVALID_HANDLE_VALUE;
-  while (hPipe == INVALID_HANDLE_VALUE) {
-    DLOG_F(INFO, "Connecting to named pipe(%s) ...", pipename.c_str());
-    hPipe = ::CreateFileA(pipename.c_str(), GENERIC_READ, 0, NULL,
-                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (hPipe == INVALID_HANDLE_VALUE) {
-      DLOG_F(WARNING,
-             "error: Can't connect to the named pipe. sleeping 3 sec ...");
-      ::Sleep(3000);
-      continue;
-    }
+  StreamLoop loop;
+  if (!loop.Create(::GetCurrentProcessId())) {
+    DLOG_F(ERROR, "failed to create the stream loop.");
+    return 1;
+  }
+  settings.doorbell = loop.doorbell();
+  // Shared by every stream, so the thread count does not grow with them.
+  std::shared_ptr<WorkerPool> pool = Pipeline::MakePool(pipeline_options);
+
+  std::string stamp = TimeStamp();
+
+  // With --mix, every stream feeds |mixer| and only the mix is saved.
+  std::unique_ptr<Pipeline> mix;
+  std::unique_ptr<Mixer> mixer;
+  if (mix_options.enabled) {
+    // The mix is clocked already; the sources are smoothed on the way in.
+    Pipeline::Options mix_pipeline_options = pipeline_options;
+    mix_pipeline_options.jitter_ms = 0;
+    mix = std::make_unique<Pipeline>(
+        mix_pipeline_options,
+        "record_" + stamp + Pipeline::Extension(pipeline_options), pool);
+    mixer = Pipeline::MakeMixer(pipeline_options, mix_options,
+                                [&](const Packet& packet) {
+                                  mix->Write(packet);
+                                });
+    loop.SetPump([&] { mixer->Pump(); });
   }
-  DLOG_F(INFO, "Connected.");
-
-  std::vector<uint8_t> buf;
-  size_t pipesize = 1024 * 1024;
-  buf.resize(pipesize);
-
-  std::vector<uint8_t> audiodata;
-
-  drwav_data_format df;
-  df.container = drwav_container_riff;
-  df.format = DR_WAVE_FORMAT_PCM;
-  int samples = 0;
-
-  time_t rawtime;
-  std::time(&rawtime);
-  char tb[256];
-  std::tm ti;
-  localtime_s(&ti, &rawtime);
-  std::strftime(tb, sizeof(tb), "%Y%m%d_%H%M%S", &ti);
-  std::string filename = "record_" + std::string(tb) + ".wav";
-
-  while (true) {
-    DWORD read_bytes = 0;
-    DWORD avail_bytes = 0;
-    BOOL ret;
-    ret = ::PeekNamedPipe(hPipe, buf.data(), pipesize, &read_bytes,
-                          &avail_bytes, NULL);
-    if (!ret) {
-      DLOG_F(WARNING, "failed PeekNamedPipe().");
-      break;
-    }
-
-    if (read_bytes < (2 + sizeof(Header))) {
-      continue;
-    }
-
-    Header* h = (Header*)(buf.data() + 2);
-    if ((int)read_bytes < h->total_size) {
-      continue;
-    }
 
-    if (buf[0] != 0xfe || buf[1] != 0xcf) {
-      DLOG_F(ERROR, "unexpected data.");
-      return 1;
+  // Connects to injected processes once their DLL has created the transport.
+  bool failed = false;
+  auto connect = [&] {
+    for (auto it = pending.begin(); it != pending.end();) {
+      auto stream = std::make_unique<StreamLoop::Stream>();
+      stream->id = it->pid;
+      stream->name = it->name;
+      stream->transport = std::make_unique<Transport>();
+      stream->process = std::make_unique<Process>();
+      if (!stream->process->Open(it->pid) || stream->process->exited()) {
+        DLOG_F(WARNING, "pid(%u) exited before connecting.", it->pid);
+        it = pending.erase(it);
+        continue;
+      }
+      if (!stream->transport->Open(it->pid, settings)) {
+        if (!it->warned) {
+          DLOG_F(WARNING, "Can't open the capture transport of pid(%u) yet.",
+                 it->pid);
+          it->warned = true;
+        }
+        ++it;
+        continue;
+      }
+      DLOG_F(INFO, "Connected to pid(%u). protocol(v%u)", it->pid,
+             stream->transport->settings().protocol_version);
+
+      std::string suffix =
+          all ? "_" + it->name + "_" + std::to_string(it->pid) : "";
+      if (mixer) {
+        size_t source = mixer->AddSource(
+            it->name + "(" + std::to_string(it->pid) + ")",
+            Mixer::GainFor(mix_options, it->name));
+        stream->pipeline = std::make_unique<Pipeline>(
+            mixer.get(), source, mix->path(), pipeline_options.jitter_ms);
+      } else {
+        std::string filename = "record_" + stamp + suffix +
+                               Pipeline::Extension(pipeline_options);
+        stream->pipeline =
+            std::make_unique<Pipeline>(pipeline_options, filename, pool);
+      }
+      if (!trace_path.empty()) {
+        std::filesystem::path p(trace_path);
+        std::string path = (p.parent_path() / p.stem()).string() + suffix +
+                           p.extension().string();
+        stream->trace = std::make_unique<TraceWriter>();
+        if (!stream->trace->Open(path)) {
+          DLOG_F(ERROR, "failed to create %s.", path.c_str());
+          failed = true;
+          loop.Stop();
+          return;
+        }
+      }
+      loop.Add(std::move(stream));
+      it = pending.erase(it);
     }
-
-    uint8_t* ptr = buf.data() + h->data_offset;
-    size_t offset = audiodata.size();
-    audiodata.resize(audiodata.size() + h->data_size);
-    memcpy(audiodata.data() + offset, ptr, h->data_size);
-
-    df.channels = h->channels;
-    df.sampleRate = h->sampling_rate;
-    df.bitsPerSample = h->bits_per_sample;
-    samples += h->samples;
-
-    ret = ::ReadFile(hPipe, buf.data(), read_bytes, &read_bytes, NULL);
-    if (!ret) {
-      DLOG_F(ERROR, "failed ReadFile().");
-      return 1;
+  };
+
+  uint64_t last_scan = MonotonicNanoseconds();
+  loop.SetPoll(
+      [&] {
+        uint64_t now = MonotonicNanoseconds();
+        if (all && now - last_scan >= 3000000000ull) {
+          inject_new();
+          last_scan = now;
+        }
+        connect();
+      },
+      1000);
+  loop.SetFinishHandler([&](const StreamLoop::Stream& stream) {
+    uint64_t dropped = stream.transport->ring().control()->dropped.load();
+    std::string output = "Mixed into " + stream.pipeline->path();
+    if (!mixer) {
+      output = "Saved to " + stream.pipeline->path() + " (" +
+               std::to_string(stream.pipeline->bytes()) + " bytes)";
     }
+    DLOG_F(INFO,
+           "pid(%u) %s: %llu packets, %llu frames (%llu silent), %llu "
+           "packets dropped, %llu packets lost. %s.",
+           stream.id, stream.name.c_str(),
+           (unsigned long long)stream.pipeline->packets(),
+           (unsigned long long)stream.pipeline->frames(),
+           (unsigned long long)stream.pipeline->silent_frames(),
+           (unsigned long long)dropped,
+           (unsigned long long)stream.pipeline->lost(), output.c_str());
+  });
+
+  g_loop = &loop;
+  ::SetConsoleCtrlHandler(ConsoleHandler, TRUE);
+  // Without --all, the loop ends with the first stream.
+  loop.Run([&] { return all || (loop.added() == 0 && !pending.empty()); });
+  ::SetConsoleCtrlHandler(ConsoleHandler, FALSE);
+  g_loop = nullptr;
+  if (mixer) {
+    mixer->Flush();
+    mix->Close();
+    DLOG_F(INFO, "Mixed %.1f s into %s (%llu bytes).",
+           mixer->frames() / double(mixer->format().sampling_rate),
+           mix->path().c_str(), (unsigned long long)mix->bytes());
   }
 
-  DLOG_F("The named pipe is closed.");
-
-  drwav wav;
-  if (!drwav_init_file_write(&wav, filename.c_str(), &df, NULL)) {
-    DLOG_F(ERROR, "failed drwav_init_file_write().");
-    return 1;
-  }
-
-  drwav_uint64 written =
-      drwav_write_pcm_frames(&wav, samples, audiodata.data());
-  DLOG_F(INFO, "Saved to %s (%d bytes).", record_wav_path.c_str(), written);
-  drwav_uninit(&wav);
-
-  return 0;
+  DLOG_F(INFO, "Captured %llu streams.", (unsigned long long)loop.added());
+  return failed ? 1 : 0;
 }
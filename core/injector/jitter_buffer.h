@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "../inject/protocol.h"
+
+// Holds a stream's packets for a few milliseconds and reconstructs its
+// sample clock from their timestamps. The hooks stamp a packet when the
+// application hands it over, so timestamps wobble with thread scheduling; a
+// delay-locked loop (a second-order filter over the stamp of each packet's
+// first frame) turns them into a steady clock and estimates the producer's
+// actual sample rate. Packets leave with the smoothed timestamps.
+//
+// Gaps are filled with silent packets, so the stream keeps its length: lost
+// packets show as a jump in the packet positions, which says exactly how
+// many frames are missing, and an application that fell behind as a packet
+// arriving well after the loop predicted it. Gaps longer than
+// kMaxGapSeconds are pauses (a stopped stream renders nothing) and restart
+// the loop instead.
+//
+// Packets are held until the newest timestamp is |depth()| past theirs. The
+// depth follows the measured timing jitter, up to the configured maximum.
+// Time is taken from the packets themselves, as the Mixer does, so a
+// replayed trace is buffered exactly as the live capture was.
+class JitterBuffer {
+ public:
+  // The loop starts wide to lock quickly and narrows to kBandwidthHz, which
+  // keeps the rate estimate steady.
+  static constexpr double kInitialBandwidthHz = 1.0;
+  static constexpr double kBandwidthHz = 0.05;
+  // A packet this much later than predicted, and over one and a half
+  // packets, follows a gap.
+  static constexpr double kGapSeconds = 0.015;
+  static constexpr double kMaxGapSeconds = 1.0;
+  // A packet this much earlier than predicted means the clock jumped.
+  static constexpr double kResyncSeconds = 0.1;
+  // The estimate never strays further than this from the nominal rate.
+  static constexpr double kMaxDeviation = 0.01;
+  // Weight of each packet in the smoothed timing error.
+  static constexpr double kJitterSmoothing = 0.01;
+  // The depth covers this many times the smoothed timing error.
+  static constexpr double kDepthPerJitter = 4;
+
+  explicit JitterBuffer(uint32_t max_latency_ms)
+      : max_depth_ns_(max_latency_ms * 1e6) {}
+  JitterBuffer(const JitterBuffer&) = delete;
+  JitterBuffer& operator=(const JitterBuffer&) = delete;
+
+  // Buffers |packet| and passes the packets that are due to
+  // |fn(const Packet&)|. Packets without a timestamp (protocol v1) cannot be
+  // placed and go straight through, after everything held.
+  template <typename Fn>
+  void Write(const Packet& packet, Fn fn) {
+    if (packet.timestamp_ns == 0) {
+      Flush(fn);
+      fn(packet);
+      return;
+    }
+    const AudioFormat& format = *packet.format;
+    double ts = double(packet.timestamp_ns);
+    if (!locked_ || format.sampling_rate != nominal_rate_) {
+      Start(format, ts);
+    } else {
+      double error = ts - next_ns_;
+      if (error > kMaxGapSeconds * 1e9 || error < -kResyncSeconds * 1e9) {
+        ++resyncs_;
+        Flush(fn);
+        Start(format, ts);
+      } else {
+        if (packet.position > next_position_ &&
+            packet.position - next_position_ <
+                kMaxGapSeconds * nominal_rate_) {
+          Conceal(format, packet.position - next_position_);
+          error = ts - next_ns_;
+        }
+        if (error > std::max(kGapSeconds * 1e9,
+                             1.5 * double(span_) * period_ns_)) {
+          Conceal(format, Missing(error));
+          error = ts - next_ns_;
+        }
+        Track(error);
+      }
+    }
+    next_position_ = packet.position + packet.frames;
+    Fit(double(frames_) / nominal_rate_, (ts - start_ns_) * 1e-9);
+    Hold(packet, format);
+    last_frames_ = packet.frames;
+    newest_ns_ = ts;
+    Release(fn, false);
+  }
+
+  // Passes on everything held, e.g. when the stream ends.
+  template <typename Fn>
+  void Flush(Fn fn) {
+    Release(fn, true);
+  }
+
+  // Estimated frames per second of the producer's clock; 0 until a few
+  // seconds of timestamps have been seen. This is a least-squares fit over
+  // every timestamp since the clock (re)started rather than the loop's
+  // current period, so it settles instead of wandering with the jitter.
+  double rate() const {
+    if (!locked_ || elapsed_ns_ < 2e9 || fit_xx_ <= 0 || fit_xy_ <= 0) {
+      return 0;
+    }
+    return nominal_rate_ * fit_xx_ / fit_xy_;
+  }
+  uint32_t nominal_rate() const { return nominal_rate_; }
+  // Smoothed deviation of the timestamps from the reconstructed clock.
+  double jitter_ms() const { return jitter_ns_ * 1e-6; }
+  double depth_ms() const { return Depth() * 1e-6; }
+  uint64_t gaps() const { return gaps_; }
+  uint64_t concealed_frames() const { return concealed_frames_; }
+  // Times the clock had to be restarted after a pause or a jump.
+  uint64_t resyncs() const { return resyncs_; }
+
+ private:
+  struct Entry {
+    Packet packet;
+    AudioFormat format;
+    std::vector<uint8_t> data;
+    // Smoothed timestamp.
+    double time_ns;
+  };
+
+  void Start(const AudioFormat& format, double ts) {
+    locked_ = true;
+    nominal_rate_ = format.sampling_rate;
+    period_ns_ = 1e9 / nominal_rate_;
+    start_ns_ = ts;
+    next_ns_ = ts;
+    elapsed_ns_ = 0;
+    span_ = 0;
+    frames_ = 0;
+    fit_count_ = 0;
+    fit_x_ = fit_y_ = fit_xx_ = fit_xy_ = 0;
+  }
+
+  // Adds a point to the fit of timestamps (|y| seconds) against stream time
+  // (|x| seconds at the nominal rate), updating the centered sums
+  // incrementally so they stay accurate over long sessions.
+  void Fit(double x, double y) {
+    ++fit_count_;
+    double dx = x - fit_x_;
+    fit_x_ += dx / fit_count_;
+    fit_y_ += (y - fit_y_) / fit_count_;
+    fit_xx_ += dx * (x - fit_x_);
+    fit_xy_ += dx * (y - fit_y_);
+  }
+
+  // One step of the loop: |error| is how far the packet's timestamp is from
+  // where the previous packets put it, span_ frames ago.
+  void Track(double error) {
+    if (span_ == 0) {
+      return;
+    }
+    double seconds = double(span_) / nominal_rate_;
+    elapsed_ns_ += seconds * 1e9;
+    double bandwidth =
+        std::max(kBandwidthHz, kInitialBandwidthHz / (1 + elapsed_ns_ * 1e-9));
+    const double pi = 3.14159265358979323846;
+    double omega = 2 * pi * bandwidth * seconds;
+    next_ns_ += std::sqrt(2.0) * omega * error;
+    double nominal = 1e9 / nominal_rate_;
+    period_ns_ = std::clamp(period_ns_ + omega * omega * error / double(span_),
+                            nominal * (1 - kMaxDeviation),
+                            nominal * (1 + kMaxDeviation));
+    jitter_ns_ += kJitterSmoothing * (std::fabs(error) - jitter_ns_);
+    span_ = 0;
+  }
+
+  // Frames missing before a packet |error| ns late. Applications render in
+  // periods of one size, so a gap close to a whole number of them is taken
+  // to be exactly that.
+  uint64_t Missing(double error) const {
+    double frames = error / period_ns_;
+    double periods =
+        last_frames_ != 0 ? std::round(frames / last_frames_) : 0;
+    if (periods >= 1 &&
+        std::fabs(frames - periods * last_frames_) < 0.25 * last_frames_) {
+      frames = periods * last_frames_;
+    }
+    return static_cast<uint64_t>(frames + 0.5);
+  }
+
+  // Queues |frames| of silence where the loop expected the next packet.
+  void Conceal(const AudioFormat& format, uint64_t frames) {
+    ++gaps_;
+    concealed_frames_ += frames;
+    Packet silent{};
+    silent.format = &format;
+    silent.frames = static_cast<uint32_t>(frames);
+    silent.flags = kPacketSilent;
+    Hold(silent, format);
+  }
+
+  // Queues a copy of |packet| at next_ns_ and moves next_ns_ past it.
+  void Hold(const Packet& packet, const AudioFormat& format) {
+    queue_.emplace_back();
+    Entry& entry = queue_.back();
+    entry.packet = packet;
+    entry.format = format;
+    if (!spare_.empty()) {
+      entry.data = std::move(spare_.back());
+      spare_.pop_back();
+    }
+    entry.data.assign(packet.data, packet.data + packet.size);
+    entry.time_ns = next_ns_;
+    next_ns_ += packet.frames * period_ns_;
+    span_ += packet.frames;
+    frames_ += packet.frames;
+  }
+
+  double Depth() const {
+    return std::min(max_depth_ns_, kDepthPerJitter * jitter_ns_);
+  }
+
+  template <typename Fn>
+  void Release(Fn& fn, bool all) {
+    double due = newest_ns_ - Depth();
+    while (!queue_.empty() && (all || queue_.front().time_ns <= due)) {
+      Entry& entry = queue_.front();
+      Packet packet = entry.packet;
+      packet.format = &entry.format;
+      packet.data = entry.data.data();
+      packet.timestamp_ns = static_cast<uint64_t>(entry.time_ns);
+      fn(static_cast<const Packet&>(packet));
+      spare_.push_back(std::move(entry.data));
+      queue_.pop_front();
+    }
+  }
+
+  double max_depth_ns_;
+  std::deque<Entry> queue_;
+  std::vector<std::vector<uint8_t>> spare_;
+
+  bool locked_ = false;
+  uint32_t nominal_rate_ = 0;
+  // Where the next packet is expected on the reconstructed clock.
+  double next_ns_ = 0;
+  // Reconstructed frame period.
+  double period_ns_ = 0;
+  // Frames since the last loop step and since Start(), and stream time
+  // since Start().
+  uint64_t span_ = 0;
+  uint64_t frames_ = 0;
+  // Position the next packet should have if none are lost.
+  uint64_t next_position_ = 0;
+  // Size of the last packet received.
+  uint32_t last_frames_ = 0;
+  double elapsed_ns_ = 0;
+  double newest_ns_ = 0;
+  double start_ns_ = 0;
+  double jitter_ns_ = 0;
+
+  // Running means and centered sums for rate().
+  uint64_t fit_count_ = 0;
+  double fit_x_ = 0;
+  double fit_y_ = 0;
+  double fit_xx_ = 0;
+  double fit_xy_ = 0;
+
+  uint64_t gaps_ = 0;
+  uint64_t concealed_frames_ = 0;
+  uint64_t resyncs_ = 0;
+};
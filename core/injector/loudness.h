@@ -0,0 +1,355 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "remix.h"
+
+// Streaming loudness meter after ITU-R BS.1770-4 / EBU R128: K-weighting,
+// momentary (400 ms) and short-term (3 s) loudness, gated integrated
+// loudness and 4x oversampled true peak.
+//
+// Audio is summed in 100 ms sub-blocks; the gating blocks overlap by 75%, so
+// a new one completes with every sub-block. Integrated loudness needs every
+// gating block ever seen; they go into a histogram of 0.01 LU bins that
+// keeps each bin's energy sum, so memory stays fixed however long the
+// capture runs and the gates are exact to within a bin.
+class LoudnessMeter {
+ public:
+  static constexpr double kAbsoluteGate = -70.0;
+  static constexpr double kRelativeGate = -10.0;
+
+  LoudnessMeter()
+      : bin_counts_(kBins, 0), bin_energy_(kBins, 0.0), recent_(kShortTerm) {}
+
+  // Starts a new format. Filters and the momentary and short-term windows
+  // start over; integrated loudness and peaks carry on.
+  void SetFormat(uint32_t rate, int channels, uint32_t channel_mask) {
+    for (const Channel& channel : channels_state_) {
+      past_peak_ = std::max(past_peak_, channel.peak);
+    }
+    rate_ = rate;
+    channels_ = channels;
+    channels_state_.assign(channels, Channel());
+    if (channel_mask == 0) {
+      channel_mask = DefaultChannelMask(channels);
+    }
+    // Channel weights: 0 for LFE, +1.5 dB (1.41) for the surrounds.
+    int bit = 0;
+    for (int c = 0; c < channels; ++c) {
+      double weight = 1.0;
+      if (channel_mask != 0) {
+        while (bit < 32 && !(channel_mask & (1u << bit))) {
+          ++bit;
+        }
+        uint32_t speaker = bit < 32 ? 1u << bit : 0;
+        ++bit;
+        if (speaker == 0x8) {
+          weight = 0.0;
+        } else if (speaker & (0x10 | 0x20 | 0x200 | 0x400)) {
+          weight = 1.41;
+        }
+      }
+      channels_state_[c].weight = weight;
+    }
+    DesignFilters();
+    sub_block_ = 0;
+    sub_block_pos_ = 0;
+    sub_block_size_ = SubBlockSize(0);
+    recent_count_ = 0;
+  }
+
+  // |pcm| is |frames| interleaved frames in the last SetFormat() format.
+  void Process(const float* pcm, size_t frames) {
+    while (frames > 0) {
+      size_t n = std::min<size_t>(frames, sub_block_size_ - sub_block_pos_);
+      for (int c = 0; c < channels_; ++c) {
+        FilterChannel(channels_state_[c], pcm + c, n);
+      }
+      Advance(n);
+      pcm += n * channels_;
+      frames -= n;
+    }
+  }
+
+  // Same as Process() with |frames| frames of zeros. Once the filters have
+  // decayed, whole sub-blocks are skipped without touching samples.
+  void ProcessSilence(uint64_t frames) {
+    static const float kZeros[1024 * 8] = {};
+    size_t chunk = sizeof(kZeros) / sizeof(float) / std::max(channels_, 1);
+    while (frames > 0) {
+      size_t n = static_cast<size_t>(std::min<uint64_t>(
+          frames, sub_block_size_ - sub_block_pos_));
+      if (Settled()) {
+        Advance(n);
+      } else {
+        n = std::min(n, chunk);
+        Process(kZeros, n);
+      }
+      frames -= n;
+    }
+  }
+
+  // Loudness in LUFS, or -HUGE_VAL before there is any (or only silence).
+  double momentary() const { return WindowLoudness(kMomentary); }
+  double short_term() const { return WindowLoudness(kShortTerm); }
+  double integrated() const {
+    uint64_t count = 0;
+    double energy = 0;
+    for (size_t i = 0; i < kBins; ++i) {
+      count += bin_counts_[i];
+      energy += bin_energy_[i];
+    }
+    if (count == 0) {
+      return -HUGE_VAL;
+    }
+    double gate = Loudness(energy / count) + kRelativeGate;
+    size_t first = gate <= kAbsoluteGate ? 0 : BinOf(gate);
+    count = 0;
+    energy = 0;
+    for (size_t i = first; i < kBins; ++i) {
+      count += bin_counts_[i];
+      energy += bin_energy_[i];
+    }
+    return count == 0 ? -HUGE_VAL : Loudness(energy / count);
+  }
+  double max_momentary() const { return max_momentary_; }
+  double max_short_term() const { return max_short_term_; }
+
+  // Highest true peak so far in dBTP, over all channels.
+  double true_peak() const {
+    double peak = 0;
+    for (const Channel& channel : channels_state_) {
+      peak = std::max(peak, channel.peak);
+    }
+    peak = std::max(peak, past_peak_);
+    return peak > 0 ? 20.0 * std::log10(peak) : -HUGE_VAL;
+  }
+
+  // Audio time measured so far.
+  double seconds() const { return seconds_; }
+
+ private:
+  static constexpr size_t kMomentary = 4;
+  static constexpr size_t kShortTerm = 30;
+  static constexpr size_t kBins = 10000;  // -70 to +30 LUFS.
+  static constexpr int kTaps = 12;
+
+  struct Biquad {
+    double b0 = 1, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
+  };
+
+  struct Channel {
+    double weight = 1.0;
+    // Direct form I state for the two K-weighting stages.
+    double x1 = 0, x2 = 0, y1 = 0, y2 = 0, z1 = 0, z2 = 0;
+    double energy = 0;
+    // Input history for the oversampling filter, stored twice so the
+    // latest kTaps samples are always contiguous.
+    float history[2 * kTaps] = {};
+    int head = 0;
+    double peak = 0;
+  };
+
+  struct SubBlock {
+    double energy = 0;
+    uint64_t samples = 0;
+  };
+
+  static double Loudness(double mean_square) {
+    return mean_square > 0 ? -0.691 + 10.0 * std::log10(mean_square)
+                           : -HUGE_VAL;
+  }
+
+  static size_t BinOf(double loudness) {
+    double bin = std::floor((loudness - kAbsoluteGate) * 100.0);
+    return static_cast<size_t>(std::min(std::max(bin, 0.0), kBins - 1.0));
+  }
+
+  // Sub-block boundaries fall on whole samples; for rates that are not a
+  // multiple of 10 their lengths alternate so 10 of them are one second.
+  size_t SubBlockSize(uint64_t index) const {
+    return static_cast<size_t>((index + 1) * rate_ / 10 - index * rate_ / 10);
+  }
+
+  // K-weighting for any rate, from the analog prototype (the BS.1770
+  // coefficients are its 48 kHz instance): a +4 dB high shelf and a 38 Hz
+  // high-pass.
+  void DesignFilters() {
+    const double pi = 3.14159265358979323846;
+    double k = std::tan(pi * 1681.974450955533 / rate_);
+    double q = 0.7071752369554196;
+    double vh = std::pow(10.0, 3.999843853973347 / 20.0);
+    double vb = std::pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    shelf_.b0 = (vh + vb * k / q + k * k) / a0;
+    shelf_.b1 = 2.0 * (k * k - vh) / a0;
+    shelf_.b2 = (vh - vb * k / q + k * k) / a0;
+    shelf_.a1 = 2.0 * (k * k - 1.0) / a0;
+    shelf_.a2 = (1.0 - k / q + k * k) / a0;
+
+    k = std::tan(pi * 38.13547087602444 / rate_);
+    q = 0.5003270373238773;
+    a0 = 1.0 + k / q + k * k;
+    highpass_.b0 = 1.0;
+    highpass_.b1 = -2.0;
+    highpass_.b2 = 1.0;
+    highpass_.a1 = 2.0 * (k * k - 1.0) / a0;
+    highpass_.a2 = (1.0 - k / q + k * k) / a0;
+  }
+
+  void FilterChannel(Channel& ch, const float* in, size_t frames) {
+    // BS.1770-4 Annex 2 interpolation filter: 4 phases of 12 taps.
+    static const float kPhases[4][kTaps] = {
+        {0.0017089843750f, 0.0109863281250f, -0.0196533203125f,
+         0.0332031250000f, -0.0594482421875f, 0.1373291015625f,
+         0.9721679687500f, -0.1022949218750f, 0.0476074218750f,
+         -0.0266113281250f, 0.0148925781250f, -0.0083007812500f},
+        {-0.0291748046875f, 0.0292968750000f, -0.0517578125000f,
+         0.0891113281250f, -0.1665039062500f, 0.4650878906250f,
+         0.7797851562500f, -0.2003173828125f, 0.1015625000000f,
+         -0.0582275390625f, 0.0330810546875f, -0.0189208984375f},
+        {-0.0189208984375f, 0.0330810546875f, -0.0582275390625f,
+         0.1015625000000f, -0.2003173828125f, 0.7797851562500f,
+         0.4650878906250f, -0.1665039062500f, 0.0891113281250f,
+         -0.0517578125000f, 0.0292968750000f, -0.0291748046875f},
+        {-0.0083007812500f, 0.0148925781250f, -0.0266113281250f,
+         0.0476074218750f, -0.1022949218750f, 0.9721679687500f,
+         0.1373291015625f, -0.0594482421875f, 0.0332031250000f,
+         -0.0196533203125f, 0.0109863281250f, 0.0017089843750f}};
+
+    const Biquad& s = shelf_;
+    const Biquad& h = highpass_;
+    double x1 = ch.x1, x2 = ch.x2, y1 = ch.y1, y2 = ch.y2, z1 = ch.z1,
+           z2 = ch.z2;
+    double energy = ch.energy;
+    float peak = static_cast<float>(ch.peak);
+    for (size_t i = 0; i < frames; ++i) {
+      float sample = in[i * channels_];
+      double x = sample;
+      double y = s.b0 * x + s.b1 * x1 + s.b2 * x2 - s.a1 * y1 - s.a2 * y2;
+      double z = h.b0 * y + h.b1 * y1 + h.b2 * y2 - h.a1 * z1 - h.a2 * z2;
+      x2 = x1;
+      x1 = x;
+      y2 = y1;
+      y1 = y;
+      z2 = z1;
+      z1 = z;
+      energy += z * z;
+
+      // Newest sample last; the taps run oldest to newest.
+      ch.history[ch.head] = sample;
+      ch.history[ch.head + kTaps] = sample;
+      ch.head = ch.head + 1 == kTaps ? 0 : ch.head + 1;
+      const float* window = ch.history + ch.head;
+      for (int p = 0; p < 4; ++p) {
+        float acc = 0;
+        for (int t = 0; t < kTaps; ++t) {
+          acc += kPhases[p][t] * window[t];
+        }
+        peak = std::max(peak, std::fabs(acc));
+      }
+    }
+    ch.x1 = x1;
+    ch.x2 = x2;
+    ch.y1 = y1;
+    ch.y2 = y2;
+    ch.z1 = z1;
+    ch.z2 = z2;
+    ch.energy = energy;
+    ch.peak = peak;
+  }
+
+  // True once every filter state is small enough that zeros in give zeros
+  // out, to the precision the result is reported at.
+  bool Settled() const {
+    const double kEpsilon = 1e-10;
+    for (const Channel& ch : channels_state_) {
+      if (std::fabs(ch.x1) > kEpsilon || std::fabs(ch.x2) > kEpsilon ||
+          std::fabs(ch.y1) > kEpsilon || std::fabs(ch.y2) > kEpsilon ||
+          std::fabs(ch.z1) > kEpsilon || std::fabs(ch.z2) > kEpsilon) {
+        return false;
+      }
+      for (int t = 0; t < kTaps; ++t) {
+        if (ch.history[t] != 0.0f) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Moves |n| frames ahead in the current sub-block, closing it if full.
+  void Advance(size_t n) {
+    sub_block_pos_ += n;
+    seconds_ += double(n) / rate_;
+    if (sub_block_pos_ < sub_block_size_) {
+      return;
+    }
+    SubBlock block;
+    block.samples = sub_block_size_;
+    for (Channel& ch : channels_state_) {
+      block.energy += ch.weight * ch.energy;
+      ch.energy = 0;
+    }
+    recent_[recent_count_ % kShortTerm] = block;
+    ++recent_count_;
+    ++sub_block_;
+    sub_block_pos_ = 0;
+    sub_block_size_ = SubBlockSize(sub_block_);
+
+    if (recent_count_ >= kMomentary) {
+      double mean = WindowMeanSquare(kMomentary);
+      double loudness = Loudness(mean);
+      if (loudness > kAbsoluteGate) {
+        size_t bin = BinOf(loudness);
+        ++bin_counts_[bin];
+        bin_energy_[bin] += mean;
+      }
+      max_momentary_ = std::max(max_momentary_, loudness);
+    }
+    if (recent_count_ >= kShortTerm) {
+      max_short_term_ = std::max(max_short_term_, short_term());
+    }
+  }
+
+  double WindowMeanSquare(size_t blocks) const {
+    double energy = 0;
+    uint64_t samples = 0;
+    for (size_t i = 0; i < blocks; ++i) {
+      const SubBlock& block = recent_[(recent_count_ - 1 - i) % kShortTerm];
+      energy += block.energy;
+      samples += block.samples;
+    }
+    return samples > 0 ? energy / samples : 0.0;
+  }
+
+  double WindowLoudness(size_t blocks) const {
+    if (recent_count_ < blocks) {
+      return -HUGE_VAL;
+    }
+    return Loudness(WindowMeanSquare(blocks));
+  }
+
+  uint32_t rate_ = 48000;
+  int channels_ = 0;
+  Biquad shelf_;
+  Biquad highpass_;
+  std::vector<Channel> channels_state_;
+
+  uint64_t sub_block_ = 0;
+  size_t sub_block_pos_ = 0;
+  size_t sub_block_size_ = 4800;
+  std::vector<uint64_t> bin_counts_;
+  std::vector<double> bin_energy_;
+  std::vector<SubBlock> recent_;
+  uint64_t recent_count_ = 0;
+
+  double seconds_ = 0;
+  double max_momentary_ = -HUGE_VAL;
+  double max_short_term_ = -HUGE_VAL;
+  double past_peak_ = 0;
+};
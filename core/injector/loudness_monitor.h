@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../inject/protocol.h"
+#include "convert.h"
+#include "loguru.hpp"
+#include "loudness.h"
+#include "worker_pool.h"
+
+// Runs a LoudnessMeter over a captured stream on a WorkerPool. The read loop
+// only appends packet bytes to a queue; decoding to float and metering happen
+// on a pool thread. At most one task per monitor is queued or running, so
+// packets are metered in order, and many monitors can share one small pool.
+//
+// Every |report_seconds| of audio a JSON line goes to stderr:
+//   {"time":12.0,"momentary":-21.3,"short_term":-22.0,"integrated":-23.1,
+//    "true_peak":-1.2}
+// Close() writes the final figures to |sidecar_path|. Values are null while
+// they are undefined, e.g. integrated loudness of pure silence.
+class LoudnessMonitor {
+ public:
+  // Audio waiting for the worker beyond this is dropped rather than letting
+  // a stalled pool hold on to unbounded memory.
+  static constexpr size_t kMaxQueued = 32 << 20;
+
+  LoudnessMonitor(std::shared_ptr<WorkerPool> pool, double report_seconds,
+                  std::string sidecar_path)
+      : pool_(std::move(pool)),
+        report_seconds_(report_seconds),
+        next_report_(report_seconds),
+        sidecar_path_(std::move(sidecar_path)) {}
+
+  ~LoudnessMonitor() { Close(); }
+
+  LoudnessMonitor(const LoudnessMonitor&) = delete;
+  LoudnessMonitor& operator=(const LoudnessMonitor&) = delete;
+
+  void Write(const AudioFormat& format, const uint8_t* data, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queued_ + size > kMaxQueued) {
+      Drop(format, format.block_align() ? size / format.block_align() : 0);
+      Schedule();
+      return;
+    }
+    // Consecutive packets in one format share a buffer.
+    if (queue_.empty() || queue_.back().silent_frames != 0 ||
+        queue_.back().format != format) {
+      queue_.emplace_back();
+      queue_.back().format = format;
+    }
+    std::vector<uint8_t>& pcm = queue_.back().pcm;
+    pcm.insert(pcm.end(), data, data + size);
+    queued_ += size;
+    Schedule();
+  }
+
+  void WriteSilence(const AudioFormat& format, uint64_t frames) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    QueueSilence(format, frames);
+    Schedule();
+  }
+
+  // Waits for queued audio to be metered and writes the sidecar.
+  void Close() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      idle_.wait(lock, [this] { return !scheduled_; });
+      if (closed_) {
+        return;
+      }
+      closed_ = true;
+    }
+    if (dropped_frames_ != 0) {
+      DLOG_F(WARNING, "loudness: %llu frames were not metered.",
+             (unsigned long long)dropped_frames_);
+    }
+    if (!sidecar_path_.empty() && !WriteSidecar()) {
+      DLOG_F(ERROR, "failed to write %s.", sidecar_path_.c_str());
+    }
+  }
+
+ private:
+  struct Chunk {
+    AudioFormat format;
+    std::vector<uint8_t> pcm;
+    uint64_t silent_frames = 0;
+  };
+
+  // Called with mutex_ held.
+  void Schedule() {
+    if (scheduled_) {
+      return;
+    }
+    scheduled_ = true;
+    pool_->Submit([this] { Run(); });
+  }
+
+  // Called with mutex_ held.
+  void QueueSilence(const AudioFormat& format, uint64_t frames) {
+    if (!queue_.empty() && queue_.back().silent_frames != 0 &&
+        queue_.back().format == format) {
+      queue_.back().silent_frames += frames;
+      return;
+    }
+    queue_.emplace_back();
+    queue_.back().format = format;
+    queue_.back().silent_frames = frames;
+  }
+
+  // Called with mutex_ held. The meter's clock keeps going: the audio that
+  // did not fit is metered as silence.
+  void Drop(const AudioFormat& format, uint64_t frames) {
+    if (dropped_frames_ == 0) {
+      DLOG_F(WARNING, "loudness meter is behind, dropping audio.");
+    }
+    dropped_frames_ += frames;
+    QueueSilence(format, frames);
+  }
+
+  // Pool task: meters everything queued, including what arrives meanwhile.
+  void Run() {
+    std::deque<Chunk> chunks;
+    for (;;) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (queue_.empty()) {
+          scheduled_ = false;
+          idle_.notify_all();
+          return;
+        }
+        chunks.swap(queue_);
+        queued_ = 0;
+      }
+      for (const Chunk& chunk : chunks) {
+        Meter(chunk);
+      }
+      chunks.clear();
+    }
+  }
+
+  void Meter(const Chunk& chunk) {
+    const AudioFormat& format = chunk.format;
+    SampleEncoding encoding = EncodingOf(format);
+    if (encoding == SampleEncoding::kUnknown || format.channels == 0 ||
+        format.sampling_rate == 0) {
+      return;
+    }
+    if (!has_format_ || format != format_) {
+      meter_.SetFormat(format.sampling_rate, format.channels,
+                       format.channel_mask);
+      format_ = format;
+      has_format_ = true;
+    }
+    // Decoded a few thousand frames at a time to keep the buffer in cache,
+    // and split at report times so each report is exactly on time.
+    bool silent = chunk.silent_frames != 0;
+    size_t frame_size = format.block_align();
+    uint64_t frames =
+        silent ? chunk.silent_frames : chunk.pcm.size() / frame_size;
+    const uint64_t step = 4096;
+    floats_.resize(step * format.channels);
+    for (uint64_t done = 0; done < frames;) {
+      uint64_t n = std::min(frames - done, FramesToReport(format));
+      if (silent) {
+        meter_.ProcessSilence(n);
+      } else {
+        n = std::min(n, step);
+        ConvertSamples(SampleEncoding::kF32, floats_.data(), encoding,
+                       chunk.pcm.data() + done * frame_size,
+                       static_cast<size_t>(n) * format.channels);
+        meter_.Process(floats_.data(), static_cast<size_t>(n));
+      }
+      done += n;
+      if (report_seconds_ > 0 && meter_.seconds() >= next_report_ - 1e-9) {
+        Report();
+        next_report_ += report_seconds_;
+      }
+    }
+  }
+
+  uint64_t FramesToReport(const AudioFormat& format) const {
+    if (report_seconds_ <= 0) {
+      return UINT64_MAX;
+    }
+    double left = (next_report_ - meter_.seconds()) * format.sampling_rate;
+    return std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(left - 1e-6)));
+  }
+
+  static std::string Number(double value) {
+    if (!std::isfinite(value)) {
+      return "null";
+    }
+    char text[32];
+    ::snprintf(text, sizeof(text), "%.2f", value);
+    return text;
+  }
+
+  void Report() {
+    ::fprintf(stderr,
+              "{\"time\":%.1f,\"momentary\":%s,\"short_term\":%s,"
+              "\"integrated\":%s,\"true_peak\":%s}\n",
+              meter_.seconds(), Number(meter_.momentary()).c_str(),
+              Number(meter_.short_term()).c_str(),
+              Number(meter_.integrated()).c_str(),
+              Number(meter_.true_peak()).c_str());
+  }
+
+  bool WriteSidecar() {
+    FILE* file = NULL;
+#ifdef _MSC_VER
+    if (::fopen_s(&file, sidecar_path_.c_str(), "w") != 0) {
+      file = NULL;
+    }
+#else
+    file = ::fopen(sidecar_path_.c_str(), "w");
+#endif
+    if (file == NULL) {
+      return false;
+    }
+    int written = ::fprintf(
+        file,
+        "{\n"
+        "  \"duration\": %.3f,\n"
+        "  \"integrated\": %s,\n"
+        "  \"max_momentary\": %s,\n"
+        "  \"max_short_term\": %s,\n"
+        "  \"true_peak\": %s,\n"
+        "  \"unmetered_frames\": %llu\n"
+        "}\n",
+        meter_.seconds(), Number(meter_.integrated()).c_str(),
+        Number(meter_.max_momentary()).c_str(),
+        Number(meter_.max_short_term()).c_str(),
+        Number(meter_.true_peak()).c_str(),
+        (unsigned long long)dropped_frames_);
+    return ::fclose(file) == 0 && written > 0;
+  }
+
+  std::shared_ptr<WorkerPool> pool_;
+  double report_seconds_;
+  double next_report_;
+  std::string sidecar_path_;
+
+  std::mutex mutex_;
+  std::condition_variable idle_;
+  std::deque<Chunk> queue_;
+  size_t queued_ = 0;
+  bool scheduled_ = false;
+  bool closed_ = false;
+  uint64_t dropped_frames_ = 0;
+
+  // Used by the pool task only.
+  LoudnessMeter meter_;
+  AudioFormat format_;
+  bool has_format_ = false;
+  std::vector<float> floats_;
+};
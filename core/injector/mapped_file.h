@@ -0,0 +1,193 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Output file written through a sliding memory-mapped window. Storage is
+// reserved ahead of the window in large extents, which keeps the file in few
+// fragments and lets the page cache absorb writes without a syscall each.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  ~MappedFile() { Close(); }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool Create(const std::string& path) {
+    Close();
+#ifdef _WIN32
+    file_ = ::CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+                          FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                          FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_ == INVALID_HANDLE_VALUE) {
+      file_ = NULL;
+      return false;
+    }
+#else
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      return false;
+    }
+#endif
+    allocated_ = 0;
+    return true;
+  }
+
+  bool is_open() const {
+#ifdef _WIN32
+    return file_ != NULL;
+#else
+    return fd_ >= 0;
+#endif
+  }
+
+  // Alignment required for Map() offsets.
+  static size_t granularity() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    ::GetSystemInfo(&info);
+    return info.dwAllocationGranularity;
+#else
+    return static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+#endif
+  }
+
+  // Makes sure at least |size| bytes of the file are backed by storage.
+  bool Reserve(uint64_t size) {
+    if (size <= allocated_) {
+      return true;
+    }
+#ifdef _WIN32
+    FILE_ALLOCATION_INFO alloc;
+    alloc.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+    ::SetFileInformationByHandle(file_, FileAllocationInfo, &alloc,
+                                 sizeof(alloc));
+    FILE_END_OF_FILE_INFO eof;
+    eof.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+    if (!::SetFileInformationByHandle(file_, FileEndOfFileInfo, &eof,
+                                      sizeof(eof))) {
+      return false;
+    }
+#else
+    if (::posix_fallocate(fd_, static_cast<off_t>(allocated_),
+                          static_cast<off_t>(size - allocated_)) != 0 &&
+        ::ftruncate(fd_, static_cast<off_t>(size)) != 0) {
+      return false;
+    }
+#endif
+    allocated_ = size;
+    return true;
+  }
+
+  // Maps [offset, offset + size) of the reserved part of the file, replacing
+  // the previous window. |offset| must be a multiple of granularity().
+  uint8_t* Map(uint64_t offset, size_t size) {
+    Unmap();
+#ifdef _WIN32
+    uint64_t end = offset + size;
+    mapping_ = ::CreateFileMappingA(file_, NULL, PAGE_READWRITE,
+                                    static_cast<DWORD>(end >> 32),
+                                    static_cast<DWORD>(end), NULL);
+    if (mapping_ == NULL) {
+      return nullptr;
+    }
+    view_ = static_cast<uint8_t*>(::MapViewOfFile(
+        mapping_, FILE_MAP_WRITE, static_cast<DWORD>(offset >> 32),
+        static_cast<DWORD>(offset), size));
+#else
+    void* ptr = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_,
+                       static_cast<off_t>(offset));
+    view_ = ptr == MAP_FAILED ? nullptr : static_cast<uint8_t*>(ptr);
+#endif
+    view_size_ = view_ != nullptr ? size : 0;
+    return view_;
+  }
+
+  // Writes outside the mapped window, e.g. to patch a header.
+  bool WriteAt(uint64_t offset, const void* data, size_t size) {
+#ifdef _WIN32
+    OVERLAPPED overlapped{};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD written = 0;
+    return ::WriteFile(file_, data, static_cast<DWORD>(size), &written,
+                       &overlapped) &&
+           written == size;
+#else
+    return ::pwrite(fd_, data, size, static_cast<off_t>(offset)) ==
+           static_cast<ssize_t>(size);
+#endif
+  }
+
+  // Unmaps the window and cuts the file to |size|, giving back whatever was
+  // reserved beyond it.
+  bool Truncate(uint64_t size) {
+    Unmap();
+#ifdef _WIN32
+    FILE_END_OF_FILE_INFO eof;
+    eof.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+    bool ok = ::SetFileInformationByHandle(file_, FileEndOfFileInfo, &eof,
+                                           sizeof(eof)) != FALSE;
+#else
+    bool ok = ::ftruncate(fd_, static_cast<off_t>(size)) == 0;
+#endif
+    allocated_ = size;
+    return ok;
+  }
+
+  void Close() {
+    Unmap();
+#ifdef _WIN32
+    if (file_ != NULL) {
+      ::CloseHandle(file_);
+      file_ = NULL;
+    }
+#else
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+#endif
+  }
+
+ private:
+  void Unmap() {
+#ifdef _WIN32
+    if (view_ != nullptr) {
+      ::UnmapViewOfFile(view_);
+    }
+    if (mapping_ != NULL) {
+      ::CloseHandle(mapping_);
+      mapping_ = NULL;
+    }
+#else
+    if (view_ != nullptr) {
+      ::munmap(view_, view_size_);
+    }
+#endif
+    view_ = nullptr;
+    view_size_ = 0;
+  }
+
+#ifdef _WIN32
+  HANDLE file_ = NULL;
+  HANDLE mapping_ = NULL;
+#else
+  int fd_ = -1;
+#endif
+  uint8_t* view_ = nullptr;
+  size_t view_size_ = 0;
+  uint64_t allocated_ = 0;
+};
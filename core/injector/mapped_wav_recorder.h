@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "../inject/protocol.h"
+#include "mapped_file.h"
+#include "recorder.h"
+
+// Writes a WAV file through a MappedFile: PCM is copied straight from the
+// receive buffer into the page cache with no stdio or dr_wav in between.
+// Storage is reserved kExtentSize at a time ahead of the write cursor, and the
+// file is cut to its real length on Close(). The header is rewritten on idle,
+// so a recording that is killed stays playable up to that point.
+class MappedWavRecorder : public Recorder {
+ public:
+  static constexpr size_t kHeaderSize = 44;
+  static constexpr size_t kWindowSize = 16 * 1024 * 1024;
+  static constexpr uint64_t kExtentSize = 64 * 1024 * 1024;
+  // How stale the on-disk header may get before Idle() rewrites it.
+  static constexpr std::chrono::milliseconds kMaxHeaderAge{1000};
+
+  ~MappedWavRecorder() override { Close(); }
+
+  bool Open(const std::string& path, const AudioFormat& format) override {
+    Close();
+    if (!file_.Create(path)) {
+      return false;
+    }
+    format_ = format;
+    bytes_ = 0;
+    header_written_ = 0;
+    window_ = nullptr;
+    window_offset_ = 0;
+    window_size_ = 0;
+    if (!WriteHeader()) {
+      file_.Close();
+      return false;
+    }
+    return true;
+  }
+
+  bool is_open() const override { return file_.is_open(); }
+  const AudioFormat& format() const override { return format_; }
+  uint64_t bytes() const override { return bytes_; }
+
+  // Preallocates the whole recording and maps the first window, so the first
+  // writes do not pay for it.
+  void Reserve(uint64_t bytes) override {
+    uint64_t size = kHeaderSize + bytes;
+    file_.Reserve((size + kExtentSize - 1) / kExtentSize * kExtentSize);
+    if (window_ == nullptr) {
+      MoveWindow(kHeaderSize + bytes_);
+    }
+  }
+
+  bool Write(const uint8_t* data, size_t size) override {
+    if (size > 0 && header_written_ == bytes_) {
+      stale_since_ = std::chrono::steady_clock::now();
+    }
+    while (size > 0) {
+      uint64_t cursor = kHeaderSize + bytes_;
+      if (window_ == nullptr || cursor >= window_offset_ + window_size_) {
+        if (!MoveWindow(cursor)) {
+          return false;
+        }
+      }
+      size_t offset = static_cast<size_t>(cursor - window_offset_);
+      size_t n = std::min(size, window_size_ - offset);
+      ::memcpy(window_ + offset, data, n);
+      bytes_ += n;
+      data += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  // The file beyond the cursor has never been written and reads as zeros,
+  // so silence only moves the cursor: no page is touched or dirtied. 8-bit
+  // PCM is unsigned and still has to be written.
+  bool WriteSilence(uint64_t frames) override {
+    if (SilenceByte(format_) != 0) {
+      return Recorder::WriteSilence(frames);
+    }
+    uint64_t size = frames * format_.block_align();
+    if (size > 0 && header_written_ == bytes_) {
+      stale_since_ = std::chrono::steady_clock::now();
+    }
+    bytes_ += size;
+    return true;
+  }
+
+  // Rewrites the header once it has lagged the data for kMaxHeaderAge, and
+  // returns true while it still lags.
+  bool Idle() override {
+    if (!is_open() || header_written_ == bytes_) {
+      return false;
+    }
+    if (std::chrono::steady_clock::now() - stale_since_ >= kMaxHeaderAge) {
+      WriteHeader();
+    }
+    return header_written_ != bytes_;
+  }
+
+  void Close() override {
+    if (!is_open()) {
+      return;
+    }
+    // RIFF chunks are padded to an even size.
+    uint64_t size = kHeaderSize + bytes_;
+    if (size & 1) {
+      uint8_t pad = 0;
+      file_.WriteAt(size, &pad, 1);
+      ++size;
+    }
+    window_ = nullptr;
+    file_.Truncate(size);
+    WriteHeader();
+    file_.Close();
+  }
+
+ private:
+  bool MoveWindow(uint64_t cursor) {
+    uint64_t granularity = MappedFile::granularity();
+    uint64_t offset = cursor / granularity * granularity;
+    uint64_t end = offset + kWindowSize;
+    if (!file_.Reserve((end + kExtentSize - 1) / kExtentSize * kExtentSize)) {
+      return false;
+    }
+    window_ = file_.Map(offset, kWindowSize);
+    window_offset_ = offset;
+    window_size_ = window_ != nullptr ? kWindowSize : 0;
+    return window_ != nullptr;
+  }
+
+  bool WriteHeader() {
+    uint64_t data_size = bytes_;
+    uint32_t data32 =
+        data_size > 0xFFFFFFFF - 36 ? 0xFFFFFFFF - 36 : (uint32_t)data_size;
+    uint32_t riff32 = 36 + data32 + (data32 & 1);
+    uint16_t tag = format_.sample_type == SampleType::kFloat ? 3 : 1;
+    uint16_t channels = format_.channels;
+    uint32_t rate = format_.sampling_rate;
+    uint16_t align = static_cast<uint16_t>(format_.block_align());
+    uint32_t byte_rate = rate * align;
+    uint16_t bits = format_.bits_per_sample;
+    uint32_t fmt_size = 16;
+
+    uint8_t h[kHeaderSize];
+    ::memcpy(h + 0, "RIFF", 4);
+    ::memcpy(h + 4, &riff32, 4);
+    ::memcpy(h + 8, "WAVEfmt ", 8);
+    ::memcpy(h + 16, &fmt_size, 4);
+    ::memcpy(h + 20, &tag, 2);
+    ::memcpy(h + 22, &channels, 2);
+    ::memcpy(h + 24, &rate, 4);
+    ::memcpy(h + 28, &byte_rate, 4);
+    ::memcpy(h + 32, &align, 2);
+    ::memcpy(h + 34, &bits, 2);
+    ::memcpy(h + 36, "data", 4);
+    ::memcpy(h + 40, &data32, 4);
+    if (!file_.WriteAt(0, h, kHeaderSize)) {
+      return false;
+    }
+    header_written_ = bytes_;
+    return true;
+  }
+
+  MappedFile file_;
+  AudioFormat format_;
+  uint64_t bytes_ = 0;
+  uint8_t* window_ = nullptr;
+  uint64_t window_offset_ = 0;
+  size_t window_size_ = 0;
+
+  // Data size the on-disk header describes, and since when it is stale.
+  uint64_t header_written_ = 0;
+  std::chrono::steady_clock::time_point stale_since_;
+};
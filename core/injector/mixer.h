@@ -0,0 +1,586 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../inject/protocol.h"
+#include "CLI11.hpp"
+#include "convert.h"
+#include "loguru.hpp"
+#include "remix.h"
+#include "resampler.h"
+
+// Mixes several captured streams into one, on the timeline their packet
+// timestamps describe. Every source is converted to float, remixed to the
+// mix channel count and resampled to the mix rate, and queued at the output
+// frame its timestamp maps to. Pump() mixes up to the point every live
+// source has delivered, but never waits for one longer than the latency:
+// past that it counts as silent until it catches up.
+//
+// Sources run on their own device clocks, so they drift against the
+// timeline by a few frames a second. The gap between where a packet lands
+// and where its timestamp says it belongs is smoothed over packets and
+// steers the source's resampling ratio by up to kMaxAdjust: in proportion
+// to the error, which takes it out over about kCorrectionSeconds without
+// audible pitch change, plus a slowly integrated estimate of the clock's
+// rate offset, so a constant drift leaves no residual error. A jump
+// past kRealignSeconds, e.g. after the application stopped rendering, is
+// closed at once by inserting silence or dropping audio.
+//
+// The timeline is the capture timestamps, not the wall clock, so a replayed
+// trace mixes the same as it did live. Packets without a timestamp (wire
+// version 1) are queued back to back.
+namespace mixer_internal {
+
+using AccumulateKernel = void (*)(float* out, const float* in, size_t count,
+                                  float gain);
+
+inline void AccumulateScalar(float* out, const float* in, size_t count,
+                             float gain) {
+  for (size_t i = 0; i < count; ++i) {
+    out[i] += gain * in[i];
+  }
+}
+
+#ifdef CONVERT_X86
+
+CONVERT_TARGET("sse2")
+inline void AccumulateSse2(float* out, const float* in, size_t count,
+                           float gain) {
+  const __m128 g = _mm_set1_ps(gain);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128 a = _mm_loadu_ps(in + i);
+    __m128 b = _mm_loadu_ps(in + i + 4);
+    _mm_storeu_ps(out + i,
+                  _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(a, g)));
+    _mm_storeu_ps(out + i + 4,
+                  _mm_add_ps(_mm_loadu_ps(out + i + 4), _mm_mul_ps(b, g)));
+  }
+  AccumulateScalar(out + i, in + i, count - i, gain);
+}
+
+#endif  // CONVERT_X86
+
+inline AccumulateKernel DefaultAccumulateKernel() {
+#ifdef CONVERT_X86
+  if (convert_internal::CpuSupports(ConvertIsa::kSse2)) {
+    return &AccumulateSse2;
+  }
+#endif
+  return &AccumulateScalar;
+}
+
+// Gain moving linearly from |from| to |to| over |frames| frames, so a gain
+// change or mute does not click.
+inline void AccumulateRamp(float* out, const float* in, size_t frames,
+                           int channels, float from, float to) {
+  float step = (to - from) / static_cast<float>(frames);
+  for (size_t i = 0; i < frames; ++i) {
+    float gain = from + step * static_cast<float>(i + 1);
+    for (int c = 0; c < channels; ++c) {
+      *out++ += gain * *in++;
+    }
+  }
+}
+
+// Interleaved frames waiting to be mixed. The first one belongs at the
+// mixer's current output frame.
+class FrameQueue {
+ public:
+  void Reset(int channels) {
+    channels_ = channels;
+    samples_.clear();
+    head_ = 0;
+  }
+
+  size_t frames() const { return (samples_.size() - head_) / channels_; }
+  const float* data() const { return samples_.data() + head_; }
+
+  void Append(const float* pcm, size_t frames) {
+    Compact();
+    samples_.insert(samples_.end(), pcm, pcm + frames * channels_);
+  }
+
+  // Removes |frames| frames from the front.
+  void Pop(size_t frames) {
+    head_ += std::min(frames, this->frames()) * channels_;
+  }
+
+  // Removes |frames| frames from the back.
+  void Trim(size_t frames) {
+    samples_.resize(samples_.size() - std::min(frames, this->frames()) *
+                                          channels_);
+  }
+
+ private:
+  // Mixed frames are dropped once they make up half the buffer, so appending
+  // stays amortised O(1) without a ring.
+  void Compact() {
+    if (head_ != 0 && head_ >= samples_.size() / 2) {
+      samples_.erase(samples_.begin(), samples_.begin() + head_);
+      head_ = 0;
+    }
+  }
+
+  int channels_ = 1;
+  std::vector<float> samples_;
+  size_t head_ = 0;
+};
+
+}  // namespace mixer_internal
+
+class Mixer {
+ public:
+  struct Options {
+    bool enabled = false;
+    double latency_ms = 200;
+    // NAME=DB pairs and names, matched as substrings of the source name.
+    std::vector<std::string> gains;
+    std::vector<std::string> mutes;
+  };
+
+  static void AddOptions(CLI::App& app, Options* options) {
+    app.add_flag("--mix", options->enabled,
+                 "mix every stream into one file, aligned by capture time, "
+                 "at --rate and --channels (default: 48000 Hz, stereo)");
+    app.add_option("--mix-latency", options->latency_ms,
+                   "how long to wait for a late stream before mixing it as "
+                   "silent, in ms")
+        ->check(CLI::Range(1.0, 10000.0));
+    app.add_option("--mix-gain", options->gains,
+                   "gain of the streams whose name contains NAME: NAME=DB "
+                   "(repeatable)")
+        ->check([](const std::string& text) {
+          double db;
+          return ParseGain(text, nullptr, &db) ? std::string()
+                                               : "expected NAME=DB";
+        });
+    app.add_option("--mix-mute", options->mutes,
+                   "mute the streams whose name contains NAME (repeatable)");
+  }
+
+  // Splits "NAME=DB".
+  static bool ParseGain(const std::string& text, std::string* name,
+                        double* db) {
+    size_t equals = text.rfind('=');
+    if (equals == std::string::npos || equals == 0) {
+      return false;
+    }
+    const char* value = text.c_str() + equals + 1;
+    char* end = nullptr;
+    *db = std::strtod(value, &end);
+    if (end == value || *end != '\0') {
+      return false;
+    }
+    if (name != nullptr) {
+      *name = text.substr(0, equals);
+    }
+    return true;
+  }
+
+  // Linear gain |options| gives a source called |name|; 0 if it is muted.
+  static float GainFor(const Options& options, const std::string& name) {
+    for (const std::string& mute : options.mutes) {
+      if (name.find(mute) != std::string::npos) {
+        return 0.0f;
+      }
+    }
+    double gain = 1.0;
+    for (const std::string& text : options.gains) {
+      std::string pattern;
+      double db;
+      if (ParseGain(text, &pattern, &db) &&
+          name.find(pattern) != std::string::npos) {
+        gain = std::pow(10.0, db / 20.0);
+      }
+    }
+    return static_cast<float>(gain);
+  }
+
+  // Receives the mix as float packets, e.g. Pipeline::Write.
+  using Sink = std::function<void(const Packet&)>;
+
+  static constexpr size_t kBlockFrames = 1024;
+  static constexpr double kMaxAdjust = 0.002;
+  static constexpr double kCorrectionSeconds = 5;
+  // Weight of each new packet in the smoothed position error.
+  static constexpr double kErrorSmoothing = 0.01;
+  static constexpr double kRealignSeconds = 0.05;
+  // When no source has sent anything for this long, the pause is left out
+  // of the mix, as it is left out of a single recording.
+  static constexpr double kMaxStallSeconds = 2;
+  // A source never holds more than this ahead of the others.
+  static constexpr double kMaxQueuedSeconds = 10;
+
+  Mixer(uint32_t rate, uint16_t channels, double latency_ms,
+        ResampleQuality quality, Sink sink)
+      : quality_(quality),
+        latency_frames_(latency_ms * rate / 1000.0),
+        sink_(std::move(sink)),
+        accumulate_(mixer_internal::DefaultAccumulateKernel()) {
+    format_.channels = channels;
+    format_.bits_per_sample = 32;
+    format_.sampling_rate = rate;
+    format_.sample_type = SampleType::kFloat;
+    format_.channel_mask = DefaultChannelMask(channels);
+  }
+
+  Mixer(const Mixer&) = delete;
+  Mixer& operator=(const Mixer&) = delete;
+
+  // Returns the index to pass to the other calls. Sources can be added at
+  // any time; they join at the frame their first timestamp maps to.
+  size_t AddSource(std::string name, float gain = 1.0f) {
+    auto source = std::make_unique<Source>();
+    source->name = std::move(name);
+    source->gain = gain;
+    source->applied_gain = gain;
+    source->queue.Reset(format_.channels);
+    sources_.push_back(std::move(source));
+    return sources_.size() - 1;
+  }
+
+  const std::string& name(size_t source) const {
+    return sources_[source]->name;
+  }
+  float gain(size_t source) const { return sources_[source]->gain; }
+
+  // Gain changes take effect over one block.
+  void SetGain(size_t source, float gain) { sources_[source]->gain = gain; }
+  void SetMute(size_t source, bool muted) {
+    sources_[source]->muted = muted;
+  }
+
+  // Queues a packet of source |index| where its timestamp puts it.
+  void Write(size_t index, const Packet& packet) {
+    Source& source = *sources_[index];
+    if (source.ended) {
+      return;
+    }
+    const AudioFormat& format = *packet.format;
+    if (source.format != format) {
+      SetFormat(source, format);
+    }
+    if (!source.usable) {
+      return;
+    }
+    size_t skip = 0;
+    if (packet.timestamp_ns != 0) {
+      Advance(packet.timestamp_ns);
+      skip = Align(source, packet.timestamp_ns,
+                   double(packet.frames) / source.format.sampling_rate);
+      skip = std::min<size_t>(skip, packet.frames);
+      source.dropped_frames += static_cast<uint64_t>(
+          skip * source.resampler.ratio() + 0.5);
+    }
+    Feed(source, packet, skip);
+  }
+
+  // The source will send nothing more; what it queued is still mixed.
+  void End(size_t index) {
+    Source& source = *sources_[index];
+    if (source.ended) {
+      return;
+    }
+    source.ended = true;
+    if (source.usable) {
+      source.resampled.clear();
+      source.resampler.Flush(&source.resampled);
+      source.queue.Append(source.resampled.data(),
+                          source.resampled.size() / format_.channels);
+    }
+    DLOG_F(INFO,
+           "mix source %s: %llu frames late, %llu frames of silence "
+           "inserted, %llu frames dropped, clock off by %.0f ppm.",
+           source.name.c_str(), (unsigned long long)source.late_frames,
+           (unsigned long long)source.inserted_frames,
+           (unsigned long long)source.dropped_frames, source.drift * 1e6);
+  }
+
+  // Mixes everything that is due, and passes it to the sink.
+  void Pump() {
+    double deadline = -1;
+    if (start_ns_ != 0) {
+      deadline = (last_ns_ - start_ns_) * 1e-9 * format_.sampling_rate -
+                 latency_frames_;
+    }
+    uint64_t target = UINT64_MAX;
+    uint64_t longest = position_;
+    for (const std::unique_ptr<Source>& source : sources_) {
+      uint64_t end = position_ + source->queue.frames();
+      longest = std::max(longest, end);
+      if (!source->ended) {
+        target = std::min(target, std::max(end, Frame(deadline)));
+      }
+    }
+    if (target == UINT64_MAX) {
+      target = Frame(deadline);
+    }
+    uint64_t queued_limit = static_cast<uint64_t>(
+        kMaxQueuedSeconds * format_.sampling_rate);
+    if (longest > queued_limit) {
+      target = std::max(target, longest - queued_limit);
+    }
+    if (target > position_) {
+      Mix(target - position_);
+    }
+  }
+
+  // Mixes everything queued, after the last source has ended.
+  void Flush() {
+    uint64_t longest = position_;
+    for (const std::unique_ptr<Source>& source : sources_) {
+      longest = std::max<uint64_t>(longest,
+                                   position_ + source->queue.frames());
+    }
+    Mix(longest - position_);
+  }
+
+  const AudioFormat& format() const { return format_; }
+  // Frames mixed so far.
+  uint64_t frames() const { return position_; }
+
+ private:
+  struct Source {
+    std::string name;
+    float gain = 1.0f;
+    bool muted = false;
+    // The gain the last block ended at.
+    float applied_gain = 1.0f;
+    bool ended = false;
+
+    AudioFormat format;
+    SampleEncoding encoding = SampleEncoding::kUnknown;
+    bool usable = false;
+    bool remix = false;
+    Remixer remixer;
+    VariableResampler resampler;
+    mixer_internal::FrameQueue queue;
+    std::vector<float> floats;
+    std::vector<float> remixed;
+    std::vector<float> resampled;
+
+    bool aligned = false;
+    // Smoothed distance, in output frames, from where packets land to where
+    // their timestamps say they belong; positive when they land late.
+    double error = 0;
+    // Integrated rate offset of the source clock; positive when it runs
+    // slow, so its audio has to be shortened.
+    double drift = 0;
+
+    // Frames mixed as silence because the source had not delivered yet.
+    uint64_t late_frames = 0;
+    uint64_t inserted_frames = 0;
+    uint64_t dropped_frames = 0;
+  };
+
+  static double Clamp(double adjust) {
+    return std::min(std::max(adjust, -kMaxAdjust), kMaxAdjust);
+  }
+
+  static uint64_t Frame(double position) {
+    return position > 0 ? static_cast<uint64_t>(position) : 0;
+  }
+
+  void SetFormat(Source& source, const AudioFormat& format) {
+    bool rate_changed = !source.usable ||
+                        format.sampling_rate != source.format.sampling_rate;
+    if (source.usable && rate_changed) {
+      source.resampled.clear();
+      source.resampler.Flush(&source.resampled);
+      source.queue.Append(source.resampled.data(),
+                          source.resampled.size() / format_.channels);
+    }
+    source.format = format;
+    source.encoding = EncodingOf(format);
+    source.usable = source.encoding != SampleEncoding::kUnknown &&
+                    format.channels != 0 && format.sampling_rate != 0;
+    if (!source.usable) {
+      DLOG_F(WARNING, "mix source %s: cannot mix %u-bit samples.",
+             source.name.c_str(), format.bits_per_sample);
+      return;
+    }
+    source.remix = format.channels != format_.channels;
+    if (source.remix) {
+      source.remixer.Reset(
+          RemixMatrix::Preset(format.channels, format_.channels));
+    }
+    if (rate_changed) {
+      source.resampler.Reset(format.sampling_rate, format_.sampling_rate,
+                             format_.channels, quality_);
+    }
+  }
+
+  // Moves the timeline on to |timestamp_ns|.
+  void Advance(uint64_t timestamp_ns) {
+    if (start_ns_ == 0) {
+      start_ns_ = timestamp_ns;
+      last_ns_ = timestamp_ns;
+    }
+    if (timestamp_ns > last_ns_ + uint64_t(kMaxStallSeconds * 1e9)) {
+      start_ns_ += timestamp_ns - last_ns_;
+    }
+    last_ns_ = std::max(last_ns_, timestamp_ns);
+  }
+
+  // Steers |source| towards where a packet stamped |timestamp_ns|, lasting
+  // |seconds|, belongs. Returns how many of its frames to drop.
+  size_t Align(Source& source, uint64_t timestamp_ns, double seconds) {
+    double rate = format_.sampling_rate;
+    double ideal =
+        (double(timestamp_ns) - double(start_ns_)) * 1e-9 * rate;
+    double ratio = source.resampler.ratio();
+    double actual = double(position_) + double(source.queue.frames()) +
+                    source.resampler.pending() * ratio;
+    double error = actual - ideal;
+    if (source.aligned && std::abs(error) <= kRealignSeconds * rate) {
+      source.error += kErrorSmoothing * (error - source.error);
+      // Critically damped: the integral gain is a quarter of the
+      // proportional one squared.
+      const double tc = kCorrectionSeconds;
+      source.drift = Clamp(
+          source.drift + source.error * seconds / (4 * tc * tc * rate));
+      double adjust = Clamp(source.error / (tc * rate) + source.drift);
+      source.resampler.set_adjust(1.0 - adjust);
+      return 0;
+    }
+    // Too far off to steer: close the gap now. The drift estimate stays.
+    source.aligned = true;
+    source.error = 0;
+    source.resampler.set_adjust(1.0 - source.drift);
+    ratio = source.resampler.ratio();
+    if (error < 0) {
+      double limit = kMaxQueuedSeconds * rate;
+      size_t frames =
+          static_cast<size_t>(std::min(-error, limit) / ratio + 0.5);
+      source.inserted_frames += static_cast<uint64_t>(frames * ratio + 0.5);
+      source.floats.assign(std::min<size_t>(frames, 4096) * format_.channels,
+                           0.0f);
+      for (size_t done = 0; done < frames;) {
+        size_t n = std::min<size_t>(frames - done, 4096);
+        Resample(source, source.floats.data(), n);
+        done += n;
+      }
+      return 0;
+    }
+    size_t trim = std::min(static_cast<size_t>(error), source.queue.frames());
+    source.queue.Trim(trim);
+    source.dropped_frames += trim;
+    return static_cast<size_t>((error - trim) / ratio + 0.5);
+  }
+
+  // Decodes a packet a few thousand frames at a time and queues it, less
+  // its first |skip| frames.
+  void Feed(Source& source, const Packet& packet, size_t skip) {
+    const size_t step = 4096;
+    int channels = source.format.channels;
+    size_t frame_size = source.format.block_align();
+    bool silent = (packet.flags & kPacketSilent) != 0;
+    source.floats.resize(step * std::max<int>(channels, format_.channels));
+    for (size_t done = skip; done < packet.frames;) {
+      size_t n = std::min<size_t>(packet.frames - done, step);
+      if (silent) {
+        std::fill(source.floats.begin(),
+                  source.floats.begin() + n * format_.channels, 0.0f);
+        Resample(source, source.floats.data(), n);
+      } else {
+        ConvertSamples(SampleEncoding::kF32, source.floats.data(),
+                       source.encoding, packet.data + done * frame_size,
+                       n * channels);
+        const float* pcm = source.floats.data();
+        if (source.remix) {
+          source.remixed.resize(n * format_.channels);
+          source.remixer.Process(pcm, source.remixed.data(), n);
+          pcm = source.remixed.data();
+        }
+        Resample(source, pcm, n);
+      }
+      done += n;
+    }
+  }
+
+  // |pcm| has the mix channel count.
+  void Resample(Source& source, const float* pcm, size_t frames) {
+    source.resampled.clear();
+    source.resampler.Process(pcm, frames, &source.resampled);
+    source.queue.Append(source.resampled.data(),
+                        source.resampled.size() / format_.channels);
+  }
+
+  void Mix(uint64_t frames) {
+    int channels = format_.channels;
+    while (frames > 0) {
+      size_t n = static_cast<size_t>(std::min<uint64_t>(frames, kBlockFrames));
+      mix_.assign(n * channels, 0.0f);
+      bool audible = false;
+      for (const std::unique_ptr<Source>& source : sources_) {
+        size_t queued = std::min(n, source->queue.frames());
+        if (queued < n && !source->ended && source->aligned) {
+          source->late_frames += n - queued;
+        }
+        float gain = source->muted ? 0.0f : source->gain;
+        float from = source->applied_gain;
+        source->applied_gain = gain;
+        if (queued == 0 || (gain == 0.0f && from == 0.0f)) {
+          source->queue.Pop(queued);
+          continue;
+        }
+        if (gain != from) {
+          mixer_internal::AccumulateRamp(mix_.data(), source->queue.data(),
+                                         queued, channels, from, gain);
+        } else {
+          accumulate_(mix_.data(), source->queue.data(), queued * channels,
+                      gain);
+        }
+        source->queue.Pop(queued);
+        audible = true;
+      }
+      Emit(n, audible);
+      frames -= n;
+    }
+  }
+
+  void Emit(size_t frames, bool audible) {
+    Packet packet{};
+    packet.format = &format_;
+    packet.data = audible ? reinterpret_cast<const uint8_t*>(mix_.data())
+                          : nullptr;
+    packet.size = audible ? mix_.size() * sizeof(float) : 0;
+    packet.frames = static_cast<uint32_t>(frames);
+    packet.flags = audible ? 0 : kPacketSilent;
+    packet.sequence = sequence_++;
+    packet.position = position_;
+    packet.timestamp_ns =
+        start_ns_ != 0
+            ? start_ns_ + static_cast<uint64_t>(
+                              position_ * 1e9 / format_.sampling_rate)
+            : 0;
+    packet.discontinuity = false;
+    position_ += frames;
+    sink_(packet);
+  }
+
+  AudioFormat format_;
+  ResampleQuality quality_;
+  double latency_frames_;
+  Sink sink_;
+  mixer_internal::AccumulateKernel accumulate_;
+  std::vector<std::unique_ptr<Source>> sources_;
+
+  // Timestamp of output frame 0, moved on past pauses, and the newest
+  // timestamp seen.
+  uint64_t start_ns_ = 0;
+  uint64_t last_ns_ = 0;
+  uint64_t position_ = 0;
+  uint64_t sequence_ = 0;
+  std::vector<float> mix_;
+};
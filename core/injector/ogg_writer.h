@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Minimal Ogg muxer for a single logical stream. Packets are gathered into
+// pages of about kPageSize bytes; a page is written as soon as it fills, so
+// the file on disk lags the encoder by at most one page.
+class OggWriter {
+ public:
+  static constexpr size_t kPageSize = 4096;
+
+  explicit OggWriter(uint32_t serial) : serial_(serial) {}
+
+  void set_file(FILE* file) { file_ = file; }
+
+  // Adds a packet that ends at |granule|. Header packets are given their own
+  // page by calling Flush() after them.
+  bool AddPacket(const uint8_t* data, size_t size, int64_t granule) {
+    // A packet of n bytes takes n / 255 + 1 lacing values.
+    size_t lacing = size / 255 + 1;
+    if (segments_.size() + lacing > 255 && !WritePage(false)) {
+      return false;
+    }
+    for (size_t left = size;; left -= 255) {
+      segments_.push_back(static_cast<uint8_t>(left < 255 ? left : 255));
+      if (left < 255) {
+        break;
+      }
+    }
+    body_.insert(body_.end(), data, data + size);
+    granule_ = granule;
+    if (body_.size() >= kPageSize) {
+      return WritePage(false);
+    }
+    return true;
+  }
+
+  // Writes out the pending packets, if any.
+  bool Flush() { return segments_.empty() || WritePage(false); }
+
+  // Writes the last page with the end-of-stream flag and |granule|, which
+  // may be smaller than the last packet's to trim padding.
+  bool Finish(int64_t granule) {
+    granule_ = granule;
+    return WritePage(true);
+  }
+
+ private:
+  static uint32_t Crc(const uint8_t* data, size_t size, uint32_t crc) {
+    static const auto table = [] {
+      std::vector<uint32_t> t(256);
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t r = i << 24;
+        for (int k = 0; k < 8; ++k) {
+          r = (r & 0x80000000u) ? (r << 1) ^ 0x04C11DB7u : r << 1;
+        }
+        t[i] = r;
+      }
+      return t;
+    }();
+    for (size_t i = 0; i < size; ++i) {
+      crc = (crc << 8) ^ table[(crc >> 24) ^ data[i]];
+    }
+    return crc;
+  }
+
+  bool WritePage(bool last) {
+    uint8_t header[27 + 255];
+    ::memcpy(header, "OggS", 4);
+    header[4] = 0;
+    header[5] = static_cast<uint8_t>((sequence_ == 0 ? 0x02 : 0) |
+                                     (last ? 0x04 : 0));
+    for (int i = 0; i < 8; ++i) {
+      header[6 + i] = static_cast<uint8_t>(uint64_t(granule_) >> (8 * i));
+    }
+    for (int i = 0; i < 4; ++i) {
+      header[14 + i] = static_cast<uint8_t>(serial_ >> (8 * i));
+      header[18 + i] = static_cast<uint8_t>(sequence_ >> (8 * i));
+      header[22 + i] = 0;
+    }
+    header[26] = static_cast<uint8_t>(segments_.size());
+    ::memcpy(header + 27, segments_.data(), segments_.size());
+    size_t header_size = 27 + segments_.size();
+
+    uint32_t crc = Crc(header, header_size, 0);
+    crc = Crc(body_.data(), body_.size(), crc);
+    for (int i = 0; i < 4; ++i) {
+      header[22 + i] = static_cast<uint8_t>(crc >> (8 * i));
+    }
+    bool ok = ::fwrite(header, 1, header_size, file_) == header_size &&
+              ::fwrite(body_.data(), 1, body_.size(), file_) == body_.size();
+    ++sequence_;
+    segments_.clear();
+    body_.clear();
+    return ok;
+  }
+
+  FILE* file_ = NULL;
+  uint32_t serial_;
+  uint32_t sequence_ = 0;
+  int64_t granule_ = 0;
+  std::vector<uint8_t> segments_;
+  std::vector<uint8_t> body_;
+};
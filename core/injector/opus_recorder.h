@@ -0,0 +1,324 @@
+#pragma once
+
+#ifdef AUDIOCAPTURE_WITH_OPUS
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opus_multistream.h>
+
+#include "../inject/protocol.h"
+#include "convert.h"
+#include "ogg_writer.h"
+#include "recorder.h"
+#include "resampler.h"
+#include "worker_pool.h"
+
+// Writes Opus in Ogg (RFC 7845) for compact long-running archives. Encoding
+// runs on a private single-thread WorkerPool, so it stays in order and off
+// the read thread. Write() only copies PCM into a block and hands full blocks
+// over, waiting only if kMaxBlocksInFlight blocks are already queued.
+//
+// Opus codes 48 kHz. The other rates it accepts (8-24 kHz) are passed
+// through; anything else goes through a Resampler to 48 kHz first. More
+// than two channels use the surround mapping (family 1, up to 8 channels).
+class OpusRecorder : public Recorder {
+ public:
+  static constexpr uint32_t kFrameMs = 20;
+  static constexpr uint32_t kBlockMs = 100;
+  static constexpr size_t kMaxBlocksInFlight = 16;
+  // Largest packet libopus produces per elementary stream.
+  static constexpr size_t kMaxPacketSize = 1275 * 3 + 7;
+
+  explicit OpusRecorder(uint32_t bitrate) : bitrate_(bitrate) {}
+  ~OpusRecorder() override { Close(); }
+  OpusRecorder(const OpusRecorder&) = delete;
+  OpusRecorder& operator=(const OpusRecorder&) = delete;
+
+  bool Open(const std::string& path, const AudioFormat& format) override {
+    Close();
+    source_ = EncodingOf(format);
+    if (source_ == SampleEncoding::kUnknown || format.channels < 1 ||
+        format.channels > 8) {
+      return false;
+    }
+    switch (format.sampling_rate) {
+      case 8000:
+      case 12000:
+      case 16000:
+      case 24000:
+      case 48000:
+        encoder_rate_ = format.sampling_rate;
+        resample_ = false;
+        break;
+      default:
+        encoder_rate_ = 48000;
+        resample_ = true;
+        resampler_.Reset(format.sampling_rate, 48000, format.channels);
+        break;
+    }
+
+    int error = OPUS_OK;
+    int streams = 0;
+    int coupled = 0;
+    uint8_t mapping[8];
+    family_ = format.channels > 2 ? 1 : 0;
+    encoder_ = opus_multistream_surround_encoder_create(
+        encoder_rate_, format.channels, family_, &streams, &coupled, mapping,
+        OPUS_APPLICATION_AUDIO, &error);
+    if (error != OPUS_OK || encoder_ == NULL) {
+      encoder_ = NULL;
+      return false;
+    }
+    opus_multistream_encoder_ctl(encoder_, OPUS_SET_BITRATE(bitrate_));
+    opus_int32 lookahead = 0;
+    opus_multistream_encoder_ctl(encoder_, OPUS_GET_LOOKAHEAD(&lookahead));
+    // Pre-skip is always counted at 48 kHz.
+    pre_skip_ = static_cast<uint32_t>(lookahead * (48000 / encoder_rate_));
+    streams_ = streams;
+
+#ifdef _MSC_VER
+    if (::fopen_s(&file_, path.c_str(), "wb") != 0) {
+      file_ = NULL;
+    }
+#else
+    file_ = ::fopen(path.c_str(), "wb");
+#endif
+    if (file_ == NULL) {
+      opus_multistream_encoder_destroy(encoder_);
+      encoder_ = NULL;
+      return false;
+    }
+    format_ = format;
+    bytes_ = 0;
+    input_frames_ = 0;
+    packets_ = 0;
+    in_flight_ = 0;
+    failed_ = false;
+    frame_size_ = encoder_rate_ * kFrameMs / 1000;
+    pending_.clear();
+    block_bytes_ =
+        format.sampling_rate * kBlockMs / 1000 * format.block_align();
+    block_.clear();
+    block_.reserve(block_bytes_);
+    ogg_ = std::make_unique<OggWriter>(static_cast<uint32_t>(
+        std::chrono::steady_clock::now().time_since_epoch().count()));
+    ogg_->set_file(file_);
+    if (!WriteHeaders(mapping, coupled)) {
+      Close();
+      return false;
+    }
+    worker_ = std::make_unique<WorkerPool>(1);
+    return true;
+  }
+
+  bool is_open() const override { return file_ != NULL; }
+  const AudioFormat& format() const override { return format_; }
+  uint64_t bytes() const override { return bytes_; }
+
+  bool Write(const uint8_t* data, size_t size) override {
+    while (size > 0) {
+      size_t n = std::min(size, block_bytes_ - block_.size());
+      block_.insert(block_.end(), data, data + n);
+      bytes_ += n;
+      data += n;
+      size -= n;
+      if (block_.size() == block_bytes_) {
+        Submit();
+      }
+    }
+    return !failed_;
+  }
+
+  // Hands over a partial block so quiet periods are encoded too, and returns
+  // true while the encoder still has work queued.
+  bool Idle() override {
+    if (!is_open()) {
+      return false;
+    }
+    if (!block_.empty()) {
+      Submit();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    return in_flight_ != 0;
+  }
+
+  void Close() override {
+    if (worker_ != nullptr) {
+      if (!block_.empty()) {
+        Submit();
+      }
+      worker_->Submit([this] { Finish(); });
+      worker_.reset();  // Runs everything queued, then joins.
+    }
+    if (encoder_ != NULL) {
+      opus_multistream_encoder_destroy(encoder_);
+      encoder_ = NULL;
+    }
+    if (file_ != NULL) {
+      ::fclose(file_);
+      file_ = NULL;
+    }
+    ogg_.reset();
+  }
+
+ private:
+  void Submit() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      drained_.wait(lock, [this] { return in_flight_ < kMaxBlocksInFlight; });
+      ++in_flight_;
+    }
+    auto block = std::make_shared<std::vector<uint8_t>>();
+    block->swap(block_);
+    block_.reserve(block_bytes_);
+    worker_->Submit([this, block] {
+      if (!Encode(block->data(), block->size())) {
+        failed_ = true;
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      --in_flight_;
+      drained_.notify_all();
+    });
+  }
+
+  // Encoder thread: converts, resamples and encodes whole 20 ms frames,
+  // keeping the remainder in |pending_| for the next block.
+  bool Encode(const uint8_t* data, size_t size) {
+    size_t samples = size / BytesPerSample(source_);
+    size_t frames = samples / format_.channels;
+    input_frames_ += frames;
+    floats_.resize(samples);
+    ConvertSamples(SampleEncoding::kF32, floats_.data(), source_, data,
+                   samples);
+    if (resample_) {
+      resampler_.Process(floats_.data(), frames, &pending_);
+    } else {
+      pending_.insert(pending_.end(), floats_.begin(), floats_.end());
+    }
+    return EncodeFrames(false);
+  }
+
+  bool EncodeFrames(bool flush) {
+    size_t frame_samples = frame_size_ * format_.channels;
+    size_t offset = 0;
+    bool ok = true;
+    while (ok && (pending_.size() - offset >= frame_samples ||
+                  (flush && offset < pending_.size()))) {
+      if (pending_.size() - offset < frame_samples) {
+        pending_.resize(offset + frame_samples, 0.0f);
+      }
+      ok = EncodeFrame(pending_.data() + offset);
+      offset += frame_samples;
+    }
+    pending_.erase(pending_.begin(), pending_.begin() + offset);
+    return ok;
+  }
+
+  bool EncodeFrame(const float* pcm) {
+    packet_.resize(kMaxPacketSize * streams_);
+    int n = opus_multistream_encode_float(
+        encoder_, pcm, frame_size_, packet_.data(),
+        static_cast<opus_int32>(packet_.size()));
+    if (n < 0) {
+      return false;
+    }
+    ++packets_;
+    int64_t granule = pre_skip_ + packets_ * (kFrameMs * 48);
+    return ogg_->AddPacket(packet_.data(), n, granule);
+  }
+
+  // Encoder thread: pads out the last frame, flushes the encoder's lookahead
+  // and ends the stream with a granule that trims the padding again.
+  void Finish() {
+    if (resample_) {
+      resampler_.Flush(&pending_);
+    }
+    bool ok = EncodeFrames(true);
+    std::vector<float> silence(frame_size_ * format_.channels, 0.0f);
+    for (uint32_t flushed = 0; ok && flushed < pre_skip_;
+         flushed += kFrameMs * 48) {
+      ok = EncodeFrame(silence.data());
+    }
+    uint64_t samples_48k = input_frames_ * 48000 / format_.sampling_rate;
+    ok = ogg_->Finish(static_cast<int64_t>(pre_skip_ + samples_48k)) && ok;
+    if (!ok) {
+      failed_ = true;
+    }
+  }
+
+  // OpusHead and OpusTags, each on a page of its own.
+  bool WriteHeaders(const uint8_t* mapping, int coupled) {
+    std::vector<uint8_t> head(19);
+    ::memcpy(head.data(), "OpusHead", 8);
+    head[8] = 1;
+    head[9] = static_cast<uint8_t>(format_.channels);
+    head[10] = static_cast<uint8_t>(pre_skip_);
+    head[11] = static_cast<uint8_t>(pre_skip_ >> 8);
+    for (int i = 0; i < 4; ++i) {
+      head[12 + i] = static_cast<uint8_t>(format_.sampling_rate >> (8 * i));
+    }
+    head[16] = 0;  // Output gain.
+    head[17] = 0;
+    head[18] = static_cast<uint8_t>(family_);
+    if (family_ != 0) {
+      head.push_back(static_cast<uint8_t>(streams_));
+      head.push_back(static_cast<uint8_t>(coupled));
+      head.insert(head.end(), mapping, mapping + format_.channels);
+    }
+
+    const char* vendor = opus_get_version_string();
+    uint32_t vendor_size = static_cast<uint32_t>(::strlen(vendor));
+    std::vector<uint8_t> tags(8 + 4 + vendor_size + 4);
+    ::memcpy(tags.data(), "OpusTags", 8);
+    for (int i = 0; i < 4; ++i) {
+      tags[8 + i] = static_cast<uint8_t>(vendor_size >> (8 * i));
+    }
+    ::memcpy(tags.data() + 12, vendor, vendor_size);
+
+    return ogg_->AddPacket(head.data(), head.size(), 0) && ogg_->Flush() &&
+           ogg_->AddPacket(tags.data(), tags.size(), 0) && ogg_->Flush();
+  }
+
+  uint32_t bitrate_;
+  FILE* file_ = NULL;
+  AudioFormat format_;
+  SampleEncoding source_ = SampleEncoding::kUnknown;
+  uint64_t bytes_ = 0;
+
+  // Everything below is only touched by the encoder thread once Open() has
+  // returned.
+  OpusMSEncoder* encoder_ = NULL;
+  std::unique_ptr<OggWriter> ogg_;
+  int family_ = 0;
+  int streams_ = 1;
+  uint32_t encoder_rate_ = 48000;
+  uint32_t frame_size_ = 960;
+  uint32_t pre_skip_ = 0;
+  bool resample_ = false;
+  Resampler resampler_;
+  uint64_t input_frames_ = 0;
+  int64_t packets_ = 0;
+  std::vector<float> floats_;
+  std::vector<float> pending_;
+  std::vector<uint8_t> packet_;
+
+  size_t block_bytes_ = 0;
+  std::vector<uint8_t> block_;
+  std::unique_ptr<WorkerPool> worker_;
+  std::mutex mutex_;
+  std::condition_variable drained_;
+  size_t in_flight_ = 0;
+  std::atomic<bool> failed_{false};
+};
+
+#endif  // AUDIOCAPTURE_WITH_OPUS
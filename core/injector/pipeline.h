@@ -0,0 +1,570 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../inject/protocol.h"
+#include "CLI11.hpp"
+#include "convert.h"
+#include "converter.h"
+#include "flac_recorder.h"
+#include "jitter_buffer.h"
+#include "loguru.hpp"
+#include "loudness_monitor.h"
+#include "mapped_wav_recorder.h"
+#include "mixer.h"
+#include "opus_recorder.h"
+#include "recorder.h"
+#include "remix.h"
+#include "segmented_recorder.h"
+#include "wav_recorder.h"
+#include "waveform_recorder.h"
+#include "worker_pool.h"
+
+// Everything between a transport record and the output file: decoding the
+// wire format, resampling and converting samples to the requested rate and
+// encoding, and writing packets through the configured Recorder. The injector
+// and the offline replay tool share it, so a replayed trace runs exactly the
+// code a live capture does.
+//
+// The captured format can change mid-session, e.g. when the default device
+// changes. A packet whose stored format would stay the same just switches
+// Converter. Otherwise the policy decides: "split" closes the file and
+// continues in path-2.ext, path-3.ext, ...; "convert" keeps converting to the
+// first file's format.
+//
+// With --jitter-buffer, each stream's packets pass through a JitterBuffer
+// first, which smooths their timestamps and fills gaps with silence.
+//
+// With --loudness, the captured packets are also metered (EBU R128) on the
+// worker pool, before any conversion, and the figures for the whole session
+// are written next to the first file as <name>.loudness.json.
+//
+// A pipeline can also feed one source of a Mixer instead of a file; the mix
+// then goes to a pipeline of its own through Write().
+//
+// Producers speaking protocol v3 tag packets with the stream they belong to
+// when a process renders several at once. The first stream seen goes to
+// |path| (or the pipeline's mixer source); each other one gets a pipeline of
+// its own, writing <name>_stream2.ext, <name>_stream3.ext, ... or feeding a
+// mixer source of its own.
+class Pipeline {
+ public:
+  struct Options {
+    std::string writer = "stdio";
+    std::string format;
+    bool dither = false;
+    uint32_t threads = 0;
+    uint32_t bitrate_kbps = 64;
+    uint32_t rate = 0;
+    std::string quality = "medium";
+    uint16_t channels = 0;
+    std::string remix;
+    uint32_t segment_seconds = 0;
+    uint32_t segment_mb = 0;
+    std::string format_change = "split";
+    bool loudness = false;
+    double loudness_interval = 10;
+    bool waveform = false;
+    uint32_t jitter_ms = 0;
+  };
+
+  static void AddOptions(CLI::App& app, Options* options) {
+    app.add_option("--writer", options->writer,
+                   "output writer: stdio (wav via dr_wav), mmap (wav via a "
+                   "preallocated mapping), flac or opus")
+#ifdef AUDIOCAPTURE_WITH_OPUS
+        ->check(CLI::IsMember({"stdio", "mmap", "flac", "opus"}));
+#else
+        ->check(CLI::IsMember({"stdio", "mmap", "flac"}));
+#endif
+    app.add_option("--format", options->format,
+                   "sample format to store (default: as captured)")
+        ->check(CLI::IsMember({"s16", "s24", "s32", "f32"}));
+    app.add_flag("--dither", options->dither,
+                 "add TPDF dither when storing float as s16 or s24");
+    app.add_option("--rate", options->rate,
+                   "sample rate to store in Hz (default: as captured)");
+    app.add_option("--quality", options->quality,
+                   "resampler quality: fast, medium or high")
+        ->check(CLI::IsMember({"fast", "medium", "high"}));
+    app.add_option("--channels", options->channels,
+                   "channel count to store (default: as captured); 7.1 and "
+                   "5.1 to stereo and mono to stereo use standard mixes");
+    app.add_option("--remix", options->remix,
+                   "remix matrix, one row per output channel: "
+                   "\"0.5,0.5;1,0\"")
+        ->check([](const std::string& text) {
+          RemixMatrix matrix;
+          return RemixMatrix::Parse(text, &matrix)
+                     ? std::string()
+                     : "rows of comma-separated numbers, separated by ';'";
+        });
+    app.add_option("--threads", options->threads,
+                   "worker threads for flac encoding and loudness metering "
+                   "(default: up to 4)");
+    app.add_option("--bitrate", options->bitrate_kbps,
+                   "opus bitrate in kbit/s");
+    app.add_option("--segment-seconds", options->segment_seconds,
+                   "start a new file every N seconds of audio (0: off)");
+    app.add_option("--segment-mb", options->segment_mb,
+                   "start a new file every N MiB of audio (0: off)");
+    app.add_option("--on-format-change", options->format_change,
+                   "when the captured format changes: split (start a new "
+                   "file) or convert (to the first file's format)")
+        ->check(CLI::IsMember({"split", "convert"}));
+    app.add_flag("--loudness", options->loudness,
+                 "meter loudness and true peak (EBU R128) and write a "
+                 ".loudness.json sidecar");
+    app.add_option("--loudness-interval", options->loudness_interval,
+                   "report loudness on stderr every N seconds of audio (0: "
+                   "off)");
+    app.add_flag("--waveform", options->waveform,
+                 "write a min/max/RMS waveform index (.peaks) next to each "
+                 "file");
+    app.add_option("--jitter-buffer", options->jitter_ms,
+                   "hold each stream up to N ms to rebuild its clock from the "
+                   "timestamps and fill gaps with silence (0: off)");
+  }
+
+  // File extension for the chosen writer, including the dot.
+  static const char* Extension(const Options& options) {
+    if (options.writer == "flac") {
+      return ".flac";
+    }
+    if (options.writer == "opus") {
+      return ".opus";
+    }
+    return ".wav";
+  }
+
+  static ResampleQuality Quality(const Options& options) {
+    if (options.quality == "fast") {
+      return ResampleQuality::kFast;
+    }
+    if (options.quality == "high") {
+      return ResampleQuality::kHigh;
+    }
+    return ResampleQuality::kMedium;
+  }
+
+  // A Mixer at the rate and channel count |options| ask for, 48 kHz stereo
+  // by default, that passes the mix to |sink|.
+  static std::unique_ptr<Mixer> MakeMixer(const Options& options,
+                                          const Mixer::Options& mix,
+                                          Mixer::Sink sink) {
+    return std::make_unique<Mixer>(
+        options.rate != 0 ? options.rate : 48000,
+        options.channels != 0 ? options.channels : 2, mix.latency_ms,
+        Quality(options), std::move(sink));
+  }
+
+  // The worker pool |options| calls for, or nullptr if nothing would use
+  // it. Pipelines running side by side can share one.
+  static std::shared_ptr<WorkerPool> MakePool(const Options& options) {
+    if (options.writer != "flac" && !options.loudness) {
+      return nullptr;
+    }
+    size_t threads = options.threads;
+    if (threads == 0) {
+      threads = std::min<size_t>(std::thread::hardware_concurrency(), 4);
+    }
+    return std::make_shared<WorkerPool>(threads);
+  }
+
+  // |pool| is shared with other pipelines if given; otherwise one is created
+  // when the writer or the loudness meter needs it.
+  Pipeline(const Options& options, const std::string& path,
+           std::shared_ptr<WorkerPool> pool = nullptr)
+      : options_(options),
+        path_(path),
+        pool_(std::move(pool)),
+        rate_(options.rate),
+        channels_(options.channels),
+        split_(options.format_change == "split"),
+        dither_enabled_(options.dither) {
+    if (options.format == "s16") {
+      encoding_ = SampleEncoding::kS16;
+    } else if (options.format == "s24") {
+      encoding_ = SampleEncoding::kS24;
+    } else if (options.format == "s32") {
+      encoding_ = SampleEncoding::kS32;
+    } else if (options.format == "f32") {
+      encoding_ = SampleEncoding::kF32;
+    }
+    quality_ = Quality(options);
+    if (options.jitter_ms != 0) {
+      jitter_ = std::make_unique<JitterBuffer>(options.jitter_ms);
+    }
+    if (!options.remix.empty() && RemixMatrix::Parse(options.remix, &remix_)) {
+      has_remix_ = true;
+    }
+    std::string writer = options.writer;
+    flac_ = writer == "flac";
+    if (pool_ == nullptr) {
+      // One pool for all segments and the meter, so rotation never adds
+      // threads.
+      pool_ = MakePool(options);
+    }
+    if (options.loudness) {
+      std::filesystem::path p(path_);
+      loudness_ = std::make_unique<LoudnessMonitor>(
+          pool_, options.loudness_interval,
+          (p.parent_path() / p.stem()).string() + ".loudness.json");
+    }
+    uint32_t bitrate = options.bitrate_kbps * 1000;
+    auto make_writer = [writer, pool = pool_,
+                        bitrate]() -> std::unique_ptr<Recorder> {
+      if (writer == "flac") {
+        return std::make_unique<FlacRecorder>(pool);
+      }
+#ifdef AUDIOCAPTURE_WITH_OPUS
+      if (writer == "opus") {
+        return std::make_unique<OpusRecorder>(bitrate);
+      }
+#endif
+      if (writer == "mmap") {
+        return std::make_unique<MappedWavRecorder>();
+      }
+      if (writer == "none") {
+        return std::make_unique<NullRecorder>();
+      }
+      return std::make_unique<WavRecorder>();
+    };
+    bool waveform = options.waveform;
+    auto make_recorder = [make_writer,
+                          waveform]() -> std::unique_ptr<Recorder> {
+      if (waveform) {
+        return std::make_unique<WaveformRecorder>(make_writer());
+      }
+      return make_writer();
+    };
+    if (options.segment_seconds != 0 || options.segment_mb != 0) {
+      recorder_ = std::make_unique<SegmentedRecorder>(
+          make_recorder, options.segment_seconds,
+          uint64_t(options.segment_mb) << 20);
+    } else {
+      recorder_ = make_recorder();
+    }
+  }
+
+  // Passes the decoded packets to source |source| of |mixer|. |path| names
+  // the mix in logs.
+  Pipeline(Mixer* mixer, size_t source, const std::string& path,
+           uint32_t jitter_ms = 0)
+      : path_(path),
+        rate_(0),
+        channels_(0),
+        split_(false),
+        dither_enabled_(false),
+        mixer_(mixer),
+        mix_source_(source) {
+    options_.jitter_ms = jitter_ms;
+    if (jitter_ms != 0) {
+      jitter_ = std::make_unique<JitterBuffer>(jitter_ms);
+    }
+  }
+
+  // Decodes one transport record and writes its packets. Returns false if the
+  // record is malformed.
+  bool Process(const uint8_t* record, size_t size) {
+    return decoder_.Decode(record, size,
+                           [this](const Packet& packet) { Write(packet); });
+  }
+
+  // Writes one decoded packet, e.g. from a Mixer. The counters include every
+  // stream.
+  void Write(const Packet& packet) {
+    if (packet.discontinuity) {
+      DLOG_F(WARNING, "lost packets before sequence %llu.",
+             (unsigned long long)packet.sequence);
+    }
+    ++packets_;
+    frames_ += packet.frames;
+    if (packet.flags & kPacketSilent) {
+      silent_frames_ += packet.frames;
+    }
+    if (packets_ == 1) {
+      stream_ = packet.stream;
+    } else if (packet.stream != stream_) {
+      Substream(packet.stream).Write(packet);
+      return;
+    }
+    if (jitter_) {
+      jitter_->Write(packet, [this](const Packet& p) { Store(p); });
+    } else {
+      Store(packet);
+    }
+  }
+
+  // For StreamLoop, which wakes up while this returns true.
+  bool Idle() {
+    bool idle = recorder_ != nullptr && recorder_->Idle();
+    for (const auto& substream : substreams_) {
+      idle |= substream.second->Idle();
+    }
+    return idle;
+  }
+
+  void Close() {
+    for (const auto& substream : substreams_) {
+      substream.second->Close();
+    }
+    if (jitter_) {
+      jitter_->Flush([this](const Packet& p) { Store(p); });
+      LogClock();
+    }
+    if (mixer_ != nullptr) {
+      mixer_->End(mix_source_);
+      return;
+    }
+    if (recorder_->is_open()) {
+      converter_->Flush(recorder_.get(), dither());
+      closed_bytes_ += recorder_->bytes();
+    }
+    recorder_->Close();
+    if (loudness_) {
+      loudness_->Close();
+    }
+  }
+
+  const std::string& path() const { return path_; }
+  uint64_t lost() const { return decoder_.lost(); }
+  uint64_t packets() const { return packets_; }
+  uint64_t frames() const { return frames_; }
+  // Frames that arrived as kPacketSilent packets, included in frames().
+  uint64_t silent_frames() const { return silent_frames_; }
+  // Bytes stored for every stream.
+  uint64_t bytes() const {
+    uint64_t bytes = 0;
+    for (const auto& substream : substreams_) {
+      bytes += substream.second->bytes();
+    }
+    if (recorder_ == nullptr) {
+      return bytes;
+    }
+    return bytes + closed_bytes_ +
+           (recorder_->is_open() ? recorder_->bytes() : 0);
+  }
+
+ private:
+  // Passes a packet of this pipeline's own stream to the mixer or the file.
+  void Store(const Packet& packet) {
+    if (mixer_ != nullptr) {
+      mixer_->Write(mix_source_, packet);
+      return;
+    }
+
+    const AudioFormat& format = *packet.format;
+    if ((!recorder_->is_open() || format != source_format_) &&
+        !Switch(format)) {
+      return;
+    }
+    if (loudness_) {
+      if (packet.flags & kPacketSilent) {
+        loudness_->WriteSilence(format, packet.frames);
+      } else {
+        loudness_->Write(format, packet.data, packet.size);
+      }
+    }
+    bool ok;
+    if (packet.flags & kPacketSilent) {
+      ok = converter_->WriteSilence(packet.frames, recorder_.get());
+    } else {
+      ok = converter_->Write(packet.data, packet.size, recorder_.get(),
+                             dither());
+    }
+    if (!ok) {
+      DLOG_F(ERROR, "failed to write %s.", PartPath().c_str());
+    }
+  }
+
+  // The pipeline for stream |id|, created on its first packet.
+  Pipeline& Substream(uint32_t id) {
+    for (const auto& substream : substreams_) {
+      if (substream.first == id) {
+        return *substream.second;
+      }
+    }
+    std::string n = std::to_string(substreams_.size() + 2);
+    std::unique_ptr<Pipeline> pipeline;
+    if (mixer_ != nullptr) {
+      size_t source = mixer_->AddSource(mixer_->name(mix_source_) + "#" + n,
+                                        mixer_->gain(mix_source_));
+      pipeline =
+          std::make_unique<Pipeline>(mixer_, source, path_, options_.jitter_ms);
+      DLOG_F(INFO, "stream %u: mixing as %s.", id,
+             mixer_->name(source).c_str());
+    } else {
+      std::filesystem::path p(path_);
+      std::string path = (p.parent_path() / p.stem()).string() + "_stream" +
+                         n + p.extension().string();
+      pipeline = std::make_unique<Pipeline>(options_, path, pool_);
+      DLOG_F(INFO, "stream %u: recording to %s.", id, path.c_str());
+    }
+    substreams_.emplace_back(id, std::move(pipeline));
+    return *substreams_.back().second;
+  }
+
+  void LogClock() const {
+    if (jitter_->rate() == 0) {
+      return;
+    }
+    const std::string& name =
+        mixer_ != nullptr ? mixer_->name(mix_source_) : path_;
+    DLOG_F(INFO,
+           "%s: clock %.2f Hz (%+.0f ppm), jitter %.2f ms, %llu gaps filled "
+           "(%llu frames), %llu restarts.",
+           name.c_str(), jitter_->rate(),
+           (jitter_->rate() / jitter_->nominal_rate() - 1) * 1e6,
+           jitter_->jitter_ms(), (unsigned long long)jitter_->gaps(),
+           (unsigned long long)jitter_->concealed_frames(),
+           (unsigned long long)jitter_->resyncs());
+  }
+
+  // Opens the output for the first packet, and handles a format change on
+  // later ones. Returns false if the packet cannot be stored.
+  bool Switch(const AudioFormat& format) {
+    bool open = recorder_->is_open();
+    AudioFormat output = OutputFormat(format);
+    if (open) {
+      DLOG_F(INFO, "format changed to %u ch, %u Hz, %u-bit.", format.channels,
+             format.sampling_rate, format.bits_per_sample);
+      converter_->Flush(recorder_.get(), dither());
+      const AudioFormat& current = recorder_->format();
+      // The speaker mask alone is no reason to split.
+      AudioFormat unmasked = output;
+      unmasked.channel_mask = current.channel_mask;
+      bool keep = unmasked == current ||
+                  (!split_ && Converter::Supports(format, current));
+      if (keep) {
+        output = current;
+      } else {
+        if (!split_) {
+          DLOG_F(WARNING, "cannot convert to the first format, splitting.");
+        }
+        closed_bytes_ += recorder_->bytes();
+        recorder_->Close();
+        ++part_;
+        open = false;
+      }
+    }
+    if (!open && !recorder_->Open(PartPath(), output)) {
+      DLOG_F(ERROR, "failed to create %s.", PartPath().c_str());
+      return false;
+    }
+    converter_ = FindConverter(format, output);
+    source_format_ = format;
+    return true;
+  }
+
+  // The format a file started by a packet in |format| is stored in.
+  AudioFormat OutputFormat(const AudioFormat& format) const {
+    AudioFormat output = format;
+    SampleEncoding source = EncodingOf(format);
+    if (source == SampleEncoding::kUnknown) {
+      if (encoding_ != SampleEncoding::kUnknown || rate_ != 0 ||
+          channels_ != 0 || has_remix_) {
+        DLOG_F(WARNING, "cannot convert %u-bit samples, storing as captured.",
+               format.bits_per_sample);
+      }
+      return output;
+    }
+    SampleEncoding encoding =
+        encoding_ != SampleEncoding::kUnknown ? encoding_ : source;
+    // FLAC has no float and few decoders take 32-bit; store those as s24.
+    if (flac_ && (encoding == SampleEncoding::kF32 ||
+                  encoding == SampleEncoding::kS32)) {
+      encoding = SampleEncoding::kS24;
+    }
+    output.sample_type = encoding == SampleEncoding::kF32 ? SampleType::kFloat
+                                                          : SampleType::kInt;
+    output.bits_per_sample =
+        static_cast<uint16_t>(BytesPerSample(encoding) * 8);
+    if (rate_ != 0) {
+      output.sampling_rate = rate_;
+    }
+    if (has_remix_ && remix_.in_channels == format.channels) {
+      output.channels = static_cast<uint16_t>(remix_.out_channels);
+    } else if (channels_ != 0) {
+      output.channels = channels_;
+    }
+    if (output.channels != format.channels) {
+      output.channel_mask = DefaultChannelMask(output.channels);
+    }
+    return output;
+  }
+
+  // Converters are kept for the whole run, so a format that comes back
+  // reuses its buffers and filters.
+  Converter* FindConverter(const AudioFormat& source,
+                           const AudioFormat& output) {
+    for (const std::unique_ptr<Converter>& converter : converters_) {
+      if (converter->source() == source && converter->output() == output) {
+        return converter.get();
+      }
+    }
+    converters_.push_back(std::make_unique<Converter>(
+        source, output, quality_, has_remix_ ? &remix_ : nullptr));
+    return converters_.back().get();
+  }
+
+  // path_ for the first file, then path-2.ext, path-3.ext, ...
+  std::string PartPath() const {
+    if (part_ == 0) {
+      return path_;
+    }
+    std::filesystem::path p(path_);
+    return ((p.parent_path() / p.stem()).string() + "-" +
+            std::to_string(part_ + 1) + p.extension().string());
+  }
+
+  TpdfDither* dither() { return dither_enabled_ ? &dither_ : nullptr; }
+
+  Options options_;
+  std::string path_;
+  std::shared_ptr<WorkerPool> pool_;
+  std::unique_ptr<Recorder> recorder_;
+  std::unique_ptr<LoudnessMonitor> loudness_;
+  AudioFormat source_format_;
+  uint32_t part_ = 0;
+  uint64_t closed_bytes_ = 0;
+
+  // Requested encoding (kUnknown: as captured), rate and channel count (0:
+  // as captured).
+  SampleEncoding encoding_ = SampleEncoding::kUnknown;
+  uint32_t rate_;
+  uint16_t channels_;
+  ResampleQuality quality_ = ResampleQuality::kMedium;
+  bool has_remix_ = false;
+  RemixMatrix remix_;
+  bool split_;
+  bool flac_ = false;
+  bool dither_enabled_;
+  TpdfDither dither_;
+
+  std::vector<std::unique_ptr<Converter>> converters_;
+  Converter* converter_ = nullptr;
+
+  // Set when feeding a mixer instead of a file.
+  Mixer* mixer_ = nullptr;
+  size_t mix_source_ = 0;
+
+  // The stream this pipeline stores itself, and the others by id.
+  uint32_t stream_ = 0;
+  std::vector<std::pair<uint32_t, std::unique_ptr<Pipeline>>> substreams_;
+
+  std::unique_ptr<JitterBuffer> jitter_;
+
+  Decoder decoder_;
+  uint64_t packets_ = 0;
+  uint64_t frames_ = 0;
+  uint64_t silent_frames_ = 0;
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "../inject/protocol.h"
+#include "../inject/silence.h"
+
+// Destination for captured PCM. The injector opens a recorder when the first
+// packet arrives, because the format is only known then.
+class Recorder {
+ public:
+  virtual ~Recorder() = default;
+
+  virtual bool Open(const std::string& path, const AudioFormat& format) = 0;
+  virtual bool is_open() const = 0;
+  virtual const AudioFormat& format() const = 0;
+  // Bytes of PCM accepted so far.
+  virtual uint64_t bytes() const = 0;
+
+  // Hint that about |bytes| of PCM will follow, so storage can be set aside
+  // before the data arrives.
+  virtual void Reserve(uint64_t /*bytes*/) {}
+
+  virtual bool Write(const uint8_t* data, size_t size) = 0;
+
+  // Appends |frames| frames of silence. The default writes them a small
+  // chunk at a time, so a long gap never needs a buffer of its size;
+  // recorders that can skip over storage instead override it.
+  virtual bool WriteSilence(uint64_t frames) {
+    size_t align = format().block_align();
+    if (align == 0) {
+      return false;
+    }
+    uint8_t chunk[16 * 1024];
+    ::memset(chunk, SilenceByte(format()), sizeof(chunk));
+    uint64_t chunk_frames = sizeof(chunk) / align;
+    while (frames > 0) {
+      uint64_t n = std::min(frames, chunk_frames);
+      if (!Write(chunk, static_cast<size_t>(n * align))) {
+        return false;
+      }
+      frames -= n;
+    }
+    return true;
+  }
+
+  // Called by the reader when the transport runs dry. Returns true while the
+  // recorder still has deferred work and wants to be called again.
+  virtual bool Idle() = 0;
+
+  virtual void Close() = 0;
+};
+
+// Accepts PCM and stores nothing, for a pipeline that only meters what goes
+// through it (e.g. a listener without -s). A waveform index is still written
+// when it is wrapped in a WaveformRecorder.
+class NullRecorder : public Recorder {
+ public:
+  bool Open(const std::string& /*path*/, const AudioFormat& format) override {
+    format_ = format;
+    bytes_ = 0;
+    open_ = true;
+    return true;
+  }
+  bool is_open() const override { return open_; }
+  const AudioFormat& format() const override { return format_; }
+  uint64_t bytes() const override { return bytes_; }
+  bool Write(const uint8_t* /*data*/, size_t size) override {
+    bytes_ += size;
+    return true;
+  }
+  bool WriteSilence(uint64_t frames) override {
+    bytes_ += frames * format_.block_align();
+    return true;
+  }
+  bool Idle() override { return false; }
+  void Close() override { open_ = false; }
+
+ private:
+  AudioFormat format_;
+  uint64_t bytes_ = 0;
+  bool open_ = false;
+};
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "convert.h"
+
+// Maps N input channels to M output channels with a coefficient matrix:
+// out[m] = sum over n of matrix(m, n) * in[n]. Matrices are stored with rows
+// padded to a multiple of four floats, so the SIMD kernels can load whole
+// rows. Common (N, M) pairs get kernels with the channel counts fixed at
+// compile time; anything else runs a generic loop.
+struct RemixMatrix {
+  int in_channels = 0;
+  int out_channels = 0;
+  // |out_channels| rows of |in_channels| coefficients.
+  std::vector<float> coefficients;
+
+  RemixMatrix() = default;
+  RemixMatrix(int in, int out)
+      : in_channels(in),
+        out_channels(out),
+        coefficients(size_t(in) * out, 0.0f) {}
+
+  float& at(int out, int in) {
+    return coefficients[size_t(out) * in_channels + in];
+  }
+  float at(int out, int in) const {
+    return coefficients[size_t(out) * in_channels + in];
+  }
+
+  // Parses "a,b,c;d,e,f": one row per output channel, one value per input
+  // channel. Returns false unless every row has the same length.
+  static bool Parse(const std::string& text, RemixMatrix* matrix) {
+    std::vector<std::vector<float>> rows(1);
+    const char* p = text.c_str();
+    while (*p != '\0') {
+      char* end = nullptr;
+      float value = std::strtof(p, &end);
+      if (end == p) {
+        return false;
+      }
+      rows.back().push_back(value);
+      p = end;
+      if (*p == ';') {
+        rows.emplace_back();
+      } else if (*p != ',' && *p != '\0') {
+        return false;
+      }
+      if (*p != '\0') {
+        ++p;
+      }
+    }
+    int in = static_cast<int>(rows[0].size());
+    if (in == 0) {
+      return false;
+    }
+    *matrix = RemixMatrix(in, static_cast<int>(rows.size()));
+    for (int m = 0; m < matrix->out_channels; ++m) {
+      if (rows[m].size() != size_t(in)) {
+        return false;
+      }
+      for (int n = 0; n < in; ++n) {
+        matrix->at(m, n) = rows[m][n];
+      }
+    }
+    return true;
+  }
+
+  // Built-in mixes for WAVEFORMATEXTENSIBLE channel order (FL FR FC LFE BL
+  // BR SL SR). 7.1 and 5.1 fold into stereo with the centre and surrounds at
+  // -3 dB and no LFE (ITU-R BS.775), scaled down so a full-scale signal on
+  // every channel cannot clip. Mono is spread to both sides. Other pairs fall
+  // back to averaging into mono, spreading mono, or matching by position.
+  static RemixMatrix Preset(int in, int out) {
+    RemixMatrix matrix(in, out);
+    const float k = 0.70710678f;
+    if ((in == 6 || in == 8) && out == 2) {
+      float scale = 1.0f / (1.0f + k + k * (in == 8 ? 2 : 1));
+      for (int side = 0; side < 2; ++side) {
+        matrix.at(side, side) = scale;
+        matrix.at(side, 2) = k * scale;
+        matrix.at(side, 4 + side) = k * scale;
+        if (in == 8) {
+          matrix.at(side, 6 + side) = k * scale;
+        }
+      }
+    } else if (in == 1) {
+      for (int m = 0; m < out; ++m) {
+        matrix.at(m, 0) = 1.0f;
+      }
+    } else if (out == 1) {
+      for (int n = 0; n < in; ++n) {
+        matrix.at(0, n) = 1.0f / in;
+      }
+    } else {
+      for (int c = 0; c < in && c < out; ++c) {
+        matrix.at(c, c) = 1.0f;
+      }
+    }
+    return matrix;
+  }
+};
+
+// WAVEFORMATEXTENSIBLE speaker mask for a remixed output, or 0 (unspecified)
+// for uncommon counts.
+inline uint32_t DefaultChannelMask(int channels) {
+  switch (channels) {
+    case 1:
+      return 0x4;  // FC
+    case 2:
+      return 0x3;  // FL FR
+    case 4:
+      return 0x33;  // FL FR BL BR
+    case 6:
+      return 0x3F;  // FL FR FC LFE BL BR
+    case 8:
+      return 0x63F;  // FL FR FC LFE BL BR SL SR
+  }
+  return 0;
+}
+
+namespace remix_internal {
+
+// |matrix| rows are |stride| floats apart.
+using RemixKernel = void (*)(const float* in, float* out, size_t frames,
+                             const float* matrix, int in_channels,
+                             int out_channels, int stride);
+
+inline int PaddedStride(int in_channels) { return (in_channels + 3) / 4 * 4; }
+
+inline void RemixGeneric(const float* in, float* out, size_t frames,
+                         const float* matrix, int in_channels,
+                         int out_channels, int stride) {
+  for (size_t i = 0; i < frames; ++i) {
+    const float* frame = in + i * in_channels;
+    for (int m = 0; m < out_channels; ++m) {
+      const float* row = matrix + m * stride;
+      float sum = 0;
+      for (int n = 0; n < in_channels; ++n) {
+        sum += row[n] * frame[n];
+      }
+      *out++ = sum;
+    }
+  }
+}
+
+// Same loop with the channel counts known, so it is fully unrolled and the
+// coefficients stay in registers.
+template <int N, int M>
+void RemixFixed(const float* in, float* out, size_t frames,
+                const float* matrix, int, int, int) {
+  constexpr int kStride = (N + 3) / 4 * 4;
+  float h[M][N];
+  for (int m = 0; m < M; ++m) {
+    for (int n = 0; n < N; ++n) {
+      h[m][n] = matrix[m * kStride + n];
+    }
+  }
+  for (size_t i = 0; i < frames; ++i) {
+    const float* frame = in + i * N;
+    for (int m = 0; m < M; ++m) {
+      float sum = 0;
+      for (int n = 0; n < N; ++n) {
+        sum += h[m][n] * frame[n];
+      }
+      out[i * M + m] = sum;
+    }
+  }
+}
+
+#ifdef CONVERT_X86
+
+// N channels to stereo, N = 6 or 8: each frame is multiplied by both rows
+// and the two products are reduced together.
+template <int N>
+CONVERT_TARGET("sse2")
+void RemixToStereoSse2(const float* in, float* out, size_t frames,
+                       const float* matrix, int, int, int) {
+  const __m128 l0 = _mm_loadu_ps(matrix);
+  const __m128 l1 = _mm_loadu_ps(matrix + 4);
+  const __m128 r0 = _mm_loadu_ps(matrix + 8);
+  const __m128 r1 = _mm_loadu_ps(matrix + 12);
+  for (size_t i = 0; i < frames; ++i) {
+    const float* frame = in + i * N;
+    __m128 a = _mm_loadu_ps(frame);
+    __m128 b;
+    if (N == 8) {
+      b = _mm_loadu_ps(frame + 4);
+    } else {
+      b = _mm_castpd_ps(
+          _mm_load_sd(reinterpret_cast<const double*>(frame + 4)));
+    }
+    __m128 l = _mm_add_ps(_mm_mul_ps(a, l0), _mm_mul_ps(b, l1));
+    __m128 r = _mm_add_ps(_mm_mul_ps(a, r0), _mm_mul_ps(b, r1));
+    // [l0+l2, r0+r2, l1+l3, r1+r3], then fold the upper half down.
+    __m128 t = _mm_add_ps(_mm_unpacklo_ps(l, r), _mm_unpackhi_ps(l, r));
+    t = _mm_add_ps(t, _mm_movehl_ps(t, t));
+    _mm_storel_pi(reinterpret_cast<__m64*>(out + i * 2), t);
+  }
+}
+
+#endif  // CONVERT_X86
+
+inline RemixKernel SelectRemixKernel(int in, int out) {
+#ifdef CONVERT_X86
+  if (out == 2 && convert_internal::CpuSupports(ConvertIsa::kSse2)) {
+    if (in == 8) {
+      return &RemixToStereoSse2<8>;
+    }
+    if (in == 6) {
+      return &RemixToStereoSse2<6>;
+    }
+  }
+#endif
+  if (in == 1 && out == 2) {
+    return &RemixFixed<1, 2>;
+  }
+  if (in == 2 && out == 1) {
+    return &RemixFixed<2, 1>;
+  }
+  if (in == 4 && out == 2) {
+    return &RemixFixed<4, 2>;
+  }
+  if (in == 6 && out == 2) {
+    return &RemixFixed<6, 2>;
+  }
+  if (in == 8 && out == 2) {
+    return &RemixFixed<8, 2>;
+  }
+  return &RemixGeneric;
+}
+
+}  // namespace remix_internal
+
+class Remixer {
+ public:
+  void Reset(const RemixMatrix& matrix) {
+    in_channels_ = matrix.in_channels;
+    out_channels_ = matrix.out_channels;
+    stride_ = remix_internal::PaddedStride(in_channels_);
+    padded_.assign(size_t(stride_) * out_channels_, 0.0f);
+    for (int m = 0; m < out_channels_; ++m) {
+      for (int n = 0; n < in_channels_; ++n) {
+        padded_[m * stride_ + n] = matrix.at(m, n);
+      }
+    }
+    kernel_ = remix_internal::SelectRemixKernel(in_channels_, out_channels_);
+  }
+
+  // |in| holds |frames| frames of the matrix's input channels, |out| gets
+  // the same number of frames of its output channels.
+  void Process(const float* in, float* out, size_t frames) const {
+    kernel_(in, out, frames, padded_.data(), in_channels_, out_channels_,
+            stride_);
+  }
+
+ private:
+  int in_channels_ = 0;
+  int out_channels_ = 0;
+  int stride_ = 0;
+  std::vector<float> padded_;
+  remix_internal::RemixKernel kernel_ = &remix_internal::RemixGeneric;
+};
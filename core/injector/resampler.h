@@ -0,0 +1,451 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "convert.h"
+
+// Streaming sample rate converter: a polyphase bank of Kaiser-windowed sinc
+// filters evaluated at exact rational positions, so in_rate input frames
+// always become exactly out_rate output frames, with no drift.
+//
+// The ratio is reduced to L/M. For common rate pairs L is small and every
+// output phase has its own filter row; for odd pairs the bank is capped at
+// kMaxPhases rows and a position uses the nearest one. The per-tap dot
+// product is the hot loop and is dispatched like the convert.h kernels.
+
+enum class ResampleQuality { kFast, kMedium, kHigh };
+
+namespace resampler_internal {
+
+using DotFunction = float (*)(const float* x, const float* h, size_t n);
+
+// |n| is always a multiple of 16.
+inline float DotScalar(const float* x, const float* h, size_t n) {
+  float acc[4] = {};
+  for (size_t i = 0; i < n; i += 4) {
+    for (int k = 0; k < 4; ++k) {
+      acc[k] += x[i + k] * h[i + k];
+    }
+  }
+  return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+#ifdef CONVERT_X86
+
+CONVERT_TARGET("sse2")
+inline float DotSse2(const float* x, const float* h, size_t n) {
+  __m128 a = _mm_setzero_ps();
+  __m128 b = _mm_setzero_ps();
+  for (size_t i = 0; i < n; i += 8) {
+    a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_load_ps(h + i)));
+    b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(x + i + 4),
+                                 _mm_load_ps(h + i + 4)));
+  }
+  a = _mm_add_ps(a, b);
+  a = _mm_add_ps(a, _mm_movehl_ps(a, a));
+  a = _mm_add_ss(a, _mm_shuffle_ps(a, a, 1));
+  return _mm_cvtss_f32(a);
+}
+
+CONVERT_TARGET("avx2,fma")
+inline float DotAvx2(const float* x, const float* h, size_t n) {
+  __m256 a = _mm256_setzero_ps();
+  __m256 b = _mm256_setzero_ps();
+  for (size_t i = 0; i < n; i += 16) {
+    a = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_load_ps(h + i), a);
+    b = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_load_ps(h + i + 8),
+                        b);
+  }
+  a = _mm256_add_ps(a, b);
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(a),
+                        _mm256_extractf128_ps(a, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+CONVERT_TARGET("avx512f")
+inline float DotAvx512(const float* x, const float* h, size_t n) {
+  __m512 a = _mm512_setzero_ps();
+  for (size_t i = 0; i < n; i += 16) {
+    a = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_load_ps(h + i), a);
+  }
+  return _mm512_reduce_add_ps(a);
+}
+
+inline bool CpuSupportsFma() {
+  uint32_t regs[4];
+  convert_internal::Cpuid(1, 0, regs);
+  return (regs[2] & (1u << 12)) != 0;
+}
+
+#endif  // CONVERT_X86
+
+#ifdef CONVERT_NEON
+
+inline float DotNeon(const float* x, const float* h, size_t n) {
+  float32x4_t a = vdupq_n_f32(0.0f);
+  float32x4_t b = vdupq_n_f32(0.0f);
+  for (size_t i = 0; i < n; i += 8) {
+    a = vfmaq_f32(a, vld1q_f32(x + i), vld1q_f32(h + i));
+    b = vfmaq_f32(b, vld1q_f32(x + i + 4), vld1q_f32(h + i + 4));
+  }
+  return vaddvq_f32(vaddq_f32(a, b));
+}
+
+#endif  // CONVERT_NEON
+
+inline DotFunction DefaultDot() {
+  static const DotFunction dot = [] {
+#ifdef CONVERT_X86
+    using convert_internal::CpuSupports;
+    if (CpuSupports(ConvertIsa::kAvx512) && CpuSupportsFma()) {
+      return &DotAvx512;
+    }
+    if (CpuSupports(ConvertIsa::kAvx2) && CpuSupportsFma()) {
+      return &DotAvx2;
+    }
+    if (CpuSupports(ConvertIsa::kSse2)) {
+      return &DotSse2;
+    }
+#endif
+#ifdef CONVERT_NEON
+    return &DotNeon;
+#endif
+    return &DotScalar;
+  }();
+  return dot;
+}
+
+// Zeroth-order modified Bessel function of the first kind.
+inline double BesselI0(double x) {
+  double sum = 1.0;
+  double term = 1.0;
+  for (int k = 1; k < 50; ++k) {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+    if (term < sum * 1e-12) {
+      break;
+    }
+  }
+  return sum;
+}
+
+// 64-byte aligned float storage, so filter rows suit any vector width.
+class AlignedFloats {
+ public:
+  void assign(size_t size, float value) {
+    storage_.assign(size + 16, value);
+    size_t misalign =
+        (reinterpret_cast<uintptr_t>(storage_.data()) / sizeof(float)) % 16;
+    offset_ = misalign == 0 ? 0 : 16 - misalign;
+  }
+  float* data() { return storage_.data() + offset_; }
+  const float* data() const { return storage_.data() + offset_; }
+
+ private:
+  std::vector<float> storage_;
+  size_t offset_ = 0;
+};
+
+// Filter length and shape for |quality|, shared by both resamplers.
+struct FilterSpec {
+  size_t taps;
+  double cutoff;
+  double beta;
+};
+
+inline FilterSpec DesignFilter(uint32_t in_rate, uint32_t out_rate,
+                               ResampleQuality quality) {
+  int base_taps;
+  double beta;
+  double rolloff;
+  switch (quality) {
+    case ResampleQuality::kFast:
+      base_taps = 16;
+      beta = 6.0;
+      rolloff = 0.90;
+      break;
+    case ResampleQuality::kHigh:
+      base_taps = 64;
+      beta = 10.0;
+      rolloff = 0.97;
+      break;
+    default:
+      base_taps = 32;
+      beta = 8.0;
+      rolloff = 0.945;
+      break;
+  }
+  // Cutoff relative to the input Nyquist; when decimating the filter
+  // stretches to keep the same transition band at the output.
+  FilterSpec spec;
+  spec.cutoff = std::min(1.0, double(out_rate) / in_rate) * rolloff;
+  spec.taps = static_cast<size_t>(std::ceil(base_taps / spec.cutoff * rolloff));
+  spec.taps = (spec.taps + 15) / 16 * 16;
+  spec.beta = beta;
+  return spec;
+}
+
+// Fills |rows| filter rows of |spec.taps| taps; row p interpolates at
+// p / |phases| of a sample past its position.
+inline void BuildFilterBank(const FilterSpec& spec, uint32_t rows,
+                            uint32_t phases, AlignedFloats* filters) {
+  size_t taps = spec.taps;
+  filters->assign(size_t(rows) * taps, 0.0f);
+  const double pi = 3.14159265358979323846;
+  double half = taps / 2.0;
+  double i0_beta = BesselI0(spec.beta);
+  std::vector<double> h(taps);
+  for (uint32_t p = 0; p < rows; ++p) {
+    // Tap k sees input sample (index - taps/2 + 1 + k) from a position
+    // |p / phases| past |index|.
+    double frac = double(p) / phases;
+    double sum = 0;
+    float* row = filters->data() + p * taps;
+    for (size_t k = 0; k < taps; ++k) {
+      double t = double(k) - half + 1.0 - frac;
+      double x = spec.cutoff * t;
+      double sinc = x == 0 ? 1.0 : std::sin(pi * x) / (pi * x);
+      double r = t / half;
+      double window =
+          r * r >= 1.0 ? 0.0
+                       : BesselI0(spec.beta * std::sqrt(1.0 - r * r)) /
+                             i0_beta;
+      h[k] = sinc * window;
+      sum += h[k];
+    }
+    for (size_t k = 0; k < taps; ++k) {
+      row[k] = static_cast<float>(h[k] / sum);
+    }
+  }
+}
+
+}  // namespace resampler_internal
+
+class Resampler {
+ public:
+  static constexpr uint32_t kMaxPhases = 4096;
+
+  // Returns false if either rate is zero.
+  bool Reset(uint32_t in_rate, uint32_t out_rate, int channels,
+             ResampleQuality quality = ResampleQuality::kMedium) {
+    if (in_rate == 0 || out_rate == 0 || channels <= 0) {
+      return false;
+    }
+    uint32_t g = std::gcd(in_rate, out_rate);
+    up_ = out_rate / g;
+    down_ = in_rate / g;
+    channels_ = channels;
+    in_rate_ = in_rate;
+    out_rate_ = out_rate;
+    phases_ = std::min(up_, kMaxPhases);
+
+    resampler_internal::FilterSpec spec =
+        resampler_internal::DesignFilter(in_rate, out_rate, quality);
+    taps_ = spec.taps;
+    resampler_internal::BuildFilterBank(spec, phases_, phases_, &filters_);
+    dot_ = resampler_internal::DefaultDot();
+    Restart();
+    return true;
+  }
+
+  uint32_t in_rate() const { return in_rate_; }
+  uint32_t out_rate() const { return out_rate_; }
+
+  // Appends the output for |frames| frames of interleaved |in| to |out|.
+  void Process(const float* in, size_t frames, std::vector<float>* out) {
+    for (int c = 0; c < channels_; ++c) {
+      std::vector<float>& buffer = buffers_[c];
+      size_t base = buffer.size();
+      buffer.resize(base + frames);
+      for (size_t i = 0; i < frames; ++i) {
+        buffer[base + i] = in[i * channels_ + c];
+      }
+    }
+    input_frames_ += frames;
+    Run(out);
+  }
+
+  // Feeds silence through the filter and appends the remaining output, so
+  // the total matches the input length exactly at the output rate. The
+  // resampler is then ready for a new stream at the same rates.
+  void Flush(std::vector<float>* out) {
+    uint64_t expected =
+        (input_frames_ * out_rate_ + in_rate_ - 1) / in_rate_;
+    for (std::vector<float>& buffer : buffers_) {
+      buffer.resize(buffer.size() + taps_, 0.0f);
+    }
+    Run(out, expected);
+    Restart();
+  }
+
+ private:
+  void Restart() {
+    // Half a filter of silence ahead of the first sample keeps the output
+    // aligned with the input.
+    buffers_.assign(channels_, std::vector<float>(taps_ / 2 - 1, 0.0f));
+    index_ = 0;
+    phase_ = 0;
+    input_frames_ = 0;
+    output_frames_ = 0;
+  }
+
+  // Emits every output whose filter window is fully buffered, or up to
+  // |limit| outputs in total.
+  void Run(std::vector<float>* out, uint64_t limit = UINT64_MAX) {
+    size_t available = buffers_[0].size();
+    while (index_ + taps_ <= available && output_frames_ < limit) {
+      uint32_t row = phases_ == up_
+                         ? phase_
+                         : static_cast<uint32_t>(uint64_t(phase_) * phases_ /
+                                                 up_);
+      const float* h = filters_.data() + size_t(row) * taps_;
+      for (int c = 0; c < channels_; ++c) {
+        out->push_back(dot_(buffers_[c].data() + index_, h, taps_));
+      }
+      ++output_frames_;
+      phase_ += down_;
+      index_ += phase_ / up_;
+      phase_ %= up_;
+    }
+    // Drop input no later output can reach.
+    size_t consumed = std::min(index_, available);
+    if (consumed > 0) {
+      for (std::vector<float>& buffer : buffers_) {
+        buffer.erase(buffer.begin(), buffer.begin() + consumed);
+      }
+      index_ -= consumed;
+    }
+  }
+
+  uint32_t in_rate_ = 0;
+  uint32_t out_rate_ = 0;
+  uint32_t up_ = 1;
+  uint32_t down_ = 1;
+  uint32_t phases_ = 1;
+  size_t taps_ = 16;
+  int channels_ = 0;
+  resampler_internal::AlignedFloats filters_;
+  resampler_internal::DotFunction dot_ = nullptr;
+
+  std::vector<std::vector<float>> buffers_;
+  size_t index_ = 0;
+  uint32_t phase_ = 0;
+  uint64_t input_frames_ = 0;
+  uint64_t output_frames_ = 0;
+};
+
+// Rate converter whose ratio can be nudged while it runs, for following a
+// clock that drifts against ours. It uses Resampler's filters over a fixed
+// bank of kPhases rows and interpolates linearly between neighbouring rows,
+// so any position between two input frames is reachable.
+class VariableResampler {
+ public:
+  static constexpr uint32_t kPhases = 256;
+
+  bool Reset(uint32_t in_rate, uint32_t out_rate, int channels,
+             ResampleQuality quality = ResampleQuality::kMedium) {
+    if (in_rate == 0 || out_rate == 0 || channels <= 0) {
+      return false;
+    }
+    channels_ = channels;
+    base_step_ = double(in_rate) / out_rate;
+    step_ = base_step_;
+    // Leave headroom for the adjustment, so it never aliases.
+    resampler_internal::FilterSpec spec = resampler_internal::DesignFilter(
+        in_rate, static_cast<uint32_t>(out_rate * 0.99), quality);
+    taps_ = spec.taps;
+    resampler_internal::BuildFilterBank(spec, kPhases + 1, kPhases,
+                                        &filters_);
+    dot_ = resampler_internal::DefaultDot();
+    buffers_.assign(channels_, std::vector<float>(taps_ / 2 - 1, 0.0f));
+    index_ = 0;
+    frac_ = 0;
+    input_frames_ = 0;
+    consumed_ = 0;
+    return true;
+  }
+
+  // Makes |factor| times as many output frames per input frame as the
+  // nominal ratio; 1.001 stretches the input by 0.1%.
+  void set_adjust(double factor) { step_ = base_step_ / factor; }
+  double ratio() const { return 1.0 / step_; }
+
+  // Appends the output for |frames| frames of interleaved |in| to |out|.
+  void Process(const float* in, size_t frames, std::vector<float>* out) {
+    for (int c = 0; c < channels_; ++c) {
+      std::vector<float>& buffer = buffers_[c];
+      size_t base = buffer.size();
+      buffer.resize(base + frames);
+      for (size_t i = 0; i < frames; ++i) {
+        buffer[base + i] = in[i * channels_ + c];
+      }
+    }
+    input_frames_ += frames;
+
+    size_t available = buffers_[0].size();
+    while (index_ + taps_ <= available) {
+      double scaled = frac_ * kPhases;
+      uint32_t row = static_cast<uint32_t>(scaled);
+      float t = static_cast<float>(scaled - row);
+      const float* h0 = filters_.data() + size_t(row) * taps_;
+      const float* h1 = h0 + taps_;
+      for (int c = 0; c < channels_; ++c) {
+        const float* x = buffers_[c].data() + index_;
+        float a = dot_(x, h0, taps_);
+        float b = dot_(x, h1, taps_);
+        out->push_back(a + t * (b - a));
+      }
+      frac_ += step_;
+      size_t whole = static_cast<size_t>(frac_);
+      index_ += whole;
+      frac_ -= whole;
+    }
+    size_t consumed = std::min(index_, available);
+    if (consumed > 0) {
+      for (std::vector<float>& buffer : buffers_) {
+        buffer.erase(buffer.begin(), buffer.begin() + consumed);
+      }
+      index_ -= consumed;
+      consumed_ += consumed;
+    }
+  }
+
+  // Appends the output for the input received but not yet passed, as if the
+  // stream ended with it.
+  void Flush(std::vector<float>* out) {
+    size_t base = out->size();
+    size_t remaining =
+        static_cast<size_t>(std::max(0.0, std::round(pending() * ratio())));
+    std::vector<float> zeros(taps_ * channels_, 0.0f);
+    Process(zeros.data(), taps_, out);
+    out->resize(std::min(out->size(), base + remaining * channels_));
+  }
+
+  // Input frames received but not yet passed by the output position. The
+  // next input frame comes out pending() * ratio() frames after the last
+  // output frame so far.
+  double pending() const {
+    return double(input_frames_) - double(consumed_ + index_) - frac_;
+  }
+
+ private:
+  int channels_ = 0;
+  double base_step_ = 1.0;
+  double step_ = 1.0;
+  size_t taps_ = 16;
+  resampler_internal::AlignedFloats filters_;
+  resampler_internal::DotFunction dot_ = nullptr;
+
+  std::vector<std::vector<float>> buffers_;
+  size_t index_ = 0;
+  double frac_ = 0;
+  uint64_t input_frames_ = 0;
+  uint64_t consumed_ = 0;
+};
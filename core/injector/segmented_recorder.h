@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "../inject/protocol.h"
+#include "recorder.h"
+
+// Splits a recording into numbered segments, each written by its own
+// Recorder. Segments end after a fixed duration of audio or number of bytes,
+// always on a frame boundary, so consecutive segments join without a gap or an overlap.
+//
+// The next segment is opened and preallocated on a background thread while
+// the current one fills up, and a finished segment is closed in the
+// background too, so a rotation never blocks the read loop on file I/O.
+class SegmentedRecorder : public Recorder {
+ public:
+  using Factory = std::function<std::unique_ptr<Recorder>()>;
+
+  // A limit of 0 disables it. Segment files are named after the path given
+  // to Open() with "_0001", "_0002", ... inserted before the extension.
+  SegmentedRecorder(Factory factory, uint32_t max_seconds, uint64_t max_bytes)
+      : factory_(std::move(factory)),
+        max_seconds_(max_seconds),
+        max_bytes_(max_bytes) {}
+  ~SegmentedRecorder() override { Close(); }
+
+  bool Open(const std::string& path, const AudioFormat& format) override {
+    Close();
+    std::filesystem::path p(path);
+    stem_ = (p.parent_path() / p.stem()).string();
+    extension_ = p.extension().string();
+    format_ = format;
+    index_ = 0;
+    bytes_ = 0;
+
+    size_t align = format.block_align();
+    if (align == 0) {
+      return false;
+    }
+    segment_bytes_ = UINT64_MAX;
+    if (max_seconds_ != 0) {
+      // Counted in frames, not wall-clock time, so boundaries are exact.
+      segment_bytes_ = uint64_t(max_seconds_) * format.sampling_rate * align;
+    }
+    if (max_bytes_ != 0) {
+      segment_bytes_ = std::min(segment_bytes_, max_bytes_ / align * align);
+    }
+    if (segment_bytes_ == 0) {
+      return false;
+    }
+
+    Prepare();
+    return Rotate();
+  }
+
+  bool is_open() const override { return current_ != nullptr; }
+  const AudioFormat& format() const override { return format_; }
+  uint64_t bytes() const override { return bytes_; }
+
+  bool Write(const uint8_t* data, size_t size) override {
+    while (size > 0) {
+      if (current_ == nullptr) {
+        return false;
+      }
+      uint64_t room = segment_bytes_ - current_->bytes();
+      size_t n = static_cast<size_t>(std::min<uint64_t>(size, room));
+      if (!current_->Write(data, n)) {
+        return false;
+      }
+      bytes_ += n;
+      data += n;
+      size -= n;
+      if (current_->bytes() == segment_bytes_ && !Rotate()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Passed on to the segments, so each can store its share its own way.
+  bool WriteSilence(uint64_t frames) override {
+    uint64_t align = format_.block_align();
+    while (frames > 0) {
+      if (current_ == nullptr) {
+        return false;
+      }
+      uint64_t room = (segment_bytes_ - current_->bytes()) / align;
+      uint64_t n = std::min(frames, room);
+      if (!current_->WriteSilence(n)) {
+        return false;
+      }
+      bytes_ += n * align;
+      frames -= n;
+      if (current_->bytes() == segment_bytes_ && !Rotate()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool Idle() override {
+    return current_ != nullptr && current_->Idle();
+  }
+
+  void Close() override {
+    Wait(closing_);
+    if (current_ != nullptr) {
+      current_->Close();
+      if (current_->bytes() == 0 && index_ > 1) {
+        // The recording ended exactly on a segment boundary.
+        std::error_code ec;
+        std::filesystem::remove(SegmentPath(index_), ec);
+      }
+      current_.reset();
+    }
+    if (next_.valid()) {
+      // The spare segment was never written; do not leave it behind.
+      Segment spare = next_.get();
+      if (spare.recorder != nullptr) {
+        spare.recorder->Close();
+        std::error_code ec;
+        std::filesystem::remove(spare.path, ec);
+      }
+    }
+  }
+
+ private:
+  struct Segment {
+    std::unique_ptr<Recorder> recorder;
+    std::string path;
+  };
+
+  static void Wait(std::future<void>& future) {
+    if (future.valid()) {
+      future.get();
+    }
+  }
+
+  std::string SegmentPath(uint32_t index) const {
+    char suffix[16];
+    std::snprintf(suffix, sizeof(suffix), "_%04u", index);
+    return stem_ + suffix + extension_;
+  }
+
+  // Opens segment |index_ + 1| in the background.
+  void Prepare() {
+    std::string path = SegmentPath(index_ + 1);
+    next_ = std::async(std::launch::async, [this, path] {
+      Segment segment;
+      segment.recorder = factory_();
+      segment.path = path;
+      if (!segment.recorder->Open(path, format_)) {
+        segment.recorder.reset();
+      } else if (segment_bytes_ != UINT64_MAX) {
+        segment.recorder->Reserve(segment_bytes_);
+      }
+      return segment;
+    });
+  }
+
+  // Retires the current segment and switches to the prepared one.
+  bool Rotate() {
+    Segment segment = next_.get();
+    if (segment.recorder == nullptr) {
+      return false;
+    }
+    ++index_;
+    Wait(closing_);
+    if (current_ != nullptr) {
+      closing_ = std::async(
+          std::launch::async,
+          [old = std::move(current_)]() mutable { old->Close(); });
+    }
+    current_ = std::move(segment.recorder);
+    Prepare();
+    return true;
+  }
+
+  Factory factory_;
+  uint32_t max_seconds_;
+  uint64_t max_bytes_;
+
+  std::string stem_;
+  std::string extension_;
+  AudioFormat format_;
+  uint64_t segment_bytes_ = 0;
+  uint64_t bytes_ = 0;
+  uint32_t index_ = 0;
+
+  std::unique_ptr<Recorder> current_;
+  std::future<Segment> next_;
+  std::future<void> closing_;
+};
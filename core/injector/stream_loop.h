@@ -0,0 +1,229 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../inject/platform.h"
+#include "../inject/transport.h"
+#include "loguru.hpp"
+#include "pipeline.h"
+#include "trace.h"
+
+// Serves any number of capture transports from the calling thread. Every
+// producer wakes the loop through one shared doorbell event (see
+// Transport::Settings::doorbell), so there is no thread or wait handle per
+// stream and a parked loop costs no CPU. A pass reads at most kBudget records
+// from each stream, so one busy stream cannot starve the others.
+class StreamLoop {
+ public:
+  static constexpr size_t kBudget = 64;
+  // Wakeup interval while a pipeline has deferred work (see Pipeline::Idle).
+  static constexpr uint32_t kIdleIntervalMs = 1000;
+  // Process exit cannot signal the doorbell, so it is polled this often.
+  static constexpr uint32_t kExitPollMs = 500;
+
+  struct Stream {
+    uint32_t id = 0;
+    std::string name;
+    std::unique_ptr<Transport> transport;
+    // Watched for exit if set.
+    std::unique_ptr<Process> process;
+    std::unique_ptr<Pipeline> pipeline;
+    // Records are also written here if set.
+    std::unique_ptr<TraceWriter> trace;
+    uint64_t records = 0;
+    uint64_t record_bytes = 0;
+    bool failed = false;
+  };
+
+  StreamLoop() = default;
+  StreamLoop(const StreamLoop&) = delete;
+  StreamLoop& operator=(const StreamLoop&) = delete;
+
+  // Creates the doorbell. Transports must be opened with
+  // Settings::doorbell = |doorbell| before they are added.
+  bool Create(uint32_t doorbell) {
+    doorbell_id_ = doorbell;
+    return doorbell_.Create(Transport::DoorbellName(doorbell));
+  }
+
+  uint32_t doorbell() const { return doorbell_id_; }
+
+  // Called on the loop thread.
+  void Add(std::unique_ptr<Stream> stream) {
+    DLOG_F(INFO, "stream %u (%s): recording to %s.", stream->id,
+           stream->name.c_str(), stream->pipeline->path().c_str());
+    streams_.push_back(std::move(stream));
+    ++added_;
+  }
+
+  // |poll| runs on the loop thread every |interval_ms|, e.g. to look for new
+  // producers and Add() them.
+  void SetPoll(std::function<void()> poll, uint32_t interval_ms) {
+    poll_ = std::move(poll);
+    poll_interval_ms_ = interval_ms;
+  }
+
+  // |pump| runs on the loop thread after every pass over the streams, e.g.
+  // to mix what they delivered, and once more after the last one finished.
+  void SetPump(std::function<void()> pump) { pump_ = std::move(pump); }
+
+  // Called with each stream after its transport closed or its process
+  // exited, and its pipeline has been closed.
+  void SetFinishHandler(std::function<void(const Stream&)> handler) {
+    finish_handler_ = std::move(handler);
+  }
+
+  // Runs until every stream has ended and |more| returns false, or until
+  // Stop(). Streams still running then are finished too.
+  void Run(const std::function<bool()>& more) {
+    uint64_t next_poll = 0;
+    while (!stop_.load(std::memory_order_acquire)) {
+      if (poll_ && MonotonicNanoseconds() >= next_poll) {
+        poll_();
+        next_poll = MonotonicNanoseconds() + poll_interval_ms_ * 1000000ull;
+      }
+      bool busy = false;
+      for (size_t i = 0; i < streams_.size();) {
+        Stream& stream = *streams_[i];
+        busy |= Drain(stream) != 0;
+        if (stream.failed || Ended(stream)) {
+          Finish(i);
+        } else {
+          ++i;
+        }
+      }
+      if (pump_) {
+        pump_();
+      }
+      if (busy) {
+        continue;
+      }
+      if (streams_.empty() && !more()) {
+        break;
+      }
+      Park(next_poll);
+    }
+    while (!streams_.empty()) {
+      Drain(*streams_.back());
+      Finish(streams_.size() - 1);
+    }
+    if (pump_) {
+      pump_();
+    }
+  }
+
+  // Thread-safe. Makes Run() finish the streams and return.
+  void Stop() {
+    stop_.store(true, std::memory_order_release);
+    doorbell_.Signal();
+  }
+
+  size_t size() const { return streams_.size(); }
+  // Streams added so far, including finished ones.
+  uint64_t added() const { return added_; }
+  // Wakeups that found nothing to do; a sanity check that the loop is not
+  // spinning.
+  uint64_t idle_wakeups() const { return idle_wakeups_; }
+
+ private:
+  // Reads up to kBudget records. Returns how many.
+  size_t Drain(Stream& stream) {
+    Ring& ring = stream.transport->ring();
+    size_t count = 0;
+    size_t size = 0;
+    while (count < kBudget && !stream.failed) {
+      const uint8_t* buf = ring.Peek(&size);
+      if (buf == nullptr) {
+        break;
+      }
+      if (stream.trace) {
+        stream.trace->Write(MonotonicNanoseconds(), buf, size);
+      }
+      if (!stream.pipeline->Process(buf, size)) {
+        DLOG_F(ERROR, "stream %u (%s): unexpected data.", stream.id,
+               stream.name.c_str());
+        stream.failed = true;
+      }
+      ring.Release();
+      ++stream.records;
+      stream.record_bytes += size;
+      ++count;
+    }
+    return count;
+  }
+
+  // True once the producer is gone and everything it published was read.
+  static bool Ended(const Stream& stream) {
+    // closed() first: records published before closing are visible then.
+    bool gone = stream.transport->closed() ||
+                (stream.process && stream.process->exited());
+    return gone && stream.transport->ring().Empty();
+  }
+
+  void Finish(size_t index) {
+    std::unique_ptr<Stream> stream = std::move(streams_[index]);
+    streams_.erase(streams_.begin() + index);
+    stream->pipeline->Close();
+    if (stream->trace) {
+      stream->trace->Close();
+    }
+    if (finish_handler_) {
+      finish_handler_(*stream);
+    }
+    stream->transport->Close();
+  }
+
+  // Waits on the doorbell until a producer publishes, closes, or a timer is
+  // due.
+  void Park(uint64_t next_poll) {
+    uint32_t timeout_ms = kInfinite;
+    if (poll_) {
+      uint64_t now = MonotonicNanoseconds();
+      timeout_ms = next_poll > now
+                       ? static_cast<uint32_t>((next_poll - now) / 1000000)
+                       : 0;
+    }
+    bool ready = false;
+    for (const std::unique_ptr<Stream>& stream : streams_) {
+      stream->transport->SetWaiting(true);
+    }
+    for (const std::unique_ptr<Stream>& stream : streams_) {
+      if (!stream->transport->ring().Empty() ||
+          stream->transport->closed()) {
+        ready = true;
+      }
+      if (stream->pipeline->Idle()) {
+        timeout_ms = std::min(timeout_ms, kIdleIntervalMs);
+      }
+      if (stream->process) {
+        timeout_ms = std::min(timeout_ms, kExitPollMs);
+      }
+    }
+    if (!ready && !stop_.load(std::memory_order_acquire) &&
+        !doorbell_.Wait(timeout_ms)) {
+      ++idle_wakeups_;
+    }
+    for (const std::unique_ptr<Stream>& stream : streams_) {
+      stream->transport->SetWaiting(false);
+    }
+  }
+
+  Event doorbell_;
+  uint32_t doorbell_id_ = 0;
+  std::vector<std::unique_ptr<Stream>> streams_;
+  std::function<void()> poll_;
+  uint32_t poll_interval_ms_ = kInfinite;
+  std::function<void()> pump_;
+  std::function<void(const Stream&)> finish_handler_;
+  std::atomic<bool> stop_{false};
+  uint64_t added_ = 0;
+  uint64_t idle_wakeups_ = 0;
+};
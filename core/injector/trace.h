@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Capture traces: the transport records the injector receives, byte for
+// byte, with the time each one was read. A trace can be replayed through the
+// Pipeline offline to reproduce a capture or to benchmark the pipeline.
+//
+// File layout: a 16-byte TraceFileHeader, then for every record a
+// TraceRecordHeader followed by the record, padded to 8 bytes.
+struct TraceFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+struct TraceRecordHeader {
+  uint64_t timestamp_ns;
+  uint32_t size;
+  uint32_t reserved;
+};
+
+constexpr char kTraceMagic[8] = {'A', 'C', 'T', 'R', 'A', 'C', 'E', 0};
+constexpr uint32_t kTraceVersion = 1;
+
+inline FILE* OpenTraceFile(const std::string& path, const char* mode) {
+#ifdef _MSC_VER
+  FILE* file = NULL;
+  if (::fopen_s(&file, path.c_str(), mode) != 0) {
+    return NULL;
+  }
+  return file;
+#else
+  return ::fopen(path.c_str(), mode);
+#endif
+}
+
+class TraceWriter {
+ public:
+  TraceWriter() = default;
+  ~TraceWriter() { Close(); }
+  TraceWriter(const TraceWriter&) = delete;
+  TraceWriter& operator=(const TraceWriter&) = delete;
+
+  bool Open(const std::string& path) {
+    Close();
+    file_ = OpenTraceFile(path, "wb");
+    if (file_ == NULL) {
+      return false;
+    }
+    TraceFileHeader header{};
+    ::memcpy(header.magic, kTraceMagic, sizeof(header.magic));
+    header.version = kTraceVersion;
+    return ::fwrite(&header, sizeof(header), 1, file_) == 1;
+  }
+
+  bool is_open() const { return file_ != NULL; }
+
+  bool Write(uint64_t timestamp_ns, const uint8_t* data, size_t size) {
+    static const uint8_t kPadding[8] = {};
+    TraceRecordHeader header{};
+    header.timestamp_ns = timestamp_ns;
+    header.size = static_cast<uint32_t>(size);
+    size_t padding = (8 - size % 8) % 8;
+    return ::fwrite(&header, sizeof(header), 1, file_) == 1 &&
+           ::fwrite(data, 1, size, file_) == size &&
+           ::fwrite(kPadding, 1, padding, file_) == padding;
+  }
+
+  void Close() {
+    if (file_ != NULL) {
+      ::fclose(file_);
+      file_ = NULL;
+    }
+  }
+
+ private:
+  FILE* file_ = NULL;
+};
+
+class TraceReader {
+ public:
+  TraceReader() = default;
+  ~TraceReader() { Close(); }
+  TraceReader(const TraceReader&) = delete;
+  TraceReader& operator=(const TraceReader&) = delete;
+
+  bool Open(const std::string& path) {
+    Close();
+    file_ = OpenTraceFile(path, "rb");
+    if (file_ == NULL) {
+      return false;
+    }
+    TraceFileHeader header;
+    if (::fread(&header, sizeof(header), 1, file_) != 1 ||
+        ::memcmp(header.magic, kTraceMagic, sizeof(header.magic)) != 0 ||
+        header.version != kTraceVersion) {
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  // Reads the next record into an internal buffer. Returns nullptr at the
+  // end of the trace or on a truncated record.
+  const uint8_t* Next(uint64_t* timestamp_ns, size_t* size) {
+    TraceRecordHeader header;
+    if (file_ == NULL || ::fread(&header, sizeof(header), 1, file_) != 1) {
+      return nullptr;
+    }
+    size_t padded = (header.size + 7) & ~size_t(7);
+    buffer_.resize(padded);
+    if (::fread(buffer_.data(), 1, padded, file_) != padded) {
+      return nullptr;
+    }
+    *timestamp_ns = header.timestamp_ns;
+    *size = header.size;
+    return buffer_.data();
+  }
+
+  void Close() {
+    if (file_ != NULL) {
+      ::fclose(file_);
+      file_ = NULL;
+    }
+  }
+
+ private:
+  FILE* file_ = NULL;
+  std::vector<uint8_t> buffer_;
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../inject/protocol.h"
+#include "dr_wav.h"
+#include "recorder.h"
+
+// Streams PCM into a WAV file through dr_wav. Packets are gathered in a
+// fixed-size write-behind buffer that is written out when it fills, and after
+// every write the RIFF and data chunk sizes are patched in place, so the file
+// on disk is always a valid WAV up to the last flush. Memory use does not
+// depend on how long the recording runs.
+class WavRecorder : public Recorder {
+ public:
+  static constexpr size_t kBufferSize = 1024 * 1024;
+  // Buffered audio older than this is written out by Idle().
+  static constexpr std::chrono::milliseconds kMaxBufferAge{1000};
+
+  WavRecorder() : buffer_(kBufferSize) {}
+  ~WavRecorder() override { Close(); }
+  WavRecorder(const WavRecorder&) = delete;
+  WavRecorder& operator=(const WavRecorder&) = delete;
+
+  bool Open(const std::string& path, const AudioFormat& format) override {
+    Close();
+#ifdef _MSC_VER
+    if (::fopen_s(&file_, path.c_str(), "wb") != 0) {
+      file_ = NULL;
+    }
+#else
+    file_ = ::fopen(path.c_str(), "wb");
+#endif
+    if (file_ == NULL) {
+      return false;
+    }
+
+    drwav_data_format df;
+    df.container = drwav_container_riff;
+    df.format = format.sample_type == SampleType::kFloat
+                    ? DR_WAVE_FORMAT_IEEE_FLOAT
+                    : DR_WAVE_FORMAT_PCM;
+    df.channels = format.channels;
+    df.sampleRate = format.sampling_rate;
+    df.bitsPerSample = format.bits_per_sample;
+    if (!drwav_init_write(&wav_, &df, OnWrite, OnSeek, file_, NULL)) {
+      ::fclose(file_);
+      file_ = NULL;
+      return false;
+    }
+    format_ = format;
+    used_ = 0;
+    return true;
+  }
+
+  bool is_open() const override { return file_ != NULL; }
+  const AudioFormat& format() const override { return format_; }
+  uint64_t bytes() const override { return wav_.dataChunkDataSize + used_; }
+
+  bool Write(const uint8_t* data, size_t size) override {
+    if (used_ + size > buffer_.size() && !Flush()) {
+      return false;
+    }
+    if (size >= buffer_.size()) {
+      return drwav_write_raw(&wav_, size, data) == size && UpdateHeader();
+    }
+    if (used_ == 0) {
+      oldest_ = std::chrono::steady_clock::now();
+    }
+    ::memcpy(buffer_.data() + used_, data, size);
+    used_ += size;
+    return true;
+  }
+
+  // Writes out buffered audio and makes the header match it.
+  bool Flush() {
+    if (used_ == 0) {
+      return true;
+    }
+    size_t written = drwav_write_raw(&wav_, used_, buffer_.data());
+    bool ok = written == used_;
+    used_ = 0;
+    return ok && UpdateHeader();
+  }
+
+  // Flushes audio that has sat in the buffer for kMaxBufferAge, and returns
+  // true while anything is still buffered.
+  bool Idle() override {
+    if (used_ != 0 &&
+        std::chrono::steady_clock::now() - oldest_ >= kMaxBufferAge) {
+      Flush();
+    }
+    return used_ != 0;
+  }
+
+  void Close() override {
+    if (file_ == NULL) {
+      return;
+    }
+    Flush();
+    drwav_uninit(&wav_);
+    ::fclose(file_);
+    file_ = NULL;
+  }
+
+ private:
+  static size_t OnWrite(void* user, const void* data, size_t size) {
+    return ::fwrite(data, 1, size, static_cast<FILE*>(user));
+  }
+
+  static drwav_bool32 OnSeek(void* user, int offset,
+                             drwav_seek_origin origin) {
+    return ::fseek(static_cast<FILE*>(user), offset,
+                   origin == drwav_seek_origin_current ? SEEK_CUR
+                                                       : SEEK_SET) == 0;
+  }
+
+  // drwav_uninit() only writes the chunk sizes at the very end; patching them
+  // as we go keeps a crashed or killed recording playable.
+  bool UpdateHeader() {
+    uint64_t data_size = wav_.dataChunkDataSize;
+    uint64_t riff_size = wav_.dataChunkDataPos + data_size - 8;
+    uint32_t riff32 = riff_size > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)riff_size;
+    uint32_t data32 = data_size > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)data_size;
+    bool ok = ::fseek(file_, 4, SEEK_SET) == 0 &&
+              ::fwrite(&riff32, 4, 1, file_) == 1 &&
+              ::fseek(file_, (long)wav_.dataChunkDataPos - 4, SEEK_SET) == 0 &&
+              ::fwrite(&data32, 4, 1, file_) == 1;
+    ::fseek(file_, 0, SEEK_END);
+    return ::fflush(file_) == 0 && ok;
+  }
+
+  FILE* file_ = NULL;
+  drwav wav_{};
+  AudioFormat format_;
+  std::vector<uint8_t> buffer_;
+  size_t used_ = 0;
+  std::chrono::steady_clock::time_point oldest_;
+};
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "convert.h"
+
+// Waveform index: min, max and RMS per channel over blocks of 256, 4096 and
+// 65536 frames, so a viewer can draw an hour of audio from a few kilobytes
+// instead of reading the recording.
+//
+// File layout, all little-endian:
+//   0   "ACWF"
+//   4   u16 version (1), u16 channels, u32 sampling rate, u32 level count (3)
+//   16  u64 frames (0 until the index is closed)
+//   24  per level, 24 bytes: u32 frames per entry, u32 entry size,
+//       u64 offset of the first entry, u64 entry count
+//   96  level 0 entries, then level 1 and level 2
+// An entry holds, per channel, int16 min, max and RMS scaled to full scale
+// 32767. The last entry of each level may cover fewer frames.
+//
+// Level 0 is appended as it is computed; the two coarser levels (1/16 and
+// 1/256 of its size) are kept in memory and written on Close(), together
+// with the final header. If the process dies first, the header still says 0
+// entries and level 0 runs to the end of the file.
+namespace waveform_internal {
+
+// Adds |frames| interleaved frames into per-channel running min, max and sum
+// of squares.
+using StatsKernel = void (*)(const float* pcm, size_t frames, int channels,
+                             float* min, float* max, float* sum_squares);
+
+inline void StatsScalar(const float* pcm, size_t frames, int channels,
+                        float* min, float* max, float* sum_squares) {
+  for (size_t i = 0; i < frames; ++i) {
+    for (int c = 0; c < channels; ++c) {
+      float x = *pcm++;
+      min[c] = std::min(min[c], x);
+      max[c] = std::max(max[c], x);
+      sum_squares[c] += x * x;
+    }
+  }
+}
+
+#ifdef CONVERT_X86
+
+// Interleaved channels map onto fixed lanes once the loop steps by a
+// multiple of both 4 and the channel count; lane k of a group of G floats
+// belongs to channel k % channels. G is at least 16 so several independent
+// accumulators hide the latency of min, max and add.
+CONVERT_TARGET("sse2")
+inline void StatsSse2(const float* pcm, size_t frames, int channels,
+                      float* min, float* max, float* sum_squares) {
+  int period = channels % 4 == 0   ? channels
+               : channels % 2 == 0 ? channels * 2
+                                   : channels * 4;
+  int group = period * std::max(1, 16 / period);
+  int vectors = group / 4;
+  if (vectors > 8) {
+    StatsScalar(pcm, frames, channels, min, max, sum_squares);
+    return;
+  }
+  __m128 vmin[8], vmax[8], vsum[8];
+  for (int v = 0; v < vectors; ++v) {
+    vmin[v] = _mm_set1_ps(FLT_MAX);
+    vmax[v] = _mm_set1_ps(-FLT_MAX);
+    vsum[v] = _mm_setzero_ps();
+  }
+  size_t count = frames * channels;
+  size_t whole = count / group * group;
+  for (size_t i = 0; i < whole; i += group) {
+    for (int v = 0; v < vectors; ++v) {
+      __m128 x = _mm_loadu_ps(pcm + i + v * 4);
+      vmin[v] = _mm_min_ps(vmin[v], x);
+      vmax[v] = _mm_max_ps(vmax[v], x);
+      vsum[v] = _mm_add_ps(vsum[v], _mm_mul_ps(x, x));
+    }
+  }
+  float lanes_min[32], lanes_max[32], lanes_sum[32];
+  for (int v = 0; v < vectors; ++v) {
+    _mm_storeu_ps(lanes_min + v * 4, vmin[v]);
+    _mm_storeu_ps(lanes_max + v * 4, vmax[v]);
+    _mm_storeu_ps(lanes_sum + v * 4, vsum[v]);
+  }
+  for (int k = 0; k < group; ++k) {
+    int c = k % channels;
+    min[c] = std::min(min[c], lanes_min[k]);
+    max[c] = std::max(max[c], lanes_max[k]);
+    sum_squares[c] += lanes_sum[k];
+  }
+  StatsScalar(pcm + whole, (count - whole) / channels, channels, min, max,
+              sum_squares);
+}
+
+#endif  // CONVERT_X86
+
+inline StatsKernel DefaultStatsKernel() {
+#ifdef CONVERT_X86
+  if (convert_internal::CpuSupports(ConvertIsa::kSse2)) {
+    return &StatsSse2;
+  }
+#endif
+  return &StatsScalar;
+}
+
+inline int16_t ToInt16(double x) {
+  double scaled = std::round(x * 32767.0);
+  return static_cast<int16_t>(std::min(std::max(scaled, -32768.0), 32767.0));
+}
+
+inline void PutLe(uint8_t* p, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    p[i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
+
+}  // namespace waveform_internal
+
+class WaveformIndex {
+ public:
+  static constexpr int kLevels = 3;
+  static constexpr uint32_t kFramesPerEntry[kLevels] = {256, 4096, 65536};
+  static constexpr size_t kHeaderSize = 24 + kLevels * 24;
+
+  ~WaveformIndex() { Close(); }
+
+  bool Open(const std::string& path, int channels, uint32_t sampling_rate) {
+    Close();
+    if (channels <= 0) {
+      return false;
+    }
+#ifdef _MSC_VER
+    if (::fopen_s(&file_, path.c_str(), "wb") != 0) {
+      file_ = NULL;
+    }
+#else
+    file_ = ::fopen(path.c_str(), "wb");
+#endif
+    if (file_ == NULL) {
+      return false;
+    }
+    channels_ = channels;
+    sampling_rate_ = sampling_rate;
+    frames_ = 0;
+    level0_entries_ = 0;
+    entry_.resize(EntrySize());
+    for (Level& level : levels_) {
+      level.Reset(channels);
+    }
+    coarse_[0].clear();
+    coarse_[1].clear();
+    kernel_ = waveform_internal::DefaultStatsKernel();
+    ok_ = WriteHeader();
+    return ok_;
+  }
+
+  bool is_open() const { return file_ != NULL; }
+
+  // Adds |frames| interleaved frames.
+  void Process(const float* pcm, size_t frames) {
+    Level& base = levels_[0];
+    while (frames > 0 && file_ != NULL) {
+      size_t n = std::min<size_t>(frames, kFramesPerEntry[0] - base.frames);
+      kernel_(pcm, n, channels_, base.min.data(), base.max.data(),
+              base.block_squares.data());
+      for (int c = 0; c < channels_; ++c) {
+        base.sum_squares[c] += base.block_squares[c];
+        base.block_squares[c] = 0;
+      }
+      base.frames += static_cast<uint32_t>(n);
+      frames_ += n;
+      if (base.frames == kFramesPerEntry[0]) {
+        Emit(0);
+      }
+      pcm += n * channels_;
+      frames -= n;
+    }
+  }
+
+  // Same as Process() with |frames| frames of zeros, without scanning any.
+  void ProcessSilence(uint64_t frames) {
+    Level& base = levels_[0];
+    while (frames > 0 && file_ != NULL) {
+      uint32_t n = static_cast<uint32_t>(
+          std::min<uint64_t>(frames, kFramesPerEntry[0] - base.frames));
+      for (int c = 0; c < channels_; ++c) {
+        base.min[c] = std::min(base.min[c], 0.0f);
+        base.max[c] = std::max(base.max[c], 0.0f);
+      }
+      base.frames += n;
+      frames_ += n;
+      if (base.frames == kFramesPerEntry[0]) {
+        Emit(0);
+      }
+      frames -= n;
+    }
+  }
+
+  // Writes the partial last entries, the coarse levels and the final
+  // header. Returns false if anything failed to be written.
+  bool Close() {
+    if (file_ == NULL) {
+      return true;
+    }
+    for (int i = 0; i < kLevels; ++i) {
+      if (levels_[i].frames != 0) {
+        Emit(i);
+      }
+    }
+    uint64_t entries[kLevels] = {level0_entries_,
+                                 coarse_[0].size() / EntrySize(),
+                                 coarse_[1].size() / EntrySize()};
+    uint64_t offsets[kLevels];
+    offsets[0] = kHeaderSize;
+    offsets[1] = offsets[0] + entries[0] * EntrySize();
+    offsets[2] = offsets[1] + entries[1] * EntrySize();
+    for (int i = 0; i < 2; ++i) {
+      if (!coarse_[i].empty() &&
+          ::fwrite(coarse_[i].data(), coarse_[i].size(), 1, file_) != 1) {
+        ok_ = false;
+      }
+    }
+    if (ok_) {
+      ok_ = ::fseek(file_, 0, SEEK_SET) == 0 && WriteHeader(entries, offsets);
+    }
+    bool ok = ::fclose(file_) == 0 && ok_;
+    file_ = NULL;
+    return ok;
+  }
+
+ private:
+  struct Level {
+    std::vector<float> min;
+    std::vector<float> max;
+    std::vector<double> sum_squares;
+    // Level 0 only: the kernel's float sum for the current call.
+    std::vector<float> block_squares;
+    uint32_t frames = 0;
+
+    void Reset(int channels) {
+      min.assign(channels, FLT_MAX);
+      max.assign(channels, -FLT_MAX);
+      sum_squares.assign(channels, 0.0);
+      block_squares.assign(channels, 0.0f);
+      frames = 0;
+    }
+  };
+
+  size_t EntrySize() const { return size_t(channels_) * 6; }
+
+  // Ends the current entry of level |i| and folds it into the next level.
+  void Emit(int i) {
+    Level& level = levels_[i];
+    uint8_t* entry = entry_.data();
+    for (int c = 0; c < channels_; ++c) {
+      double rms = std::sqrt(level.sum_squares[c] / level.frames);
+      waveform_internal::PutLe(
+          entry, uint16_t(waveform_internal::ToInt16(level.min[c])), 2);
+      waveform_internal::PutLe(
+          entry + 2, uint16_t(waveform_internal::ToInt16(level.max[c])), 2);
+      waveform_internal::PutLe(entry + 4,
+                               uint16_t(waveform_internal::ToInt16(rms)), 2);
+      entry += 6;
+    }
+    if (i == 0) {
+      if (::fwrite(entry_.data(), EntrySize(), 1, file_) != 1) {
+        ok_ = false;
+      }
+      ++level0_entries_;
+    } else {
+      coarse_[i - 1].insert(coarse_[i - 1].end(), entry_.begin(),
+                            entry_.end());
+    }
+    if (i + 1 < kLevels) {
+      Level& next = levels_[i + 1];
+      for (int c = 0; c < channels_; ++c) {
+        next.min[c] = std::min(next.min[c], level.min[c]);
+        next.max[c] = std::max(next.max[c], level.max[c]);
+        next.sum_squares[c] += level.sum_squares[c];
+      }
+      next.frames += level.frames;
+      if (next.frames == kFramesPerEntry[i + 1]) {
+        Emit(i + 1);
+      }
+    }
+    level.Reset(channels_);
+  }
+
+  bool WriteHeader(const uint64_t* entries = nullptr,
+                   const uint64_t* offsets = nullptr) {
+    using waveform_internal::PutLe;
+    uint8_t header[kHeaderSize] = {'A', 'C', 'W', 'F'};
+    PutLe(header + 4, 1, 2);
+    PutLe(header + 6, channels_, 2);
+    PutLe(header + 8, sampling_rate_, 4);
+    PutLe(header + 12, kLevels, 4);
+    PutLe(header + 16, entries != nullptr ? frames_ : 0, 8);
+    for (int i = 0; i < kLevels; ++i) {
+      uint8_t* p = header + 24 + i * 24;
+      PutLe(p, kFramesPerEntry[i], 4);
+      PutLe(p + 4, EntrySize(), 4);
+      PutLe(p + 8, offsets != nullptr ? offsets[i] : i == 0 ? kHeaderSize : 0,
+            8);
+      PutLe(p + 16, entries != nullptr ? entries[i] : 0, 8);
+    }
+    return ::fwrite(header, sizeof(header), 1, file_) == 1;
+  }
+
+  FILE* file_ = NULL;
+  bool ok_ = true;
+  int channels_ = 0;
+  uint32_t sampling_rate_ = 0;
+  uint64_t frames_ = 0;
+  uint64_t level0_entries_ = 0;
+  Level levels_[kLevels];
+  // Encoded entries of levels 1 and 2, written on Close().
+  std::vector<uint8_t> coarse_[kLevels - 1];
+  waveform_internal::StatsKernel kernel_ = &waveform_internal::StatsScalar;
+  std::vector<uint8_t> entry_;
+};
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "../inject/protocol.h"
+#include "convert.h"
+#include "loguru.hpp"
+#include "recorder.h"
+#include "waveform.h"
+
+// Passes everything to another Recorder and builds a WaveformIndex of what
+// it stores, in <name>.peaks next to each file. Wrapping the recorders a
+// SegmentedRecorder creates gives every segment its own index.
+class WaveformRecorder : public Recorder {
+ public:
+  explicit WaveformRecorder(std::unique_ptr<Recorder> recorder)
+      : recorder_(std::move(recorder)) {}
+  ~WaveformRecorder() override { Close(); }
+
+  bool Open(const std::string& path, const AudioFormat& format) override {
+    Close();
+    if (!recorder_->Open(path, format)) {
+      return false;
+    }
+    encoding_ = EncodingOf(format);
+    if (encoding_ == SampleEncoding::kUnknown) {
+      DLOG_F(WARNING, "no waveform index for %u-bit samples.",
+             format.bits_per_sample);
+      return true;
+    }
+    std::filesystem::path p(path);
+    index_path_ = (p.parent_path() / p.stem()).string() + ".peaks";
+    if (!index_.Open(index_path_, format.channels, format.sampling_rate)) {
+      DLOG_F(ERROR, "failed to create %s.", index_path_.c_str());
+    }
+    return true;
+  }
+
+  bool is_open() const override { return recorder_->is_open(); }
+  const AudioFormat& format() const override { return recorder_->format(); }
+  uint64_t bytes() const override { return recorder_->bytes(); }
+  void Reserve(uint64_t bytes) override { recorder_->Reserve(bytes); }
+
+  bool Write(const uint8_t* data, size_t size) override {
+    if (!recorder_->Write(data, size)) {
+      return false;
+    }
+    if (index_.is_open()) {
+      Index(data, size);
+    }
+    return true;
+  }
+
+  bool WriteSilence(uint64_t frames) override {
+    if (!recorder_->WriteSilence(frames)) {
+      return false;
+    }
+    index_.ProcessSilence(frames);
+    return true;
+  }
+
+  bool Idle() override { return recorder_->Idle(); }
+
+  void Close() override {
+    bool empty = recorder_->bytes() == 0;
+    recorder_->Close();
+    if (!index_.is_open()) {
+      return;
+    }
+    if (!index_.Close()) {
+      DLOG_F(ERROR, "failed to write %s.", index_path_.c_str());
+    } else if (empty) {
+      // A spare segment that was never used; its file is removed as well.
+      std::error_code ec;
+      std::filesystem::remove(index_path_, ec);
+    }
+  }
+
+ private:
+  // Samples are turned into float a few thousand at a time, so the scratch
+  // buffer stays in cache.
+  void Index(const uint8_t* data, size_t size) {
+    const AudioFormat& format = recorder_->format();
+    size_t channels = format.channels;
+    size_t frame_size = format.block_align();
+    size_t frames = size / frame_size;
+    size_t chunk = std::max<size_t>(4096 / channels, 1);
+    if (encoding_ == SampleEncoding::kF32) {
+      index_.Process(reinterpret_cast<const float*>(data), frames);
+      return;
+    }
+    floats_.resize(chunk * channels);
+    for (size_t done = 0; done < frames; done += chunk) {
+      size_t n = std::min(chunk, frames - done);
+      ConvertSamples(SampleEncoding::kF32, floats_.data(), encoding_,
+                     data + done * frame_size, n * channels);
+      index_.Process(floats_.data(), n);
+    }
+  }
+
+  std::unique_ptr<Recorder> recorder_;
+  SampleEncoding encoding_ = SampleEncoding::kUnknown;
+  std::string index_path_;
+  WaveformIndex index_;
+  std::vector<float> floats_;
+};
@@ -0,0 +1,370 @@
+﻿#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define DR_WAV_IMPLEMENTATION
+#include "../inject/broadcast.h"
+#include "../inject/platform.h"
+#include "../injector/CLI11.hpp"
+#include "../injector/dr_wav.h"
+#include "../injector/loguru.hpp"
+#include "../inject/transport.h"
+#include "../injector/pipeline.h"
+#include "../injector/stream_loop.h"
+#include "../injector/trace.h"
+
+// Replays trace records at the pace they were captured: Wait() returns once
+// as much time has passed since the Pacer was created as separates
+// |timestamp| from the first timestamp it was given.
+class Pacer {
+ public:
+  Pacer() : start_(MonotonicNanoseconds()) {}
+
+  void Wait(uint64_t timestamp) {
+    if (first_) {
+      first_timestamp_ = timestamp;
+      first_ = false;
+    }
+    uint64_t due = start_ + (timestamp - first_timestamp_);
+    uint64_t now = MonotonicNanoseconds();
+    if (due > now) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+    }
+  }
+
+ private:
+  uint64_t start_;
+  uint64_t first_timestamp_ = 0;
+  bool first_ = true;
+};
+
+// Publishes |trace_path| through |transport| the way the inject DLL does,
+// then closes it. Records are never dropped: a full ring is retried, so the
+// output matches a plain replay.
+static void Produce(Transport* transport, const std::string& trace_path,
+                    bool realtime) {
+  TraceReader trace;
+  if (!trace.Open(trace_path)) {
+    transport->Close();
+    return;
+  }
+  Pacer pacer;
+  uint64_t timestamp = 0;
+  size_t size = 0;
+  while (const uint8_t* buf = trace.Next(&timestamp, &size)) {
+    if (realtime) {
+      pacer.Wait(timestamp);
+    }
+    while (!transport->ring().Write(buf, size)) {
+      transport->Notify();
+      std::this_thread::yield();
+    }
+    transport->Notify();
+  }
+  transport->Close();
+}
+
+// Replays the trace from |streams| producer threads at once, each through
+// its own shared-memory Transport, and serves them all with one StreamLoop
+// on this thread, like `injector --all` serves several processes. With
+// --mix they are mixed into |output_path| instead of a file each.
+static int ReplayStreams(const std::string& trace_path,
+                         const std::string& output_path, bool realtime,
+                         uint32_t streams, const Pipeline::Options& options,
+                         const Mixer::Options& mix_options) {
+  uint32_t base = CurrentProcessId() << 8;
+  StreamLoop loop;
+  if (!loop.Create(base)) {
+    LOG_F(ERROR, "Can't create the doorbell.");
+    return 1;
+  }
+  Transport::Settings settings;
+  settings.protocol_version = kProtocolVersion;
+  settings.doorbell = loop.doorbell();
+  std::shared_ptr<WorkerPool> pool = Pipeline::MakePool(options);
+  std::filesystem::path p(output_path);
+  std::unique_ptr<Pipeline> mix;
+  std::unique_ptr<Mixer> mixer;
+  if (mix_options.enabled) {
+    // The mix is clocked already; the sources are smoothed on the way in.
+    Pipeline::Options mix_pipeline_options = options;
+    mix_pipeline_options.jitter_ms = 0;
+    mix = std::make_unique<Pipeline>(mix_pipeline_options, output_path, pool);
+    mixer = Pipeline::MakeMixer(options, mix_options,
+                                [&](const Packet& packet) {
+                                  mix->Write(packet);
+                                });
+    loop.SetPump([&] { mixer->Pump(); });
+  }
+  std::vector<std::unique_ptr<Transport>> producers;
+  for (uint32_t i = 0; i < streams; ++i) {
+    uint32_t id = base + 1 + i;
+    producers.push_back(std::make_unique<Transport>());
+    auto stream = std::make_unique<StreamLoop::Stream>();
+    stream->id = id;
+    stream->name = "producer " + std::to_string(i + 1);
+    stream->transport = std::make_unique<Transport>();
+    if (!producers.back()->Create(id) ||
+        !stream->transport->Open(id, settings)) {
+      LOG_F(ERROR, "Can't create transport %u.", id);
+      return 1;
+    }
+    if (mixer) {
+      size_t source = mixer->AddSource(
+          stream->name, Mixer::GainFor(mix_options, stream->name));
+      stream->pipeline = std::make_unique<Pipeline>(
+          mixer.get(), source, output_path, options.jitter_ms);
+    } else {
+      std::string path = (p.parent_path() / p.stem()).string() + "-stream" +
+                         std::to_string(i + 1) + p.extension().string();
+      stream->pipeline = std::make_unique<Pipeline>(options, path, pool);
+    }
+    loop.Add(std::move(stream));
+  }
+
+  uint64_t records = 0;
+  uint64_t frames = 0;
+  uint64_t lost = 0;
+  loop.SetFinishHandler([&](const StreamLoop::Stream& stream) {
+    records += stream.records;
+    frames += stream.pipeline->frames();
+    lost += stream.pipeline->lost();
+  });
+  uint64_t start = MonotonicNanoseconds();
+  std::vector<std::thread> threads;
+  for (std::unique_ptr<Transport>& producer : producers) {
+    threads.emplace_back(Produce, producer.get(), trace_path, realtime);
+  }
+  loop.Run([] { return false; });
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  if (mixer) {
+    mixer->Flush();
+    mix->Close();
+  }
+  double seconds = (MonotonicNanoseconds() - start) / 1e9;
+  LOG_F(INFO,
+        "Served %u streams (%llu records, %llu frames) in %.3f s on one "
+        "thread: %.0f frames/s, %llu idle wakeups, %llu packets lost.",
+        streams, (unsigned long long)records, (unsigned long long)frames,
+        seconds, frames / seconds, (unsigned long long)loop.idle_wakeups(),
+        (unsigned long long)lost);
+  return 0;
+}
+
+// Publishes |trace_path| through |broadcast| packet by packet, the way the
+// inject DLL does, one frame per trace record, then closes it. Nothing waits
+// for the readers.
+static void Publish(Broadcast* broadcast, const std::string& trace_path,
+                    bool realtime, uint64_t* published_bytes) {
+  TraceReader trace;
+  if (!trace.Open(trace_path)) {
+    broadcast->Close();
+    return;
+  }
+  Decoder decoder;
+  Pacer pacer;
+  uint64_t timestamp = 0;
+  size_t size = 0;
+  while (const uint8_t* buf = trace.Next(&timestamp, &size)) {
+    if (realtime) {
+      pacer.Wait(timestamp);
+    }
+    decoder.Decode(buf, size, [&](const Packet& packet) {
+      PacketMessage message{};
+      message.frames = packet.frames;
+      message.flags = packet.flags;
+      message.sequence = packet.sequence;
+      message.position = packet.position;
+      message.timestamp_ns = packet.timestamp_ns;
+      if (broadcast->Add(*packet.format, message, packet.data, packet.size,
+                         packet.stream)) {
+        *published_bytes += packet.size;
+      }
+    });
+    broadcast->Flush();
+  }
+  broadcast->Close();
+}
+
+// Replays the trace through a Broadcast read by |readers| threads at once,
+// each into its own file, like several `injector --listen` on one capture.
+// Unless --realtime paces the producer, it can lap readers that are busy
+// writing, which then skip ahead; the report says how much each one missed.
+static int ReplayBroadcast(const std::string& trace_path,
+                           const std::string& output_path, bool realtime,
+                           uint32_t readers,
+                           const Pipeline::Options& options) {
+  uint32_t id = CurrentProcessId();
+  Broadcast broadcast;
+  if (!broadcast.Create(id)) {
+    LOG_F(ERROR, "Can't create the broadcast.");
+    return 1;
+  }
+  struct Reader {
+    BroadcastReader reader;
+    std::unique_ptr<Pipeline> pipeline;
+    uint64_t records = 0;
+    bool failed = false;
+  };
+  std::filesystem::path p(output_path);
+  std::vector<std::unique_ptr<Reader>> list;
+  for (uint32_t i = 0; i < readers; ++i) {
+    auto reader = std::make_unique<Reader>();
+    if (!reader->reader.Open(id)) {
+      LOG_F(ERROR, "Can't open broadcast reader %u.", i + 1);
+      return 1;
+    }
+    std::string path = (p.parent_path() / p.stem()).string() + "-reader" +
+                       std::to_string(i + 1) + p.extension().string();
+    reader->pipeline = std::make_unique<Pipeline>(options, path);
+    list.push_back(std::move(reader));
+  }
+
+  uint64_t start = MonotonicNanoseconds();
+  std::vector<std::thread> threads;
+  for (std::unique_ptr<Reader>& r : list) {
+    threads.emplace_back([reader = r.get()] {
+      size_t size = 0;
+      while (true) {
+        bool closed = reader->reader.closed();
+        if (const uint8_t* buf = reader->reader.Read(&size)) {
+          if (!reader->pipeline->Process(buf, size)) {
+            reader->failed = true;
+            break;
+          }
+          ++reader->records;
+          continue;
+        }
+        if (closed) {
+          break;
+        }
+        reader->reader.Wait(kInfinite);
+      }
+      reader->pipeline->Close();
+    });
+  }
+  uint64_t published_bytes = 0;
+  Publish(&broadcast, trace_path, realtime, &published_bytes);
+  double publish_seconds = (MonotonicNanoseconds() - start) / 1e9;
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  double seconds = (MonotonicNanoseconds() - start) / 1e9;
+
+  double mb = published_bytes / (1024.0 * 1024.0);
+  LOG_F(INFO, "Published %.1f MiB of PCM in %.3f s (%.1f MiB/s) to %u readers.",
+        mb, publish_seconds, mb / publish_seconds, readers);
+  bool failed = false;
+  for (size_t i = 0; i < list.size(); ++i) {
+    const Reader& r = *list[i];
+    failed |= r.failed;
+    LOG_F(INFO,
+          "reader %zu: %llu records, %llu frames, %llu packets lost, %.1f "
+          "MiB skipped in %llu laps%s. Saved to %s.",
+          i + 1, (unsigned long long)r.records,
+          (unsigned long long)r.pipeline->frames(),
+          (unsigned long long)r.pipeline->lost(),
+          r.reader.skipped_bytes() / (1024.0 * 1024.0),
+          (unsigned long long)r.reader.laps(),
+          r.failed ? ", unexpected data" : "", r.pipeline->path().c_str());
+  }
+  LOG_F(INFO, "Done in %.3f s.", seconds);
+  return failed ? 1 : 0;
+}
+
+// Feeds a trace recorded with `injector --trace` through the capture
+// pipeline, either as fast as possible to measure throughput or at the pace
+// it was captured to reproduce a session. Needs no Windows APIs.
+int main(int argc, char** argv) {
+  CLI::App app{"replay"};
+  std::string trace_path;
+  std::string output_path = "replay.wav";
+  bool realtime = false;
+  app.add_option("trace", trace_path, "trace file from injector --trace")
+      ->required();
+  app.add_option("-s,--save", output_path, "output file");
+  app.add_flag("--realtime", realtime, "replay at the pace it was captured");
+  uint32_t streams = 0;
+  app.add_option("--streams", streams,
+                 "replay through N concurrent synthetic producers served by "
+                 "one stream loop (0: read the trace directly)");
+  uint32_t readers = 0;
+  app.add_option("--broadcast", readers,
+                 "publish the trace once through a broadcast read by N "
+                 "concurrent readers, each into its own file (0: off)");
+  Pipeline::Options options;
+  Pipeline::AddOptions(app, &options);
+  Mixer::Options mix_options;
+  Mixer::AddOptions(app, &mix_options);
+
+  try {
+    app.parse(argc, argv);
+  } catch (const CLI::ParseError& e) {
+    return app.exit(e);
+  }
+
+  if (mix_options.enabled && streams == 0) {
+    LOG_F(ERROR, "--mix needs --streams.");
+    return 1;
+  }
+  if (readers != 0) {
+    if (streams != 0) {
+      LOG_F(ERROR, "--broadcast cannot be combined with --streams.");
+      return 1;
+    }
+    return ReplayBroadcast(trace_path, output_path, realtime, readers,
+                           options);
+  }
+  if (streams != 0) {
+    return ReplayStreams(trace_path, output_path, realtime, streams, options,
+                         mix_options);
+  }
+
+  TraceReader trace;
+  if (!trace.Open(trace_path)) {
+    LOG_F(ERROR, "Can't open trace %s.", trace_path.c_str());
+    return 1;
+  }
+
+  Pipeline pipeline(options, output_path);
+  uint64_t records = 0;
+  uint64_t record_bytes = 0;
+  uint64_t start = MonotonicNanoseconds();
+  Pacer pacer;
+
+  uint64_t timestamp = 0;
+  size_t size = 0;
+  while (const uint8_t* buf = trace.Next(&timestamp, &size)) {
+    if (realtime) {
+      pacer.Wait(timestamp);
+    }
+    if (!pipeline.Process(buf, size)) {
+      LOG_F(ERROR, "unexpected data in record %llu.",
+            (unsigned long long)records);
+      return 1;
+    }
+    ++records;
+    record_bytes += size;
+  }
+  pipeline.Close();
+
+  double seconds = (MonotonicNanoseconds() - start) / 1e9;
+  double mb = record_bytes / (1024.0 * 1024.0);
+  LOG_F(INFO,
+        "Replayed %llu records (%llu packets, %llu frames, %llu of them "
+        "silent, %.1f MiB) in %.3f s: %.1f MiB/s, %.0f frames/s, %llu "
+        "packets lost.",
+        (unsigned long long)records, (unsigned long long)pipeline.packets(),
+        (unsigned long long)pipeline.frames(),
+        (unsigned long long)pipeline.silent_frames(), mb, seconds,
+        mb / seconds, pipeline.frames() / seconds,
+        (unsigned long long)pipeline.lost());
+  return 0;
+}
@@ -0,0 +1,319 @@
+﻿// Tests the BroadcastRing the capture is broadcast through: records around
+// the wrap point, reader slots, a reader being lapped, and a stress run with
+// several reader threads on one ring, some too slow to keep up and one that
+// keeps leaving and rejoining. Every record a reader gets must be intact,
+// byte for byte, and every record it misses must be accounted for by a lap.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "../inject/broadcast_ring.h"
+#include "check.h"
+
+namespace {
+
+// A ring in ordinary memory, aligned like a shared mapping.
+struct LocalRing {
+  explicit LocalRing(size_t capacity)
+      : size(BroadcastRing::RequiredSize(capacity)),
+        memory(new uint64_t[size / 8]) {
+    ring.Initialize(memory.get(), capacity);
+  }
+  size_t size;
+  std::unique_ptr<uint64_t[]> memory;
+  BroadcastRing ring;
+};
+
+bool Never(uint32_t) { return false; }
+
+// Payload byte |i| of record |seq|.
+uint8_t Pattern(uint64_t seq, size_t i) {
+  return static_cast<uint8_t>(seq * 131 + i * 7);
+}
+
+void Publish(BroadcastRing* ring, uint64_t seq, size_t size) {
+  uint8_t* buf = ring->Reserve(size);
+  ::memcpy(buf, &seq, sizeof(seq));
+  for (size_t i = sizeof(seq); i < size; ++i) {
+    buf[i] = Pattern(seq, i);
+  }
+  ring->Commit(size);
+}
+
+bool Verify(const std::vector<uint8_t>& record, size_t size, uint64_t* seq) {
+  if (record.size() != size || size < sizeof(*seq)) {
+    return false;
+  }
+  ::memcpy(seq, record.data(), sizeof(*seq));
+  for (size_t i = sizeof(*seq); i < size; ++i) {
+    if (record[i] != Pattern(*seq, i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Record sizes from 8 bytes to 3 KiB, so records wrap at every offset.
+size_t SizeOf(uint64_t seq) { return 8 + (seq * 2654435761u) % 3064; }
+
+bool VerifySeq(const std::vector<uint8_t>& record, uint64_t* seq) {
+  if (record.size() < sizeof(*seq)) {
+    return false;
+  }
+  ::memcpy(seq, record.data(), sizeof(*seq));
+  return Verify(record, SizeOf(*seq), seq);
+}
+
+void TestWrapAndLap() {
+  LocalRing r(1024);
+  BroadcastRing& ring = r.ring;
+  BroadcastRing reader;
+  CHECK(reader.Attach(r.memory.get(), r.size));
+  CHECK(!ring.listening());
+  CHECK_EQ(ring.max_record_size(), 1024 / 2 - 8);
+  CHECK(ring.Reserve(ring.max_record_size() + 1) == nullptr);
+
+  BroadcastRing::Cursor cursor;
+  CHECK(reader.AddReader(1, Never, &cursor));
+  CHECK(ring.listening());
+  std::vector<uint8_t> record;
+  CHECK(!reader.Read(&cursor, &record));
+  CHECK(reader.Empty(cursor));
+
+  // 3 records of 296 bytes (304 with the header) leave 112 bytes before the
+  // end, so the fourth goes after a padding record, at offset 0. The
+  // producer does not wait for the reader: the first record is overwritten.
+  for (uint64_t n = 0; n < 3; ++n) {
+    Publish(&ring, n, 296);
+  }
+  uint64_t seq = 0;
+  CHECK(reader.Read(&cursor, &record) && Verify(record, 296, &seq) &&
+        seq == 0);
+  Publish(&ring, 3, 296);
+  CHECK_EQ(ring.control()->head.load(), 3 * 304 + 112 + 304);
+  CHECK(reader.Read(&cursor, &record) && Verify(record, 296, &seq) &&
+        seq == 1);
+  CHECK(reader.Read(&cursor, &record) && Verify(record, 296, &seq) &&
+        seq == 2);
+  // The padding is skipped.
+  CHECK(reader.Read(&cursor, &record) && Verify(record, 296, &seq) &&
+        seq == 3);
+  CHECK(!reader.Read(&cursor, &record));
+  CHECK_EQ(cursor.laps, 0u);
+
+  // More than a ring's length behind: the reader jumps to the newest
+  // position and counts what it missed, then reads on normally.
+  uint64_t head = ring.control()->head.load();
+  for (uint64_t n = 4; n < 10; ++n) {
+    Publish(&ring, n, 296);
+  }
+  uint64_t missed = ring.control()->head.load() - head;
+  CHECK(!reader.Read(&cursor, &record));
+  CHECK_EQ(cursor.laps, 1u);
+  CHECK_EQ(cursor.skipped_bytes, missed);
+  Publish(&ring, 10, 100);
+  CHECK(reader.Read(&cursor, &record) && Verify(record, 100, &seq) &&
+        seq == 10);
+
+  // Commit() may publish less than was reserved.
+  uint8_t* ptr = ring.Reserve(200);
+  CHECK(ptr != nullptr);
+  uint64_t eleven = 11;
+  ::memcpy(ptr, &eleven, sizeof(eleven));
+  ring.Commit(8);
+  CHECK(reader.Read(&cursor, &record) && record.size() == 8);
+
+  reader.RemoveReader(&cursor);
+  CHECK_EQ(cursor.slot, -1);
+  CHECK(!ring.listening());
+}
+
+// Every slot can be taken once, and one whose owner is gone is taken over.
+void TestSlots() {
+  LocalRing r(4096);
+  BroadcastRing reader;
+  CHECK(reader.Attach(r.memory.get(), r.size));
+  BroadcastRing::Cursor cursors[BroadcastRing::kMaxReaders + 1];
+  for (int i = 0; i < BroadcastRing::kMaxReaders; ++i) {
+    CHECK(reader.AddReader(100 + i, Never, &cursors[i]));
+    CHECK_EQ(cursors[i].slot, i);
+  }
+  BroadcastRing::Cursor& extra = cursors[BroadcastRing::kMaxReaders];
+  CHECK(!reader.AddReader(200, Never, &extra));
+  CHECK(reader.AddReader(200, [](uint32_t owner) { return owner == 103; },
+                         &extra));
+  CHECK_EQ(extra.slot, 3);
+  CHECK_EQ(r.ring.control()->readers.load(),
+           uint32_t(BroadcastRing::kMaxReaders));
+
+  reader.RemoveReader(&cursors[5]);
+  BroadcastRing::Cursor again;
+  CHECK(reader.AddReader(300, Never, &again));
+  CHECK_EQ(again.slot, 5);
+
+  // A new reader starts at the newest record.
+  Publish(&r.ring, 0, 64);
+  BroadcastRing::Cursor late;
+  reader.RemoveReader(&cursors[0]);
+  CHECK(reader.AddReader(400, Never, &late));
+  std::vector<uint8_t> record;
+  CHECK(!reader.Read(&late, &record));
+  Publish(&r.ring, 1, 64);
+  uint64_t seq = 0;
+  CHECK(reader.Read(&late, &record) && Verify(record, 64, &seq) && seq == 1);
+}
+
+struct ReaderStats {
+  uint64_t received = 0;
+  uint64_t missing = 0;
+  uint64_t laps = 0;
+  uint64_t unexplained_gaps = 0;
+  bool intact = true;
+  bool ordered = true;
+};
+
+// Reads until |done| and the ring is drained. A reader with |pause_every|
+// sleeps 1 ms every that many records, so the producer laps it.
+void ReadAll(const LocalRing& r, uint32_t owner, uint32_t pause_every,
+             uint64_t records, const std::atomic<bool>& done,
+             std::atomic<int>* ready, ReaderStats* stats) {
+  BroadcastRing ring;
+  BroadcastRing::Cursor cursor;
+  if (!ring.Attach(r.memory.get(), r.size) ||
+      !ring.AddReader(owner, Never, &cursor)) {
+    stats->intact = false;
+    ready->fetch_add(1);
+    return;
+  }
+  ready->fetch_add(1);
+  std::vector<uint8_t> record;
+  uint64_t next = 0;
+  // Laps as of the last record received. A lap may be noticed by a Read()
+  // that then finds nothing newer, so gaps are checked against this.
+  uint64_t laps = 0;
+  while (true) {
+    bool finished = done.load(std::memory_order_acquire);
+    if (!ring.Read(&cursor, &record)) {
+      if (finished) {
+        break;
+      }
+      std::this_thread::yield();
+      continue;
+    }
+    uint64_t seq = 0;
+    if (!VerifySeq(record, &seq)) {
+      stats->intact = false;
+      continue;
+    }
+    stats->ordered &= seq >= next;
+    if (seq > next) {
+      stats->missing += seq - next;
+      // Records are only ever missed by being lapped.
+      stats->unexplained_gaps += cursor.laps == laps;
+    }
+    next = seq + 1;
+    laps = cursor.laps;
+    if (++stats->received % pause_every == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  stats->missing += records - next;
+  stats->laps = cursor.laps;
+  ring.RemoveReader(&cursor);
+}
+
+void TestStress() {
+  constexpr uint64_t kRecords = 100000;
+  constexpr int kReaders = 6;
+  LocalRing r(64 * 1024);
+  std::atomic<bool> done{false};
+  std::atomic<int> ready{0};
+  std::vector<ReaderStats> stats(kReaders);
+  std::vector<std::thread> readers;
+  for (int i = 0; i < kReaders; ++i) {
+    // Half keep up as best they can, half are slow.
+    uint32_t pause_every = i < kReaders / 2 ? UINT32_MAX : 64;
+    readers.emplace_back([&, i, pause_every] {
+      ReadAll(r, 1000 + i, pause_every, kRecords, done, &ready, &stats[i]);
+    });
+  }
+
+  // Joins at a random point, checks a few records and leaves again, so
+  // slots are claimed and released while the others read.
+  std::atomic<uint64_t> rejoins{0};
+  bool rejoiner_intact = true;
+  std::thread rejoiner([&] {
+    BroadcastRing ring;
+    ring.Attach(r.memory.get(), r.size);
+    std::vector<uint8_t> record;
+    while (!done.load()) {
+      BroadcastRing::Cursor cursor;
+      if (!ring.AddReader(2000, Never, &cursor)) {
+        rejoiner_intact = false;
+        return;
+      }
+      for (int n = 0; n < 16 && !done.load();) {
+        uint64_t seq = 0;
+        if (ring.Read(&cursor, &record)) {
+          rejoiner_intact &= VerifySeq(record, &seq);
+          ++n;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+      ring.RemoveReader(&cursor);
+      rejoins.fetch_add(1);
+    }
+  });
+
+  while (ready.load() < kReaders) {
+    std::this_thread::yield();
+  }
+  // Paced so that readers on a single core get to run too, at several times
+  // the rate the slow readers consume.
+  for (uint64_t seq = 0; seq < kRecords; ++seq) {
+    Publish(&r.ring, seq, SizeOf(seq));
+    if (seq % 32 == 31) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+  done.store(true, std::memory_order_release);
+  for (std::thread& thread : readers) {
+    thread.join();
+  }
+  rejoiner.join();
+
+  for (int i = 0; i < kReaders; ++i) {
+    const ReaderStats& s = stats[i];
+    std::printf("reader %d: %llu received, %llu missed in %llu laps\n", i,
+                (unsigned long long)s.received,
+                (unsigned long long)s.missing, (unsigned long long)s.laps);
+    CHECK(s.intact);
+    CHECK(s.ordered);
+    CHECK_EQ(s.received + s.missing, kRecords);
+    CHECK_EQ(s.unexplained_gaps, 0u);
+    CHECK(s.missing == 0 || s.laps != 0);
+    CHECK(s.received != 0);
+    if (i >= kReaders / 2) {
+      CHECK(s.laps != 0);
+    }
+  }
+  std::printf("rejoined %llu times\n", (unsigned long long)rejoins.load());
+  CHECK(rejoiner_intact);
+  CHECK_EQ(r.ring.control()->readers.load(), 0u);
+}
+
+}  // namespace
+
+int main() {
+  TestWrapAndLap();
+  TestSlots();
+  TestStress();
+  return TestResult("broadcast_ring_test");
+}
@@ -0,0 +1,225 @@
+﻿// Counts the bytes each thread copies to get one 10 ms packet of 8 channel,
+// 192 kHz, 32-bit float PCM (61440 bytes) from an audio hook to the
+// consumer, along the original path and the current one.
+//
+// The original hook copied the packet into a static buffer behind the 0xFE
+// 0xCF magic and Header, then WriteFile() copied that buffer into the pipe,
+// both on the render thread, and the consumer's ReadFile() copied it out
+// again. That is emulated with a buffer standing in for the pipe.
+//
+// The current hook copies the PCM into a CaptureQueue and returns; the
+// worker frames it into the Transport ring as a v2 message, which is a
+// second copy of the PCM, off the render thread; the consumer decodes the
+// record in place. The framing the worker writes is counted too.
+//
+// Checks that the counts are what each path is expected to copy, that every
+// packet arrives intact, and prints the render thread's time per packet.
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "../inject/capture_queue.h"
+#include "../inject/inject.h"
+#include "../inject/platform.h"
+#include "../inject/transport.h"
+#include "check.h"
+
+namespace {
+
+constexpr uint32_t kFrames = 1920;
+constexpr uint32_t kChannels = 8;
+constexpr uint32_t kPcmBytes = kFrames * kChannels * 4;
+constexpr uint32_t kPackets = 2000;
+constexpr size_t kPipeSize = 1024 * 1024;
+
+// Bytes copied per location, over the whole run.
+struct Copies {
+  uint64_t render = 0;
+  // Into the ring, off the render thread.
+  uint64_t worker = 0;
+  uint64_t consumer = 0;
+  std::vector<uint64_t> render_ns;
+};
+
+void Copy(void* dst, const void* src, size_t size, uint64_t* counter) {
+  ::memcpy(dst, src, size);
+  *counter += size;
+}
+
+uint8_t Pattern(size_t i) {
+  return static_cast<uint8_t>(i * 7 + 1);
+}
+
+uint64_t Percentile(std::vector<uint64_t> v, double p) {
+  size_t i = static_cast<size_t>(p * (v.size() - 1));
+  std::nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
+}
+
+void Report(const char* name, const Copies& copies) {
+  std::printf(
+      "%s: per packet %llu bytes copied on the render thread, %llu on the "
+      "worker, %llu by the consumer; render thread p50 %llu "
+      "ns, p99 %llu ns\n",
+      name, (unsigned long long)(copies.render / kPackets),
+      (unsigned long long)(copies.worker / kPackets),
+      (unsigned long long)(copies.consumer / kPackets),
+      (unsigned long long)Percentile(copies.render_ns, 0.5),
+      (unsigned long long)Percentile(copies.render_ns, 0.99));
+}
+
+// The original writeCaptureData() and a consumer reading the pipe.
+Copies RunBaseline(const std::vector<uint8_t>& pcm) {
+  Copies copies;
+  std::unique_ptr<std::array<uint8_t, kPipeSize>> staging(
+      new std::array<uint8_t, kPipeSize>);
+  std::unique_ptr<std::array<uint8_t, kPipeSize>> pipe(
+      new std::array<uint8_t, kPipeSize>);
+  std::vector<uint8_t> received(kPipeSize);
+  bool intact = true;
+  for (uint64_t position = 0; position < kPackets; ++position) {
+    uint64_t begin = MonotonicNanoseconds();
+    uint8_t* buf = staging->data();
+    buf[0] = 0xFE;
+    buf[1] = 0xCF;
+    copies.render += 2;
+    Header header;
+    header.header_offset = 2;
+    header.header_size = sizeof(Header);
+    header.data_offset = header.header_offset + header.header_size;
+    header.data_size = kPcmBytes;
+    header.total_size =
+        header.header_offset + header.header_size + header.data_size;
+    header.channels = kChannels;
+    header.samples = kFrames;
+    header.bits_per_sample = 32;
+    header.sampling_rate = 192000;
+    Copy(buf + header.header_offset, &header, header.header_size,
+         &copies.render);
+    Copy(buf + header.data_offset, pcm.data(), kPcmBytes, &copies.render);
+    // WriteFile() copies the frame into the pipe's buffer.
+    Copy(pipe->data(), buf, header.total_size, &copies.render);
+    copies.render_ns.push_back(MonotonicNanoseconds() - begin);
+
+    // ReadFile() copies it out again.
+    Copy(received.data(), pipe->data(), header.total_size, &copies.consumer);
+    intact &= received[header.data_offset] == pcm[0] &&
+              received[header.total_size - 1] == pcm[kPcmBytes - 1];
+  }
+  CHECK(intact);
+  return copies;
+}
+
+// CaptureQueue, then a v2 frame in the Transport ring, as writeMessage()
+// builds it with batching off.
+Copies RunCurrent(const std::vector<uint8_t>& pcm) {
+  Copies copies;
+  CaptureQueue queue;
+  uint32_t id = CurrentProcessId() << 8 | 0x7E;
+  Transport transport;
+  Transport consumer;
+  CHECK(transport.Create(id));
+  CHECK(consumer.Open(id));
+  if (TestFailures() != 0) {
+    return copies;
+  }
+
+  AudioFormat format;
+  format.channels = kChannels;
+  format.bits_per_sample = 32;
+  format.sampling_rate = 192000;
+  format.sample_type = SampleType::kFloat;
+
+  Ring& ring = transport.ring();
+  FrameWriter frame;
+  Encoder encoder;
+  Decoder decoder;
+  uint64_t delivered = 0;
+  bool intact = true;
+  for (uint64_t position = 0; position < kPackets; ++position) {
+    uint64_t begin = MonotonicNanoseconds();
+    CapturePacket packet{};
+    packet.size = kPcmBytes;
+    packet.frames = kFrames;
+    packet.format = format;
+    packet.position = position * kFrames;
+    if (uint8_t* dst = queue.Begin(packet)) {
+      Copy(dst, pcm.data(), kPcmBytes, &copies.render);
+      queue.End(dst);
+    }
+    copies.render_ns.push_back(MonotonicNanoseconds() - begin);
+
+    queue.Drain([&](const CapturePacket& staged, const uint8_t* data) {
+      PacketMessage message{};
+      message.frames = staged.frames;
+      message.sequence = staged.sequence;
+      message.position = staged.position;
+      size_t size = std::min<size_t>(
+          FrameWriter::FrameSize(Encoder::kPacketOverhead + staged.size),
+          ring.max_record_size());
+      uint8_t* buf = ring.Reserve(size);
+      if (buf == nullptr) {
+        intact = false;
+        return;
+      }
+      frame.Begin(buf, size);
+      uint8_t* dst =
+          encoder.AddPacket(frame, staged.format, message, staged.size);
+      if (dst == nullptr) {
+        intact = false;
+        return;
+      }
+      Copy(dst, data, staged.size, &copies.worker);
+      size_t used = frame.Finish();
+      // Messages, the frame header and the offset table.
+      copies.worker += used - staged.size;
+      ring.Commit(used);
+    });
+
+    size_t size = 0;
+    while (const uint8_t* record = consumer.ring().Peek(&size)) {
+      intact &= decoder.Decode(record, size, [&](const Packet& p) {
+        intact &= p.size == kPcmBytes && p.data[0] == pcm[0] &&
+                  p.data[kPcmBytes - 1] == pcm[kPcmBytes - 1];
+        ++delivered;
+      });
+      consumer.ring().Release();
+    }
+  }
+  CHECK(intact);
+  CHECK_EQ(delivered, kPackets);
+  CHECK_EQ(queue.dropped(), 0u);
+  CHECK_EQ(decoder.lost(), 0u);
+  return copies;
+}
+
+}  // namespace
+
+int main() {
+  std::vector<uint8_t> pcm(kPcmBytes);
+  for (size_t i = 0; i < pcm.size(); ++i) {
+    pcm[i] = Pattern(i);
+  }
+
+  Copies baseline = RunBaseline(pcm);
+  Copies current = RunCurrent(pcm);
+  Report("baseline", baseline);
+  Report("current", current);
+
+  // Two copies of the frame on the render thread, one more by the consumer.
+  constexpr uint64_t kFrameBytes = 2 + sizeof(Header) + kPcmBytes;
+  CHECK_EQ(baseline.render, 2 * kFrameBytes * kPackets);
+  CHECK_EQ(baseline.consumer, kFrameBytes * kPackets);
+  // One copy of the PCM on the render thread, one into the ring on the
+  // worker, none by the consumer.
+  CHECK_EQ(current.render, uint64_t(kPcmBytes) * kPackets);
+  CHECK(current.worker >= uint64_t(kPcmBytes) * kPackets);
+  CHECK(current.worker < uint64_t(kPcmBytes + 256) * kPackets);
+  CHECK_EQ(current.consumer, 0u);
+  return TestResult("capture_copy_bench");
+}
@@ -0,0 +1,169 @@
+﻿// Measures what a capture hook costs the render thread: 1, 2 and 4 threads
+// stage 10 ms packets (480 frames of 8 channel float) through a
+// CaptureQueue, timing Begin() to End(), while a worker drains them into a
+// Transport that a mock consumer empties. The threads render 50 times faster
+// than real time, then once more unpaced so the queue overflows. Each run
+// checks that every packet is either delivered intact or counted as
+// dropped, and that the sequence numbers leave a gap for each drop.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "../inject/capture_queue.h"
+#include "../inject/platform.h"
+#include "../inject/transport.h"
+#include "check.h"
+
+namespace {
+
+constexpr uint32_t kFrames = 480;
+constexpr uint32_t kChannels = 8;
+constexpr uint32_t kPacketBytes = kFrames * kChannels * 4;
+constexpr uint32_t kPackets = 5000;
+// Time between the packets of one render thread when paced.
+constexpr uint64_t kPeriodNs = 200000;
+
+uint8_t Pattern(uint32_t stream, uint64_t position) {
+  return static_cast<uint8_t>(stream * 31 + position * 7);
+}
+
+uint64_t Percentile(std::vector<uint64_t>& v, double p) {
+  size_t i = static_cast<size_t>(p * (v.size() - 1));
+  std::nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
+}
+
+void Run(uint32_t threads, bool paced) {
+  CaptureQueue queue;
+  uint32_t id = CurrentProcessId() << 8 | 0x7D;
+  Transport transport;
+  Transport consumer;
+  CHECK(transport.Create(id));
+  CHECK(consumer.Open(id));
+  if (TestFailures() != 0) {
+    return;
+  }
+
+  AudioFormat format;
+  format.channels = kChannels;
+  format.bits_per_sample = 32;
+  format.sampling_rate = 48000;
+  format.sample_type = SampleType::kFloat;
+
+  std::atomic<uint32_t> running{threads};
+  std::vector<std::vector<uint64_t>> latency(threads);
+  std::vector<std::thread> render;
+  uint64_t start = MonotonicNanoseconds();
+  for (uint32_t t = 0; t < threads; ++t) {
+    render.emplace_back([&, t] {
+      std::vector<uint8_t> buffer(kPacketBytes);
+      latency[t].reserve(kPackets);
+      for (uint64_t position = 0; position < kPackets; ++position) {
+        ::memset(buffer.data(), Pattern(t, position), buffer.size());
+        if (paced) {
+          uint64_t due = start + position * kPeriodNs;
+          uint64_t now = MonotonicNanoseconds();
+          if (due > now) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+          }
+        }
+        uint64_t begin = MonotonicNanoseconds();
+        CapturePacket packet{};
+        packet.size = kPacketBytes;
+        packet.frames = kFrames;
+        packet.format = format;
+        packet.position = position;
+        packet.stream = t;
+        if (uint8_t* dst = queue.Begin(packet)) {
+          ::memcpy(dst, buffer.data(), buffer.size());
+          queue.End(dst);
+        }
+        latency[t].push_back(MonotonicNanoseconds() - begin);
+      }
+      running.fetch_sub(1);
+    });
+  }
+
+  // The mock consumer only frees what the worker publishes.
+  std::atomic<bool> done{false};
+  std::thread reader([&] {
+    while (!done.load()) {
+      consumer.ring().Skip();
+      std::this_thread::yield();
+    }
+  });
+
+  uint64_t drained = 0;
+  uint64_t next_sequence = 0;
+  uint64_t gaps = 0;
+  bool ordered = true;
+  bool intact = true;
+  std::vector<int64_t> last_position(threads, -1);
+  auto drain = [&] {
+    return queue.Drain([&](const CapturePacket& packet, const uint8_t* pcm) {
+      ordered &= packet.sequence >= next_sequence &&
+                 static_cast<int64_t>(packet.position) >
+                     last_position[packet.stream];
+      gaps += packet.sequence - next_sequence;
+      next_sequence = packet.sequence + 1;
+      last_position[packet.stream] = static_cast<int64_t>(packet.position);
+      uint8_t expected = Pattern(packet.stream, packet.position);
+      intact &= packet.size == kPacketBytes && pcm[0] == expected &&
+                pcm[kPacketBytes - 1] == expected;
+      while (!transport.ring().Write(pcm, packet.size)) {
+        std::this_thread::yield();
+      }
+      ++drained;
+    });
+  };
+  while (running.load() != 0) {
+    if (drain() == 0) {
+      std::this_thread::yield();
+    }
+  }
+  for (std::thread& thread : render) {
+    thread.join();
+  }
+  drain();
+  double seconds = (MonotonicNanoseconds() - start) / 1e9;
+  done.store(true);
+  reader.join();
+
+  std::vector<uint64_t> all;
+  for (const std::vector<uint64_t>& v : latency) {
+    all.insert(all.end(), v.begin(), v.end());
+  }
+  uint64_t dropped = queue.dropped();
+  std::printf(
+      "%u render threads%s: hook p50 %llu ns, p99 %llu ns, p99.9 %llu ns, "
+      "max %llu ns; %.0f MiB/s staged, %llu of %llu packets dropped\n",
+      threads, paced ? "" : " (unpaced)",
+      (unsigned long long)Percentile(all, 0.5),
+      (unsigned long long)Percentile(all, 0.99),
+      (unsigned long long)Percentile(all, 0.999),
+      (unsigned long long)*std::max_element(all.begin(), all.end()),
+      drained * kPacketBytes / seconds / (1024 * 1024),
+      (unsigned long long)dropped, (unsigned long long)all.size());
+  CHECK(intact);
+  CHECK(ordered);
+  CHECK_EQ(drained + dropped, all.size());
+  // Drops after the last delivered packet leave no gap behind them.
+  CHECK(gaps <= dropped);
+  CHECK_EQ(next_sequence + (dropped - gaps), all.size());
+}
+
+}  // namespace
+
+int main() {
+  for (uint32_t threads : {1u, 2u, 4u}) {
+    Run(threads, true);
+  }
+  Run(4, false);
+  return TestResult("capture_queue_bench");
+}
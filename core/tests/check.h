@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdio>
+
+// Minimal assertions for the test programs in this directory. A failed
+// CHECK() is reported and counted but does not stop the test, so one run
+// shows every failure; main() returns TestResult().
+
+inline int& TestFailures() {
+  static int failures = 0;
+  return failures;
+}
+
+#define CHECK(condition)                                                  \
+  do {                                                                    \
+    if (!(condition)) {                                                   \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,        \
+                   __LINE__, #condition);                                 \
+      ++TestFailures();                                                   \
+    }                                                                     \
+  } while (0)
+
+#define CHECK_EQ(a, b) CHECK((a) == (b))
+
+inline int TestResult(const char* name) {
+  if (TestFailures() != 0) {
+    std::fprintf(stderr, "%s: %d checks failed\n", name, TestFailures());
+    return 1;
+  }
+  std::printf("%s: passed\n", name);
+  return 0;
+}
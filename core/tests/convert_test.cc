@@ -0,0 +1,248 @@
+﻿// Compares every convert.h kernel set this CPU runs against the scalar
+// reference, and the scalar reference against the drwav_*_to_* conversions
+// it stands in for. Every count up to a few vector widths is converted at
+// several starting points, so each main loop and each tail is exercised on
+// inputs that include out-of-range values, infinities and NaN. Inputs are
+// copied to exact-size buffers, so a sanitizer build catches overreads, and
+// bytes past the output are checked to be untouched. Float to s16 and s24
+// must round to nearest, so that integer samples survive a trip through
+// float.
+
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <vector>
+
+#define DR_WAV_IMPLEMENTATION
+#include "../injector/convert.h"
+#include "../injector/dr_wav.h"
+#include "check.h"
+
+namespace {
+
+// Counts up to kMaxCount cover two full AVX-512 iterations plus every tail.
+constexpr size_t kMaxCount = 80;
+// The float inputs start with the special values; starting points up to
+// kMaxStart slide every one of them through every lane.
+constexpr size_t kMaxStart = 32;
+constexpr uint8_t kGuard = 0xA5;
+
+std::vector<float> FloatInputs(size_t size = kMaxStart + kMaxCount) {
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const float inf = std::numeric_limits<float>::infinity();
+  std::vector<float> v = {
+      0.0f, -0.0f, 1.0f, -1.0f, 0.5f, -0.5f, 1.0000001f, -1.0000001f,
+      2.0f, -2.0f, 1e10f, -1e10f, inf, -inf, nan, -nan,
+      // Around the s16 and s24 rounding steps, and denormals.
+      1.0f / 32768, -1.0f / 32768, 0.5f / 32768, 1.5f / 32768, -0.5f / 32768,
+      0.5f / 8388608, 1e-40f, -1e-40f, 0.99999994f, -0.99999994f};
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> dist(-1.25f, 1.25f);
+  while (v.size() < size) {
+    v.push_back(dist(rng));
+  }
+  return v;
+}
+
+std::vector<int32_t> IntInputs(size_t size = kMaxStart + kMaxCount) {
+  std::vector<int32_t> v = {0,       -1,       1,          INT32_MAX,
+                            INT32_MIN, 32767,   -32768,     65535,
+                            -65536,  8388607,  -8388608,   0x7FFF8000,
+                            -0x7FFF8000};
+  std::mt19937 rng(2);
+  while (v.size() < size) {
+    v.push_back(static_cast<int32_t>(rng()));
+  }
+  return v;
+}
+
+// Packed s24: the low three bytes of each int.
+std::vector<uint8_t> PackS24(const std::vector<int32_t>& in) {
+  std::vector<uint8_t> out(in.size() * 3);
+  for (size_t i = 0; i < in.size(); ++i) {
+    convert_internal::StoreS24(out.data() + i * 3, in[i]);
+  }
+  return out;
+}
+
+// Converts |count| samples with |kernel|, reading |in_size| elements of
+// |in| from an exact-size copy, and returns the |out_size| bytes written
+// per sample. Fails the test if the kernel wrote past them.
+template <typename Out, typename In>
+std::vector<uint8_t> Run(void (*kernel)(Out*, const In*, size_t),
+                         const In* in, size_t in_size, size_t count,
+                         size_t out_size) {
+  std::vector<In> src(in, in + in_size);
+  std::vector<uint8_t> dst(count * out_size + 64, kGuard);
+  kernel(reinterpret_cast<Out*>(dst.data()), src.data(), count);
+  bool guard_intact = true;
+  for (size_t i = count * out_size; i < dst.size(); ++i) {
+    guard_intact &= dst[i] == kGuard;
+  }
+  CHECK(guard_intact);
+  dst.resize(count * out_size);
+  return dst;
+}
+
+// Calls |check(start, count)| for every start and count.
+template <typename Check>
+void ForEachRun(Check check) {
+  for (size_t start = 0; start <= kMaxStart; ++start) {
+    for (size_t count = 0; count <= kMaxCount; ++count) {
+      check(start, count);
+    }
+  }
+}
+
+void Expect(bool same, const char* isa, const char* kernel, size_t start,
+            size_t count) {
+  if (!same) {
+    std::fprintf(stderr, "%s %s differs at start %zu, count %zu\n", isa,
+                 kernel, start, count);
+  }
+  CHECK(same);
+}
+
+void CompareWithScalar(const ConvertKernels& k) {
+  const ConvertKernels& ref = *ConvertKernelsFor(ConvertIsa::kScalar);
+  const std::vector<float> f32 = FloatInputs();
+  const std::vector<int32_t> s32 = IntInputs();
+  const std::vector<int16_t> s16(s32.begin(), s32.end());
+  const std::vector<uint8_t> s24 = PackS24(s32);
+
+  ForEachRun([&](size_t start, size_t count) {
+    const float* f = f32.data() + start;
+    const int32_t* i32 = s32.data() + start;
+    const int16_t* i16 = s16.data() + start;
+    const uint8_t* i24 = s24.data() + start * 3;
+    Expect(Run(k.f32_to_s16, f, count, count, 2) ==
+               Run(ref.f32_to_s16, f, count, count, 2),
+           k.name, "f32_to_s16", start, count);
+    Expect(Run(k.f32_to_s24, f, count, count, 3) ==
+               Run(ref.f32_to_s24, f, count, count, 3),
+           k.name, "f32_to_s24", start, count);
+    Expect(Run(k.f32_to_s32, f, count, count, 4) ==
+               Run(ref.f32_to_s32, f, count, count, 4),
+           k.name, "f32_to_s32", start, count);
+    Expect(Run(k.s16_to_f32, i16, count, count, 4) ==
+               Run(ref.s16_to_f32, i16, count, count, 4),
+           k.name, "s16_to_f32", start, count);
+    Expect(Run(k.s24_to_f32, i24, count * 3, count, 4) ==
+               Run(ref.s24_to_f32, i24, count * 3, count, 4),
+           k.name, "s24_to_f32", start, count);
+    Expect(Run(k.s32_to_f32, i32, count, count, 4) ==
+               Run(ref.s32_to_f32, i32, count, count, 4),
+           k.name, "s32_to_f32", start, count);
+    Expect(Run(k.s32_to_s16, i32, count, count, 2) ==
+               Run(ref.s32_to_s16, i32, count, count, 2),
+           k.name, "s32_to_s16", start, count);
+  });
+
+  // Dither noise is generated in scalar code, so dithered output must not
+  // depend on the kernels either.
+  for (SampleEncoding encoding :
+       {SampleEncoding::kS16, SampleEncoding::kS24}) {
+    size_t size = BytesPerSample(encoding);
+    std::vector<uint8_t> a(f32.size() * size);
+    std::vector<uint8_t> b(f32.size() * size);
+    TpdfDither da;
+    TpdfDither db;
+    ConvertSamples(encoding, a.data(), SampleEncoding::kF32, f32.data(),
+                   f32.size(), &da, k);
+    ConvertSamples(encoding, b.data(), SampleEncoding::kF32, f32.data(),
+                   f32.size(), &db, ref);
+    Expect(a == b, k.name, "dithered", 0, f32.size());
+  }
+}
+
+// Every s16 value, and s24 values across the range, must come back from
+// float unchanged, and silence must stay 0.
+void CheckRoundTrip(const ConvertKernels& k) {
+  std::vector<int16_t> s16(65536);
+  for (size_t i = 0; i < s16.size(); ++i) {
+    s16[i] = static_cast<int16_t>(i);
+  }
+  std::vector<float> f32(s16.size());
+  std::vector<int16_t> back16(s16.size());
+  k.s16_to_f32(f32.data(), s16.data(), s16.size());
+  k.f32_to_s16(back16.data(), f32.data(), f32.size());
+  Expect(back16 == s16, k.name, "s16 round trip", 0, s16.size());
+
+  std::vector<int32_t> s32;
+  for (int32_t x = -8388608; x < 8388608; x += 997) {
+    s32.push_back(x);
+  }
+  s32.push_back(8388607);
+  std::vector<uint8_t> s24 = PackS24(s32);
+  std::vector<uint8_t> back24(s24.size());
+  f32.resize(s32.size());
+  k.s24_to_f32(f32.data(), s24.data(), s32.size());
+  k.f32_to_s24(back24.data(), f32.data(), f32.size());
+  Expect(back24 == s24, k.name, "s24 round trip", 0, s32.size());
+
+  const float zero[16] = {0.0f, -0.0f, 0.0f, -0.0f, 0.0f, -0.0f, 0.0f, -0.0f,
+                          0.0f, -0.0f, 0.0f, -0.0f, 0.0f, -0.0f, 0.0f, -0.0f};
+  int16_t z16[16];
+  uint8_t z24[16 * 3];
+  k.f32_to_s16(z16, zero, 16);
+  k.f32_to_s24(z24, zero, 16);
+  bool silent = true;
+  for (int16_t x : z16) {
+    silent &= x == 0;
+  }
+  for (uint8_t x : z24) {
+    silent &= x == 0;
+  }
+  Expect(silent, k.name, "silence", 0, 16);
+}
+
+// dr_wav has no vector paths, so one long run per conversion will do. Its
+// f32 to s32 overflows at full scale, so those inputs are left out.
+void CompareWithDrWav() {
+  constexpr size_t kCount = 4096;
+  const ConvertKernels& ref = *ConvertKernelsFor(ConvertIsa::kScalar);
+  std::vector<float> in_range;
+  for (float x : FloatInputs(kCount)) {
+    if (x >= -1.0f && x < 1.0f) {
+      in_range.push_back(x);
+    }
+  }
+  const std::vector<int32_t> s32 = IntInputs(kCount);
+  const std::vector<int16_t> s16(s32.begin(), s32.end());
+  const std::vector<uint8_t> s24 = PackS24(s32);
+
+  size_t n = in_range.size();
+  Expect(Run(ref.f32_to_s32, in_range.data(), n, n, 4) ==
+             Run(&drwav_f32_to_s32, in_range.data(), n, n, 4),
+         "dr_wav", "f32_to_s32", 0, n);
+  n = s32.size();
+  Expect(Run(ref.s16_to_f32, s16.data(), n, n, 4) ==
+             Run(&drwav_s16_to_f32, s16.data(), n, n, 4),
+         "dr_wav", "s16_to_f32", 0, n);
+  Expect(Run(ref.s24_to_f32, s24.data(), n * 3, n, 4) ==
+             Run(&drwav_s24_to_f32, s24.data(), n * 3, n, 4),
+         "dr_wav", "s24_to_f32", 0, n);
+  Expect(Run(ref.s32_to_f32, s32.data(), n, n, 4) ==
+             Run(&drwav_s32_to_f32, s32.data(), n, n, 4),
+         "dr_wav", "s32_to_f32", 0, n);
+  Expect(Run(ref.s32_to_s16, s32.data(), n, n, 2) ==
+             Run(&drwav_s32_to_s16, s32.data(), n, n, 2),
+         "dr_wav", "s32_to_s16", 0, n);
+}
+
+}  // namespace
+
+int main() {
+  CheckRoundTrip(*ConvertKernelsFor(ConvertIsa::kScalar));
+  for (ConvertIsa isa : {ConvertIsa::kSse2, ConvertIsa::kAvx2,
+                         ConvertIsa::kAvx512, ConvertIsa::kNeon}) {
+    if (const ConvertKernels* k = ConvertKernelsFor(isa)) {
+      std::printf("checking %s against scalar\n", k->name);
+      CompareWithScalar(*k);
+      CheckRoundTrip(*k);
+    }
+  }
+  CompareWithDrWav();
+  return TestResult("convert_test");
+}
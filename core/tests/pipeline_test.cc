@@ -0,0 +1,241 @@
+﻿// Drives a Pipeline through captured-format flips (sample type, rate,
+// channel count, and back to the first format) under both
+// --on-format-change policies and checks the files it leaves behind: how
+// many, in which format, and how many frames each holds.
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#define DR_WAV_IMPLEMENTATION
+#include "../inject/platform.h"
+#include "../inject/protocol.h"
+#include "../injector/dr_wav.h"
+#include "../injector/pipeline.h"
+#include "check.h"
+
+namespace {
+
+AudioFormat Format(uint16_t channels, uint32_t rate, SampleType type,
+                   uint16_t bits) {
+  AudioFormat format;
+  format.channels = channels;
+  format.bits_per_sample = bits;
+  format.sampling_rate = rate;
+  format.sample_type = type;
+  return format;
+}
+
+const AudioFormat kF32Stereo48 = Format(2, 48000, SampleType::kFloat, 32);
+const AudioFormat kS32Stereo48 = Format(2, 48000, SampleType::kInt, 32);
+const AudioFormat kF32Stereo44 = Format(2, 44100, SampleType::kFloat, 32);
+const AudioFormat kF32Surround44 = Format(6, 44100, SampleType::kFloat, 32);
+const AudioFormat kS16Surround44 = Format(6, 44100, SampleType::kInt, 16);
+
+// A run of packets in one captured format.
+struct Segment {
+  const AudioFormat* format;
+  uint32_t packets;
+  uint32_t frames;
+  // Index of a packet sent as kPacketSilent, or -1.
+  int silent;
+};
+
+// Sample type, rate, channel count and sample type flips, then back to the
+// first format.
+const Segment kSegments[] = {
+    {&kF32Stereo48, 10, 480, -1},  {&kS32Stereo48, 5, 480, -1},
+    {&kF32Stereo44, 10, 441, 3},   {&kF32Surround44, 10, 441, -1},
+    {&kS16Surround44, 4, 441, -1}, {&kF32Stereo48, 10, 480, -1},
+};
+
+struct File {
+  std::string path;
+  uint16_t channels;
+  uint32_t rate;
+  uint16_t bits;
+  uint64_t frames;
+};
+
+// A sine at a different pitch per channel, so resampling and remixing have
+// real signal to work on.
+void Fill(const AudioFormat& format, uint64_t start, uint32_t frames,
+          std::vector<uint8_t>* pcm) {
+  std::vector<float> f(static_cast<size_t>(frames) * format.channels);
+  for (uint32_t i = 0; i < frames; ++i) {
+    for (uint16_t c = 0; c < format.channels; ++c) {
+      double t = static_cast<double>(start + i) / format.sampling_rate;
+      f[i * format.channels + c] =
+          static_cast<float>(0.5 * std::sin(2 * M_PI * 220 * (c + 1) * t));
+    }
+  }
+  pcm->resize(frames * format.block_align());
+  ConvertSamples(EncodingOf(format), pcm->data(), SampleEncoding::kF32,
+                 f.data(), f.size());
+}
+
+// Feeds kSegments through a pipeline writing |path| with |options| and
+// returns the files found afterwards, in part order.
+std::vector<File> Record(const Pipeline::Options& options,
+                         const std::string& path) {
+  {
+    Pipeline pipeline(options, path);
+    uint64_t sequence = 0;
+    std::vector<uint8_t> pcm;
+    for (const Segment& segment : kSegments) {
+      uint64_t position = 0;
+      for (uint32_t n = 0; n < segment.packets; ++n) {
+        Packet packet{};
+        packet.format = segment.format;
+        packet.frames = segment.frames;
+        packet.sequence = sequence++;
+        packet.position = position;
+        if (static_cast<int>(n) == segment.silent) {
+          packet.flags = kPacketSilent;
+        } else {
+          Fill(*segment.format, position, segment.frames, &pcm);
+          packet.data = pcm.data();
+          packet.size = pcm.size();
+        }
+        pipeline.Write(packet);
+        position += segment.frames;
+      }
+    }
+    pipeline.Close();
+  }
+
+  std::vector<File> files;
+  std::filesystem::path p(path);
+  for (int part = 1;; ++part) {
+    std::string name =
+        part == 1 ? path
+                  : (p.parent_path() / p.stem()).string() + "-" +
+                        std::to_string(part) + p.extension().string();
+    drwav wav;
+    if (!drwav_init_file(&wav, name.c_str(), nullptr)) {
+      break;
+    }
+    files.push_back({name, wav.channels, wav.sampleRate, wav.bitsPerSample,
+                     wav.totalPCMFrameCount});
+    drwav_uninit(&wav);
+  }
+  return files;
+}
+
+bool Is(const File& file, const AudioFormat& format, uint64_t frames) {
+  bool ok = file.channels == format.channels &&
+            file.rate == format.sampling_rate &&
+            file.bits == format.bits_per_sample && file.frames == frames;
+  if (!ok) {
+    std::fprintf(stderr,
+                 "%s: %u ch, %u Hz, %u-bit, %llu frames; expected %u ch, "
+                 "%u Hz, %u-bit, %llu frames\n",
+                 file.path.c_str(), file.channels, file.rate, file.bits,
+                 (unsigned long long)file.frames, format.channels,
+                 format.sampling_rate, format.bits_per_sample,
+                 (unsigned long long)frames);
+  }
+  return ok;
+}
+
+uint64_t Frames(const Segment& segment) {
+  return uint64_t(segment.packets) * segment.frames;
+}
+
+// Every flip changes the stored format, so each segment gets a file of its
+// own, stored as captured.
+void TestSplit(const std::string& dir) {
+  Pipeline::Options options;
+  std::vector<File> files = Record(options, dir + "/split.wav");
+  CHECK_EQ(files.size(), 6u);
+  for (size_t i = 0; i < files.size() && i < 6; ++i) {
+    CHECK(Is(files[i], *kSegments[i].format, Frames(kSegments[i])));
+  }
+}
+
+// With --format s16, a flip that only changes the captured sample type
+// stores the same format and stays in the same file.
+void TestSplitS16(const std::string& dir) {
+  Pipeline::Options options;
+  options.format = "s16";
+  std::vector<File> files = Record(options, dir + "/split16.wav");
+  CHECK_EQ(files.size(), 4u);
+  if (files.size() != 4) {
+    return;
+  }
+  CHECK(Is(files[0], Format(2, 48000, SampleType::kInt, 16),
+           Frames(kSegments[0]) + Frames(kSegments[1])));
+  CHECK(Is(files[1], Format(2, 44100, SampleType::kInt, 16),
+           Frames(kSegments[2])));
+  CHECK(Is(files[2], kS16Surround44,
+           Frames(kSegments[3]) + Frames(kSegments[4])));
+  CHECK(Is(files[3], Format(2, 48000, SampleType::kInt, 16),
+           Frames(kSegments[5])));
+}
+
+// Everything is converted into the first file's format: one file, with the
+// 44.1 kHz segments resampled to 48 kHz and the 5.1 ones mixed down.
+void TestConvert(const std::string& dir) {
+  Pipeline::Options options;
+  options.format_change = "convert";
+  std::vector<File> files = Record(options, dir + "/convert.wav");
+  CHECK_EQ(files.size(), 1u);
+  if (files.size() != 1) {
+    return;
+  }
+  double expected = 0;
+  for (const Segment& segment : kSegments) {
+    expected += static_cast<double>(Frames(segment)) * 48000 /
+                segment.format->sampling_rate;
+  }
+  CHECK(Is(files[0], kF32Stereo48, files[0].frames));
+  // Each resampled run rounds on its own when the converter is flushed.
+  double error = std::fabs(static_cast<double>(files[0].frames) - expected);
+  if (error > 3) {
+    std::fprintf(stderr, "%s: %llu frames, expected about %.1f\n",
+                 files[0].path.c_str(), (unsigned long long)files[0].frames,
+                 expected);
+  }
+  CHECK(error <= 3);
+}
+
+// --rate and --channels make every segment store the same format, so even
+// "split" keeps a single file.
+void TestSplitFixedLayout(const std::string& dir) {
+  Pipeline::Options options;
+  options.format = "s24";
+  options.rate = 32000;
+  options.channels = 2;
+  std::vector<File> files = Record(options, dir + "/fixed.wav");
+  CHECK_EQ(files.size(), 1u);
+  if (files.size() != 1) {
+    return;
+  }
+  double expected = 0;
+  for (const Segment& segment : kSegments) {
+    expected += static_cast<double>(Frames(segment)) * 32000 /
+                segment.format->sampling_rate;
+  }
+  CHECK(Is(files[0], Format(2, 32000, SampleType::kInt, 24),
+           files[0].frames));
+  CHECK(std::fabs(static_cast<double>(files[0].frames) - expected) <= 6);
+}
+
+}  // namespace
+
+int main() {
+  loguru::g_stderr_verbosity = loguru::Verbosity_WARNING;
+  std::filesystem::path dir = std::filesystem::temp_directory_path() /
+                              ("pipeline_test_" +
+                               std::to_string(CurrentProcessId()));
+  std::filesystem::create_directories(dir);
+  TestSplit(dir.string());
+  TestSplitS16(dir.string());
+  TestConvert(dir.string());
+  TestSplitFixedLayout(dir.string());
+  std::filesystem::remove_all(dir);
+  return TestResult("pipeline_test");
+}
@@ -0,0 +1,473 @@
+﻿// Round-trips capture frames through the Decoder: version 1 frames and
+// batches, version 2 and 3 frames from the Encoder, format table wraparound,
+// messages that spill into the next frame, sequence gaps, and records the
+// decoder must reject.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "../inject/protocol.h"
+#include "check.h"
+
+namespace {
+
+struct Decoded {
+  AudioFormat format;
+  std::vector<uint8_t> data;
+  uint32_t frames;
+  uint8_t flags;
+  uint64_t sequence;
+  uint64_t position;
+  uint64_t timestamp_ns;
+  bool discontinuity;
+  uint32_t stream;
+};
+
+// Decodes |record| and appends its packets to |out|.
+bool Decode(Decoder& decoder, const std::vector<uint8_t>& record,
+            std::vector<Decoded>* out) {
+  return decoder.Decode(record.data(), record.size(), [&](const Packet& p) {
+    Decoded d;
+    d.format = *p.format;
+    d.data.assign(p.data, p.data + p.size);
+    d.frames = p.frames;
+    d.flags = p.flags;
+    d.sequence = p.sequence;
+    d.position = p.position;
+    d.timestamp_ns = p.timestamp_ns;
+    d.discontinuity = p.discontinuity;
+    d.stream = p.stream;
+    out->push_back(d);
+  });
+}
+
+AudioFormat Format(uint16_t channels, uint16_t bits, uint32_t rate,
+                   SampleType type = SampleType::kInt) {
+  AudioFormat format;
+  format.channels = channels;
+  format.bits_per_sample = bits;
+  format.sampling_rate = rate;
+  format.sample_type = type;
+  return format;
+}
+
+std::vector<uint8_t> Pcm(const AudioFormat& format, uint32_t frames,
+                         uint8_t seed) {
+  std::vector<uint8_t> pcm(frames * format.block_align());
+  for (size_t i = 0; i < pcm.size(); ++i) {
+    pcm[i] = static_cast<uint8_t>(seed + i * 13);
+  }
+  return pcm;
+}
+
+// A version 1 frame, laid out like the inject DLL's fillFrame().
+std::vector<uint8_t> V1Frame(const AudioFormat& format,
+                             const std::vector<uint8_t>& pcm) {
+  Header h;
+  h.header_offset = 2;
+  h.header_size = sizeof(Header);
+  h.data_offset = h.header_offset + h.header_size;
+  h.data_size = static_cast<int>(pcm.size());
+  h.total_size = h.data_offset + h.data_size;
+  h.channels = format.channels;
+  h.samples = static_cast<int>(pcm.size() / format.block_align());
+  h.bits_per_sample = format.bits_per_sample;
+  h.sampling_rate = static_cast<int>(format.sampling_rate);
+  std::vector<uint8_t> frame(h.total_size);
+  frame[0] = 0xFE;
+  frame[1] = 0xCF;
+  ::memcpy(&frame[2], &h, sizeof(h));
+  ::memcpy(&frame[h.data_offset], pcm.data(), pcm.size());
+  return frame;
+}
+
+// Version 1 frames coalesced into a batch, like the DLL's flushBatch().
+std::vector<uint8_t> V1Batch(const std::vector<std::vector<uint8_t>>& frames) {
+  std::vector<uint8_t> batch(2 + sizeof(BatchHeader));
+  std::vector<int> offsets;
+  for (const std::vector<uint8_t>& frame : frames) {
+    offsets.push_back(static_cast<int>(batch.size()));
+    batch.insert(batch.end(), frame.begin(), frame.end());
+  }
+  BatchHeader b;
+  b.header_size = sizeof(BatchHeader);
+  b.count = static_cast<int>(frames.size());
+  b.table_offset = static_cast<int>(batch.size());
+  b.total_size = b.table_offset + b.count * static_cast<int>(sizeof(int));
+  batch.resize(b.total_size);
+  batch[0] = 0xFE;
+  batch[1] = 0xCB;
+  ::memcpy(&batch[2], &b, sizeof(b));
+  ::memcpy(&batch[b.table_offset], offsets.data(),
+           offsets.size() * sizeof(int));
+  return batch;
+}
+
+PacketMessage Message(uint64_t sequence, uint32_t frames, uint64_t position,
+                      uint8_t flags = 0) {
+  PacketMessage m{};
+  m.frames = frames;
+  m.flags = flags;
+  m.sequence = sequence;
+  m.position = position;
+  m.timestamp_ns = 1000000 + sequence;
+  return m;
+}
+
+// Builds version 2/3 frames with an Encoder, the way the inject DLL does.
+class FrameBuilder {
+ public:
+  explicit FrameBuilder(size_t capacity = 64 * 1024) : buf_(capacity) {
+    writer_.Begin(buf_.data(), buf_.size());
+  }
+
+  Encoder& encoder() { return encoder_; }
+  FrameWriter& writer() { return writer_; }
+
+  bool Add(const AudioFormat& format, const PacketMessage& message,
+           const std::vector<uint8_t>& pcm, uint32_t stream = 0) {
+    uint8_t* dst =
+        encoder_.AddPacket(writer_, format, message, pcm.size(), stream);
+    if (dst == nullptr) {
+      return false;
+    }
+    ::memcpy(dst, pcm.data(), pcm.size());
+    return true;
+  }
+
+  // Returns the finished frame and starts the next one.
+  std::vector<uint8_t> Finish() {
+    size_t size = writer_.Finish();
+    std::vector<uint8_t> frame(buf_.begin(), buf_.begin() + size);
+    writer_.Begin(buf_.data(), buf_.size());
+    return frame;
+  }
+
+ private:
+  std::vector<uint8_t> buf_;
+  FrameWriter writer_;
+  Encoder encoder_;
+};
+
+void TestV1() {
+  AudioFormat s16 = Format(2, 16, 48000);
+  AudioFormat f32 = Format(2, 32, 44100);
+  std::vector<uint8_t> a = Pcm(s16, 100, 1);
+  std::vector<uint8_t> b = Pcm(f32, 50, 2);
+  std::vector<uint8_t> c = Pcm(s16, 30, 3);
+
+  Decoder decoder;
+  std::vector<Decoded> out;
+  CHECK(Decode(decoder, V1Frame(s16, a), &out));
+  CHECK(Decode(decoder, V1Batch({V1Frame(f32, b), V1Frame(s16, c)}), &out));
+  CHECK_EQ(out.size(), 3u);
+  if (out.size() != 3) {
+    return;
+  }
+  CHECK(out[0].format == s16 && out[0].data == a && out[0].frames == 100);
+  // v1 carries no sample type: 32-bit is taken to be float.
+  CHECK(out[1].format == Format(2, 32, 44100, SampleType::kFloat));
+  CHECK(out[1].data == b && out[1].frames == 50);
+  CHECK(out[2].format == s16 && out[2].data == c && out[2].frames == 30);
+  // Sequence numbers and positions are made up, so v1 never has gaps.
+  for (size_t i = 0; i < out.size(); ++i) {
+    CHECK_EQ(out[i].sequence, i);
+    CHECK(!out[i].discontinuity);
+    CHECK_EQ(out[i].stream, 0u);
+  }
+  CHECK_EQ(out[1].position, 100u);
+  CHECK_EQ(out[2].position, 150u);
+  CHECK_EQ(decoder.lost(), 0u);
+}
+
+void TestV2() {
+  AudioFormat s16 = Format(2, 16, 48000);
+  AudioFormat f32 = Format(6, 32, 96000, SampleType::kFloat);
+  f32.channel_mask = 0x3F;
+  std::vector<uint8_t> a = Pcm(s16, 480, 1);
+  std::vector<uint8_t> b = Pcm(f32, 960, 2);
+
+  FrameBuilder builder;
+  CHECK(builder.Add(s16, Message(0, 480, 0), a));
+  CHECK(builder.Add(f32, Message(1, 960, 0), b));
+  CHECK(builder.Add(s16, Message(2, 480, 480), a));
+  CHECK(builder.Add(s16, Message(3, 240, 960, kPacketSilent), {}));
+  // Two format messages and four packets; the known format is not resent.
+  CHECK_EQ(builder.writer().count(), 6u);
+
+  Decoder decoder;
+  std::vector<Decoded> out;
+  CHECK(Decode(decoder, builder.Finish(), &out));
+  CHECK_EQ(out.size(), 4u);
+  if (out.size() != 4) {
+    return;
+  }
+  CHECK(out[0].format == s16 && out[0].data == a);
+  CHECK(out[1].format == f32 && out[1].data == b);
+  CHECK(out[2].format == s16 && out[2].data == a && out[2].position == 480);
+  CHECK(out[3].flags == kPacketSilent && out[3].data.empty() &&
+        out[3].frames == 240);
+  for (size_t i = 0; i < out.size(); ++i) {
+    CHECK_EQ(out[i].sequence, i);
+    CHECK_EQ(out[i].timestamp_ns, 1000000 + i);
+    CHECK(!out[i].discontinuity);
+    CHECK_EQ(out[i].stream, 0u);
+  }
+}
+
+void TestV3Streams() {
+  AudioFormat s16 = Format(2, 16, 48000);
+  AudioFormat s24 = Format(2, 24, 48000);
+  std::vector<uint8_t> a = Pcm(s16, 10, 1);
+  std::vector<uint8_t> b = Pcm(s24, 10, 2);
+
+  FrameBuilder builder;
+  CHECK(builder.Add(s16, Message(0, 10, 0), a, 0));
+  CHECK(builder.Add(s24, Message(1, 10, 0), b, 5));
+  CHECK(builder.Add(s24, Message(2, 10, 10), b, 5));
+  CHECK(builder.Add(s16, Message(3, 10, 10), a, 0));
+  // Stream 0 needs no message at first; 5 and the switch back do.
+  CHECK_EQ(builder.writer().count(), 2u + 4u + 2u);
+  std::vector<uint8_t> first = builder.Finish();
+
+  // A restarted encoder makes the next frame self-contained, stream 0
+  // included, so a decoder that starts there needs nothing before it.
+  builder.encoder().Restart();
+  CHECK(builder.Add(s16, Message(4, 10, 20), a, 0));
+  std::vector<uint8_t> second = builder.Finish();
+
+  Decoder decoder;
+  std::vector<Decoded> out;
+  CHECK(Decode(decoder, first, &out));
+  CHECK(Decode(decoder, second, &out));
+  CHECK_EQ(out.size(), 5u);
+  if (out.size() == 5) {
+    const uint32_t streams[] = {0, 5, 5, 0, 0};
+    for (size_t i = 0; i < out.size(); ++i) {
+      CHECK_EQ(out[i].stream, streams[i]);
+    }
+    CHECK(out[1].format == s24 && out[1].data == b);
+    CHECK(out[3].format == s16 && out[3].data == a);
+  }
+
+  Decoder late;
+  out.clear();
+  CHECK(Decode(late, second, &out));
+  CHECK(out.size() == 1 && out[0].stream == 0 && out[0].format == s16 &&
+        out[0].data == a);
+
+  // A decoder that joins after the descriptors were sent drops the packets
+  // it cannot interpret rather than failing.
+  FrameBuilder session;
+  CHECK(session.Add(s16, Message(0, 10, 0), a, 3));
+  session.Finish();
+  CHECK(session.Add(s16, Message(1, 10, 10), a, 3));
+  Decoder joined;
+  out.clear();
+  CHECK(Decode(joined, session.Finish(), &out));
+  CHECK(out.empty());
+}
+
+void TestFormatWraparound() {
+  // More distinct formats than the table holds, then the first ones again:
+  // ids are reused from 0 and every packet must still decode to its own
+  // format.
+  constexpr size_t kFormats = Encoder::kMaxFormats + 5;
+  std::vector<AudioFormat> formats;
+  for (size_t i = 0; i < kFormats; ++i) {
+    formats.push_back(Format(2, 16, static_cast<uint32_t>(8000 + i * 1000)));
+  }
+  std::vector<size_t> order;
+  for (size_t i = 0; i < kFormats; ++i) {
+    order.push_back(i);
+  }
+  for (size_t i = 0; i < 8; ++i) {
+    order.push_back(i);
+  }
+
+  FrameBuilder builder;
+  Decoder decoder;
+  std::vector<Decoded> out;
+  uint64_t sequence = 0;
+  for (size_t i : order) {
+    std::vector<uint8_t> pcm = Pcm(formats[i], 4, static_cast<uint8_t>(i));
+    CHECK(builder.Add(formats[i], Message(sequence++, 4, 0), pcm));
+    // Alternate between one frame per packet and several per frame.
+    if (sequence % 3 != 0) {
+      CHECK(Decode(decoder, builder.Finish(), &out));
+    }
+  }
+  CHECK(Decode(decoder, builder.Finish(), &out));
+  CHECK_EQ(out.size(), order.size());
+  for (size_t k = 0; k < out.size() && k < order.size(); ++k) {
+    size_t i = order[k];
+    CHECK(out[k].format == formats[i]);
+    CHECK(out[k].data == Pcm(formats[i], 4, static_cast<uint8_t>(i)));
+  }
+}
+
+void TestSpill() {
+  AudioFormat f32 = Format(2, 32, 48000, SampleType::kFloat);
+  std::vector<uint8_t> pcm = Pcm(f32, 64, 9);
+
+  // Room for the stream and format messages but not for the packet after
+  // them.
+  size_t capacity = sizeof(FrameHeader) + sizeof(StreamMessage) +
+                    sizeof(FormatMessage) + sizeof(PacketMessage) + 64;
+  FrameBuilder builder(capacity);
+  CHECK(!builder.Add(f32, Message(0, 64, 0), pcm, 7));
+  CHECK_EQ(builder.writer().count(), 2u);
+  std::vector<uint8_t> first = builder.Finish();
+
+  // The retry in a fresh frame only carries the packet: the descriptors
+  // went out with the first frame, which is published regardless.
+  std::vector<uint8_t> buf(64 * 1024);
+  builder.writer().Begin(buf.data(), buf.size());
+  uint8_t* dst = builder.encoder().AddPacket(builder.writer(), f32,
+                                             Message(0, 64, 0), pcm.size(), 7);
+  CHECK(dst != nullptr);
+  CHECK_EQ(builder.writer().count(), 1u);
+  if (dst != nullptr) {
+    ::memcpy(dst, pcm.data(), pcm.size());
+  }
+  size_t size = builder.writer().Finish();
+  std::vector<uint8_t> second(buf.begin(), buf.begin() + size);
+
+  Decoder decoder;
+  std::vector<Decoded> out;
+  CHECK(Decode(decoder, first, &out));
+  CHECK(out.empty());
+  CHECK(Decode(decoder, second, &out));
+  CHECK(out.size() == 1 && out[0].format == f32 && out[0].data == pcm &&
+        out[0].stream == 7);
+}
+
+void TestDiscontinuity() {
+  AudioFormat s16 = Format(1, 16, 16000);
+  std::vector<uint8_t> pcm = Pcm(s16, 8, 0);
+  FrameBuilder builder;
+  Decoder decoder;
+  std::vector<Decoded> out;
+  for (uint64_t sequence : {0, 1, 4, 5, 9}) {
+    CHECK(builder.Add(s16, Message(sequence, 8, sequence * 8), pcm));
+    CHECK(Decode(decoder, builder.Finish(), &out));
+  }
+  CHECK_EQ(out.size(), 5u);
+  if (out.size() == 5) {
+    const bool gap[] = {false, false, true, false, true};
+    for (size_t i = 0; i < out.size(); ++i) {
+      CHECK_EQ(out[i].discontinuity, gap[i]);
+    }
+  }
+  CHECK_EQ(decoder.lost(), 2u + 3u);
+}
+
+// Returns whether |record| decodes, on a fresh decoder.
+bool Accepts(const std::vector<uint8_t>& record) {
+  Decoder decoder;
+  std::vector<Decoded> out;
+  return Decode(decoder, record, &out);
+}
+
+void TestMalformed() {
+  AudioFormat s16 = Format(2, 16, 48000);
+  std::vector<uint8_t> pcm = Pcm(s16, 16, 4);
+
+  CHECK(!Accepts({}));
+  CHECK(!Accepts({0xFE}));
+  CHECK(!Accepts({0xFE, 0x00, 0, 0, 0, 0}));
+  CHECK(!Accepts({0x00, 0xC2, 0, 0, 0, 0}));
+
+  // Version 1: truncated header, data past the end, negative fields.
+  std::vector<uint8_t> v1 = V1Frame(s16, pcm);
+  CHECK(Accepts(v1));
+  CHECK(!Accepts(std::vector<uint8_t>(v1.begin(), v1.begin() + 10)));
+  CHECK(!Accepts(std::vector<uint8_t>(v1.begin(), v1.end() - 1)));
+  std::vector<uint8_t> bad = v1;
+  int negative = -1;
+  ::memcpy(&bad[2 + offsetof(Header, samples)], &negative, sizeof(int));
+  CHECK(!Accepts(bad));
+
+  // Version 1 batches: table past the end, frame offset outside the frames.
+  std::vector<uint8_t> batch = V1Batch({v1, v1});
+  CHECK(Accepts(batch));
+  bad = batch;
+  int count = 1000;
+  ::memcpy(&bad[2 + offsetof(BatchHeader, count)], &count, sizeof(int));
+  CHECK(!Accepts(bad));
+  bad = batch;
+  int table_offset;
+  ::memcpy(&table_offset, &batch[2 + offsetof(BatchHeader, table_offset)],
+           sizeof(int));
+  ::memcpy(&bad[table_offset], &table_offset, sizeof(int));
+  CHECK(!Accepts(bad));
+
+  // Version 2.
+  FrameBuilder builder;
+  CHECK(builder.Add(s16, Message(0, 16, 0), pcm));
+  std::vector<uint8_t> v2 = builder.Finish();
+  CHECK(Accepts(v2));
+  FrameHeader h;
+  ::memcpy(&h, v2.data(), sizeof(h));
+  CHECK(!Accepts(std::vector<uint8_t>(v2.begin(), v2.end() - 1)));
+  CHECK(!Accepts(std::vector<uint8_t>(v2.begin(), v2.begin() + 8)));
+
+  // Offset table past the end of the frame.
+  bad = v2;
+  FrameHeader bh = h;
+  bh.count = 100;
+  ::memcpy(bad.data(), &bh, sizeof(bh));
+  CHECK(!Accepts(bad));
+
+  // A message offset into the frame header, and one into the offset table.
+  for (uint32_t offset : {0u, h.table_offset}) {
+    bad = v2;
+    ::memcpy(&bad[h.table_offset], &offset, sizeof(offset));
+    CHECK(!Accepts(bad));
+  }
+
+  // A format id beyond the table, in the descriptor and in the packet.
+  uint32_t format_offset;
+  uint32_t packet_offset;
+  ::memcpy(&format_offset, &v2[h.table_offset], sizeof(uint32_t));
+  ::memcpy(&packet_offset, &v2[h.table_offset + 4], sizeof(uint32_t));
+  uint16_t id = Encoder::kMaxFormats;
+  bad = v2;
+  ::memcpy(&bad[format_offset + offsetof(FormatMessage, format_id)], &id,
+           sizeof(id));
+  CHECK(!Accepts(bad));
+  bad = v2;
+  ::memcpy(&bad[packet_offset + offsetof(PacketMessage, format_id)], &id,
+           sizeof(id));
+  CHECK(!Accepts(bad));
+
+  // A packet claiming more frames than its message holds.
+  bad = v2;
+  uint32_t frames = 17;
+  ::memcpy(&bad[packet_offset + offsetof(PacketMessage, frames)], &frames,
+           sizeof(frames));
+  CHECK(!Accepts(bad));
+  // Claimed frames do not matter for a silent packet, which has no payload.
+  bad[packet_offset + offsetof(PacketMessage, flags)] = kPacketSilent;
+  CHECK(Accepts(bad));
+
+  // Unknown message types are skipped.
+  bad = v2;
+  bad[format_offset] = 0x7F;
+  CHECK(Accepts(bad));
+}
+
+}  // namespace
+
+int main() {
+  TestV1();
+  TestV2();
+  TestV3Streams();
+  TestFormatWraparound();
+  TestSpill();
+  TestDiscontinuity();
+  TestMalformed();
+  return TestResult("protocol_test");
+}
@@ -0,0 +1,251 @@
+﻿// Tests the SPSC Ring: records around the wrap point, padding records,
+// Skip(), that a Transport takes only one consumer at a time, and a
+// producer/consumer stress run through a shared-memory Transport in which
+// every record the consumer misses must show up in the drop count.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "../inject/platform.h"
+#include "../inject/ring.h"
+#include "../inject/transport.h"
+#include "check.h"
+
+namespace {
+
+// A ring in ordinary memory, aligned like a shared mapping.
+struct LocalRing {
+  explicit LocalRing(size_t capacity)
+      : memory(new uint64_t[Ring::RequiredSize(capacity) / 8]) {
+    ring.Initialize(memory.get(), capacity);
+    consumer.Attach(memory.get(), Ring::RequiredSize(capacity));
+  }
+  std::unique_ptr<uint64_t[]> memory;
+  Ring ring;
+  Ring consumer;
+};
+
+// Payload byte |i| of record |seq|.
+uint8_t Pattern(uint64_t seq, size_t i) {
+  return static_cast<uint8_t>(seq * 131 + i * 7);
+}
+
+void Fill(uint8_t* buf, uint64_t seq, size_t size) {
+  ::memcpy(buf, &seq, sizeof(seq));
+  for (size_t i = sizeof(seq); i < size; ++i) {
+    buf[i] = Pattern(seq, i);
+  }
+}
+
+bool Verify(const uint8_t* buf, size_t size, uint64_t* seq) {
+  if (size < sizeof(*seq)) {
+    return false;
+  }
+  ::memcpy(seq, buf, sizeof(*seq));
+  for (size_t i = sizeof(*seq); i < size; ++i) {
+    if (buf[i] != Pattern(*seq, i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void TestWrapAndPadding() {
+  LocalRing r(1024);
+  Ring& ring = r.ring;
+  Ring& consumer = r.consumer;
+  CHECK_EQ(ring.max_record_size(), 1024 / 2 - 8);
+  CHECK(ring.Reserve(ring.max_record_size() + 1) == nullptr);
+
+  // 3 records of 296 bytes (304 with the header) leave 112 bytes before the
+  // end, too few for a fourth: it goes after a padding record, at offset 0,
+  // once the first record has been released.
+  std::vector<uint8_t> buf(296);
+  for (uint64_t seq = 0; seq < 3; ++seq) {
+    Fill(buf.data(), seq, buf.size());
+    CHECK(ring.Write(buf.data(), buf.size()));
+  }
+  Fill(buf.data(), 3, buf.size());
+  CHECK(!ring.Write(buf.data(), buf.size()));
+
+  size_t size = 0;
+  uint64_t seq = 0;
+  const uint8_t* rec = consumer.Peek(&size);
+  CHECK(rec != nullptr && size == 296 && Verify(rec, size, &seq) && seq == 0);
+  consumer.Release();
+  CHECK(ring.Write(buf.data(), buf.size()));
+  CHECK_EQ(ring.control()->head.load(), 3 * 304 + 112 + 304);
+  // Full again: the padding counts as used until the consumer passes it.
+  CHECK(!ring.Write(buf.data(), 8));
+
+  rec = consumer.Peek(&size);
+  CHECK(rec != nullptr && Verify(rec, size, &seq) && seq == 1);
+  consumer.Release();
+  rec = consumer.Peek(&size);
+  CHECK(rec != nullptr && Verify(rec, size, &seq) && seq == 2);
+  consumer.Release();
+  // The padding record is skipped and the wrapped record is contiguous at
+  // the start of the buffer.
+  rec = consumer.Peek(&size);
+  CHECK(rec != nullptr && size == 296 && Verify(rec, size, &seq) && seq == 3);
+  CHECK(rec == reinterpret_cast<const uint8_t*>(r.memory.get()) +
+                   Ring::kControlSize + 8);
+  consumer.Release();
+  CHECK(consumer.Peek(&size) == nullptr);
+  CHECK(consumer.Empty());
+
+  // Commit() may publish less than was reserved.
+  uint8_t* ptr = ring.Reserve(200);
+  CHECK(ptr != nullptr);
+  Fill(ptr, 4, 40);
+  ring.Commit(40);
+  rec = consumer.Peek(&size);
+  CHECK(rec != nullptr && size == 40 && Verify(rec, size, &seq) && seq == 4);
+  consumer.Release();
+}
+
+void TestSkip() {
+  LocalRing r(4096);
+  std::vector<uint8_t> buf(100);
+  for (uint64_t seq = 0; seq < 10; ++seq) {
+    Fill(buf.data(), seq, buf.size());
+    CHECK(r.ring.Write(buf.data(), buf.size()));
+  }
+  CHECK(!r.consumer.Empty());
+  r.consumer.Skip();
+  CHECK(r.consumer.Empty());
+  size_t size = 0;
+  CHECK(r.consumer.Peek(&size) == nullptr);
+
+  // Skipped space is free again and later records are read normally.
+  for (uint64_t seq = 10; seq < 60; ++seq) {
+    Fill(buf.data(), seq, buf.size());
+    CHECK(r.ring.Write(buf.data(), buf.size()));
+    uint64_t got = 0;
+    const uint8_t* rec = r.consumer.Peek(&size);
+    CHECK(rec != nullptr && Verify(rec, size, &got) && got == seq);
+    r.consumer.Release();
+  }
+}
+
+// A second consumer must neither get in nor disturb the first one, which
+// would break the single-consumer ring.
+void TestSingleConsumer() {
+  uint32_t id = CurrentProcessId() << 8 | 0x7C;
+  Transport producer;
+  Transport first;
+  Transport second;
+  CHECK(producer.Create(id));
+  Transport::Settings settings;
+  settings.protocol_version = kProtocolV2;
+  settings.batch_max_bytes = 4096;
+  CHECK(first.Open(id, settings));
+  uint32_t session = producer.session();
+  CHECK(producer.connected());
+
+  std::vector<uint8_t> buf(64);
+  Fill(buf.data(), 1, buf.size());
+  CHECK(producer.ring().Write(buf.data(), buf.size()));
+  CHECK(!second.Open(id));
+  CHECK(!second.Open(id, Transport::Settings()));
+  second.Close();
+  // The first consumer's settings, session and unread record are intact.
+  CHECK(producer.connected());
+  CHECK_EQ(producer.session(), session);
+  CHECK_EQ(producer.settings().batch_max_bytes, 4096u);
+  size_t size = 0;
+  uint64_t seq = 0;
+  const uint8_t* rec = first.ring().Peek(&size);
+  CHECK(rec != nullptr && Verify(rec, size, &seq) && seq == 1);
+  first.ring().Release();
+
+  // Once the first one has gone, another may attach.
+  first.Close();
+  CHECK(!producer.connected());
+  CHECK(second.Open(id));
+  CHECK(producer.connected());
+  CHECK(producer.session() != session);
+}
+
+// Producer and consumer on two threads through a Transport. The producer
+// drops records when the ring is full, as the inject DLL does; the
+// consumer is slowed down now and then so that happens. Every record must
+// arrive intact and in order, and the gaps must add up to the drop count.
+void TestStress() {
+  constexpr uint64_t kRecords = 200000;
+  uint32_t id = CurrentProcessId() << 8 | 0x7E;
+  Transport producer;
+  Transport consumer;
+  CHECK(producer.Create(id));
+  CHECK(consumer.Open(id));
+  if (TestFailures() != 0) {
+    return;
+  }
+
+  std::thread thread([&] {
+    std::vector<uint8_t> buf(16 * 1024);
+    for (uint64_t seq = 0; seq < kRecords; ++seq) {
+      // Sizes from 8 bytes to 16 KiB, so records wrap at every offset.
+      size_t size = 8 + (seq * 2654435761u) % (16 * 1024 - 8);
+      Fill(buf.data(), seq, size);
+      if (!producer.ring().Write(buf.data(), size)) {
+        producer.Drop();
+      }
+      producer.Notify();
+    }
+    producer.Close();
+  });
+
+  uint64_t received = 0;
+  uint64_t missing = 0;
+  uint64_t next = 0;
+  bool ordered = true;
+  bool intact = true;
+  while (true) {
+    bool closed = consumer.closed();
+    size_t size = 0;
+    if (const uint8_t* rec = consumer.ring().Peek(&size)) {
+      uint64_t seq = 0;
+      intact &= Verify(rec, size, &seq);
+      ordered &= seq >= next;
+      missing += seq - next;
+      next = seq + 1;
+      consumer.ring().Release();
+      if (++received % 4096 == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      continue;
+    }
+    if (closed) {
+      break;
+    }
+    consumer.Wait(100);
+  }
+  thread.join();
+  missing += kRecords - next;
+
+  uint64_t dropped = consumer.ring().control()->dropped.load();
+  std::printf("ring stress: %llu records received, %llu dropped\n",
+              (unsigned long long)received, (unsigned long long)dropped);
+  CHECK(intact);
+  CHECK(ordered);
+  CHECK_EQ(received + dropped, kRecords);
+  CHECK_EQ(missing, dropped);
+  CHECK(received != 0);
+}
+
+}  // namespace
+
+int main() {
+  TestWrapAndPadding();
+  TestSkip();
+  TestSingleConsumer();
+  TestStress();
+  return TestResult("ring_test");
+}
@@ -0,0 +1,219 @@
+﻿// Tests the StreamRegistry the hooks keep their streams in: binding and
+// rebinding a key, reuse of stale slots once the table is full and that
+// touching a stream keeps it from going stale, concurrent Bind() of one key,
+// and threads binding, touching and reading through reuse, where a read must
+// either miss or see one stream's entry whole.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "../inject/stream_registry.h"
+#include "check.h"
+
+namespace {
+
+constexpr uint64_t kStale = StreamRegistry::kStaleNs;
+
+const void* Key(uintptr_t n) { return reinterpret_cast<const void*>(n << 4); }
+
+// A format that says which key and thread it was bound for, so a reader can
+// tell a whole entry from a mix of two.
+AudioFormat FormatFor(uintptr_t n, uint16_t channels) {
+  AudioFormat format;
+  format.channels = channels;
+  format.bits_per_sample = 32;
+  format.sampling_rate = static_cast<uint32_t>(n);
+  format.sample_type = SampleType::kFloat;
+  format.channel_mask = static_cast<uint32_t>(n * 2654435761u);
+  return format;
+}
+
+bool Matches(const StreamRegistry::Stream& stream, uintptr_t n,
+             uint16_t channels) {
+  const AudioFormat format = FormatFor(n, channels);
+  return stream.format.channels == format.channels &&
+         stream.format.bits_per_sample == format.bits_per_sample &&
+         stream.format.sampling_rate == format.sampling_rate &&
+         stream.format.sample_type == format.sample_type &&
+         stream.format.channel_mask == format.channel_mask && stream.id != 0;
+}
+
+void TestBind() {
+  StreamRegistry registry;
+  CHECK_EQ(registry.Find(Key(1)), -1);
+  int slot = registry.Bind(Key(1), FormatFor(1, 2), 10);
+  CHECK(slot >= 0);
+  CHECK_EQ(registry.Find(Key(1)), slot);
+  CHECK_EQ(registry.Find(Key(2)), -1);
+
+  StreamRegistry::Stream stream;
+  CHECK(registry.Lookup(Key(1), &stream));
+  CHECK(Matches(stream, 1, 2));
+  CHECK_EQ(stream.slot, slot);
+  CHECK(stream.buffer == nullptr);
+  CHECK(!registry.Read(slot, Key(2), &stream));
+
+  uint8_t buffer[4];
+  CHECK(registry.SetBuffer(slot, Key(1), buffer, 20));
+  CHECK(!registry.SetBuffer(slot, Key(2), buffer, 20));
+  CHECK_EQ(registry.Advance(slot, 480), 0u);
+  CHECK_EQ(registry.Advance(slot, 480), 480u);
+  CHECK(registry.Lookup(Key(1), &stream) && stream.buffer == buffer);
+  uint32_t id = stream.id;
+
+  // Rebinding starts a new stream in the same slot.
+  CHECK_EQ(registry.Bind(Key(1), FormatFor(1, 6), 30), slot);
+  CHECK(registry.Lookup(Key(1), &stream));
+  CHECK(Matches(stream, 1, 6));
+  CHECK(stream.id != id);
+  CHECK(stream.buffer == nullptr);
+  CHECK_EQ(registry.Advance(slot, 480), 0u);
+  CHECK_EQ(registry.Advance(-1, 480), 0u);
+}
+
+// Once every slot is taken, a new key gets the stalest slot idle for
+// kStaleNs, and none while every stream has been touched more recently.
+void TestReuse() {
+  constexpr size_t kCapacity = StreamRegistry::kCapacity;
+  StreamRegistry registry;
+  std::vector<int> slots;
+  for (uintptr_t n = 1; n <= kCapacity; ++n) {
+    slots.push_back(registry.Bind(Key(n), FormatFor(n, 2), 1));
+    CHECK(slots.back() >= 0);
+  }
+  CHECK_EQ(registry.Bind(Key(1000), FormatFor(1000, 2), 2), -1);
+  CHECK_EQ(registry.Bind(Key(1000), FormatFor(1000, 2), kStale), -1);
+
+  // Every stream but the last keeps playing. The last one was bound before
+  // the others were last touched, so it is the one that goes.
+  for (uintptr_t n = 1; n < kCapacity; ++n) {
+    CHECK(registry.Touch(slots[n - 1], Key(n), kStale / 2 + n));
+  }
+  CHECK(!registry.Touch(slots[0], Key(1000), kStale / 2));
+  int reused = registry.Bind(Key(1000), FormatFor(1000, 2), kStale + 1);
+  CHECK_EQ(reused, slots[kCapacity - 1]);
+  CHECK_EQ(registry.Find(Key(1000)), reused);
+  CHECK_EQ(registry.Find(Key(kCapacity)), -1);
+  StreamRegistry::Stream stream;
+  CHECK(!registry.Read(reused, Key(kCapacity), &stream));
+  CHECK(!registry.Touch(reused, Key(kCapacity), kStale + 2));
+  CHECK(registry.Lookup(Key(1000), &stream) && Matches(stream, 1000, 2));
+
+  // The touched streams are still live.
+  CHECK_EQ(registry.Bind(Key(1001), FormatFor(1001, 2), kStale + 2), -1);
+  for (uintptr_t n = 1; n < kCapacity; ++n) {
+    CHECK(registry.Lookup(Key(n), &stream) && Matches(stream, n, 2));
+  }
+
+  // Then the stream touched longest ago goes first.
+  CHECK_EQ(registry.Bind(Key(1001), FormatFor(1001, 2), kStale * 2),
+           slots[0]);
+  CHECK_EQ(registry.Find(Key(1)), -1);
+  CHECK(registry.Lookup(Key(2), &stream));
+}
+
+// Threads rebinding one key concurrently, as SetFormat() and Unlock() may,
+// must leave it in exactly one slot.
+void TestConcurrentBind() {
+  constexpr int kThreads = 4;
+  constexpr int kBinds = 20000;
+  StreamRegistry registry;
+  int first = registry.Bind(Key(7), FormatFor(7, 1), 1);
+  std::atomic<bool> same_slot{true};
+  std::atomic<uint64_t> failed{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < kBinds; ++i) {
+        int slot = registry.Bind(Key(7), FormatFor(7, t + 1), 2 + i);
+        if (slot < 0) {
+          failed.fetch_add(1);
+        } else if (slot != first) {
+          same_slot.store(false);
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  CHECK(same_slot.load());
+  int holders = 0;
+  StreamRegistry::Stream stream;
+  for (size_t slot = 0; slot < StreamRegistry::kCapacity; ++slot) {
+    holders += registry.Read(static_cast<int>(slot), Key(7), &stream);
+  }
+  CHECK_EQ(holders, 1);
+  CHECK(registry.Lookup(Key(7), &stream));
+  CHECK(stream.format.channels >= 1 && stream.format.channels <= kThreads);
+  CHECK(Matches(stream, 7, stream.format.channels));
+  // A Bind() only gives up after losing several races in a row.
+  std::printf("concurrent bind: %llu of %d gave up\n",
+              (unsigned long long)failed.load(), kThreads * kBinds);
+}
+
+// More keys than slots, on a clock fast enough that idle ones go stale, so
+// slots are reused while other threads read them.
+void TestStress() {
+  constexpr int kThreads = 4;
+  constexpr uintptr_t kKeys = 24;
+  constexpr int kIterations = 200000;
+  StreamRegistry registry;
+  std::atomic<uint64_t> clock{1};
+  std::atomic<uint64_t> torn{0};
+  std::atomic<uint64_t> hits{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      uint16_t channels = static_cast<uint16_t>(t + 1);
+      for (int i = 0; i < kIterations; ++i) {
+        uintptr_t n = 1 + t * kKeys + i % kKeys;
+        uint64_t now = clock.fetch_add(kStale / 50);
+        uint8_t* buffer = reinterpret_cast<uint8_t*>(n * 64);
+        int slot = registry.Find(Key(n));
+        if (slot < 0 || !registry.SetBuffer(slot, Key(n), buffer, now)) {
+          slot = registry.Bind(Key(n), FormatFor(n, channels), now);
+          if (slot < 0 || !registry.SetBuffer(slot, Key(n), buffer, now)) {
+            continue;
+          }
+        }
+        StreamRegistry::Stream stream;
+        if (registry.Read(slot, Key(n), &stream)) {
+          hits.fetch_add(1);
+          if (!Matches(stream, n, channels) ||
+              (stream.buffer != nullptr && stream.buffer != buffer)) {
+            torn.fetch_add(1);
+          }
+        }
+        // Some other thread's key, which may be mid-reuse.
+        uintptr_t other = 1 + ((t + 1) % kThreads) * kKeys + i % kKeys;
+        if (registry.Lookup(Key(other), &stream) &&
+            !Matches(stream, other, static_cast<uint16_t>(
+                                        (t + 1) % kThreads + 1))) {
+          torn.fetch_add(1);
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  std::printf("registry stress: %llu reads, %llu torn\n",
+              (unsigned long long)hits.load(),
+              (unsigned long long)torn.load());
+  CHECK_EQ(torn.load(), 0u);
+  CHECK(hits.load() != 0);
+}
+
+}  // namespace
+
+int main() {
+  TestBind();
+  TestReuse();
+  TestConcurrentBind();
+  TestStress();
+  return TestResult("stream_registry_test");
+}